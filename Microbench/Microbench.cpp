@@ -0,0 +1,362 @@
+// Microbench.cpp : Times the intersection and shading kernels of the renderer in isolation.
+// Every kernel runs over a pregenerated batch of inputs (rays, hit records, texture
+// coordinates), so a measurement is the kernel alone and not the path tracer around it.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+#include "vec3.h"
+#include "camera.h"
+#include "sampler.h"
+#include "aabb.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "aarect.h"
+#include "box.h"
+#include "bvh.h"
+#include "material.h"
+#include "texture.h"
+#include "perlin.h"
+
+struct kernel_options {
+	int batch = 4096;				// inputs per pass over the batch
+	int repetitions = 15;			// timed repetitions of every kernel
+	double warmup_seconds = 0.1;	// untimed passes before the first repetition
+	double repetition_seconds = 0.02;	// a repetition repeats the batch for at least this long
+	std::string filter;				// only kernels whose name contains this
+};
+
+/// <summary>
+/// Time per operation of one kernel over its repetitions
+/// </summary>
+struct kernel_result {
+	std::string name;
+	double median_ns = 0.0;
+	double min_ns = 0.0;
+	double mean_ns = 0.0;
+	double stddev_ns = 0.0;
+	double positive_rate = -1.0;	// share of operations that hit (scattered), < 0 if meaningless
+	uint64_t operations = 0;		// timed operations over all repetitions
+};
+
+// Results of the kernels end up here, so the compiler cannot drop the calls
+volatile double benchmark_sink = 0.0;
+
+/// <summary>
+/// Times pass, which runs the kernel once over a batch of batch inputs and returns how many
+/// of them were positive (a hit, a scatter), or -1 if that does not apply. The batch is
+/// repeated until warmup_seconds have passed, then timed in repetitions of at least
+/// repetition_seconds each.
+/// </summary>
+kernel_result measure_kernel(const std::string& name, const kernel_options& options,
+							 const std::function<long(void)>& pass) {
+	typedef std::chrono::steady_clock clock;
+	auto seconds_since = [](clock::time_point t) { return std::chrono::duration<double>(clock::now() - t).count(); };
+
+	kernel_result result;
+	result.name = name;
+
+	// Warm up caches and branch predictors, and learn how long one pass takes
+	long positives = 0;
+	int warmup_passes = 0;
+	auto start = clock::now();
+	do {
+		positives = pass();
+		warmup_passes++;
+	} while (seconds_since(start) < options.warmup_seconds);
+	const double pass_seconds = seconds_since(start) / warmup_passes;
+	const int passes = std::max(1, static_cast<int>(options.repetition_seconds / std::max(pass_seconds, 1e-9)));
+
+	std::vector<double> ns_per_op;
+	for (int r = 0; r < options.repetitions; r++) {
+		start = clock::now();
+		for (int p = 0; p < passes; p++)
+			positives = pass();
+		ns_per_op.push_back(seconds_since(start) * 1e9 / (static_cast<double>(passes) * options.batch));
+	}
+
+	std::sort(ns_per_op.begin(), ns_per_op.end());
+	const size_t n = ns_per_op.size();
+	result.median_ns = n % 2 ? ns_per_op[n / 2] : 0.5 * (ns_per_op[n / 2 - 1] + ns_per_op[n / 2]);
+	result.min_ns = ns_per_op.front();
+	for (auto v : ns_per_op)
+		result.mean_ns += v / n;
+	for (auto v : ns_per_op)
+		result.stddev_ns += (v - result.mean_ns) * (v - result.mean_ns) / std::max<size_t>(1, n - 1);
+	result.stddev_ns = std::sqrt(result.stddev_ns);
+	result.positive_rate = positives >= 0 ? static_cast<double>(positives) / options.batch : -1.0;
+	result.operations = static_cast<uint64_t>(passes) * options.batch * options.repetitions;
+	return result;
+}
+
+/// <summary>
+/// Rays from a sphere of radius 4 around the origin to points of the cube [-1.2, 1.2]^3,
+/// at random shutter times: most of them hit a unit object at the origin, some miss it.
+/// </summary>
+std::vector<ray> make_ray_batch(int count) {
+	std::vector<ray> rays;
+	for (int k = 0; k < count; k++) {
+		const point3 origin = 4.0 * random_unit_vector();
+		const point3 target = vec3::random(-1.2, 1.2);
+		rays.push_back(ray(origin, target - origin, random_double()));
+	}
+	return rays;
+}
+
+/// <summary>
+/// Hit records of the batch rays on a unit sphere, repeated to fill the batch
+/// </summary>
+std::vector<std::pair<ray, hit_record>> make_hit_batch(const std::vector<ray>& rays, shared_ptr<material> m) {
+	sphere target(point3(0, 0, 0), 1.0, m);
+	std::vector<std::pair<ray, hit_record>> hits;
+	for (const auto& r : rays) {
+		hit_record rec;
+		if (target.hit(r, 0.001, infinity, rec))
+			hits.push_back({ r, rec });
+	}
+	for (size_t k = 0; hits.size() < rays.size(); k++)
+		hits.push_back(hits[k]);
+	return hits;
+}
+
+void print_usage() {
+	std::cerr << "Usage: Microbench [options]\n"
+		<< "  --filter TEXT       only run kernels whose name contains TEXT\n"
+		<< "  --batch N           inputs per batch (default 4096)\n"
+		<< "  --reps N            timed repetitions per kernel (default 15)\n"
+		<< "  --warmup-ms N       untimed warm-up per kernel (default 100)\n"
+		<< "  --rep-ms N          minimum duration of one repetition (default 20)\n"
+		<< "  --json FILE         also write the results as JSON to FILE\n"
+		<< "  --list              print the kernel names and exit\n";
+}
+
+/// <summary>
+/// Writes the results as JSON
+/// </summary>
+void write_kernel_json(std::ostream& out, const kernel_options& options, const std::vector<kernel_result>& results) {
+	out << std::fixed << std::setprecision(3);
+	out << "{\n"
+		<< "  \"settings\": {\n"
+		<< "    \"batch\": " << options.batch << ",\n"
+		<< "    \"repetitions\": " << options.repetitions << ",\n"
+		<< "    \"warmup_ms\": " << options.warmup_seconds * 1000.0 << ",\n"
+		<< "    \"repetition_ms\": " << options.repetition_seconds * 1000.0 << "\n"
+		<< "  },\n"
+		<< "  \"kernels\": [\n";
+	for (size_t k = 0; k < results.size(); k++) {
+		const auto& r = results[k];
+		out << "    { \"name\": \"" << r.name << "\""
+			<< ", \"ns_per_op\": " << r.median_ns
+			<< ", \"min_ns\": " << r.min_ns
+			<< ", \"mean_ns\": " << r.mean_ns
+			<< ", \"stddev_ns\": " << r.stddev_ns
+			<< ", \"ops_per_sec\": " << (r.median_ns > 0 ? 1e9 / r.median_ns : 0.0)
+			<< ", \"operations\": " << r.operations;
+		if (r.positive_rate >= 0)
+			out << ", \"positive_rate\": " << r.positive_rate;
+		out << " }" << (k + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n}\n";
+}
+
+int main(int argc, char* argv[])
+{
+	kernel_options options;
+	std::string json_file;
+	bool list_only = false;
+
+	for (int a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		bool has_value = a + 1 < argc;
+		if (arg == "--filter" && has_value)
+			options.filter = argv[++a];
+		else if (arg == "--batch" && has_value)
+			options.batch = std::max(1, atoi(argv[++a]));
+		else if (arg == "--reps" && has_value)
+			options.repetitions = std::max(1, atoi(argv[++a]));
+		else if (arg == "--warmup-ms" && has_value)
+			options.warmup_seconds = atof(argv[++a]) / 1000.0;
+		else if (arg == "--rep-ms" && has_value)
+			options.repetition_seconds = atof(argv[++a]) / 1000.0;
+		else if (arg == "--json" && has_value)
+			json_file = argv[++a];
+		else if (arg == "--list")
+			list_only = true;
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+
+	// Inputs are the same every run; materials and cameras draw from a sampler stream as in a render
+	srand(1);
+	random_sampler stream(1, 0);
+	stream.start_pixel_sample(0, 0, 0);
+	active_sampler() = &stream;
+
+	const int n = options.batch;
+	const std::vector<ray> rays = make_ray_batch(n);
+	std::vector<double> us(n), vs(n);
+	std::vector<point3> points(n);
+	for (int k = 0; k < n; k++) {
+		us[k] = random_double();
+		vs[k] = random_double();
+		points[k] = vec3::random(-2, 2);
+	}
+
+	// Kernels by name, each a pass over the batch
+	auto gray = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+	std::vector<std::pair<std::string, std::function<long(void)>>> kernels;
+
+	auto add_hit_kernel = [&](const std::string& name, shared_ptr<hittable> object) {
+		kernels.push_back({ name, [&rays, object]() {
+			long hits = 0;
+			double t = 0.0;
+			hit_record rec;
+			for (const auto& r : rays) {
+				if (object->hit(r, 0.001, infinity, rec)) {
+					hits++;
+					t += rec.t;
+				}
+			}
+			benchmark_sink = benchmark_sink + t;
+			return hits;
+		} });
+	};
+	add_hit_kernel("sphere::hit", make_shared<sphere>(point3(0, 0, 0), 1.0, gray));
+	add_hit_kernel("moving_sphere::hit", make_shared<moving_sphere>(point3(-0.3, 0, 0), point3(0.3, 0, 0), 0.0, 1.0, 1.0, gray));
+	add_hit_kernel("xy_rect::hit", make_shared<xy_rect>(-1, 1, -1, 1, 0, gray));
+	add_hit_kernel("xz_rect::hit", make_shared<xz_rect>(-1, 1, -1, 1, 0, gray));
+	add_hit_kernel("yz_rect::hit", make_shared<yz_rect>(-1, 1, -1, 1, 0, gray));
+	add_hit_kernel("box::hit", make_shared<box>(point3(-1, -1, -1), point3(1, 1, 1), gray));
+
+	const aabb unit_box(point3(-1, -1, -1), point3(1, 1, 1));
+	kernels.push_back({ "aabb::hit", [&]() {
+		long hits = 0;
+		for (const auto& r : rays)
+			hits += unit_box.hit(r, 0.001, infinity) ? 1 : 0;
+		return hits;
+	} });
+
+	// A tree of 1000 small spheres, several levels deep
+	hittable_list small_spheres;
+	for (int k = 0; k < 1000; k++)
+		small_spheres.add(make_shared<sphere>(vec3::random(-1, 1), 0.05, gray));
+	add_hit_kernel("bvh_node::hit (1000 spheres)", make_shared<bvh_node>(small_spheres, 0.0, 1.0));
+
+	auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+	auto add_scatter_kernel = [&](const std::string& name, shared_ptr<material> m) {
+		auto hits = make_hit_batch(rays, m);
+		kernels.push_back({ name, [hits, m]() {
+			long scattered_count = 0;
+			double sum = 0.0;
+			color attenuation;
+			ray scattered;
+			for (const auto& h : hits) {
+				if (m->scatter(h.first, h.second, attenuation, scattered)) {
+					scattered_count++;
+					sum += attenuation.x() + scattered.direction().y();
+				}
+			}
+			benchmark_sink = benchmark_sink + sum;
+			return scattered_count;
+		} });
+	};
+	add_scatter_kernel("lambertian::scatter", make_shared<lambertian>(color(0.7, 0.3, 0.1)));
+	add_scatter_kernel("lambertian::scatter (checker)", make_shared<lambertian>(checker));
+	add_scatter_kernel("metal::scatter", make_shared<metal>(color(0.8, 0.8, 0.9), 0.3));
+	add_scatter_kernel("dielectric::scatter", make_shared<dielectric>(1.5));
+	add_scatter_kernel("diffuse_light::scatter", make_shared<diffuse_light>(color(4, 4, 4)));
+	add_scatter_kernel("isotropic::scatter", make_shared<isotropic>(color(0.2, 0.4, 0.9)));
+
+	auto add_texture_kernel = [&](const std::string& name, shared_ptr<texture> t) {
+		kernels.push_back({ name, [&, t]() {
+			double sum = 0.0;
+			for (int k = 0; k < n; k++)
+				sum += t->value(us[k], vs[k], points[k]).x();
+			benchmark_sink = benchmark_sink + sum;
+			return -1L;
+		} });
+	};
+	add_texture_kernel("solid_color::value", make_shared<solid_color>(color(0.5, 0.5, 0.5)));
+	add_texture_kernel("checker_texture::value", checker);
+	add_texture_kernel("noise_texture::value", make_shared<noise_texture>(4));
+	// Run from the project directory, as the renderer
+	for (const char* path : { "..\\_SourceImages\\earthmap.jpg", "../_SourceImages/earthmap.jpg" }) {
+		if (std::ifstream(path)) {
+			add_texture_kernel("image_texture::value", make_shared<image_texture>(path));
+			break;
+		}
+	}
+
+	perlin noise;
+	kernels.push_back({ "perlin::turb", [&]() {
+		double sum = 0.0;
+		for (const auto& p : points)
+			sum += noise.turb(p);
+		benchmark_sink = benchmark_sink + sum;
+		return -1L;
+	} });
+
+	const camera pinhole(point3(13, 2, 3), point3(0, 0, 0), vec3(0, 1, 0), 20, 16.0 / 9.0, 0.0, 10.0, 0.0, 1.0);
+	const camera lens(point3(13, 2, 3), point3(0, 0, 0), vec3(0, 1, 0), 20, 16.0 / 9.0, 0.1, 10.0, 0.0, 1.0);
+	auto add_camera_kernel = [&](const std::string& name, const camera& cam) {
+		kernels.push_back({ name, [&]() {
+			double sum = 0.0;
+			for (int k = 0; k < n; k++)
+				sum += cam.get_ray(us[k], vs[k]).direction().x();
+			benchmark_sink = benchmark_sink + sum;
+			return -1L;
+		} });
+	};
+	add_camera_kernel("camera::get_ray (pinhole)", pinhole);
+	add_camera_kernel("camera::get_ray (aperture 0.1)", lens);
+
+	if (list_only) {
+		for (const auto& kernel : kernels)
+			std::cout << kernel.first << '\n';
+		return 0;
+	}
+
+	// Run them
+	std::vector<kernel_result> results;
+	std::cout << std::left << std::setw(34) << "kernel" << std::right
+		<< std::setw(11) << "ns/op" << std::setw(9) << "+-%" << std::setw(11) << "min ns"
+		<< std::setw(12) << "Mops/s" << std::setw(9) << "hit %" << '\n';
+	for (const auto& kernel : kernels) {
+		if (!options.filter.empty() && kernel.first.find(options.filter) == std::string::npos)
+			continue;
+
+		auto r = measure_kernel(kernel.first, options, kernel.second);
+		results.push_back(r);
+		std::cout << std::left << std::setw(34) << r.name << std::right << std::fixed << std::setprecision(2)
+			<< std::setw(11) << r.median_ns
+			<< std::setw(9) << (r.mean_ns > 0 ? 100.0 * r.stddev_ns / r.mean_ns : 0.0)
+			<< std::setw(11) << r.min_ns
+			<< std::setw(12) << (r.median_ns > 0 ? 1e3 / r.median_ns : 0.0);
+		if (r.positive_rate >= 0)
+			std::cout << std::setw(9) << std::setprecision(1) << 100.0 * r.positive_rate;
+		std::cout << '\n';
+	}
+	active_sampler() = nullptr;
+
+	if (!json_file.empty()) {
+		std::ofstream out(json_file);
+		if (!out) {
+			std::cerr << "ERROR: Could not open '" << json_file << "' for writing.\n";
+			return 1;
+		}
+		write_kernel_json(out, options, results);
+	}
+	return 0;
+}
@@ -1,422 +1,625 @@
 // RayTracingOneWeekend.cpp : This file contains the 'main' function. Program execution begins and ends there.
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
 
 #include "rtweekend.h"
 #include "vec3.h"
 #include "color.h"
-#include "hittable_list.h"
-#include "sphere.h"
-#include "moving_sphere.h"
 #include "camera.h"
-#include "material.h"
-#include "aarect.h"
-#include "box.h"
-#include "constant_medium.h"
-#include "bvh.h"
-
-
-// Consider moving in ray header file/ ray class
-
-/// <summary>
-/// returns the color value of a ray cast into a scene
-/// </summary>
-/// <param name="r"></param>
-/// <param name="background"></param>
-/// <param name="world"></param>
-/// <param name="depth"></param>
-/// <returns></returns>
-color ray_color(const ray& r,const color& background, const hittable& world, int depth) {
-
-	hit_record rec;
-
-	// If we've exceeded the ray bounce limit, no morelight is gathered. 
-	// Prevents infinity recursion.
-	if (depth <= 0)
-		return color(0, 0, 0);
-
-	// If the ray hits nothing, return the background color.
-	if (!world.hit(r, 0.001, infinity, rec)) {
-		
-		/*
-		// if NO object is hit render default sky background
-		vec3 unit_direction = unit_vector(r.direction());
-		auto t = 0.5 * (unit_direction.y() + 1.0);
-		return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0); // linear interpolation
-		// blendValue = (1 -t) * startValue + t * endValue
-		*/
-
-		return background;
-	}
-
-	ray scattered;
-	color attenuation;
-	color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-
-	if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-		return emitted;
-
-	return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
+#include "sampler.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "convergence.h"
+#include "bench.h"
+#include "distributed.h"
+#include "animation.h"
+#include "server.h"
+#include "progressive.h"
+#include "stream_output.h"
+#include "crop.h"
+#include "quality.h"
+
+void print_usage() {
+	std::cerr << "Usage: RayTrackingNextWeek [options] > image.ppm\n"
+		<< "  --scene N           built-in scene 1-9 (default 8, final_scene), or a generated scene:\n"
+		<< "                      10 many_spheres, 11 instanced_boxes, 12 clustered_spheres,\n"
+		<< "                      13 dense_spheres, 14 moving_spheres, 15 many_lights,\n"
+		<< "                      16 terrain_grid, 17 terrain_boxes (the same terrain as box_grid or boxes)\n"
+		<< "  --primitives N      size of a generated scene (default 100000)\n"
+		<< "  --width N           image width (default: scene setting)\n"
+		<< "  --spp N             samples per pixel (default: scene setting)\n"
+		<< "  --depth N           max ray bounces (default 50)\n"
+		<< "  --threads N         render threads (default: all hardware threads)\n"
+		<< "  --sampler NAME      random | stratified | sobol (default random)\n"
+		<< "  --seed N            sampler seed (default 0)\n"
+		<< "  --convergence       print RMSE vs spp for every sampler instead of an image\n"
+		<< "  --conv-max-spp N    largest spp measured by --convergence (default 256)\n"
+		<< "  --conv-ref-spp N    reference spp for --convergence (default 16 x max)\n"
+		<< "  --stats             print traversal/shading counters (build with RT_ENABLE_STATS)\n"
+		<< "  --heatmap PREFIX    write per-pixel traversal cost images PREFIX_*.ppm (RT_ENABLE_STATS)\n"
+		<< "  --time-heatmap PREFIX\n"
+		<< "                      write the render time of every pixel as PREFIX_time.ppm (false color)\n"
+		<< "                      and PREFIX_time.pfm (microseconds per sample)\n"
+		<< "  --bench             render every built-in scene (or only --scene) at fixed settings\n"
+		<< "                      (--width default 200, --spp default 16) and print JSON timings\n"
+		<< "  --bench-out FILE    write the --bench JSON to FILE instead of stdout\n"
+		<< "  --accel NAME        wide | bvh4 | bvh8 | bvh | motion-bvh | grid | auto | none, top-level\n"
+		<< "                      structure built over the scene before rendering (default wide); auto\n"
+		<< "                      times wide and grid for the top level and each nested BVH and keeps\n"
+		<< "                      the faster one\n"
+		<< "  --bench-accel NAME  same as --accel\n"
+		<< "  --occlusion-bench   time occluded() against hit() for shadow ray queries in each scene\n"
+		<< "  --occlusion-queries N  queries per scene for --occlusion-bench (default 200000)\n"
+		<< "  --motion-steps N    time segments per node of motion-bvh (default 1)\n"
+		<< "  --scale-bench N1,N2,...  build and render the generated --scene (default 10) at each\n"
+		<< "                      primitive count (eg. 1k,10k,100k,1M) and report build time,\n"
+		<< "                      memory and rays/s against the count\n"
+		<< "  --quality-update DIR  render converged references of the built-in scenes (or only --scene)\n"
+		<< "                      into DIR and record the error and time of this build at --width\n"
+		<< "                      (default 96), --spp (default 16) and --seed as the baseline\n"
+		<< "  --quality-check DIR check this build against the references in DIR: the error at the\n"
+		<< "                      baseline's spp and in the baseline's time; exits with 1 on a regression\n"
+		<< "  --quality-ref-spp N samples per pixel of the references (default 1024)\n"
+		<< "  --quality-tolerance X  allowed relative growth of the error (relMSE) at equal spp (default 0.1)\n"
+		<< "  --quality-time-tolerance X  allowed relative growth of the error in equal time (default 0.25)\n"
+		<< "  --quality-out DIR   where --quality-check writes test and diff images of failed scenes\n"
+		<< "                      (default the references directory)\n"
+		<< "  --packet-bench      primary and shadow ray throughput of single rays against ray packets\n"
+		<< "  --no-packets        trace pinhole camera rays one by one instead of in packets\n"
+		<< "  --schedule NAME     steal | rows, work-stealing tiles split by estimated cost, or whole rows\n"
+		<< "                      in order (default steal)\n"
+		<< "  --time-budget SEC   render progressive passes until SEC seconds are used, then write the image\n"
+		<< "                      (--spp caps the samples, default no cap)\n"
+		<< "  --stream-out FILE   render in bands of rows and stream them to FILE as binary PPM, keeping\n"
+		<< "                      only a few bands in memory\n"
+		<< "  --band-rows N       rows per band of --stream-out (default 64)\n"
+		<< "  --crop X0,Y0,X1,Y1  render only the pixels [X0,X1) x [Y0,Y1) (rows from the top) of the full\n"
+		<< "                      image, exactly as in a full render, and write them as a crop image\n"
+		<< "  --merge FILE        paste the crop image FILE into a full frame written to stdout (repeatable)\n"
+		<< "  --merge-base FILE   full frame the crops of --merge are pasted into (default black)\n"
+		<< "  --thread-stats      print how busy every render thread was\n"
+		<< "  --trace FILE        record scene setup, structure builds, tiles and output as a Chrome\n"
+		<< "                      trace-event JSON file (open in chrome://tracing or Perfetto)\n"
+		<< "  --no-arena          allocate scene objects one by one on the heap instead of in a scene arena\n"
+		<< "  --math MODE         exact | fast, C library or fast approximations for shading math (default exact)\n"
+		<< "  --math-errors       print the error table and cost of the fast math approximations\n"
+		<< "  --coordinator ADDR  hand out the image in work units to worker processes connecting to ADDR\n"
+		<< "                      (HOST:PORT or unix:PATH) and write the merged image\n"
+		<< "  --worker ADDR       connect to the coordinator at ADDR and render work units until it is done\n"
+		<< "  --spawn-workers N   with --coordinator, start N local worker processes\n"
+		<< "                      (each with --threads threads, default hardware threads / N)\n"
+		<< "  --dist-tile N       tile size of a work unit in pixels (default 32)\n"
+		<< "  --dist-pass-spp N   samples of a tile per work unit (default all)\n"
+		<< "  --dist-timeout SEC  give a work unit to another worker after SEC seconds (default 60)\n"
+		<< "  --frames A:B        render the animation frames A to B into numbered files\n"
+		<< "  --anim FILE         camera/object keyframes of the animation (see load_animation)\n"
+		<< "  --fps N             frames per second of the animation (default 24)\n"
+		<< "  --shutter F         fraction of a frame the shutter is open (default 0.5)\n"
+		<< "  --anim-out PATTERN  printf pattern of the frame files (default frame_%04d.ppm)\n"
+		<< "  --rebuild-threshold X  rebuild the top-level structure when refitting grew its node\n"
+		<< "                      boxes X times on average (default 1.2)\n"
+		<< "  --lookfrom X,Y,Z    camera position (default: scene setting)\n"
+		<< "  --lookat X,Y,Z      point the camera looks at (default: scene setting)\n"
+		<< "  --vfov DEG          vertical field of view (default: scene setting)\n"
+		<< "  --aperture A        lens aperture (default: scene setting)\n"
+		<< "  --serve ADDR        run a render server on ADDR (unix:PATH or HOST:PORT) that keeps scenes\n"
+		<< "                      built between jobs and renders them on --threads shared threads\n"
+		<< "  --server-cache N    built scenes the server keeps (default 4)\n"
+		<< "  --submit ADDR       render the image on the server at ADDR instead of in this process\n"
+		<< "  --server-out FILE   with --submit, the server writes the image to FILE instead of sending it\n"
+		<< "  --server-status ADDR  print queue depth, scene cache use and recent job timings of a server\n"
+		<< "  --server-stop ADDR  let a server finish its running jobs and exit\n";
 }
 
-// Scenes
-hittable_list random_scene() {
-
-	hittable_list world;
-
-	auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-	auto ground_material = make_shared<lambertian>(checker);
-	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
-
-	for (int a = -11; a < 11; a++) {
-		for (int b = -11; b < 11; b++) {
-			auto choose_mat = random_double();
-			point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-
-			if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-				shared_ptr<material> sphere_material;
-
-				if (choose_mat < 0.8) {
-					// Diffuse 
-					auto albedo = color::random() * color::random();
-					sphere_material = make_shared<lambertian>(albedo);
-					auto center2 = center + vec3(0, random_double(0, 0.75), 0);
-					world.add(make_shared<moving_sphere>(
-						center, center2, 0.0, 1.0, 0.2, sphere_material));
-				}
-				else if (choose_mat < 0.95) {
-					// metal 
-					auto albedo = color::random(0.5, 1);
-					auto fuzz = random_double(0, 0.5);
-					sphere_material = make_shared<metal>(albedo, fuzz);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
-				}
-				else {
-					// glass 
-					sphere_material = make_shared<dielectric>(1.5);
-					double randomRadius = random_double(0.1, 0.9);
-					world.add(make_shared<sphere>(center, randomRadius, sphere_material));
-				}
+int main(int argc, char* argv[])
+{
+	// Options
+	int scene_id = 0;
+	int image_width = 0;
+	int samples_per_pixel = 0;
+	int max_depth = 50;	// sets recussive limt for ray_color function
+	int thread_count = 0;
+	std::string sampler_name = "random";
+	uint32_t seed = 0;
+	bool convergence = false;
+	int conv_max_spp = 256;
+	int conv_ref_spp = 0;
+	bool print_stats = false;
+	std::string heatmap_prefix;
+	std::string time_heatmap_prefix;
+	bool bench = false;
+	std::string bench_out;
+	std::string accel = "wide";
+	int motion_steps = 1;
+	bool occlusion_bench = false;
+	int occlusion_queries = 200000;
+	bool packet_bench = false;
+	std::string scale_counts;
+	size_t primitives = 0;
+	bool packets = true;
+	bool use_arena = true;
+	std::string schedule = "steal";
+	bool thread_stats = false;
+	double time_budget = 0.0;
+	std::string stream_out;
+	stream_options stream;
+	std::string crop_text;
+	std::string quality_update;
+	std::string quality_check;
+	quality_options quality;
+	std::vector<std::string> merge_files;
+	std::string merge_base;
+	std::string trace_file;
+	std::string math_mode = "exact";
+	bool math_errors = false;
+	std::string worker_address;
+	distributed_options dist;
+	dist.program = argv[0];
+	bool animate = false;
+	std::string anim_file;
+	animation_options anim_options;
+	render_request camera_request;	// camera values given on the command line
+	server_options server;
+	std::string submit_address;
+	std::string server_out;
+	std::string status_address;
+	std::string stop_address;
+
+	for (int a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		bool has_value = a + 1 < argc;
+
+		if (arg == "--scene" && has_value)
+			scene_id = atoi(argv[++a]);
+		else if (arg == "--primitives" && has_value)
+			primitives = static_cast<size_t>(strtoull(argv[++a], nullptr, 10));
+		else if (arg == "--scale-bench" && has_value)
+			scale_counts = argv[++a];
+		else if (arg == "--width" && has_value)
+			image_width = atoi(argv[++a]);
+		else if (arg == "--spp" && has_value)
+			samples_per_pixel = atoi(argv[++a]);
+		else if (arg == "--depth" && has_value)
+			max_depth = atoi(argv[++a]);
+		else if (arg == "--threads" && has_value)
+			thread_count = atoi(argv[++a]);
+		else if (arg == "--sampler" && has_value)
+			sampler_name = argv[++a];
+		else if (arg == "--seed" && has_value)
+			seed = static_cast<uint32_t>(strtoul(argv[++a], nullptr, 10));
+		else if (arg == "--convergence")
+			convergence = true;
+		else if (arg == "--conv-max-spp" && has_value)
+			conv_max_spp = atoi(argv[++a]);
+		else if (arg == "--conv-ref-spp" && has_value)
+			conv_ref_spp = atoi(argv[++a]);
+		else if (arg == "--stats")
+			print_stats = true;
+		else if (arg == "--heatmap" && has_value)
+			heatmap_prefix = argv[++a];
+		else if (arg == "--time-heatmap" && has_value)
+			time_heatmap_prefix = argv[++a];
+		else if (arg == "--bench")
+			bench = true;
+		else if (arg == "--bench-out" && has_value)
+			bench_out = argv[++a];
+		else if ((arg == "--accel" || arg == "--bench-accel") && has_value)
+			accel = argv[++a];
+		else if (arg == "--occlusion-bench")
+			occlusion_bench = true;
+		else if (arg == "--occlusion-queries" && has_value)
+			occlusion_queries = atoi(argv[++a]);
+		else if (arg == "--motion-steps" && has_value)
+			motion_steps = atoi(argv[++a]);
+		else if (arg == "--packet-bench")
+			packet_bench = true;
+		else if (arg == "--quality-update" && has_value)
+			quality_update = argv[++a];
+		else if (arg == "--quality-check" && has_value)
+			quality_check = argv[++a];
+		else if (arg == "--quality-ref-spp" && has_value)
+			quality.reference_spp = atoi(argv[++a]);
+		else if (arg == "--quality-tolerance" && has_value)
+			quality.tolerance = atof(argv[++a]);
+		else if (arg == "--quality-time-tolerance" && has_value)
+			quality.time_tolerance = atof(argv[++a]);
+		else if (arg == "--quality-out" && has_value)
+			quality.out_directory = argv[++a];
+		else if (arg == "--no-packets")
+			packets = false;
+		else if (arg == "--no-arena")
+			use_arena = false;
+		else if (arg == "--schedule" && has_value)
+			schedule = argv[++a];
+		else if (arg == "--thread-stats")
+			thread_stats = true;
+		else if (arg == "--time-budget" && has_value)
+			time_budget = atof(argv[++a]);
+		else if (arg == "--stream-out" && has_value)
+			stream_out = argv[++a];
+		else if (arg == "--band-rows" && has_value)
+			stream.band_rows = atoi(argv[++a]);
+		else if (arg == "--crop" && has_value)
+			crop_text = argv[++a];
+		else if (arg == "--merge" && has_value)
+			merge_files.push_back(argv[++a]);
+		else if (arg == "--merge-base" && has_value)
+			merge_base = argv[++a];
+		else if (arg == "--trace" && has_value)
+			trace_file = argv[++a];
+		else if (arg == "--math" && has_value)
+			math_mode = argv[++a];
+		else if (arg == "--math-errors")
+			math_errors = true;
+		else if (arg == "--coordinator" && has_value)
+			dist.address = argv[++a];
+		else if (arg == "--worker" && has_value)
+			worker_address = argv[++a];
+		else if (arg == "--spawn-workers" && has_value)
+			dist.spawn_workers = atoi(argv[++a]);
+		else if (arg == "--dist-tile" && has_value)
+			dist.tile_size = atoi(argv[++a]);
+		else if (arg == "--dist-pass-spp" && has_value)
+			dist.pass_samples = atoi(argv[++a]);
+		else if (arg == "--dist-timeout" && has_value)
+			dist.unit_timeout = atof(argv[++a]);
+		else if (arg == "--frames" && has_value) {
+			animate = sscanf(argv[++a], "%d:%d", &anim_options.first_frame, &anim_options.last_frame) == 2;
+			if (!animate) {
+				print_usage();
+				return 1;
 			}
 		}
+		else if (arg == "--anim" && has_value)
+			anim_file = argv[++a];
+		else if (arg == "--fps" && has_value)
+			anim_options.fps = atof(argv[++a]);
+		else if (arg == "--shutter" && has_value)
+			anim_options.shutter = atof(argv[++a]);
+		else if (arg == "--anim-out" && has_value)
+			anim_options.output_pattern = argv[++a];
+		else if (arg == "--rebuild-threshold" && has_value)
+			anim_options.rebuild_threshold = atof(argv[++a]);
+		else if (arg == "--lookfrom" && has_value)
+			camera_request.has_lookfrom = render_request::parse_point(argv[++a], camera_request.lookfrom);
+		else if (arg == "--lookat" && has_value)
+			camera_request.has_lookat = render_request::parse_point(argv[++a], camera_request.lookat);
+		else if (arg == "--vfov" && has_value)
+			camera_request.vfov = atof(argv[++a]);
+		else if (arg == "--aperture" && has_value)
+			camera_request.aperture = atof(argv[++a]);
+		else if (arg == "--serve" && has_value)
+			server.address = argv[++a];
+		else if (arg == "--server-cache" && has_value)
+			server.cached_scenes = static_cast<size_t>(atoi(argv[++a]));
+		else if (arg == "--submit" && has_value)
+			submit_address = argv[++a];
+		else if (arg == "--server-out" && has_value)
+			server_out = argv[++a];
+		else if (arg == "--server-status" && has_value)
+			status_address = argv[++a];
+		else if (arg == "--server-stop" && has_value)
+			stop_address = argv[++a];
+		else {
+			print_usage();
+			return 1;
+		}
 	}
 
-	auto material1 = make_shared<dielectric>(1.5);
-	world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-	auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-	world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, ground_material));
-
-	auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-	world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+	// Written when main returns, whichever way it does
+	trace_file_writer trace_writer(trace_file);
 
-	return world;
-}
-hittable_list two_spheres() {
-	hittable_list objects; 
-
-	auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-	auto checker_material = make_shared<lambertian>(checker);
-
-	objects.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-	objects.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
-
-	return objects;
-}
-hittable_list two_perlin_spheres() {
-	hittable_list objects; 
-
-	auto pertext = make_shared<noise_texture>(4); 
-	auto pertext_material = make_shared<lambertian>(pertext);
-
-	objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, pertext_material));
-	objects.add(make_shared<sphere>(point3(0, 2, 0), 2, pertext_material));
-
-	return objects;
-}
-hittable_list earth(){
-	hittable_list objects;
-
-	auto perlinNoise = make_shared<noise_texture>(4);
-	auto groundMat = make_shared<lambertian>(perlinNoise);
-	objects.add(make_shared<xz_rect>(-100, 100, -100, 100, -2, groundMat));
-
-	auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
-	objects.add(make_shared<sphere>(point3(1, 0, -3), 1, white));
-
-	auto earth_texture = make_shared<image_texture>("..\\_SourceImages\\earthmap.jpg"); 
-	auto earth_surface = make_shared<metal>(earth_texture, .05); 
-	auto globe = make_shared<sphere>(point3(0, 0, 0), 2, earth_surface);
-	objects.add(globe); 
-
-	return objects;
-}
-hittable_list simple_light() {
-	hittable_list objects;
-
-	auto pertext = make_shared<noise_texture>(4);
-	auto pertext_material = make_shared<lambertian>(pertext);
-
-	objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, pertext_material));
-	objects.add(make_shared<sphere>(point3(0, 2, 0), 2, pertext_material));
-
-	auto difflight = make_shared<diffuse_light>(color(4, 4, 4));
-	objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
-	objects.add(make_shared<sphere>(point3(0, 8, 0), 3, difflight));
-
-	return objects;
-}
-hittable_list cornell_box() {
-	hittable_list objects;
-
-	auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
-	auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
-	auto green = make_shared<lambertian>(color(0.12, 0.45, 0.15));
-	auto light = make_shared<diffuse_light>(color(15, 15, 15));
-
-	objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-	objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-	objects.add(make_shared<xz_rect>(150, 400, 200, 350, 554, light));
-	objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-	objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-	objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
-
-	shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-	box1 = make_shared<rotate_y>(box1, 15);
-	box1 = make_shared<translate>(box1, vec3(265, 0, 295));
-	objects.add(box1);
-
-	shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-	//box2 = make_shared<rotate_x>(box2, -20);
-	box2 = make_shared<rotate_y>(box2, -18);
-	//box2 = make_shared<rotate_z>(box2, -18);
-	box2 = make_shared<translate>(box2, vec3(130, 1, 65));
-	objects.add(box2);
-
-	/*
-	auto earth_texture = make_shared<image_texture>("..\\_SourceImages\\earthmap.jpg");
-	auto earthMetal_surface = make_shared<metal>(earth_texture, .2);
-	auto globe = make_shared<sphere>(point3(150, 100, 200), 100, earthMetal_surface);
-	objects.add(globe);
-	*/
-
-	return objects;
-}
-hittable_list cornell_smoke() {
-	hittable_list objects;
+	if (math_mode != "exact" && math_mode != "fast") {
+		std::cerr << "ERROR: Unknown math mode '" << math_mode << "'.\n";
+		print_usage();
+		return 1;
+	}
+	fast_math_enabled() = math_mode == "fast";
+
+	// Workers get everything else from the coordinator's job
+	if (!worker_address.empty())
+		return run_worker(worker_address, thread_count);
+
+	// Merging only pastes finished crop images together, no scene is needed
+	if (!merge_files.empty()) {
+		ppm_image base;
+		if (!merge_base.empty() && !read_ppm(merge_base, base))
+			return 1;
+		std::vector<ppm_image> crops(merge_files.size());
+		for (size_t k = 0; k < merge_files.size(); k++) {
+			if (!read_ppm(merge_files[k], crops[k]))
+				return 1;
+		}
+		ppm_image frame;
+		if (!merge_crops(merge_base.empty() ? nullptr : &base, crops, frame))
+			return 1;
+		write_ppm(std::cout, frame);
+		return 0;
+	}
 
-	auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
-	auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
-	auto green = make_shared<lambertian>(color(0.12, 0.45, 0.15));
-	auto light = make_shared<diffuse_light>(color(15, 15, 15));
+	if (math_errors) {
+		run_math_error_report(std::cout);
+		return 0;
+	}
 
-	objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-	objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-	objects.add(make_shared<xz_rect>(150, 400, 200, 350, 554, light));
-	objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-	objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-	objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+	if (schedule != "steal" && schedule != "rows") {
+		std::cerr << "ERROR: Unknown schedule '" << schedule << "'.\n";
+		print_usage();
+		return 1;
+	}
 
-	shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-	box1 = make_shared<rotate_y>(box1, 15);
-	box1 = make_shared<translate>(box1, vec3(265, 0, 295));
-	objects.add(make_shared<constant_medium>(box1, 0.01, color(0, 0, 0)));
+	if (!is_accel_name(accel)) {
+		std::cerr << "ERROR: Unknown acceleration structure '" << accel << "'.\n";
+		print_usage();
+		return 1;
+	}
 
-	shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-	box2 = make_shared<rotate_y>(box2, -18);
-	box2 = make_shared<translate>(box2, vec3(130, 1, 65));
-	objects.add(make_shared<constant_medium>(box2, 0.01, color(1,1,1)));
+	// Checked before any mode runs, so a benchmark never records a sampler it did not use
+	if (!make_sampler(sampler_name, 1, seed)) {
+		std::cerr << "ERROR: Unknown sampler '" << sampler_name << "'.\n";
+		print_usage();
+		return 1;
+	}
 
+	// The server renders in its own math mode; clients only send the scene, view and sampling
+	if (!server.address.empty()) {
+		server.thread_count = thread_count;
+		render_server daemon(server);
+		return daemon.run();
+	}
+	if (!status_address.empty())
+		return send_server_command(status_address, msg_status, std::cout);
+	if (!stop_address.empty())
+		return send_server_command(stop_address, msg_shutdown, std::cout);
+	if (!submit_address.empty()) {
+		render_request request = camera_request;
+		request.scene_id = scene_id > 0 ? scene_id : 8;
+		request.primitives = primitives;
+		request.image_width = image_width;
+		request.samples_per_pixel = samples_per_pixel;
+		request.max_depth = max_depth;
+		request.packets = packets;
+		request.accel = accel;
+		request.motion_steps = motion_steps;
+		request.sampler_name = sampler_name;
+		request.seed = seed;
+		request.use_arena = use_arena;
+		request.output_path = server_out;
+		return submit_render_request(submit_address, request, std::cout);
+	}
 
-	return objects;
-}
-hittable_list final_scene() {
-	hittable_list boxes1;
-	auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
-
-	const int boxes_per_side = 20;
-	for (int i = 0; i < boxes_per_side; i++) {
-		for (int j = 0; j < boxes_per_side; j++) {
-			auto w = 100.0;
-			auto x0 = -1000.0 + i * w;
-			auto z0 = -1000.0 + j * w;
-			auto y0 = 0.0;
-			auto x1 = x0 + w;
-			auto y1 = random_double(1, 101);
-			auto z1 = z0 + w;
-
-			boxes1.add(make_shared<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
+	if (!quality_update.empty() || !quality_check.empty()) {
+		if (image_width > 0)
+			quality.image_width = image_width;
+		if (samples_per_pixel > 0)
+			quality.samples_per_pixel = samples_per_pixel;
+		if (scene_id > 0)
+			quality.first_scene = quality.last_scene = scene_id;
+		if (quality.first_scene > builtin_scene_count) {
+			std::cerr << "ERROR: The quality references cover the built-in scenes 1-" << builtin_scene_count << ".\n";
+			return 1;
+		}
+		quality.max_depth = max_depth;
+		quality.thread_count = thread_count;
+		quality.seed = seed;
+		quality.sampler_name = sampler_name;
+		quality.accel = accel;
+		quality.motion_steps = motion_steps;
+		quality.packets = packets;
+		quality.use_arena = use_arena;
+		quality.schedule = schedule;
+
+		if (!quality_update.empty()) {
+			quality.directory = quality_update;
+			return update_quality_references(quality) ? 0 : 1;
 		}
+		quality.directory = quality_check;
+		return run_quality_check(quality, std::cout) == 0 ? 0 : 1;
 	}
 
-	hittable_list objects;
-
-	objects.add(make_shared<bvh_node>(boxes1, 0, 1));
+	if (bench || occlusion_bench || packet_bench || !scale_counts.empty()) {
+		bench_options options;
+		if (image_width > 0)
+			options.image_width = image_width;
+		if (samples_per_pixel > 0)
+			options.samples_per_pixel = samples_per_pixel;
+		if (scene_id > 0)
+			options.first_scene = options.last_scene = scene_id;
+		options.max_depth = max_depth;
+		options.thread_count = thread_count;
+		options.seed = seed;
+		options.sampler_name = sampler_name;
+		options.accel = accel;
+		options.motion_steps = motion_steps;
+		options.packets = packets;
+		options.use_arena = use_arena;
+		options.primitives = primitives;
+		options.schedule = schedule;
+
+		std::ofstream json_file;
+		if (!bench_out.empty()) {
+			json_file.open(bench_out);
+			if (!json_file) {
+				std::cerr << "ERROR: Could not open '" << bench_out << "' for writing.\n";
+				return 1;
+			}
+		}
+		std::ostream& json_out = bench_out.empty() ? std::cout : json_file;
+
+		if (!scale_counts.empty()) {
+			std::vector<size_t> counts;
+			const int scale_scene = scene_id > 0 ? scene_id : first_generated_scene;
+			if (!parse_primitive_counts(scale_counts, counts) || !is_generated_scene(scale_scene)) {
+				std::cerr << "ERROR: --scale-bench needs primitive counts and a generated scene ("
+						  << first_generated_scene << '-' << last_generated_scene << ").\n";
+				return 1;
+			}
+			run_scaling_benchmark(options, scale_scene, counts, json_out);
+		}
+		else if (packet_bench)
+			run_packet_benchmark(options, json_out);
+		else if (occlusion_bench)
+			run_occlusion_benchmark(options, occlusion_queries, json_out);
+		else
+			run_benchmark(options, json_out);
+		return 0;
+	}
 
-	auto light = make_shared<diffuse_light>(color(7, 7, 7));
-	objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
+	// World 
+	// A coordinator only needs the view settings, its workers build the world
+	const bool coordinate = !dist.address.empty();
+	scene_config scene = select_scene(scene_id > 0 ? scene_id : 8, use_arena, primitives, !coordinate);
+	if (image_width > 0)
+		scene.image_width = image_width;
+	if (samples_per_pixel > 0)
+		scene.samples_per_pixel = samples_per_pixel;
+	apply_request_camera(camera_request, scene);
 
-	auto center1 = point3(400, 400, 200);
-	auto center2 = center1 + vec3(30, 0, 0);
-	auto moving_sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
-	objects.add(make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+	// Camera 
+	camera cam = make_camera(scene);
+
+	render_settings settings;
+	settings.image_width = scene.image_width;
+	settings.image_height = static_cast<int>(scene.image_width / scene.aspect_ratio);
+	settings.samples_per_pixel = scene.samples_per_pixel;
+	settings.max_depth = max_depth;
+	settings.thread_count = thread_count;
+	settings.packets = packets;
+	settings.accel = accel;
+	settings.motion_steps = motion_steps;
+	settings.schedule = schedule;
+
+	if (coordinate) {
+		if (!heatmap_prefix.empty() || !time_heatmap_prefix.empty() || print_stats)
+			std::cerr << "WARNING: Heatmaps and --stats are not collected from workers, ignoring.\n";
+		if (convergence || animate || !crop_text.empty() || !stream_out.empty() || time_budget > 0)
+			std::cerr << "WARNING: Workers render whole images only, ignoring the other render modes.\n";
+		render_job job;
+		job.scene_id = scene_id > 0 ? scene_id : 8;
+		job.primitives = primitives;
+		job.settings = settings;
+		job.sampler_name = sampler_name;
+		job.seed = seed;
+		job.use_arena = use_arena;
+		job.fast_math = fast_math_enabled();
+		job.has_lookfrom = camera_request.has_lookfrom;
+		job.has_lookat = camera_request.has_lookat;
+		job.lookfrom = camera_request.lookfrom;
+		job.lookat = camera_request.lookat;
+		job.vfov = camera_request.vfov;
+		job.aperture = camera_request.aperture;
+		dist.worker_threads = thread_count;
+
+		std::vector<color> framebuffer;
+		distributed_stats dist_stats;
+		if (!run_coordinator(job, dist, framebuffer, dist_stats))
+			return 1;
+		write_ppm(std::cout, framebuffer, settings.image_width, settings.image_height, settings.samples_per_pixel);
+		print_distributed_stats(std::cerr, dist_stats);
+		return 0;
+	}
 
-	objects.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-	objects.add(make_shared<sphere>(
-		point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
-		));
+	if (convergence) {
+		if (conv_ref_spp <= 0)
+			conv_ref_spp = 16 * conv_max_spp;
+		run_convergence_benchmark(scene.world, cam, scene.background, settings,
+								  conv_max_spp, conv_ref_spp, seed, std::cout);
+		return 0;
+	}
 
-	auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, make_shared<dielectric>(1.5));
-	objects.add(boundary);
-	objects.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-	boundary = make_shared<sphere>(point3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
-	objects.add(make_shared<constant_medium>(boundary, .0001, color(1, 1, 1)));
+	// Without --spp a time budget alone decides the samples
+	if (time_budget > 0 && samples_per_pixel <= 0)
+		settings.samples_per_pixel = 1 << 20;
 
-	auto emat = make_shared<lambertian>(make_shared<image_texture>("..\\_SourceImages\\earthmap.jpg"));
-	objects.add(make_shared<sphere>(point3(400, 200, 400), 100, emat));
-	auto pertext = make_shared<noise_texture>(0.1);
-	objects.add(make_shared<sphere>(point3(220, 280, 300), 80, make_shared<lambertian>(pertext)));
+	auto smp = make_sampler(sampler_name, settings.samples_per_pixel, seed);
 
-	hittable_list boxes2;
-	auto white = make_shared<lambertian>(color(.73, .73, .73));
-	int ns = 1000;
-	for (int j = 0; j < ns; j++) {
-		boxes2.add(make_shared<sphere>(point3::random(0, 165), 10, white));
+	if (animate) {
+		animation_description anim;
+		if (!anim_file.empty() && !load_animation(anim_file, anim))
+			return 1;
+		settings.show_progress = false;
+		return run_animation(scene, anim, settings, *smp, anim_options);
 	}
 
-	objects.add(make_shared<translate>(
-		make_shared<rotate_y>(
-			make_shared<bvh_node>(boxes2, 0.0, 1.0), 15),
-		vec3(-100, 270, 395)
-		)
-	);
-
-	return objects;
-}
-
-int main()
-{
-	//	Image 
-	auto aspect_ratio = 16.0 / 9.0;
-	int samples_per_pixel = 100;  // Sets anti-alaising samples
-	int image_width = 480;
-	int max_depth = 50;	// sets recussive limt for ray_color function
+	//	Render
+	std::vector<color> framebuffer;
+	trace_heatmaps heatmaps;
+	bool want_heatmaps = !heatmap_prefix.empty();
+	if (want_heatmaps && !stats_enabled) {
+		std::cerr << "WARNING: --heatmap needs a build with RT_ENABLE_STATS defined, ignoring.\n";
+		want_heatmaps = false;
+	}
+	time_heatmap times;
+	const bool want_times = !time_heatmap_prefix.empty();
+
+	if (!crop_text.empty()) {
+		image_region crop;
+		if (!parse_crop(crop_text, crop) || crop.x1 > settings.image_width || crop.y1 > settings.image_height) {
+			std::cerr << "ERROR: Crop window '" << crop_text << "' is not inside the " << settings.image_width
+					  << 'x' << settings.image_height << " image.\n";
+			return 1;
+		}
+		if (want_heatmaps || want_times)
+			std::cerr << "WARNING: Heatmaps are not written for crops, ignoring.\n";
+		auto stats = render_crop(scene.world, cam, scene.background, settings, *smp, crop, framebuffer);
+		write_crop_ppm(std::cout, framebuffer, crop, settings);
+		if (print_stats)
+			print_trace_counters(std::cerr, stats.counters, stats.samples);
+		return 0;
+	}
 
-	// World 
-	hittable_list world;
-	point3 lookfrom;
-	point3 lookat;
-	auto vfov = 40.0;
-	auto aperture = 0.0;
-	color background(0, 0, 0);
-
-	// Choosen a scene
-	switch (8)
-	{
-	case 1:
-		world = random_scene();
-		background = color(0.70, 0.80, 1.00);
-		lookfrom = point3(13, 2, 3);
-		lookat = point3(0, 0, 0);
-		vfov = 20.0;
-		aperture = 0.1;
-		break;
-
-	case 2:
-		world = two_spheres();
-		background = color(0.70, 0.80, 1.00);
-		lookfrom = point3(13, 2, 3);
-		lookat = point3(0, 0, 0);
-		vfov = 20.0;
-		break;
-
-	case 3:
-		world = two_perlin_spheres(); 
-		background = color(0.70, 0.80, 1.00);
-		lookfrom = point3(13, 2, 3);
-		lookat = point3(0, 0, 0);
-		vfov = 20.0;
-		break;
-
-	case 4:
-		world = earth();
-		background = color(0.70, 0.80, 1.00);
-		lookfrom = point3(13, 2, 3);
-		lookat = point3(0, 0, 0);
-		vfov = 20.0;
-		break;
-
-	case 5:
-		world = simple_light();
-		samples_per_pixel = 400;
-		background = color(0, 0, 0);
-		lookfrom = point3(26, 3, 6);
-		lookat = point3(0, 2, 0);
-		vfov = 20.0;
-		break;
-	
-	case 6:
-		world = cornell_box();
-		aspect_ratio = 1.0;
-		image_width = 600;
-		samples_per_pixel = 1000;
-		background = color(0, 0, 0);
-		lookfrom = point3(278, 278, -800);
-		lookat = point3(278, 278, 0);
-		vfov = 40.0;
-		break;
-
-	case 7:
-		world = cornell_smoke();
-		aspect_ratio = 1.0;
-		image_width = 600;
-		samples_per_pixel = 1000;
-		lookfrom = point3(278, 278, -800);
-		lookat = point3(278, 278, 0);
-		vfov = 40.0;
-		break;
-
-	case 8:
-		world = final_scene();
-		aspect_ratio = 1.0;
-		image_width = 800;
-		samples_per_pixel = 500;
-		background = color(0.5, 0.7, 1.0);
-		lookfrom = point3(478, 278, -600);
-		lookat = point3(278, 278, 0);
-		vfov = 40.0;
-		break;
-
-	default:
-	case 9:
-		background = color(0.0, 0.0, 0.0);
-		break;
+	if (!stream_out.empty()) {
+		if (want_heatmaps || want_times)
+			std::cerr << "WARNING: Heatmaps need the whole image, ignoring with --stream-out.\n";
+		std::ofstream out(stream_out, std::ios::binary);
+		if (!out) {
+			std::cerr << "ERROR: Could not open '" << stream_out << "' for writing.\n";
+			return 1;
+		}
+		stream_stats stream_result;
+		auto stats = render_streaming(scene.world, cam, scene.background, settings, *smp, out, stream, stream_result);
+		print_stream_stats(std::cerr, stream_result);
+		std::cerr << "Peak resident memory " << peak_rss_bytes() / (1024 * 1024) << " MiB\n";
+		if (print_stats)
+			print_trace_counters(std::cerr, stats.counters, stats.samples);
+		if (!out) {
+			std::cerr << "ERROR: Could not write '" << stream_out << "'.\n";
+			return 1;
+		}
+		return 0;
 	}
 
-	// Camera 
-	vec3 vup(0, 1, 0);
-	auto dist_to_focus = 10.0;
-	const int image_height = static_cast<int>(image_width / aspect_ratio);
+	if (time_budget > 0) {
+		if (want_heatmaps || want_times)
+			std::cerr << "WARNING: Heatmaps are not collected with --time-budget, ignoring.\n";
+		std::vector<int> sample_counts;
+		budget_report report;
+		auto stats = render_time_budget(scene.world, cam, scene.background, settings, *smp, time_budget,
+										framebuffer, sample_counts, report);
+		write_ppm(std::cout, framebuffer, sample_counts, settings.image_width, settings.image_height);
+		print_budget_report(std::cerr, report);
+		if (print_stats)
+			print_trace_counters(std::cerr, stats.counters, stats.samples);
+		return 0;
+	}
 
-	camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
+	auto stats = render(scene.world, cam, scene.background, settings, *smp, framebuffer,
+						want_heatmaps ? &heatmaps : nullptr, want_times ? &times : nullptr);
+	write_ppm(std::cout, framebuffer, settings.image_width, settings.image_height, settings.samples_per_pixel);
 
-	//	Render
-	std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-
-	for (int j = image_height - 1; j >= 0; j--) // row
-	{
-		std::cerr << "\rScalinesRemaining: " << j << ' ' << std::flush;
-		for (int i = 0; i < image_width; ++i)	// column
-		{
-			color pixel_color(0, 0, 0);
-			for (int s = 0; s < samples_per_pixel; s++) { // anti-aliasing subpixel rays 
-				auto u = (i + random_double()) / (image_width - 1);
-				auto v = (j + random_double()) / (image_height - 1);
-				ray r = cam.get_ray(u, v);
-				pixel_color += ray_color(r, background, world, max_depth);
-			}
-			write_color(std::cout, pixel_color, samples_per_pixel);
-		}
+	if (print_stats)
+		print_trace_counters(std::cerr, stats.counters, stats.samples);
+	if (thread_stats) {
+		std::cerr << "Render " << stats.render_seconds * 1000.0 << " ms, cost estimate " << stats.pilot_seconds * 1000.0 << " ms\n";
+		print_thread_utilization(std::cerr, stats.threads, stats.render_seconds - stats.pilot_seconds);
 	}
-	std::cerr << "\nDone.\n";
+	if (want_heatmaps)
+		write_trace_heatmaps(heatmap_prefix, heatmaps);
+	if (want_times)
+		write_time_heatmap(time_heatmap_prefix, times);
+
 	return 0;
-}
\ No newline at end of file
+}
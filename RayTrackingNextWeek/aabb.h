@@ -1,6 +1,9 @@
 #pragma once
 
+#include <utility>
+
 #include "rtweekend.h"
+#include "stats.h"
 
 class aabb {
 public: 
@@ -11,13 +14,17 @@ public:
 	point3 max() const { return maximum; }
 
 	bool hit(const ray& r, double t_min, double t_max) const {
+		RT_STAT(aabb_tests++);
 		for (int a = 0; a < 3; a++) { // loops through (x,y,z)
-			auto t0 = fmin((minimum[a] - r.origin()[a]) / r.direction()[a],
-						   (maximum[a] - r.origin()[a]) / r.direction()[a]); 
-			auto t1 = fmax((minimum[a] - r.origin()[a]) / r.direction()[a],
-						   (maximum[a] - r.origin()[a]) / r.direction()[a]);
-			t_min = fmax(t0, t_min);
-			t_max = fmin(t1, t_max); 
+			// One reciprocal per axis. An axis parallel ray gives invD = inf; a NaN slab
+			// value (0 * inf) fails both comparisons below and leaves the interval unchanged.
+			auto invD = 1.0 / r.direction()[a];
+			auto t0 = (minimum[a] - r.origin()[a]) * invD;
+			auto t1 = (maximum[a] - r.origin()[a]) * invD;
+			if (invD < 0.0)
+				std::swap(t0, t1);
+			t_min = t0 > t_min ? t0 : t_min;
+			t_max = t1 < t_max ? t1 : t_max;
 			if (t_max <= t_min)
 				return false;
 		}
@@ -39,4 +46,19 @@ aabb surrounding_box(aabb box0, aabb box1) {
 			   fmax(box0.max().z(), box1.max().z()));
 
 	return aabb(small, big);
+}
+
+/// <summary>
+/// Linear interpolation between two boxes. Used for boxes that move over the shutter interval.
+/// </summary>
+aabb lerp_box(const aabb& box0, const aabb& box1, double f) {
+	return aabb(box0.min() + f * (box1.min() - box0.min()),
+				box0.max() + f * (box1.max() - box0.max()));
+}
+
+/// <summary>
+/// Grows a box by delta on both sides of every axis
+/// </summary>
+aabb expand_box(const aabb& box, const vec3& delta) {
+	return aabb(box.min() - delta, box.max() + delta);
 }
\ No newline at end of file
@@ -9,6 +9,7 @@ public:
 		: x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		// The bounding box must have non-zero wirdth in each dimension, so pad the Z 
@@ -29,6 +30,7 @@ public:
 		: x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		// The bounding box must have non-zero wirdth in each dimension, so pad the Z 
@@ -49,6 +51,7 @@ public:
 		: y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		// The bounding box must have non-zero wirdth in each dimension, so pad the Z 
@@ -65,6 +68,7 @@ public:
 
 
 bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_xy_rect]++);
 	auto t = (k - r.origin().z()) / r.direction().z();
 	
 	if (t <t_min || t > t_max)
@@ -81,12 +85,13 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 	rec.t = t; 
 	auto outward_normal = vec3(0, 0, 1);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp; 
+	rec.mat_ptr = mp.get(); 
 	rec.p = r.at(t); 
 	return true;
 }
 
 bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_xz_rect]++);
 	auto t = (k - r.origin().y()) / r.direction().y();
 
 	if (t <t_min || t > t_max)
@@ -104,13 +109,14 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 	rec.t = t;
 	auto outward_normal = vec3(0, 1, 0);
 	rec.set_face_normal(r, outward_normal); 
-	rec.mat_ptr = mp; 
+	rec.mat_ptr = mp.get(); 
 	rec.p = r.at(t);
 	return true;
 
 }
 
 bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_yz_rect]++);
 	auto t = (k - r.origin().x()) / r.direction().x();
 
 	if (t <t_min || t > t_max)
@@ -128,7 +134,40 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 	rec.t = t;
 	auto outward_normal = vec3(1, 0, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
 	rec.p = r.at(t);
 	return true;
+}
+
+bool xy_rect::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_xy_rect]++);
+	auto t = (k - r.origin().z()) / r.direction().z();
+	if (t < t_min || t > t_max)
+		return false;
+
+	auto x = r.origin().x() + t * r.direction().x();
+	auto y = r.origin().y() + t * r.direction().y();
+	return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
+bool xz_rect::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_xz_rect]++);
+	auto t = (k - r.origin().y()) / r.direction().y();
+	if (t < t_min || t > t_max)
+		return false;
+
+	auto x = r.origin().x() + t * r.direction().x();
+	auto z = r.origin().z() + t * r.direction().z();
+	return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+}
+
+bool yz_rect::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_yz_rect]++);
+	auto t = (k - r.origin().x()) / r.direction().x();
+	if (t < t_min || t > t_max)
+		return false;
+
+	auto y = r.origin().y() + t * r.direction().y();
+	auto z = r.origin().z() + t * r.direction().z();
+	return y >= y0 && y <= y1 && z >= z0 && z <= z1;
 }
\ No newline at end of file
@@ -0,0 +1,230 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+#include "motion.h"
+#include "camera.h"
+#include "sampler.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "scene_accel.h"
+
+/// <summary>
+/// Camera and object motion of an animation on top of a built-in scene
+/// </summary>
+struct animation_description {
+	struct object_keys {
+		size_t index;	// position of the object in the scene's world list
+		std::vector<vec3_keyframe> keys;	// displacement of the object
+	};
+
+	std::vector<vec3_keyframe> lookfrom_keys;	// empty keeps the scene's camera
+	std::vector<vec3_keyframe> lookat_keys;
+	double turntable_seconds = 0.0;	// > 0 orbits lookfrom around lookat (y axis) once per period
+	std::vector<object_keys> objects;
+};
+
+/// <summary>
+/// Reads an animation description. One entry per line, times in seconds, '#' starts a comment:
+///   camera TIME FROM_X FROM_Y FROM_Z AT_X AT_Y AT_Z   camera keyframe (lookfrom, lookat)
+///   object INDEX TIME DX DY DZ                       displacement keyframe of world object INDEX
+///   turntable SECONDS                                orbit the camera once every SECONDS
+/// Keys are interpolated linearly (keyframe_track) and may be given in any order.
+/// </summary>
+/// <returns>false if the file cannot be read or has a bad line</returns>
+bool load_animation(const std::string& path, animation_description& anim) {
+	std::ifstream in(path);
+	if (!in) {
+		std::cerr << "ERROR: Could not open animation file '" << path << "'.\n";
+		return false;
+	}
+
+	std::string line;
+	int line_number = 0;
+	while (std::getline(in, line)) {
+		line_number++;
+		line = line.substr(0, line.find('#'));
+		std::istringstream fields(line);
+		std::string kind;
+		if (!(fields >> kind))
+			continue;
+
+		bool ok = false;
+		if (kind == "camera") {
+			double time, fx, fy, fz, ax, ay, az;
+			ok = static_cast<bool>(fields >> time >> fx >> fy >> fz >> ax >> ay >> az);
+			if (ok) {
+				anim.lookfrom_keys.push_back({ time, point3(fx, fy, fz) });
+				anim.lookat_keys.push_back({ time, point3(ax, ay, az) });
+			}
+		}
+		else if (kind == "object") {
+			size_t index;
+			double time, dx, dy, dz;
+			ok = static_cast<bool>(fields >> index >> time >> dx >> dy >> dz);
+			if (ok) {
+				auto it = std::find_if(anim.objects.begin(), anim.objects.end(),
+									   [&](const animation_description::object_keys& o) { return o.index == index; });
+				if (it == anim.objects.end()) {
+					anim.objects.push_back({ index, {} });
+					it = anim.objects.end() - 1;
+				}
+				it->keys.push_back({ time, vec3(dx, dy, dz) });
+			}
+		}
+		else if (kind == "turntable") {
+			ok = static_cast<bool>(fields >> anim.turntable_seconds) && anim.turntable_seconds > 0;
+		}
+
+		if (!ok) {
+			std::cerr << "ERROR: " << path << ':' << line_number << ": bad animation line '" << line << "'.\n";
+			return false;
+		}
+	}
+
+	auto by_time = [](const vec3_keyframe& a, const vec3_keyframe& b) { return a.time < b.time; };
+	std::stable_sort(anim.lookfrom_keys.begin(), anim.lookfrom_keys.end(), by_time);
+	std::stable_sort(anim.lookat_keys.begin(), anim.lookat_keys.end(), by_time);
+	for (auto& o : anim.objects)
+		std::stable_sort(o.keys.begin(), o.keys.end(), by_time);
+	return true;
+}
+
+/// <summary>
+/// Puts every animated world object into a keyframed translate instance
+/// </summary>
+/// <returns>false if an object index is not in the world</returns>
+bool apply_object_animation(scene_config& scene, const animation_description& anim) {
+	for (const auto& o : anim.objects) {
+		if (o.index >= scene.world.objects.size()) {
+			std::cerr << "ERROR: Animated object " << o.index << " does not exist, the scene has "
+					  << scene.world.objects.size() << " objects.\n";
+			return false;
+		}
+		auto& object = scene.world.objects[o.index];
+		object = make_scene_object<translate>(object, keyframe_track(o.keys));
+	}
+	return true;
+}
+
+/// <summary>
+/// Camera of the frame whose shutter is open over [time0, time1]. The camera is placed
+/// at its pose at time0.
+/// </summary>
+camera animation_camera(const scene_config& scene, const animation_description& anim,
+						double time0, double time1) {
+	point3 lookfrom = anim.lookfrom_keys.empty() ? scene.lookfrom : keyframe_track(anim.lookfrom_keys).at(time0);
+	point3 lookat = anim.lookat_keys.empty() ? scene.lookat : keyframe_track(anim.lookat_keys).at(time0);
+
+	if (anim.turntable_seconds > 0) {
+		auto angle = 2 * pi * time0 / anim.turntable_seconds;
+		auto offset = lookfrom - lookat;
+		lookfrom = lookat + vec3(cos(angle) * offset.x() + sin(angle) * offset.z(), offset.y(),
+								 -sin(angle) * offset.x() + cos(angle) * offset.z());
+	}
+
+	vec3 vup(0, 1, 0);
+	auto dist_to_focus = 10.0;
+	return camera(lookfrom, lookat, vup, scene.vfov, scene.aspect_ratio,
+				  scene.aperture, dist_to_focus, time0, time1);
+}
+
+struct animation_options {
+	int first_frame = 0;
+	int last_frame = 0;		// inclusive
+	double fps = 24.0;
+	double shutter = 0.5;	// fraction of the frame time the shutter is open
+	std::string output_pattern = "frame_%04d.ppm";	// printf pattern of the frame number
+	double rebuild_threshold = 1.2;	// rebuild when refit grew the node boxes by this factor on average
+};
+
+/// <summary>
+/// File name of a frame, output_pattern with the frame number filled in
+/// </summary>
+inline std::string frame_file_name(const std::string& pattern, int frame) {
+	std::vector<char> name(pattern.size() + 32);
+	snprintf(name.data(), name.size(), pattern.c_str(), frame);
+	return name.data();
+}
+
+/// <summary>
+/// Renders the frames [first_frame, last_frame] of the scene and writes each to its own
+/// file as soon as it is done. The scene, its textures and the bottom-level structures of
+/// its objects are built once. Between frames the top-level structure is refitted to the
+/// new shutter interval, and rebuilt only when its nodes grew by rebuild_threshold on
+/// average since the last build (scene_accel::refit_growth). Every frame uses the same
+/// sampler streams, so noise does not flicker on static parts of the image.
+/// </summary>
+/// <returns>process exit code</returns>
+int run_animation(scene_config& scene, const animation_description& anim, const render_settings& settings,
+				  const sampler& smp, const animation_options& options) {
+	typedef std::chrono::steady_clock clock;
+	auto ms_since = [](clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+	};
+
+	if (!apply_object_animation(scene, anim))
+		return 1;
+
+	shared_ptr<scene_accel> accel;
+	int rebuilds = 0;
+	double update_ms_total = 0.0;
+	double render_ms_total = 0.0;
+	std::vector<color> framebuffer;
+
+	for (int frame = options.first_frame; frame <= options.last_frame; frame++) {
+		const double time0 = frame / options.fps;
+		const double time1 = (frame + options.shutter) / options.fps;
+		camera cam = animation_camera(scene, anim, time0, time1);
+
+		RT_TRACE_SCOPE("frame", "animation");
+		auto update_start = clock::now();
+		const char* update = "refit";
+		double growth = 1.0;
+		if (!accel) {
+			// Static bottom-level structures are converted once and stay resident
+			const int width = accel_width(settings.accel);
+			for (auto& object : scene.world.objects)
+				object = to_bottom_level(object, width, time0, time1);
+			accel = build_scene_accel(scene.world, settings.accel, time0, time1, settings.motion_steps);
+			update = "build";
+		}
+		else {
+			accel->refit(time0, time1);
+			growth = accel->refit_growth();
+			if (growth > options.rebuild_threshold) {
+				accel = build_scene_accel(scene.world, settings.accel, time0, time1, settings.motion_steps);
+				update = "rebuild";
+				rebuilds++;
+			}
+		}
+		const double update_ms = ms_since(update_start);
+
+		auto stats = render(*accel, cam, scene.background, settings, smp, framebuffer);
+
+		const std::string file_name = frame_file_name(options.output_pattern, frame);
+		std::ofstream out(file_name);
+		if (!out) {
+			std::cerr << "ERROR: Could not open '" << file_name << "' for writing.\n";
+			return 1;
+		}
+		write_ppm(out, framebuffer, settings.image_width, settings.image_height, settings.samples_per_pixel);
+
+		update_ms_total += update_ms;
+		render_ms_total += stats.render_seconds * 1000.0;
+		std::cerr << "Frame " << frame << ": " << update << ' ' << update_ms << " ms (node growth "
+				  << growth << "), render " << stats.render_seconds * 1000.0 << " ms -> " << file_name << '\n';
+	}
+
+	std::cerr << "Animation: " << options.last_frame - options.first_frame + 1 << " frames, "
+			  << rebuilds << " rebuilds, structure updates " << update_ms_total << " ms, render "
+			  << render_ms_total << " ms\n";
+	return 0;
+}
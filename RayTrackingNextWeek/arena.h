@@ -0,0 +1,106 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// Bump allocator for the objects of one scene. Objects are placed one after the other
+/// in large blocks, keep their address for the lifetime of the arena and are all
+/// destroyed together (in reverse order of creation) when the arena is destroyed.
+/// </summary>
+class scene_arena {
+public:
+	explicit scene_arena(size_t _block_size = 64 * 1024) : block_size(_block_size) {}
+	~scene_arena() {
+		for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+			it->destroy(it->object);
+	}
+
+	scene_arena(const scene_arena&) = delete;
+	scene_arena& operator=(const scene_arena&) = delete;
+
+	/// <summary>
+	/// Returns size bytes aligned to alignment, from the current block or a new one
+	/// </summary>
+	void* allocate(size_t size, size_t alignment) {
+		if (!blocks.empty()) {
+			auto base = reinterpret_cast<uintptr_t>(blocks.back().data.get());
+			auto aligned = (base + current_used + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+			if (aligned + size <= base + blocks.back().size) {
+				current_used = aligned + size - base;
+				used += size;
+				return reinterpret_cast<void*>(aligned);
+			}
+		}
+
+		// Large objects get a block of their own
+		size_t size_with_padding = size + alignment;
+		size_t new_block = size_with_padding > block_size ? size_with_padding : block_size;
+		blocks.push_back({ std::unique_ptr<char[]>(new char[new_block]), new_block });
+		reserved += new_block;
+		current_used = 0;
+		return allocate(size, alignment);
+	}
+
+	/// <summary>
+	/// Constructs a T in the arena
+	/// </summary>
+	template <class T, class... Args>
+	T* create(Args&&... args) {
+		void* memory = allocate(sizeof(T), alignof(T));
+		T* object = new (memory) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value)
+			destructors.push_back({ object, [](void* o) { static_cast<T*>(o)->~T(); } });
+		object_count++;
+		return object;
+	}
+
+	size_t bytes_used() const { return used; }
+	size_t bytes_reserved() const { return reserved; }
+	size_t objects() const { return object_count; }
+
+private:
+	struct block {
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+	struct destructor {
+		void* object;
+		void (*destroy)(void*);
+	};
+
+	size_t block_size;
+	std::vector<block> blocks;
+	std::vector<destructor> destructors;
+	size_t current_used = 0;	// bytes used in blocks.back()
+	size_t used = 0;
+	size_t reserved = 0;
+	size_t object_count = 0;
+};
+
+/// <summary>
+/// Arena scene objects are created in on this thread, nullptr for the heap.
+/// Set by select_scene while a scene is built.
+/// </summary>
+inline scene_arena*& active_arena() {
+	thread_local scene_arena* current = nullptr;
+	return current;
+}
+
+/// <summary>
+/// make_shared for scene objects. While an arena is active the object is created in it and
+/// the returned shared_ptr is a non-owning handle: it has no control block, copying it costs
+/// no reference counting, and the object lives as long as the arena. Without an active
+/// arena this is plain make_shared.
+/// </summary>
+template <class T, class... Args>
+std::shared_ptr<T> make_scene_object(Args&&... args) {
+	scene_arena* arena = active_arena();
+	if (!arena)
+		return std::make_shared<T>(std::forward<Args>(args)...);
+	return std::shared_ptr<T>(std::shared_ptr<T>(), arena->create<T>(std::forward<Args>(args)...));
+}
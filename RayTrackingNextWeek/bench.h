@@ -0,0 +1,834 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN	// keeps winsock.h out, distributed.h needs winsock2.h
+	#endif
+	#include <windows.h>
+	#include <psapi.h>
+	#pragma comment(lib, "psapi.lib")
+#else
+	#include <sys/resource.h>
+	#include <unistd.h>
+	#include <fstream>
+#endif
+
+#include "rtweekend.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "bvh.h"
+#include "motion_bvh.h"
+#include "bvh_wide.h"
+#include "scene_accel.h"
+
+/// <summary>
+/// Peak resident set size of the process in bytes, 0 if unknown
+/// </summary>
+inline uint64_t peak_rss_bytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return static_cast<uint64_t>(counters.PeakWorkingSetSize);
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return static_cast<uint64_t>(usage.ru_maxrss);	// bytes on macOS
+#else
+	return static_cast<uint64_t>(usage.ru_maxrss) * 1024;	// kilobytes on Linux
+#endif
+#endif
+}
+
+/// <summary>
+/// Current resident set size of the process in bytes, 0 if unknown
+/// </summary>
+inline uint64_t current_rss_bytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return static_cast<uint64_t>(counters.WorkingSetSize);
+	return 0;
+#else
+	std::ifstream statm("/proc/self/statm");
+	uint64_t total_pages = 0, resident_pages = 0;
+	if (!(statm >> total_pages >> resident_pages))
+		return 0;
+	return resident_pages * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+inline double milliseconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct bench_options {
+	int image_width = 200;
+	int samples_per_pixel = 16;
+	int max_depth = 50;
+	int thread_count = 0;
+	uint32_t seed = 0;
+	std::string sampler_name = "random";	// a make_sampler name, checked by the caller
+	std::string accel = "wide";	// top-level structure the renderer builds, see build_scene_accel
+	int motion_steps = 1;		// time segments of "motion-bvh"
+	bool packets = true;		// packet tracing of pinhole camera rays, see render_settings
+	bool use_arena = true;		// build scenes in a scene_arena instead of one heap allocation per object
+	std::string schedule = "steal";	// how render threads share the image, see render_settings
+	int first_scene = 1;
+	int last_scene = builtin_scene_count;
+	size_t primitives = 0;		// size of generated scenes, 0 for default_generated_primitives
+};
+
+struct bench_result {
+	int scene_id = 0;
+	size_t primitives = 0;			// requested size of a generated scene, 0 for the fixed scenes
+	size_t objects = 0;				// top-level objects of the world
+	int image_width = 0;
+	int image_height = 0;
+	double scene_build_ms = 0.0;
+	uint64_t scene_rss_bytes = 0;	// growth of the resident set while building the scene
+	size_t arena_bytes_used = 0;
+	size_t arena_bytes_reserved = 0;
+	size_t arena_objects = 0;
+	double bvh_build_ms = 0.0;
+	std::vector<accel_choice> accel_choices;	// structure picked per object group with accel "auto"
+	double render_ms = 0.0;
+	render_stats stats;
+	uint64_t run_rss_bytes = 0;	// growth of the resident set over scene, structure and render
+};
+
+/// <summary>
+/// Builds and renders one built-in scene with fixed settings and measures every phase.
+/// The scene generator is reseeded so each run builds the same scene as a normal render.
+/// </summary>
+bench_result run_scene_benchmark(int scene_id, const bench_options& options) {
+	bench_result result;
+	result.scene_id = scene_id;
+
+	srand(1);
+	const auto rss_before = current_rss_bytes();
+	auto start = std::chrono::steady_clock::now();
+	scene_config scene = select_scene(scene_id, options.use_arena, options.primitives);
+	result.scene_build_ms = milliseconds_since(start);
+	if (is_generated_scene(scene_id))
+		result.primitives = options.primitives > 0 ? options.primitives : default_generated_primitives;
+	result.objects = scene.world.objects.size();
+	const auto rss_after = current_rss_bytes();
+	result.scene_rss_bytes = rss_after > rss_before ? rss_after - rss_before : 0;
+	if (scene.arena) {
+		result.arena_bytes_used = scene.arena->bytes_used();
+		result.arena_bytes_reserved = scene.arena->bytes_reserved();
+		result.arena_objects = scene.arena->objects();
+	}
+
+	render_settings settings;
+	settings.image_width = options.image_width;
+	settings.image_height = static_cast<int>(options.image_width / scene.aspect_ratio);
+	settings.samples_per_pixel = options.samples_per_pixel;
+	settings.max_depth = options.max_depth;
+	settings.thread_count = options.thread_count;
+	settings.show_progress = false;
+	settings.packets = options.packets;
+	settings.accel = options.accel;
+	settings.motion_steps = options.motion_steps;
+	settings.schedule = options.schedule;
+	result.image_width = settings.image_width;
+	result.image_height = settings.image_height;
+
+	auto smp = make_sampler(options.sampler_name, settings.samples_per_pixel, options.seed);
+
+	camera cam = make_camera(scene);
+	start = std::chrono::steady_clock::now();
+	auto accel = build_scene_accel(scene.world, settings.accel, cam.shutter_open(), cam.shutter_close(),
+								   settings.motion_steps);
+	result.bvh_build_ms = milliseconds_since(start);
+	result.accel_choices = accel->choices;
+
+	std::vector<color> framebuffer;
+	result.stats = render(static_cast<const hittable&>(*accel), cam, scene.background, settings, *smp, framebuffer);
+	result.render_ms = result.stats.render_seconds * 1000.0;
+	const auto rss_end = current_rss_bytes();
+	result.run_rss_bytes = rss_end > rss_before ? rss_end - rss_before : 0;
+
+	return result;
+}
+
+inline double per_second(uint64_t count, double milliseconds) {
+	return milliseconds > 0 ? count / (milliseconds / 1000.0) : 0.0;
+}
+
+/// <summary>
+/// Writes benchmark results as JSON
+/// </summary>
+void write_bench_json(std::ostream& out, const bench_options& options, const std::vector<bench_result>& results) {
+	out << std::fixed << std::setprecision(3);
+	out << "{\n"
+		<< "  \"settings\": {\n"
+		<< "    \"image_width\": " << options.image_width << ",\n"
+		<< "    \"samples_per_pixel\": " << options.samples_per_pixel << ",\n"
+		<< "    \"max_depth\": " << options.max_depth << ",\n"
+		<< "    \"threads\": " << resolve_thread_count(options.thread_count) << ",\n"
+		<< "    \"seed\": " << options.seed << ",\n"
+		<< "    \"sampler\": \"" << options.sampler_name << "\",\n"
+		<< "    \"accel\": \"" << options.accel << "\",\n"
+		<< "    \"motion_steps\": " << options.motion_steps << ",\n"
+		<< "    \"arena\": " << (options.use_arena ? "true" : "false") << ",\n"
+		<< "    \"schedule\": \"" << options.schedule << "\",\n"
+		<< "    \"math\": \"" << (fast_math_enabled() ? "fast" : "exact") << "\"\n"
+		<< "  },\n"
+		<< "  \"peak_rss_bytes\": " << peak_rss_bytes() << ",\n"
+		<< "  \"scenes\": [\n";
+
+	for (size_t k = 0; k < results.size(); k++) {
+		const auto& r = results[k];
+		const auto total_rays = r.stats.primary_rays + r.stats.secondary_rays;
+		out << "    {\n"
+			<< "      \"id\": " << r.scene_id << ",\n"
+			<< "      \"name\": \"" << scene_name(r.scene_id) << "\",\n"
+			<< "      \"primitives\": " << r.primitives << ",\n"
+			<< "      \"objects\": " << r.objects << ",\n"
+			<< "      \"image_width\": " << r.image_width << ",\n"
+			<< "      \"image_height\": " << r.image_height << ",\n"
+			<< "      \"scene_build_ms\": " << r.scene_build_ms << ",\n"
+			<< "      \"scene_rss_bytes\": " << r.scene_rss_bytes << ",\n"
+			<< "      \"arena_bytes_used\": " << r.arena_bytes_used << ",\n"
+			<< "      \"arena_bytes_reserved\": " << r.arena_bytes_reserved << ",\n"
+			<< "      \"arena_objects\": " << r.arena_objects << ",\n"
+			<< "      \"bvh_build_ms\": " << r.bvh_build_ms << ",\n";
+		if (!r.accel_choices.empty()) {
+			out << "      \"accel_choices\": [";
+			for (size_t c = 0; c < r.accel_choices.size(); c++) {
+				const auto& choice = r.accel_choices[c];
+				out << (c ? ", " : "") << "{\"group\": \"" << choice.group << "\", \"objects\": " << choice.objects
+					<< ", \"bvh_ns\": " << choice.bvh_ns << ", \"grid_ns\": " << choice.grid_ns
+					<< ", \"structure\": \"" << (choice.grid ? "grid" : "wide") << "\"}";
+			}
+			out << "],\n";
+		}
+		out
+			<< "      \"render_ms\": " << r.render_ms << ",\n"
+			<< "      \"pilot_ms\": " << r.stats.pilot_seconds * 1000.0 << ",\n"
+			<< "      \"thread_utilization\": "
+			<< mean_utilization(r.stats.threads, r.stats.render_seconds - r.stats.pilot_seconds) << ",\n"
+			<< "      \"samples\": " << r.stats.samples << ",\n"
+			<< "      \"primary_rays\": " << r.stats.primary_rays << ",\n"
+			<< "      \"secondary_rays\": " << r.stats.secondary_rays << ",\n"
+			<< "      \"primary_rays_per_sec\": " << per_second(r.stats.primary_rays, r.render_ms) << ",\n"
+			<< "      \"secondary_rays_per_sec\": " << per_second(r.stats.secondary_rays, r.render_ms) << ",\n"
+			<< "      \"rays_per_sec\": " << per_second(total_rays, r.render_ms) << ",\n"
+			<< "      \"samples_per_sec\": " << per_second(r.stats.samples, r.render_ms) << ",\n"
+			<< "      \"run_rss_bytes\": " << r.run_rss_bytes;
+		if (stats_enabled) {
+			out << ",\n      \"counters\": ";
+			write_trace_counters_json(out, r.stats.counters, "      ");
+		}
+		out << "\n    }" << (k + 1 < results.size() ? "," : "") << "\n";
+	}
+
+	out << "  ]\n}\n";
+}
+
+/// <summary>
+/// Renders every built-in scene in [first_scene, last_scene], prints a summary
+/// to stderr and writes the results as JSON to json_out.
+/// </summary>
+void run_benchmark(const bench_options& options, std::ostream& json_out) {
+	std::vector<bench_result> results;
+
+	std::cerr << std::left << std::setw(20) << "scene"
+		<< std::right << std::setw(12) << "build ms"
+		<< std::setw(12) << "bvh ms"
+		<< std::setw(12) << "render ms"
+		<< std::setw(14) << "Mrays/s"
+		<< std::setw(14) << "Msamples/s" << '\n';
+
+	for (int id = options.first_scene; id <= options.last_scene; id++) {
+		auto r = run_scene_benchmark(id, options);
+		results.push_back(r);
+
+		const auto total_rays = r.stats.primary_rays + r.stats.secondary_rays;
+		std::cerr << std::left << std::setw(20) << scene_name(id) << std::right
+			<< std::fixed << std::setprecision(1)
+			<< std::setw(12) << r.scene_build_ms
+			<< std::setw(12) << r.bvh_build_ms
+			<< std::setw(12) << r.render_ms
+			<< std::setprecision(3)
+			<< std::setw(14) << per_second(total_rays, r.render_ms) / 1e6
+			<< std::setw(14) << per_second(r.stats.samples, r.render_ms) / 1e6 << '\n';
+		for (const auto& choice : r.accel_choices)
+			std::cerr << "    " << choice.group << " (" << choice.objects << " objects): "
+				<< (choice.grid ? "grid" : "wide") << ", " << choice.bvh_ns << " ns/ray wide, "
+				<< choice.grid_ns << " ns/ray grid\n";
+	}
+
+	write_bench_json(json_out, options, results);
+}
+
+/// <summary>
+/// Reads a list of primitive counts "N1,N2,..."; a count may end in k or M (eg. 100k, 10M)
+/// </summary>
+inline bool parse_primitive_counts(const std::string& text, std::vector<size_t>& counts) {
+	std::istringstream in(text);
+	std::string item;
+	while (std::getline(in, item, ',')) {
+		char* end = nullptr;
+		double count = strtod(item.c_str(), &end);
+		if (end == item.c_str())
+			return false;
+		if (*end == 'k' || *end == 'K')
+			count *= 1e3, end++;
+		else if (*end == 'm' || *end == 'M')
+			count *= 1e6, end++;
+		if (*end != '\0' || count < 1)
+			return false;
+		counts.push_back(static_cast<size_t>(count));
+	}
+	return !counts.empty();
+}
+
+/// <summary>
+/// Builds and renders a generated scene at every primitive count, smallest first, and writes
+/// one result per count: the curves of scene and structure build time, memory and ray
+/// throughput against scene size. The memory of a count is what its run added to the
+/// resident set; the peak of the whole process is in the JSON.
+/// </summary>
+void run_scaling_benchmark(const bench_options& options, int scene_id, std::vector<size_t> counts,
+						   std::ostream& json_out) {
+	std::sort(counts.begin(), counts.end());
+	std::vector<bench_result> results;
+
+	std::cerr << "Scaling of " << scene_name(scene_id) << '\n'
+		<< std::right << std::setw(12) << "primitives"
+		<< std::setw(12) << "build ms"
+		<< std::setw(12) << "scene MiB"
+		<< std::setw(12) << "bvh ms"
+		<< std::setw(12) << "render ms"
+		<< std::setw(12) << "Mrays/s"
+		<< std::setw(12) << "run MiB" << '\n';
+
+	for (size_t count : counts) {
+		bench_options run_options = options;
+		run_options.primitives = count;
+		auto r = run_scene_benchmark(scene_id, run_options);
+		results.push_back(r);
+
+		const auto total_rays = r.stats.primary_rays + r.stats.secondary_rays;
+		std::cerr << std::setw(12) << count
+			<< std::fixed << std::setprecision(1)
+			<< std::setw(12) << r.scene_build_ms
+			<< std::setw(12) << r.scene_rss_bytes / (1024.0 * 1024.0)
+			<< std::setw(12) << r.bvh_build_ms
+			<< std::setw(12) << r.render_ms
+			<< std::setprecision(3)
+			<< std::setw(12) << per_second(total_rays, r.render_ms) / 1e6
+			<< std::setprecision(1)
+			<< std::setw(12) << r.run_rss_bytes / (1024.0 * 1024.0) << '\n';
+	}
+
+	write_bench_json(json_out, options, results);
+}
+
+/// <summary>
+/// Shadow ray style queries for one scene: segments from the first hit of
+/// random camera rays to random points inside the scene bounds.
+/// </summary>
+std::vector<ray> make_occlusion_queries(const hittable& world, const camera& cam, int query_count) {
+	std::vector<ray> queries;
+	aabb bounds;
+	if (!world.bounding_box(0, 1, bounds))
+		return queries;
+
+	const int max_attempts = 4 * query_count;
+	for (int attempt = 0; attempt < max_attempts && static_cast<int>(queries.size()) < query_count; attempt++) {
+		ray camera_ray = cam.get_ray(random_double(), random_double());
+		hit_record rec;
+		if (!world.hit(camera_ray, 0.001, infinity, rec))
+			continue;
+
+		point3 target(random_double(bounds.min().x(), bounds.max().x()),
+					  random_double(bounds.min().y(), bounds.max().y()),
+					  random_double(bounds.min().z(), bounds.max().z()));
+		queries.push_back(ray(rec.p, target - rec.p, camera_ray.time()));
+	}
+	return queries;
+}
+
+struct occlusion_result {
+	int scene_id = 0;
+	size_t queries = 0;
+	size_t closest_hit_occluded = 0;
+	size_t any_hit_occluded = 0;
+	double closest_hit_ms = 0.0;
+	double any_hit_ms = 0.0;
+};
+
+/// <summary>
+/// Times the same visibility queries answered by hit() (closest hit) and by occluded() (any hit).
+/// Each variant runs repetitions times and the fastest run is kept. Occlusion counts can differ
+/// slightly in scenes with constant_medium, whose scattering events are sampled.
+/// </summary>
+occlusion_result run_occlusion_scene_benchmark(int scene_id, const bench_options& options,
+											   int query_count, int repetitions) {
+	occlusion_result result;
+	result.scene_id = scene_id;
+
+	srand(1);
+	scene_config scene = select_scene(scene_id, options.use_arena, options.primitives);
+	if (scene.world.objects.empty())
+		return result;
+	auto accel = build_scene_accel(scene.world, options.accel, 0.0, 1.0, options.motion_steps);
+	const hittable& world = *accel;
+
+	camera cam = make_camera(scene);
+	auto queries = make_occlusion_queries(world, cam, query_count);
+	result.queries = queries.size();
+
+	const double t_min = 0.001;
+	const double t_max = 0.999;
+	result.closest_hit_ms = infinity;
+	result.any_hit_ms = infinity;
+
+	for (int rep = 0; rep < repetitions; rep++) {
+		size_t count = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const auto& q : queries) {
+			hit_record rec;
+			if (world.hit(q, t_min, t_max, rec))
+				count++;
+		}
+		result.closest_hit_ms = fmin(result.closest_hit_ms, milliseconds_since(start));
+		result.closest_hit_occluded = count;
+
+		count = 0;
+		start = std::chrono::steady_clock::now();
+		for (const auto& q : queries) {
+			if (world.occluded(q, t_min, t_max))
+				count++;
+		}
+		result.any_hit_ms = fmin(result.any_hit_ms, milliseconds_since(start));
+		result.any_hit_occluded = count;
+	}
+
+	return result;
+}
+
+/// <summary>
+/// Runs the occlusion microbenchmark over the benchmark scenes and writes JSON to json_out
+/// </summary>
+void run_occlusion_benchmark(const bench_options& options, int query_count, std::ostream& json_out) {
+	const int repetitions = 3;
+	std::vector<occlusion_result> results;
+
+	std::cerr << std::left << std::setw(20) << "scene"
+		<< std::right << std::setw(10) << "queries"
+		<< std::setw(14) << "hit() ms"
+		<< std::setw(14) << "occluded() ms"
+		<< std::setw(10) << "speedup"
+		<< std::setw(12) << "occluded %" << '\n';
+
+	for (int id = options.first_scene; id <= options.last_scene; id++) {
+		auto r = run_occlusion_scene_benchmark(id, options, query_count, repetitions);
+		results.push_back(r);
+
+		std::cerr << std::left << std::setw(20) << scene_name(id) << std::right
+			<< std::fixed << std::setprecision(2)
+			<< std::setw(10) << r.queries
+			<< std::setw(14) << r.closest_hit_ms
+			<< std::setw(14) << r.any_hit_ms
+			<< std::setw(10) << (r.any_hit_ms > 0 ? r.closest_hit_ms / r.any_hit_ms : 0.0)
+			<< std::setw(12) << (r.queries ? 100.0 * r.any_hit_occluded / r.queries : 0.0) << '\n';
+	}
+
+	json_out << std::fixed << std::setprecision(3) << "{\n  \"occlusion\": [\n";
+	for (size_t k = 0; k < results.size(); k++) {
+		const auto& r = results[k];
+		json_out << "    { \"id\": " << r.scene_id
+			<< ", \"name\": \"" << scene_name(r.scene_id) << "\""
+			<< ", \"queries\": " << r.queries
+			<< ", \"closest_hit_ms\": " << r.closest_hit_ms
+			<< ", \"any_hit_ms\": " << r.any_hit_ms
+			<< ", \"closest_hit_occluded\": " << r.closest_hit_occluded
+			<< ", \"any_hit_occluded\": " << r.any_hit_occluded
+			<< ", \"closest_hit_queries_per_sec\": " << per_second(r.queries, r.closest_hit_ms)
+			<< ", \"any_hit_queries_per_sec\": " << per_second(r.queries, r.any_hit_ms)
+			<< " }" << (k + 1 < results.size() ? "," : "") << "\n";
+	}
+	json_out << "  ]\n}\n";
+}
+
+struct packet_result {
+	int scene_id = 0;
+	size_t primary_rays = 0;
+	size_t shadow_rays = 0;
+	size_t single_hits = 0;
+	size_t packet_hits_found = 0;
+	size_t single_occluded = 0;
+	size_t packet_occluded = 0;
+	double single_primary_ms = 0.0;
+	double packet_primary_ms = 0.0;
+	double single_shadow_ms = 0.0;
+	double packet_shadow_ms = 0.0;
+};
+
+/// <summary>
+/// Primary ray throughput of single rays against packets for one scene. The scene is
+/// seen through a pinhole camera (aperture 0) at the bench width, one ray per pixel,
+/// and the top level structure is a bvh_wide (options.accel "bvh4" or "bvh8" picks the
+/// width, otherwise the widest supported) built by build_scene_accel. Shadow batches go from the first hits of a
+/// packet to one random point in the scene, like a point light sample.
+/// Each variant runs repetitions times and the fastest run is kept.
+/// </summary>
+packet_result run_packet_scene_benchmark(int scene_id, const bench_options& options, int repetitions) {
+	packet_result result;
+	result.scene_id = scene_id;
+
+	srand(1);
+	scene_config scene = select_scene(scene_id, options.use_arena, options.primitives);
+	if (scene.world.objects.empty())
+		return result;
+	auto world = build_scene_accel(scene.world, options.accel == "bvh4" || options.accel == "bvh8" ? options.accel : "wide",
+								   0.0, 1.0);
+	aabb bounds;
+	world->bounding_box(0, 1, bounds);
+
+	scene.aperture = 0.0;
+	camera cam = make_camera(scene);
+	const int image_width = options.image_width;
+	const int image_height = static_cast<int>(image_width / scene.aspect_ratio);
+
+	// Packets of neighbouring pixels in a row
+	std::vector<ray_packet> packets;
+	for (int j = image_height - 1; j >= 0; j--) {
+		for (int i0 = 0; i0 < image_width; i0 += packet_width) {
+			ray_packet p;
+			p.count = std::min(packet_width, image_width - i0);
+			for (int k = 0; k < p.count; k++)
+				p.rays[k] = cam.get_ray((i0 + k + 0.5) / (image_width - 1), (j + 0.5) / (image_height - 1));
+			p.finalize();
+			packets.push_back(p);
+			result.primary_rays += p.count;
+		}
+	}
+
+	// Shadow batches from the first hits of each packet
+	std::vector<ray_packet> shadow_packets;
+	for (const auto& p : packets) {
+		packet_hits hits;
+		for (int k = 0; k < p.count; k++)
+			hits.t_max[k] = infinity;
+		world->hit_packet(p, p.full_mask(), 0.001, hits);
+		if (!hits.mask)
+			continue;
+
+		point3 light(random_double(bounds.min().x(), bounds.max().x()),
+					 random_double(bounds.min().y(), bounds.max().y()),
+					 random_double(bounds.min().z(), bounds.max().z()));
+		ray_packet s;
+		for (int k = 0; k < p.count; k++) {
+			if (hits.mask & (1 << k))
+				s.rays[s.count++] = ray(hits.rec[k].p, light - hits.rec[k].p, p.rays[k].time());
+		}
+		s.finalize();
+		shadow_packets.push_back(s);
+		result.shadow_rays += s.count;
+	}
+
+	const double t_min = 0.001;
+	double shadow_t_max[packet_width];
+	for (int k = 0; k < packet_width; k++)
+		shadow_t_max[k] = 0.999;
+
+	result.single_primary_ms = result.packet_primary_ms = infinity;
+	result.single_shadow_ms = result.packet_shadow_ms = infinity;
+
+	for (int rep = 0; rep < repetitions; rep++) {
+		size_t count = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const auto& p : packets) {
+			for (int k = 0; k < p.count; k++) {
+				hit_record rec;
+				if (world->hit(p.rays[k], t_min, infinity, rec))
+					count++;
+			}
+		}
+		result.single_primary_ms = fmin(result.single_primary_ms, milliseconds_since(start));
+		result.single_hits = count;
+
+		count = 0;
+		start = std::chrono::steady_clock::now();
+		for (const auto& p : packets) {
+			packet_hits hits;
+			for (int k = 0; k < p.count; k++)
+				hits.t_max[k] = infinity;
+			world->hit_packet(p, p.full_mask(), t_min, hits);
+			count += lane_count(hits.mask);
+		}
+		result.packet_primary_ms = fmin(result.packet_primary_ms, milliseconds_since(start));
+		result.packet_hits_found = count;
+
+		count = 0;
+		start = std::chrono::steady_clock::now();
+		for (const auto& s : shadow_packets) {
+			for (int k = 0; k < s.count; k++) {
+				if (world->occluded(s.rays[k], t_min, shadow_t_max[k]))
+					count++;
+			}
+		}
+		result.single_shadow_ms = fmin(result.single_shadow_ms, milliseconds_since(start));
+		result.single_occluded = count;
+
+		count = 0;
+		start = std::chrono::steady_clock::now();
+		for (const auto& s : shadow_packets)
+			count += lane_count(world->occluded_packet(s, s.full_mask(), t_min, shadow_t_max));
+		result.packet_shadow_ms = fmin(result.packet_shadow_ms, milliseconds_since(start));
+		result.packet_occluded = count;
+	}
+
+	return result;
+}
+
+/// <summary>
+/// Runs the packet benchmark over the benchmark scenes and writes JSON to json_out
+/// </summary>
+void run_packet_benchmark(const bench_options& options, std::ostream& json_out) {
+	const int repetitions = 3;
+	std::vector<packet_result> results;
+
+	std::cerr << std::left << std::setw(20) << "scene"
+		<< std::right << std::setw(12) << "single Mr/s"
+		<< std::setw(12) << "packet Mr/s"
+		<< std::setw(10) << "speedup"
+		<< std::setw(14) << "shadow single"
+		<< std::setw(14) << "shadow packet"
+		<< std::setw(10) << "speedup" << '\n';
+
+	for (int id = options.first_scene; id <= options.last_scene; id++) {
+		auto r = run_packet_scene_benchmark(id, options, repetitions);
+		results.push_back(r);
+
+		std::cerr << std::left << std::setw(20) << scene_name(id) << std::right
+			<< std::fixed << std::setprecision(2)
+			<< std::setw(12) << per_second(r.primary_rays, r.single_primary_ms) / 1e6
+			<< std::setw(12) << per_second(r.primary_rays, r.packet_primary_ms) / 1e6
+			<< std::setw(10) << (r.packet_primary_ms > 0 ? r.single_primary_ms / r.packet_primary_ms : 0.0)
+			<< std::setw(14) << per_second(r.shadow_rays, r.single_shadow_ms) / 1e6
+			<< std::setw(14) << per_second(r.shadow_rays, r.packet_shadow_ms) / 1e6
+			<< std::setw(10) << (r.packet_shadow_ms > 0 ? r.single_shadow_ms / r.packet_shadow_ms : 0.0) << '\n';
+	}
+
+	json_out << std::fixed << std::setprecision(3) << "{\n  \"packet_width\": " << packet_width
+		<< ",\n  \"packets\": [\n";
+	for (size_t k = 0; k < results.size(); k++) {
+		const auto& r = results[k];
+		json_out << "    { \"id\": " << r.scene_id
+			<< ", \"name\": \"" << scene_name(r.scene_id) << "\""
+			<< ", \"primary_rays\": " << r.primary_rays
+			<< ", \"single_primary_ms\": " << r.single_primary_ms
+			<< ", \"packet_primary_ms\": " << r.packet_primary_ms
+			<< ", \"single_hits\": " << r.single_hits
+			<< ", \"packet_hits\": " << r.packet_hits_found
+			<< ", \"shadow_rays\": " << r.shadow_rays
+			<< ", \"single_shadow_ms\": " << r.single_shadow_ms
+			<< ", \"packet_shadow_ms\": " << r.packet_shadow_ms
+			<< ", \"single_occluded\": " << r.single_occluded
+			<< ", \"packet_occluded\": " << r.packet_occluded
+			<< " }" << (k + 1 < results.size() ? "," : "") << "\n";
+	}
+	json_out << "  ]\n}\n";
+}
+
+/// <summary>
+/// Error and cost of one fast_math function against the C library over a domain
+/// </summary>
+struct math_error_row {
+	const char* name;
+	const char* domain;
+	double max_abs_error = 0.0;
+	double max_rel_error = 0.0;
+	double exact_ns = 0.0;
+	double fast_ns = 0.0;
+	double simd_ns = 0.0;	// 0 if there is no SIMD form
+};
+
+/// <summary>
+/// Measures a scalar function pair (and optionally a two-lane SIMD form) over inputs.
+/// The reported time is the fastest of three passes, per call.
+/// </summary>
+template <class Exact, class Fast, class Simd>
+math_error_row measure_math(const char* name, const char* domain, const std::vector<double>& a,
+							const std::vector<double>& b, Exact exact, Fast fast, Simd simd, bool has_simd) {
+	math_error_row row;
+	row.name = name;
+	row.domain = domain;
+	const size_t n = a.size();
+
+	std::vector<double> reference(n), approx(n), simd_out(n);
+	for (size_t k = 0; k < n; k++) {
+		reference[k] = exact(a[k], b[k]);
+		approx[k] = fast(a[k], b[k]);
+		const double err = fabs(approx[k] - reference[k]);
+		row.max_abs_error = fmax(row.max_abs_error, err);
+		if (fabs(reference[k]) > 1e-12)
+			row.max_rel_error = fmax(row.max_rel_error, err / fabs(reference[k]));
+	}
+	if (has_simd) {
+		simd(a.data(), b.data(), simd_out.data(), n);
+		for (size_t k = 0; k < n; k++) {
+			const double err = fabs(simd_out[k] - reference[k]);
+			row.max_abs_error = fmax(row.max_abs_error, err);
+			if (fabs(reference[k]) > 1e-12)
+				row.max_rel_error = fmax(row.max_rel_error, err / fabs(reference[k]));
+		}
+	}
+
+	volatile double sink = 0.0;
+	row.exact_ns = row.fast_ns = row.simd_ns = infinity;
+	for (int pass = 0; pass < 3; pass++) {
+		double sum = 0.0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t k = 0; k < n; k++)
+			sum += exact(a[k], b[k]);
+		row.exact_ns = fmin(row.exact_ns, milliseconds_since(start) * 1e6 / n);
+
+		start = std::chrono::steady_clock::now();
+		for (size_t k = 0; k < n; k++)
+			sum += fast(a[k], b[k]);
+		row.fast_ns = fmin(row.fast_ns, milliseconds_since(start) * 1e6 / n);
+
+		if (has_simd) {
+			start = std::chrono::steady_clock::now();
+			simd(a.data(), b.data(), simd_out.data(), n);
+			row.simd_ns = fmin(row.simd_ns, milliseconds_since(start) * 1e6 / n);
+			sum += simd_out[n / 2];
+		}
+		sink = sink + sum;
+	}
+	if (!has_simd)
+		row.simd_ns = 0.0;
+	return row;
+}
+
+/// <summary>
+/// Prints the error table of the fast_math approximations and their cost per call
+/// against the C library functions
+/// </summary>
+void run_math_error_report(std::ostream& out, size_t samples = 1000000) {
+	std::vector<double> a(samples), b(samples, 0.0);
+	std::vector<math_error_row> rows;
+	const bool has_simd =
+#ifdef RT_FAST_MATH_SSE2
+		true;
+#else
+		false;
+#endif
+
+	auto uniform = [&](std::vector<double>& v, double lo, double hi) {
+		for (size_t k = 0; k < v.size(); k++)
+			v[k] = lo + (hi - lo) * (k + 0.5) / v.size();
+	};
+	auto shuffle_inputs = [&](std::vector<double>& v) {
+		for (size_t k = v.size() - 1; k > 0; k--)
+			std::swap(v[k], v[static_cast<size_t>(random_double() * (k + 1))]);
+	};
+
+	uniform(a, -1.0, 1.0);
+	rows.push_back(measure_math("acos", "[-1, 1]", a, b,
+		[](double x, double) { return acos(x); },
+		[](double x, double) { return fast_acos(x); },
+		[](const double* x, const double*, double* o, size_t n) {
+#ifdef RT_FAST_MATH_SSE2
+			for (size_t k = 0; k + 1 < n; k += 2)
+				_mm_storeu_pd(o + k, fast_acos_pd(_mm_loadu_pd(x + k)));
+#endif
+		}, has_simd));
+
+	for (size_t k = 0; k < samples; k++) {
+		a[k] = random_double(-1, 1);
+		b[k] = random_double(-1, 1);
+	}
+	rows.push_back(measure_math("atan2", "[-1, 1]^2", a, b,
+		[](double y, double x) { return atan2(y, x); },
+		[](double y, double x) { return fast_atan2(y, x); },
+		[](const double* y, const double* x, double* o, size_t n) {
+#ifdef RT_FAST_MATH_SSE2
+			for (size_t k = 0; k + 1 < n; k += 2)
+				_mm_storeu_pd(o + k, fast_atan2_pd(_mm_loadu_pd(y + k), _mm_loadu_pd(x + k)));
+#endif
+		}, has_simd));
+	std::fill(b.begin(), b.end(), 0.0);
+
+	auto sin_simd = [](const double* x, const double*, double* o, size_t n) {
+		fast_sin_array(x, o, static_cast<int>(n));
+	};
+	uniform(a, -100.0, 100.0);
+	shuffle_inputs(a);
+	rows.push_back(measure_math("sin", "[-100, 100]", a, b,
+		[](double x, double) { return sin(x); },
+		[](double x, double) { return fast_sin(x); }, sin_simd, has_simd));
+	uniform(a, -1e4, 1e4);
+	shuffle_inputs(a);
+	rows.push_back(measure_math("sin", "[-1e4, 1e4]", a, b,
+		[](double x, double) { return sin(x); },
+		[](double x, double) { return fast_sin(x); }, sin_simd, has_simd));
+
+	auto log_simd = [](const double* x, const double*, double* o, size_t n) {
+#ifdef RT_FAST_MATH_SSE2
+		for (size_t k = 0; k + 1 < n; k += 2)
+			_mm_storeu_pd(o + k, fast_log_pd(_mm_loadu_pd(x + k)));
+#endif
+	};
+	uniform(a, 1e-9, 1.0);
+	rows.push_back(measure_math("log", "(0, 1]", a, b,
+		[](double x, double) { return log(x); },
+		[](double x, double) { return fast_log(x); }, log_simd, has_simd));
+	for (size_t k = 0; k < samples; k++)
+		a[k] = exp(random_double(-700, 700));
+	rows.push_back(measure_math("log", "[1e-304, 1e304]", a, b,
+		[](double x, double) { return log(x); },
+		[](double x, double) { return fast_log(x); }, log_simd, has_simd));
+
+	uniform(a, 0.0, 1.0);
+	rows.push_back(measure_math("pow5", "[0, 1]", a, b,
+		[](double x, double) { return pow(x, 5); },
+		[](double x, double) { return pow5(x); },
+		[](const double*, const double*, double*, size_t) {}, false));
+
+	out << std::left << std::setw(10) << "function"
+		<< std::setw(18) << "domain"
+		<< std::right << std::setw(14) << "max abs err"
+		<< std::setw(14) << "max rel err"
+		<< std::setw(12) << "libm ns"
+		<< std::setw(12) << "fast ns"
+		<< std::setw(12) << "simd ns" << '\n';
+	for (const auto& r : rows) {
+		out << std::left << std::setw(10) << r.name
+			<< std::setw(18) << r.domain << std::right
+			<< std::scientific << std::setprecision(2)
+			<< std::setw(14) << r.max_abs_error
+			<< std::setw(14) << r.max_rel_error
+			<< std::fixed
+			<< std::setw(12) << r.exact_ns
+			<< std::setw(12) << r.fast_ns;
+		if (r.simd_ns > 0)
+			out << std::setw(12) << r.simd_ns;
+		else
+			out << std::setw(12) << "-";
+		out << '\n';
+	}
+}
@@ -2,6 +2,7 @@
 #include "rtweekend.h"
 #include "aarect.h"
 #include "hittable_list.h"
+#include <utility>
 
 class box : public hittable {
 
@@ -10,6 +11,8 @@ public:
 	box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		output_box = aabb(box_min, box_max);
 		return true;
@@ -25,16 +28,59 @@ box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
 	box_min = p0; 
 	box_max = p1; 
 
-	sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-	sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+	sides.add(make_scene_object<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
+	sides.add(make_scene_object<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
 
-	sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-	sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+	sides.add(make_scene_object<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
+	sides.add(make_scene_object<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
 
-	sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-	sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+	sides.add(make_scene_object<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
+	sides.add(make_scene_object<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
 }
 
 bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_box]++);
 	return sides.hit(r, t_min, t_max, rec); 
-}
\ No newline at end of file
+}
+
+bool box::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_box]++);
+
+	// One slab test instead of six rect tests. The sides are hit where the ray
+	// enters and leaves the box, so the box occludes if either crossing is in range.
+	double t_enter = -infinity;
+	double t_exit = infinity;
+	for (int a = 0; a < 3; a++) {
+		auto invD = 1.0 / r.direction()[a];
+		auto t0 = (box_min[a] - r.origin()[a]) * invD;
+		auto t1 = (box_max[a] - r.origin()[a]) * invD;
+		if (invD < 0.0)
+			std::swap(t0, t1);
+		t_enter = fmax(t_enter, t0);
+		t_exit = fmin(t_exit, t1);
+	}
+
+	if (t_exit < t_enter)
+		return false;
+	return (t_enter >= t_min && t_enter <= t_max) || (t_exit >= t_min && t_exit <= t_max);
+}
+
+/// <summary>
+/// Slab test giving the entry and exit of the box. Divides like the rect tests of the
+/// sides do, so the crossings are the t the sides would report.
+/// </summary>
+bool box::hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const {
+	RT_STAT(primitive_tests[prim_box]++);
+	inside.count = 0;
+	double t_enter = -infinity;
+	double t_exit = infinity;
+	for (int a = 0; a < 3; a++) {
+		auto t0 = (box_min[a] - r.origin()[a]) / r.direction()[a];
+		auto t1 = (box_max[a] - r.origin()[a]) / r.direction()[a];
+		if (t1 < t0)
+			std::swap(t0, t1);
+		t_enter = fmax(t_enter, t0);
+		t_exit = fmin(t_exit, t1);
+	}
+	return t_enter <= t_exit && inside.add(t_enter, t_exit, t_min, t_max);
+}
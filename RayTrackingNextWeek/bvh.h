@@ -2,6 +2,7 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "trace.h"
 #include <algorithm>
 
 class bvh_node : public hittable {
@@ -15,27 +16,45 @@ public:
 	/// <param name="time0"></param>
 	/// <param name="time1"></param>
 	bvh_node(const hittable_list& list, double time0, double time1)
-		: bvh_node(list.objects, 0, list.objects.size(), time0, time1)
+		: bvh_node(std::vector<shared_ptr<hittable>>(list.objects), 0, list.objects.size(), time0, time1)
+	{}
+
+	/// <summary>
+	/// Builds the node over objects[start, end). Reorders that range in place,
+	/// so the object array is shared by the whole build instead of copied per node.
+	/// </summary>
+	bvh_node(std::vector<shared_ptr<hittable>>&& objects, size_t start, size_t end, double time0, double time1)
+		: bvh_node(objects, start, end, time0, time1)
 	{}
 
 	/// <summary>
 	/// 
 	/// </summary>
-	/// <param name="scr_objects"></param>
+	/// <param name="objects"></param>
 	/// <param name="start"></param>
 	/// <param name="end"></param>
 	/// <param name="time0"></param>
 	/// <param name="time1"></param>
-	bvh_node(const std::vector<shared_ptr<hittable>>& scr_objects, 
+	bvh_node(std::vector<shared_ptr<hittable>>& objects,
 			 size_t start, size_t end, double time0, double time1);
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override; 
+	virtual void refit(double time0, double time1) override;
+
+	/// <summary>
+	/// Mean over the nodes of this tree of the ratio of a node's box surface area to its
+	/// area when it was built: 1 after the build, growing as refit stretches the nodes
+	/// of moving objects.
+	/// </summary>
+	double refit_growth() const;
 
 public:
 	shared_ptr<hittable> left; 
 	shared_ptr<hittable> right;
 	aabb box;
+	double built_area = 0.0;	// surface area of box when the node was built
 };
 
 
@@ -65,7 +84,51 @@ bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const{
 	return true;
 }
 
+void bvh_node::refit(double time0, double time1) {
+	left->refit(time0, time1);
+	if (right != left)
+		right->refit(time0, time1);
+
+	aabb box_left, box_right;
+	if (!left->bounding_box(time0, time1, box_left)
+		|| !right->bounding_box(time0, time1, box_right))
+	{
+		std::cerr << "No bounding box in bvh_node refit. \n";
+	}
+	box = surrounding_box(box_left, box_right);
+}
+
+/// <summary>
+/// Surface area of a box, 0 for an empty or inverted one
+/// </summary>
+inline double box_surface_area(const aabb& b) {
+	auto d = b.max() - b.min();
+	if (d.x() < 0 || d.y() < 0 || d.z() < 0)
+		return 0.0;
+	return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+double bvh_node::refit_growth() const {
+	double growth = 0.0;
+	size_t count = 0;
+	std::vector<const bvh_node*> stack{ this };
+	while (!stack.empty()) {
+		auto node = stack.back();
+		stack.pop_back();
+		growth += box_surface_area(node->box) / std::max(node->built_area, 1e-12);
+		count++;
+		if (auto inner = dynamic_cast<const bvh_node*>(node->left.get()))
+			stack.push_back(inner);
+		if (node->right != node->left) {
+			if (auto inner = dynamic_cast<const bvh_node*>(node->right.get()))
+				stack.push_back(inner);
+		}
+	}
+	return growth / count;
+}
+
 bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(bvh_nodes_visited++);
 	if (!box.hit(r, t_min, t_max))
 		return false;
 
@@ -75,10 +138,19 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	return hit_left || hit_right;
 }
 
-bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& scr_objects,
-	size_t start, size_t end, double time0, double time1) {
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(bvh_nodes_visited++);
+	if (!box.hit(r, t_min, t_max))
+		return false;
+
+	return left->occluded(r, t_min, t_max)
+		|| (right != left && right->occluded(r, t_min, t_max));
+}
 
-	auto objects = scr_objects; // Create a modifiable array of the sourc scene objects 
+bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects,
+	size_t start, size_t end, double time0, double time1) {
+	// Only the root of a tree is marked; its children are built inside it
+	RT_TRACE_SCOPE_IF(start == 0 && end == objects.size(), "bvh_node build", "build");
 
 	int axis = random_int(0, 2);
 	auto comparator = (axis == 0) ? box_x_compare
@@ -104,8 +176,8 @@ bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& scr_objects,
 		std::sort(objects.begin() + start, objects.begin() + end, comparator); 
 
 		auto mid = start + object_span / 2; 
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1); 
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+		left = make_scene_object<bvh_node>(objects, start, mid, time0, time1); 
+		right = make_scene_object<bvh_node>(objects, mid, end, time0, time1);
 	}
 
 	aabb box_left, box_right; 
@@ -117,5 +189,5 @@ bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& scr_objects,
 	}
 
 	box = surrounding_box(box_left, box_right);
-
+	built_area = box_surface_area(box);
 }
@@ -0,0 +1,692 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "stats.h"
+#include "packet.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define RT_X86 1
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define RT_TARGET_AVX
+	#else
+		#define RT_TARGET_AVX __attribute__((target("avx")))
+	#endif
+#endif
+
+// CPU feature detection
+// --------------------------
+
+/// <summary>
+/// True if the CPU and the operating system support AVX (256 bit float vectors)
+/// </summary>
+inline bool cpu_supports_avx() {
+#if defined(RT_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx)
+		return false;
+	return (_xgetbv(0) & 6) == 6;	// XMM and YMM state enabled by the OS
+#elif defined(RT_X86)
+	return __builtin_cpu_supports("avx");
+#else
+	return false;
+#endif
+}
+
+/// <summary>
+/// Widest BVH node width the running CPU can test in one go
+/// </summary>
+inline int widest_bvh_width() {
+	return cpu_supports_avx() ? 8 : 4;
+}
+
+// Wide BVH
+// --------------------------
+
+/// <summary>
+/// Ray data prepared once per traversal, see safe_inverse() for axis parallel rays
+/// </summary>
+struct wide_ray {
+	float org[3];
+	float inv_dir[3];
+
+	wide_ray(const ray& r) {
+		for (int a = 0; a < 3; a++) {
+			org[a] = static_cast<float>(r.origin()[a]);
+			inv_dir[a] = safe_inverse(r.direction()[a]);
+		}
+	}
+};
+
+/// <summary>
+/// Node with W children. Child boxes are stored as structure of arrays,
+/// so all of them are tested with one set of vector instructions.
+/// child[k] >= 0 is an inner node index, child[k] < 0 is ~(primitive index).
+/// </summary>
+template <int W>
+struct alignas(32) wide_bvh_node {
+	float min_x[W], min_y[W], min_z[W];
+	float max_x[W], max_y[W], max_z[W];
+	int32_t child[W];
+	int count;
+};
+
+// Float bounds moved at least one ulp outward. Besides covering the rounding of the
+// double box, this keeps a ray that runs exactly along a box face (zero direction
+// component, origin on the face) inside the slab, as aabb::hit does.
+inline float round_down(double v) {
+	auto f = static_cast<float>(v);
+	f = std::nextafter(f, -std::numeric_limits<float>::infinity());
+	return f > v ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+inline float round_up(double v) {
+	auto f = static_cast<float>(v);
+	f = std::nextafter(f, std::numeric_limits<float>::infinity());
+	return f < v ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Cheap upper bound of a hit distance as float, for t >= 0 (used once per node visit)
+inline float round_up_distance(double t) {
+	return static_cast<float>(t) * (1.0f + 2.4e-7f);
+}
+
+/// <summary>
+/// Portable slab test of every child box. Returns a bit mask of the children hit
+/// and their entry distances in dist.
+/// </summary>
+template <int W>
+inline int intersect_children_scalar(const wide_bvh_node<W>& n, const wide_ray& r,
+									 float t_min, float t_max, float* dist) {
+	int mask = 0;
+	for (int k = 0; k < n.count; k++) {
+		const float lo[3] = { n.min_x[k], n.min_y[k], n.min_z[k] };
+		const float hi[3] = { n.max_x[k], n.max_y[k], n.max_z[k] };
+		float t_near = t_min;
+		float t_far = t_max;
+		for (int a = 0; a < 3; a++) {
+			float t0 = (lo[a] - r.org[a]) * r.inv_dir[a];
+			float t1 = (hi[a] - r.org[a]) * r.inv_dir[a];
+			t_near = std::max(t_near, std::min(t0, t1));
+			t_far = std::min(t_far, std::max(t0, t1));
+		}
+		dist[k] = t_near;
+		if (t_near <= t_far * slab_far_scale)
+			mask |= 1 << k;
+	}
+	return mask;
+}
+
+#ifdef RT_X86
+/// <summary>
+/// SSE slab test of four child boxes
+/// </summary>
+inline int intersect_children(const wide_bvh_node<4>& n, const wide_ray& r,
+							  float t_min, float t_max, float* dist) {
+	const __m128 ox = _mm_set1_ps(r.org[0]), oy = _mm_set1_ps(r.org[1]), oz = _mm_set1_ps(r.org[2]);
+	const __m128 ix = _mm_set1_ps(r.inv_dir[0]), iy = _mm_set1_ps(r.inv_dir[1]), iz = _mm_set1_ps(r.inv_dir[2]);
+
+	const __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.min_x), ox), ix);
+	const __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.max_x), ox), ix);
+	const __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.min_y), oy), iy);
+	const __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.max_y), oy), iy);
+	const __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.min_z), oz), iz);
+	const __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.max_z), oz), iz);
+
+	__m128 t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+							   _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(t_min)));
+	__m128 t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+							  _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(t_max)));
+	t_far = _mm_mul_ps(t_far, _mm_set1_ps(slab_far_scale));
+
+	_mm_storeu_ps(dist, t_near);
+	return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & ((1 << n.count) - 1);
+}
+
+/// <summary>
+/// AVX slab test of eight child boxes. Only called when cpu_supports_avx().
+/// </summary>
+RT_TARGET_AVX inline int intersect_children_avx(const wide_bvh_node<8>& n, const wide_ray& r,
+												float t_min, float t_max, float* dist) {
+	const __m256 ox = _mm256_set1_ps(r.org[0]), oy = _mm256_set1_ps(r.org[1]), oz = _mm256_set1_ps(r.org[2]);
+	const __m256 ix = _mm256_set1_ps(r.inv_dir[0]), iy = _mm256_set1_ps(r.inv_dir[1]), iz = _mm256_set1_ps(r.inv_dir[2]);
+
+	const __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.min_x), ox), ix);
+	const __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.max_x), ox), ix);
+	const __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.min_y), oy), iy);
+	const __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.max_y), oy), iy);
+	const __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.min_z), oz), iz);
+	const __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.max_z), oz), iz);
+
+	__m256 t_near = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+								  _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_set1_ps(t_min)));
+	__m256 t_far = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+								 _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(t_max)));
+	t_far = _mm256_mul_ps(t_far, _mm256_set1_ps(slab_far_scale));
+
+	_mm256_storeu_ps(dist, t_near);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ)) & ((1 << n.count) - 1);
+}
+
+inline int intersect_children(const wide_bvh_node<8>& n, const wide_ray& r,
+							  float t_min, float t_max, float* dist) {
+	static const bool use_avx = cpu_supports_avx();
+	if (use_avx)
+		return intersect_children_avx(n, r, t_min, t_max, dist);
+	return intersect_children_scalar(n, r, t_min, t_max, dist);
+}
+#else
+template <int W>
+inline int intersect_children(const wide_bvh_node<W>& n, const wide_ray& r,
+							  float t_min, float t_max, float* dist) {
+	return intersect_children_scalar(n, r, t_min, t_max, dist);
+}
+#endif
+
+/// <summary>
+/// Multi-way BVH. Built by collapsing a binary bvh_node tree: a node keeps opening
+/// its largest inner child until it has W children. Nested bvh_nodes in the list are
+/// collapsed into the same tree. Children are visited nearest first by entry distance.
+/// </summary>
+template <int W>
+class bvh_wide : public hittable {
+public:
+	bvh_wide(const hittable_list& list, double time0, double time1) {
+		if (list.objects.empty())
+			return;
+		build(make_shared<bvh_node>(list, time0, time1), time0, time1);
+	}
+
+	/// <summary>
+	/// Collapses an existing binary tree, eg. a bvh_node built by a scene
+	/// </summary>
+	bvh_wide(const shared_ptr<bvh_node>& root, double time0, double time1) {
+		build(root, time0, time1);
+	}
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual void hit_packet(const ray_packet& p, int active, double t_min, packet_hits& hits) const override;
+	virtual int occluded_packet(const ray_packet& p, int active, double t_min, const double* t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+		output_box = box;
+		return !nodes.empty();
+	}
+
+	size_t node_count() const { return nodes.size(); }
+
+	/// <summary>
+	/// Recomputes the child boxes of every node for [time0, time1], keeping the tree
+	/// </summary>
+	virtual void refit(double time0, double time1) override;
+
+	/// <summary>
+	/// Mean ratio of node surface area now to when the tree was built, see bvh_node::refit_growth
+	/// </summary>
+	double refit_growth() const;
+
+private:
+	struct stack_entry {
+		int32_t child;
+		float dist;
+	};
+	struct packet_entry {
+		int32_t child;
+		int mask;	// lanes that reached this child
+		float dist;	// nearest entry distance among those lanes
+	};
+	// Traversal stacks up to this size live on the call stack, deeper trees get a heap one
+	static const int stack_size = 1024;
+
+	std::vector<wide_bvh_node<W>> nodes;
+	std::vector<const hittable*> primitives;
+	std::vector<shared_ptr<hittable>> owned;	// keeps the leaf objects alive
+	std::vector<double> built_areas;	// surface area of every node when the tree was built
+	aabb box;
+	int depth = 0;				// inner node levels of the tree
+	int stack_needed = 1;		// entries a traversal can have on its stack at once
+
+	double node_area(const wide_bvh_node<W>& n) const;
+
+
+	// Packets whose active lanes drop to this many continue as single rays
+	static const int packet_min_lanes = 2;
+
+	bool hit_from(int32_t start, const ray& r, double t_min, double t_max, hit_record& rec) const;
+	bool occluded_from(int32_t start, const ray& r, double t_min, double t_max) const;
+	void build(const shared_ptr<hittable>& root, double time0, double time1);
+	int32_t build_node(const shared_ptr<hittable>& binary, double time0, double time1, int level = 1);
+
+	/// <summary>
+	/// Stack for one traversal: local when the tree fits in stack_size entries, heap otherwise
+	/// </summary>
+	template <typename T>
+	T* traversal_stack(T* local, std::vector<T>& heap) const {
+		if (stack_needed <= stack_size)
+			return local;
+		heap.resize(stack_needed);
+		return heap.data();
+	}
+};
+
+template <int W>
+void bvh_wide<W>::build(const shared_ptr<hittable>& root, double time0, double time1) {
+	RT_TRACE_SCOPE("bvh_wide collapse", "build");
+	root->bounding_box(time0, time1, box);
+
+	if (dynamic_cast<const bvh_node*>(root.get())) {
+		build_node(root, time0, time1);
+	}
+	else {
+		// A single object: one node with one leaf child
+		nodes.emplace_back();
+		auto& n = nodes.back();
+		n.count = 1;
+		n.min_x[0] = round_down(box.min().x()); n.max_x[0] = round_up(box.max().x());
+		n.min_y[0] = round_down(box.min().y()); n.max_y[0] = round_up(box.max().y());
+		n.min_z[0] = round_down(box.min().z()); n.max_z[0] = round_up(box.max().z());
+		n.child[0] = ~0;
+		primitives.push_back(root.get());
+		owned.push_back(root);
+		depth = 1;
+	}
+
+	// Every inner node popped on the way down leaves at most W - 1 siblings behind
+	stack_needed = depth * (W - 1) + 1;
+
+	for (const auto& n : nodes)
+		built_areas.push_back(node_area(n));
+}
+
+template <int W>
+int32_t bvh_wide<W>::build_node(const shared_ptr<hittable>& binary, double time0, double time1, int level) {
+	depth = std::max(depth, level);
+
+	// Gather up to W children by opening the largest inner binary node first
+	std::vector<shared_ptr<hittable>> children;
+	auto open = [&](const shared_ptr<hittable>& node) {
+		auto bn = static_cast<const bvh_node*>(node.get());
+		children.push_back(bn->left);
+		if (bn->right != bn->left)
+			children.push_back(bn->right);
+	};
+	open(binary);
+
+	while (static_cast<int>(children.size()) < W) {
+		int best = -1;
+		double best_area = -1.0;
+		for (size_t k = 0; k < children.size(); k++) {
+			auto bn = dynamic_cast<const bvh_node*>(children[k].get());
+			if (!bn)
+				continue;
+			int extra = (bn->right != bn->left) ? 1 : 0;
+			if (static_cast<int>(children.size()) + extra > W)
+				continue;
+			auto area = box_surface_area(bn->box);
+			if (area > best_area) {
+				best_area = area;
+				best = static_cast<int>(k);
+			}
+		}
+		if (best < 0)
+			break;
+		auto node = children[best];
+		children.erase(children.begin() + best);
+		open(node);
+	}
+
+	int32_t index = static_cast<int32_t>(nodes.size());
+	nodes.emplace_back();
+	{
+		auto& n = nodes[index];
+		n.count = static_cast<int>(children.size());
+		for (int k = 0; k < W; k++) {
+			aabb b;
+			if (k < n.count && !children[k]->bounding_box(time0, time1, b))
+				std::cerr << "No bounding box in bvh_wide constructor. \n";
+			n.min_x[k] = round_down(b.min().x()); n.max_x[k] = round_up(b.max().x());
+			n.min_y[k] = round_down(b.min().y()); n.max_y[k] = round_up(b.max().y());
+			n.min_z[k] = round_down(b.min().z()); n.max_z[k] = round_up(b.max().z());
+			n.child[k] = 0;
+		}
+	}
+
+	for (int k = 0; k < static_cast<int>(children.size()); k++) {
+		int32_t code;
+		if (dynamic_cast<const bvh_node*>(children[k].get())) {
+			code = build_node(children[k], time0, time1, level + 1);
+		}
+		else {
+			code = ~static_cast<int32_t>(primitives.size());
+			primitives.push_back(children[k].get());
+			owned.push_back(children[k]);
+		}
+		nodes[index].child[k] = code;	// nodes may have been reallocated by the recursion
+	}
+
+	return index;
+}
+
+template <int W>
+void bvh_wide<W>::refit(double time0, double time1) {
+	for (const auto& object : owned)
+		object->refit(time0, time1);
+
+	// Children come after their parent in nodes, so walking backwards visits
+	// every child before the node that holds it
+	std::vector<aabb> node_boxes(nodes.size());
+	for (size_t i = nodes.size(); i-- > 0;) {
+		auto& n = nodes[i];
+		for (int k = 0; k < n.count; k++) {
+			aabb b;
+			if (n.child[k] >= 0)
+				b = node_boxes[n.child[k]];
+			else if (!owned[~n.child[k]]->bounding_box(time0, time1, b))
+				std::cerr << "No bounding box in bvh_wide refit. \n";
+			n.min_x[k] = round_down(b.min().x()); n.max_x[k] = round_up(b.max().x());
+			n.min_y[k] = round_down(b.min().y()); n.max_y[k] = round_up(b.max().y());
+			n.min_z[k] = round_down(b.min().z()); n.max_z[k] = round_up(b.max().z());
+			node_boxes[i] = k == 0 ? b : surrounding_box(node_boxes[i], b);
+		}
+	}
+	if (!nodes.empty())
+		box = node_boxes[0];
+}
+
+template <int W>
+double bvh_wide<W>::node_area(const wide_bvh_node<W>& n) const {
+	point3 lo(n.min_x[0], n.min_y[0], n.min_z[0]);
+	point3 hi(n.max_x[0], n.max_y[0], n.max_z[0]);
+	for (int k = 1; k < n.count; k++) {
+		lo = point3(fmin(lo.x(), n.min_x[k]), fmin(lo.y(), n.min_y[k]), fmin(lo.z(), n.min_z[k]));
+		hi = point3(fmax(hi.x(), n.max_x[k]), fmax(hi.y(), n.max_y[k]), fmax(hi.z(), n.max_z[k]));
+	}
+	return box_surface_area(aabb(lo, hi));
+}
+
+template <int W>
+double bvh_wide<W>::refit_growth() const {
+	if (nodes.empty())
+		return 1.0;
+	double growth = 0.0;
+	for (size_t i = 0; i < nodes.size(); i++)
+		growth += node_area(nodes[i]) / std::max(built_areas[i], 1e-12);
+	return growth / nodes.size();
+}
+
+template <int W>
+bool bvh_wide<W>::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	if (nodes.empty())
+		return false;
+	return hit_from(0, r, t_min, t_max, rec);
+}
+
+template <int W>
+bool bvh_wide<W>::hit_from(int32_t start, const ray& r, double t_min, double t_max, hit_record& rec) const {
+	const wide_ray wr(r);
+	const float t_min_f = static_cast<float>(t_min);
+	double closest = t_max;
+	bool hit_anything = false;
+
+	stack_entry local_stack[stack_size];
+	std::vector<stack_entry> heap_stack;
+	stack_entry* stack = traversal_stack(local_stack, heap_stack);
+	int sp = 0;
+	stack[sp++] = { start, t_min_f };
+
+	while (sp > 0) {
+		const auto entry = stack[--sp];
+		if (entry.dist > closest)
+			continue;
+
+		if (entry.child < 0) {
+			if (primitives[~entry.child]->hit(r, t_min, closest, rec)) {
+				hit_anything = true;
+				closest = rec.t;
+			}
+			continue;
+		}
+
+		const auto& n = nodes[entry.child];
+		RT_STAT(bvh_nodes_visited++);
+		RT_STAT(aabb_tests += n.count);
+
+		alignas(32) float dist[W];
+		int mask = intersect_children(n, wr, t_min_f, round_up_distance(closest), dist);
+
+		// Push hit children far to near, so the nearest is popped first
+		stack_entry hits[W];
+		int hit_count = 0;
+		for (int k = 0; k < n.count; k++) {
+			if (!(mask & (1 << k)))
+				continue;
+			stack_entry e = { n.child[k], dist[k] };
+			int j = hit_count++;
+			while (j > 0 && hits[j - 1].dist < e.dist) {
+				hits[j] = hits[j - 1];
+				j--;
+			}
+			hits[j] = e;
+		}
+		for (int k = 0; k < hit_count; k++)
+			stack[sp++] = hits[k];
+	}
+
+	return hit_anything;
+}
+
+template <int W>
+bool bvh_wide<W>::occluded(const ray& r, double t_min, double t_max) const {
+	if (nodes.empty())
+		return false;
+	return occluded_from(0, r, t_min, t_max);
+}
+
+template <int W>
+bool bvh_wide<W>::occluded_from(int32_t start, const ray& r, double t_min, double t_max) const {
+	const wide_ray wr(r);
+	const float t_min_f = static_cast<float>(t_min);
+	const float t_max_f = round_up_distance(t_max);
+
+	int32_t local_stack[stack_size];
+	std::vector<int32_t> heap_stack;
+	int32_t* stack = traversal_stack(local_stack, heap_stack);
+	int sp = 0;
+	stack[sp++] = start;
+
+	while (sp > 0) {
+		const auto child = stack[--sp];
+		if (child < 0) {
+			if (primitives[~child]->occluded(r, t_min, t_max))
+				return true;
+			continue;
+		}
+
+		const auto& n = nodes[child];
+		RT_STAT(bvh_nodes_visited++);
+		RT_STAT(aabb_tests += n.count);
+
+		alignas(32) float dist[W];
+		int mask = intersect_children(n, wr, t_min_f, t_max_f, dist);
+		for (int k = 0; k < n.count; k++) {
+			if (mask & (1 << k))
+				stack[sp++] = n.child[k];
+		}
+	}
+
+	return false;
+}
+
+/// <summary>
+/// Traces a packet through the tree. Every child box is first tested against the
+/// packet's interval bounds, which rejects the box for all lanes at once; boxes that
+/// pass are tested per lane with SIMD. Lanes that miss drop out of the subtree.
+/// </summary>
+template <int W>
+void bvh_wide<W>::hit_packet(const ray_packet& p, int active, double t_min, packet_hits& hits) const {
+	if (nodes.empty() || !active)
+		return;
+
+	const float t_min_f = static_cast<float>(t_min);
+	alignas(16) float t_max_f[packet_width];
+	for (int k = 0; k < packet_width; k++)
+		t_max_f[k] = k < p.count ? round_up_distance(hits.t_max[k]) : 0.0f;
+
+	packet_entry local_stack[stack_size];
+	std::vector<packet_entry> heap_stack;
+	packet_entry* stack = traversal_stack(local_stack, heap_stack);
+	int sp = 0;
+	stack[sp++] = { 0, active, t_min_f };
+
+	while (sp > 0) {
+		const auto entry = stack[--sp];
+
+		// Lanes whose closest hit is nearer than this subtree are done with it
+		const int mask = lanes_not_beyond(entry.mask, t_max_f, entry.dist);
+		if (!mask)
+			continue;
+
+		if (entry.child < 0) {
+			primitives[~entry.child]->hit_packet(p, mask, t_min, hits);
+			for (int k = 0; k < p.count; k++)
+				t_max_f[k] = round_up_distance(hits.t_max[k]);
+			continue;
+		}
+
+		// The packet has diverged: finish the few lanes left with single rays
+		if (lane_count(mask) <= packet_min_lanes) {
+			for (int k = 0; k < p.count; k++) {
+				if ((mask & (1 << k)) && hit_from(entry.child, p.rays[k], t_min, hits.t_max[k], hits.rec[k])) {
+					hits.t_max[k] = hits.rec[k].t;
+					hits.mask |= 1 << k;
+					t_max_f[k] = round_up_distance(hits.t_max[k]);
+				}
+			}
+			continue;
+		}
+
+		const auto& n = nodes[entry.child];
+		RT_STAT(bvh_nodes_visited++);
+		RT_STAT(aabb_tests += n.count);
+
+		float packet_t_max = 0.0f;
+		for (int k = 0; k < p.count; k++) {
+			if (mask & (1 << k))
+				packet_t_max = std::max(packet_t_max, t_max_f[k]);
+		}
+
+		packet_entry children[W];
+		int child_count = 0;
+		for (int k = 0; k < n.count; k++) {
+			const float lo[3] = { n.min_x[k], n.min_y[k], n.min_z[k] };
+			const float hi[3] = { n.max_x[k], n.max_y[k], n.max_z[k] };
+			if (!packet_may_hit_box(p, lo, hi, t_min_f, packet_t_max))
+				continue;
+
+			float nearest;
+			int child_mask = packet_box_mask(p, mask, lo, hi, t_min_f, t_max_f, nearest);
+			if (!child_mask)
+				continue;
+
+			// Keep far to near order, so the nearest child is popped first
+			packet_entry e = { n.child[k], child_mask, nearest };
+			int j = child_count++;
+			while (j > 0 && children[j - 1].dist < e.dist) {
+				children[j] = children[j - 1];
+				j--;
+			}
+			children[j] = e;
+		}
+		for (int k = 0; k < child_count; k++)
+			stack[sp++] = children[k];
+	}
+}
+
+template <int W>
+int bvh_wide<W>::occluded_packet(const ray_packet& p, int active, double t_min, const double* t_max) const {
+	if (nodes.empty() || !active)
+		return 0;
+
+	const float t_min_f = static_cast<float>(t_min);
+	alignas(16) float t_max_f[packet_width];
+	float packet_t_max = 0.0f;
+	for (int k = 0; k < packet_width; k++) {
+		t_max_f[k] = k < p.count ? round_up_distance(t_max[k]) : 0.0f;
+		if (active & (1 << k))
+			packet_t_max = std::max(packet_t_max, t_max_f[k]);
+	}
+
+	int occluded_mask = 0;
+	packet_entry local_stack[stack_size];
+	std::vector<packet_entry> heap_stack;
+	packet_entry* stack = traversal_stack(local_stack, heap_stack);
+	int sp = 0;
+	stack[sp++] = { 0, active, t_min_f };
+
+	while (sp > 0) {
+		const auto entry = stack[--sp];
+		const int mask = entry.mask & ~occluded_mask;
+		if (!mask)
+			continue;
+
+		if (entry.child < 0) {
+			occluded_mask |= primitives[~entry.child]->occluded_packet(p, mask, t_min, t_max);
+			if ((active & ~occluded_mask) == 0)
+				break;
+			continue;
+		}
+
+		if (lane_count(mask) <= packet_min_lanes) {
+			for (int k = 0; k < p.count; k++) {
+				if ((mask & (1 << k)) && occluded_from(entry.child, p.rays[k], t_min, t_max[k]))
+					occluded_mask |= 1 << k;
+			}
+			if ((active & ~occluded_mask) == 0)
+				break;
+			continue;
+		}
+
+		const auto& n = nodes[entry.child];
+		RT_STAT(bvh_nodes_visited++);
+		RT_STAT(aabb_tests += n.count);
+
+		for (int k = 0; k < n.count; k++) {
+			const float lo[3] = { n.min_x[k], n.min_y[k], n.min_z[k] };
+			const float hi[3] = { n.max_x[k], n.max_y[k], n.max_z[k] };
+			if (!packet_may_hit_box(p, lo, hi, t_min_f, packet_t_max))
+				continue;
+
+			float nearest;
+			int child_mask = packet_box_mask(p, mask, lo, hi, t_min_f, t_max_f, nearest);
+			if (child_mask)
+				stack[sp++] = { n.child[k], child_mask, nearest };
+		}
+	}
+
+	return occluded_mask & active;
+}
+
+using bvh4 = bvh_wide<4>;
+using bvh8 = bvh_wide<8>;
+
+/// <summary>
+/// Builds a wide BVH. width 0 picks the widest width the CPU supports (8 with AVX, otherwise 4).
+/// </summary>
+inline shared_ptr<hittable> make_wide_bvh(const hittable_list& list, double time0, double time1, int width = 0) {
+	if (width == 0)
+		width = widest_bvh_width();
+	if (width == 8)
+		return make_shared<bvh8>(list, time0, time1);
+	return make_shared<bvh4>(list, time0, time1);
+}
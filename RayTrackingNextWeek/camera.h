@@ -1,5 +1,6 @@
 #pragma once
 #include "rtweekend.h"
+#include "sampler.h"
 
 class camera {
 
@@ -54,15 +55,24 @@ public:
 
 	ray get_ray(double s, double t) const {
 		
-		//
-		vec3 rd = lens_radius * random_in_unit_disk();
+		// Lens and shutter samples come from the active sampler stream
+		vec3 rd = lens_radius * sample_in_unit_disk();
 		vec3 offset = u * rd.x() + v * rd.y();
 
 		return ray(origin + offset,
 			lower_left_corner + s * horizontal + t * vertical - origin - offset, 
-			random_double(time0,time1));
+			time0 + (time1 - time0) * sample_1d());
 	}
 
+	/// <summary>
+	/// True for a camera without depth of field. Its primary rays share one origin,
+	/// which makes them coherent enough to be traced as packets.
+	/// </summary>
+	bool is_pinhole() const { return lens_radius == 0; }
+
+	double shutter_open() const { return time0; }
+	double shutter_close() const { return time1; }
+
 private: 
 	point3 origin; 
 	point3 lower_left_corner; 
@@ -2,13 +2,11 @@
 #include <iostream>
 #include "vec3.h"
 
-void write_color(std::ostream& out, color pixel_color, int samples_per_pixel)
+/// <summary>
+/// 8-bit value of each color component of a pixel: the mean of its samples, sqrt gamma corrected
+/// </summary>
+inline void color_to_rgb8(color pixel_color, int samples_per_pixel, unsigned char rgb[3])
 {
-	// Write the translated [0,255] value of each color component. 
-	/*out << static_cast<int>(255.999 * pixel_color.x()) << ' '
-		<< static_cast<int>(255.999 * pixel_color.y()) << ' '
-		<< static_cast<int>(255.999 * pixel_color.z()) << '\n';*/
-
 	auto r = pixel_color.x(); 
 	auto g = pixel_color.y(); 
 	auto b = pixel_color.z(); 
@@ -21,8 +19,22 @@ void write_color(std::ostream& out, color pixel_color, int samples_per_pixel)
 	g = sqrt(scale * g);
 	b = sqrt(scale * b);
 
-	// Write the translated [0,255] value of each color component 
-	out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-		<< static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-		<< static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
-}
\ No newline at end of file
+	// Translated [0,255] value of each color component 
+	rgb[0] = static_cast<unsigned char>(256 * clamp(r, 0.0, 0.999));
+	rgb[1] = static_cast<unsigned char>(256 * clamp(g, 0.0, 0.999));
+	rgb[2] = static_cast<unsigned char>(256 * clamp(b, 0.0, 0.999));
+}
+
+void write_color(std::ostream& out, color pixel_color, int samples_per_pixel)
+{
+	// Write the translated [0,255] value of each color component. 
+	/*out << static_cast<int>(255.999 * pixel_color.x()) << ' '
+		<< static_cast<int>(255.999 * pixel_color.y()) << ' '
+		<< static_cast<int>(255.999 * pixel_color.z()) << '\n';*/
+
+	unsigned char rgb[3];
+	color_to_rgb8(pixel_color, samples_per_pixel, rgb);
+	out << static_cast<int>(rgb[0]) << ' '
+		<< static_cast<int>(rgb[1]) << ' '
+		<< static_cast<int>(rgb[2]) << '\n';
+}
@@ -1,73 +1,130 @@
 #pragma once
+#include <cstdint>
+#include <cstring>
+
 #include "hittable.h"
 #include "material.h"
 #include "texture.h"
+#include "sampler.h"
 
 class constant_medium : public hittable {
 public:
 	constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
-		: boundary(b), neg_inv_density(-1/d), phase_function(make_shared<isotropic>(a)) {}
+		: boundary(b), neg_inv_density(-1/d), phase_function(make_scene_object<isotropic>(a)),
+		  sample_key(make_sample_key()) {}
 
 	constant_medium(shared_ptr<hittable> b, double d, color c)
-		: boundary(b), neg_inv_density(-1 / d), phase_function(make_shared<isotropic>(c)) {}
+		: boundary(b), neg_inv_density(-1 / d), phase_function(make_scene_object<isotropic>(c)),
+		  sample_key(make_sample_key()) {}
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		return boundary->bounding_box(time0, time1, output_box);
 	}
+	virtual bool motion_bounds(double time0, double time1, aabb& box0, aabb& box1) const override {
+		return boundary->motion_bounds(time0, time1, box0, box1);
+	}
+	virtual void refit(double time0, double time1) override { boundary->refit(time0, time1); }
 
 public:
 	shared_ptr<hittable> boundary; 
 	shared_ptr<material> phase_function; 
 	double neg_inv_density;
+
+	// Key of the free-flight samples (sample_keyed_1d). Made from the medium's own density and
+	// bounds, so it is the same in every process and media on one ray draw independent values.
+	uint32_t sample_key;
+
+private:
+	uint32_t make_sample_key() const;
+
+	/// <summary>
+	/// Samples a scattering distance inside the boundary.
+	/// Returns true and the ray parameter t of the scattering event if it lies in [t_min, t_max].
+	/// </summary>
+	bool sample_collision(const ray& r, double t_min, double t_max, double& t) const;
 };
 
-bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+uint32_t constant_medium::make_sample_key() const {
+	aabb box;
+	boundary->bounding_box(0, 1, box);
+	const double values[7] = { neg_inv_density, box.min().x(), box.min().y(), box.min().z(),
+							   box.max().x(), box.max().y(), box.max().z() };
+	uint32_t key = 0x6d656469;
+	for (double value : values) {
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		key = hash_combine(hash_combine(key, static_cast<uint32_t>(bits)), static_cast<uint32_t>(bits >> 32));
+	}
+	return key;
+}
+
+bool constant_medium::sample_collision(const ray& r, double t_min, double t_max, double& t) const {
 
 	// Print occasional samples when debugging. To enable, set enableDebug true.
 	const bool enableDebug = false;
 	const bool debugging = enableDebug && random_double() < 0.00001;
 
-	hit_record rec1, rec2;
-
-	if (!boundary->hit(r, -infinity, infinity, rec1))
-		return false;
-	if (!boundary->hit(r, rec1.t+0.0001, infinity, rec2))
+	// One query for all parts of the ray inside the boundary, which may be several
+	// if the boundary is not convex
+	ray_intervals inside;
+	if (!boundary->hit_interval(r, t_min, t_max, inside))
 		return false;
 
 	if (debugging)
-		std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
-
-	if (rec1.t < t_min) 
-		rec1.t = t_min; 
-	if (rec2.t > t_max)
-		rec2.t = t_max; 
+		std::cerr << "\nt_min=" << inside.enter[0] << ", t_max=" << inside.exit[inside.count - 1] << '\n';
 
-	if (rec1.t >= rec2.t)
+	const auto ray_length = r.direction().length();
+	// Keyed, not the next dimension: whether and when this runs depends on the structure
+	const auto hit_distance = neg_inv_density * rt_log(1.0 - sample_keyed_1d(sample_key));
+
+	// Use up the sampled distance over the inside parts, front to back
+	auto remaining = hit_distance;
+	bool collided = false;
+	for (int k = 0; k < inside.count && !collided; k++) {
+		const auto enter = fmax(inside.enter[k], 0.0);
+		const auto distance_inside_boundary = (inside.exit[k] - enter) * ray_length;
+		if (remaining <= distance_inside_boundary) {
+			t = enter + remaining / ray_length;
+			collided = true;
+		}
+		else if (distance_inside_boundary > 0) {
+			remaining -= distance_inside_boundary;
+		}
+	}
+	if (!collided)
 		return false;
 
-	if (rec1.t < 0)
-		rec1.t = 0;
+	if (debugging) {
+		std::cerr << "hit_distance = " << hit_distance << '\n'
+			<< "rec.t = " << t << '\n'
+			<< "rec.p = " << r.at(t) << '\n';
+	}
 
-	const auto ray_length = r.direction().length();
-	const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length; 
-	const auto hit_distance = neg_inv_density * log(random_double());
+	return true;
+}
 
-	if (hit_distance > distance_inside_boundary)
-		return false; 
+bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_constant_medium]++);
 
-	rec.t = rec1.t + hit_distance / ray_length; 
-	rec.p = r.at(rec.t); 
+	double t;
+	if (!sample_collision(r, t_min, t_max, t))
+		return false;
 
-	if (debugging) {
-		std::cerr << "hit_distance = " << hit_distance << '\n'
-			<< "rec.t = " << rec.t << '\n'
-			<< "rec.p = " << rec.p << '\n';
-	}
+	rec.t = t; 
+	rec.p = r.at(rec.t); 
 
 	rec.normal = vec3(1, 0, 0);	// arbitrary 
 	rec.front_face = true;		// also arbitrary 
-	rec.mat_ptr = phase_function; 
+	rec.mat_ptr = phase_function.get(); 
 
 	return true;
+}
+
+bool constant_medium::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_constant_medium]++);
+
+	double t;
+	return sample_collision(r, t_min, t_max, t);
 }
\ No newline at end of file
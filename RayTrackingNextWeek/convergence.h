@@ -0,0 +1,93 @@
+#pragma once
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "rtweekend.h"
+#include "renderer.h"
+#include "sampler.h"
+
+/// <summary>
+/// Root mean square error between two framebuffers of summed samples.
+/// Pixels are normalized by their sample counts and compared in linear color.
+/// </summary>
+double image_rmse(const std::vector<color>& image, int image_spp,
+				  const std::vector<color>& reference, int reference_spp) {
+	if (image.empty() || image.size() != reference.size())
+		return infinity;
+
+	double sum = 0.0;
+	for (size_t p = 0; p < image.size(); p++) {
+		auto diff = image[p] / image_spp - reference[p] / reference_spp;
+		sum += diff.length_squared() / 3.0;
+	}
+	return sqrt(sum / image.size());
+}
+
+/// <summary>
+/// Measures RMSE against a high sample count reference for every power of two
+/// sample count up to max_spp, for each sampler. Prints a table and the fitted
+/// convergence rate (slope of log RMSE over log spp; -0.5 is plain Monte Carlo).
+/// </summary>
+void run_convergence_benchmark(const hittable& world, const camera& cam, const color& background,
+							   render_settings settings, int max_spp, int reference_spp,
+							   uint32_t seed, std::ostream& out) {
+	settings.show_progress = false;
+
+	// The reference uses an unrelated scramble so it is not correlated with the measured images.
+	std::cerr << "Rendering reference at " << reference_spp << " spp\n";
+	std::vector<color> reference;
+	settings.samples_per_pixel = reference_spp;
+	sobol_sampler reference_sampler(reference_spp, hash_u32(seed ^ 0x5bd1e995U));
+	render(world, cam, background, settings, reference_sampler, reference);
+
+	const char* names[] = { "random", "stratified", "sobol" };
+	const int sampler_count = 3;
+
+	std::vector<int> spp_steps;
+	for (int spp = 1; spp <= max_spp; spp *= 2)
+		spp_steps.push_back(spp);
+
+	std::vector<std::vector<double>> errors(sampler_count);
+	for (int k = 0; k < sampler_count; k++) {
+		for (int spp : spp_steps) {
+			std::cerr << "\r" << names[k] << " " << spp << " spp     " << std::flush;
+			settings.samples_per_pixel = spp;
+			auto smp = make_sampler(names[k], spp, seed);
+			std::vector<color> image;
+			render(world, cam, background, settings, *smp, image);
+			errors[k].push_back(image_rmse(image, spp, reference, reference_spp));
+		}
+	}
+	std::cerr << "\n";
+
+	out << "RMSE vs spp (" << settings.image_width << "x" << settings.image_height
+		<< ", reference " << reference_spp << " spp)\n";
+	out << std::setw(8) << "spp";
+	for (int k = 0; k < sampler_count; k++)
+		out << std::setw(14) << names[k];
+	out << '\n';
+
+	for (size_t s = 0; s < spp_steps.size(); s++) {
+		out << std::setw(8) << spp_steps[s];
+		for (int k = 0; k < sampler_count; k++)
+			out << std::setw(14) << std::setprecision(6) << errors[k][s];
+		out << '\n';
+	}
+
+	// Least squares fit of log2(rmse) = a + slope * log2(spp)
+	out << std::setw(8) << "slope";
+	for (int k = 0; k < sampler_count; k++) {
+		double sx = 0, sy = 0, sxx = 0, sxy = 0;
+		const double n = static_cast<double>(spp_steps.size());
+		for (size_t s = 0; s < spp_steps.size(); s++) {
+			auto x = log2(static_cast<double>(spp_steps[s]));
+			auto y = log2(errors[k][s]);
+			sx += x; sy += y; sxx += x * x; sxy += x * y;
+		}
+		auto denom = n * sxx - sx * sx;
+		auto slope = denom != 0 ? (n * sxy - sx * sy) / denom : 0.0;
+		out << std::setw(14) << std::setprecision(3) << slope;
+	}
+	out << '\n';
+}
@@ -0,0 +1,194 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+#include "color.h"
+#include "camera.h"
+#include "sampler.h"
+#include "renderer.h"
+
+// Crop windows
+// --------------------------
+// A crop is a rectangle of pixels of the full-resolution image, rendered with the camera
+// of the full image and the sampler streams of its pixels, so its pixels are exactly those
+// of a full render. Crop images are PPM files that name their place in the full image in a
+// "# crop X0 Y0 FULL_WIDTH FULL_HEIGHT" comment, which merging uses to paste them back.
+
+/// <summary>
+/// Reads a crop window "X0,Y0,X1,Y1": pixels [X0, X1) x [Y0, Y1), rows counted from the top
+/// </summary>
+inline bool parse_crop(const std::string& text, image_region& region) {
+	int x0, y0, x1, y1;
+	if (sscanf(text.c_str(), "%d,%d,%d,%d", &x0, &y0, &x1, &y1) != 4)
+		return false;
+	region.x0 = x0;
+	region.y0 = y0;
+	region.x1 = x1;
+	region.y1 = y1;
+	return x0 >= 0 && y0 >= 0 && x1 > x0 && y1 > y0;
+}
+
+/// <summary>
+/// Renders the crop window of the image described by settings into tile (sums of all
+/// samples, row by row from the top of the window)
+/// </summary>
+render_stats render_crop(const hittable& world, const camera& cam, const color& background,
+						 const render_settings& settings, const sampler& smp, const image_region& crop,
+						 std::vector<color>& tile) {
+	image_region window = crop;
+	window.sample_begin = 0;
+	window.sample_end = settings.samples_per_pixel;
+	return render_region(world, cam, background, settings, smp, window, tile);
+}
+
+/// <summary>
+/// Builds the top-level structure over the world list, then renders the crop window
+/// </summary>
+render_stats render_crop(const hittable_list& world, const camera& cam, const color& background,
+						 const render_settings& settings, const sampler& smp, const image_region& crop,
+						 std::vector<color>& tile) {
+	auto start = std::chrono::steady_clock::now();
+	auto accel = build_scene_accel(world, settings.accel, cam.shutter_open(), cam.shutter_close(),
+								   settings.motion_steps);
+	double build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	auto stats = render_crop(static_cast<const hittable&>(*accel), cam, background, settings, smp, crop, tile);
+	stats.accel_build_seconds = build_seconds;
+	return stats;
+}
+
+/// <summary>
+/// Writes a rendered crop as plain PPM with its place in the full image
+/// </summary>
+void write_crop_ppm(std::ostream& out, const std::vector<color>& tile, const image_region& crop,
+					const render_settings& settings) {
+	out << "P3\n# crop " << crop.x0 << ' ' << crop.y0 << ' ' << settings.image_width << ' ' << settings.image_height
+		<< '\n' << crop.width() << ' ' << crop.height() << "\n255\n";
+	for (const auto& pixel_color : tile)
+		write_color(out, pixel_color, settings.samples_per_pixel);
+}
+
+/// <summary>
+/// 8-bit RGB image as read from a PPM file. A crop image also knows where it belongs.
+/// </summary>
+struct ppm_image {
+	int width = 0;
+	int height = 0;
+	std::vector<unsigned char> rgb;
+	bool is_crop = false;
+	int crop_x = 0, crop_y = 0;
+	int full_width = 0, full_height = 0;
+};
+
+/// <summary>
+/// Reads a plain (P3) or binary (P6) PPM file with a maximum value of 255
+/// </summary>
+bool read_ppm(const std::string& path, ppm_image& image) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		std::cerr << "ERROR: Could not open image '" << path << "'.\n";
+		return false;
+	}
+
+	// Header fields, skipping comments; a crop comment is remembered
+	auto next_field = [&](std::string& field) {
+		field.clear();
+		int c;
+		while ((c = in.get()) != EOF) {
+			if (c == '#') {
+				std::string comment;
+				std::getline(in, comment);
+				std::istringstream crop(comment);
+				std::string word;
+				if (crop >> word && word == "crop"
+					&& crop >> image.crop_x >> image.crop_y >> image.full_width >> image.full_height)
+					image.is_crop = true;
+			}
+			else if (!isspace(c)) {
+				field += static_cast<char>(c);
+				break;
+			}
+		}
+		while ((c = in.peek()) != EOF && !isspace(c) && c != '#')
+			field += static_cast<char>(in.get());
+		return !field.empty();
+	};
+
+	std::string magic, width, height, max_value;
+	if (!next_field(magic) || (magic != "P3" && magic != "P6") || !next_field(width) || !next_field(height)
+		|| !next_field(max_value) || max_value != "255") {
+		std::cerr << "ERROR: '" << path << "' is not an 8-bit PPM image.\n";
+		return false;
+	}
+	image.width = atoi(width.c_str());
+	image.height = atoi(height.c_str());
+	image.rgb.resize(static_cast<size_t>(image.width) * image.height * 3);
+
+	if (magic == "P6") {
+		in.get();	// the single whitespace after the header
+		in.read(reinterpret_cast<char*>(image.rgb.data()), image.rgb.size());
+	}
+	else {
+		for (auto& value : image.rgb) {
+			int v;
+			if (!(in >> v))
+				break;
+			value = static_cast<unsigned char>(v);
+		}
+	}
+	if (!in) {
+		std::cerr << "ERROR: '" << path << "' ends before its last pixel.\n";
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Writes an 8-bit image as plain PPM
+/// </summary>
+void write_ppm(std::ostream& out, const ppm_image& image) {
+	out << "P3\n" << image.width << ' ' << image.height << "\n255\n";
+	for (size_t k = 0; k < image.rgb.size(); k += 3)
+		out << static_cast<int>(image.rgb[k]) << ' ' << static_cast<int>(image.rgb[k + 1]) << ' '
+			<< static_cast<int>(image.rgb[k + 2]) << '\n';
+}
+
+/// <summary>
+/// Pastes crop images into a full frame. Without a base image the frame is black and
+/// takes its size from the crops. Later crops overwrite earlier ones where they overlap.
+/// </summary>
+/// <returns>false if a crop does not belong to a frame of that size</returns>
+bool merge_crops(const ppm_image* base, const std::vector<ppm_image>& crops, ppm_image& frame) {
+	if (base) {
+		frame = *base;
+	}
+	else if (!crops.empty()) {
+		frame = ppm_image();
+		frame.width = crops.front().full_width;
+		frame.height = crops.front().full_height;
+		frame.rgb.assign(static_cast<size_t>(frame.width) * frame.height * 3, 0);
+	}
+	frame.is_crop = false;
+
+	for (const auto& crop : crops) {
+		if (!crop.is_crop || crop.full_width != frame.width || crop.full_height != frame.height
+			|| crop.crop_x + crop.width > frame.width || crop.crop_y + crop.height > frame.height) {
+			std::cerr << "ERROR: A " << crop.width << 'x' << crop.height << " crop does not belong to a "
+					  << frame.width << 'x' << frame.height << " image.\n";
+			return false;
+		}
+		for (int y = 0; y < crop.height; y++) {
+			const auto first = crop.rgb.begin() + static_cast<size_t>(y) * crop.width * 3;
+			std::copy(first, first + crop.width * 3,
+					  frame.rgb.begin() + (static_cast<size_t>(crop.crop_y + y) * frame.width + crop.crop_x) * 3);
+		}
+	}
+	return true;
+}
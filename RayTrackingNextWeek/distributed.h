@@ -0,0 +1,879 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+	#include <windows.h>
+	#pragma comment(lib, "Ws2_32.lib")
+#else
+	#include <csignal>
+	#include <netdb.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <sys/select.h>
+	#include <sys/socket.h>
+	#include <sys/types.h>
+	#include <sys/un.h>
+	#include <sys/wait.h>
+	#include <unistd.h>
+#endif
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "sampler.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "scene_accel.h"
+
+// Distributed rendering
+// --------------------------
+// A coordinator process listens on a TCP or Unix socket and hands out work units (a tile
+// of the image and a range of its samples) to worker processes. Every worker builds the
+// scene itself from the job description it gets when it connects, renders the units it
+// is sent and returns each as a float tile, which the coordinator adds into the
+// framebuffer. Units that are not returned in time are given to another worker.
+// Messages are a header (type, payload size) and the payload in native byte order, so
+// coordinator and workers must run on machines of the same architecture.
+
+// Sockets
+// --------------------------
+
+#ifdef _WIN32
+typedef SOCKET socket_handle;
+const socket_handle no_socket = INVALID_SOCKET;
+inline void close_socket(socket_handle s) { closesocket(s); }
+#else
+typedef int socket_handle;
+const socket_handle no_socket = -1;
+inline void close_socket(socket_handle s) { close(s); }
+#endif
+
+/// <summary>
+/// Starts the socket library once per process. A worker that goes away must not kill
+/// the coordinator with SIGPIPE, so that signal is ignored.
+/// </summary>
+inline bool init_sockets() {
+#ifdef _WIN32
+	static const bool ok = [] {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}();
+#else
+	static const bool ok = [] {
+		signal(SIGPIPE, SIG_IGN);
+		return true;
+	}();
+#endif
+	return ok;
+}
+
+/// <summary>
+/// Address of the coordinator: "unix:PATH" or "[tcp:]HOST:PORT". An empty host listens on
+/// every interface and connects to the local machine.
+/// </summary>
+struct socket_address {
+	bool is_unix = false;
+	std::string host;	// host name, or the path of a Unix socket
+	std::string port;
+
+	bool parse(const std::string& text) {
+		if (text.compare(0, 5, "unix:") == 0) {
+			is_unix = true;
+			host = text.substr(5);
+			return !host.empty();
+		}
+		std::string rest = text.compare(0, 4, "tcp:") == 0 ? text.substr(4) : text;
+		auto colon = rest.rfind(':');
+		if (colon == std::string::npos)
+			return false;
+		is_unix = false;
+		host = rest.substr(0, colon);
+		port = rest.substr(colon + 1);
+		return !port.empty();
+	}
+};
+
+inline void set_no_delay(socket_handle s) {
+	int one = 1;
+	// Fails for Unix sockets, which have no Nagle delay anyway
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+}
+
+/// <summary>
+/// Opens a listening socket on address, or connects to it
+/// </summary>
+/// <returns>the socket, or no_socket on failure</returns>
+inline socket_handle open_socket(const socket_address& address, bool listening) {
+	if (!init_sockets())
+		return no_socket;
+
+	if (address.is_unix) {
+#ifdef _WIN32
+		return no_socket;
+#else
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (address.host.size() >= sizeof(addr.sun_path))
+			return no_socket;
+		memcpy(addr.sun_path, address.host.c_str(), address.host.size());
+
+		socket_handle s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s == no_socket)
+			return no_socket;
+		int result;
+		if (listening) {
+			unlink(address.host.c_str());
+			result = bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+			if (result == 0)
+				result = listen(s, 64);
+		}
+		else {
+			result = connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+		}
+		if (result != 0) {
+			close_socket(s);
+			return no_socket;
+		}
+		return s;
+#endif
+	}
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (listening)
+		hints.ai_flags = AI_PASSIVE;
+	const char* host = !address.host.empty() ? address.host.c_str() : listening ? nullptr : "127.0.0.1";
+
+	addrinfo* list = nullptr;
+	if (getaddrinfo(host, address.port.c_str(), &hints, &list) != 0)
+		return no_socket;
+
+	socket_handle s = no_socket;
+	for (addrinfo* a = list; a; a = a->ai_next) {
+		s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (s == no_socket)
+			continue;
+		if (listening) {
+			int one = 1;
+			setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+			if (bind(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0 && listen(s, 64) == 0)
+				break;
+		}
+		else if (connect(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0) {
+			set_no_delay(s);
+			break;
+		}
+		close_socket(s);
+		s = no_socket;
+	}
+	freeaddrinfo(list);
+	return s;
+}
+
+inline bool send_all(socket_handle s, const char* data, size_t size) {
+	while (size > 0) {
+		int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+		int sent = static_cast<int>(send(s, data, chunk, 0));
+		if (sent <= 0)
+			return false;
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+inline bool receive_all(socket_handle s, char* data, size_t size) {
+	while (size > 0) {
+		int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+		int received = static_cast<int>(recv(s, data, chunk, 0));
+		if (received <= 0)
+			return false;
+		data += received;
+		size -= received;
+	}
+	return true;
+}
+
+// Messages
+// --------------------------
+
+enum message_type : uint32_t {
+	msg_job = 1,	// coordinator -> worker: render_job as text
+	msg_ready,		// worker -> coordinator: scene is built, send work
+	msg_unit,		// coordinator -> worker: unit id and its image_region
+	msg_result,		// worker -> coordinator: unit id and the float RGB sums of its pixels
+	msg_done,		// coordinator -> worker: image finished, exit
+
+	// Render server (server.h)
+	msg_request,	// client -> server: render_request as text
+	msg_reply,		// server -> client: outcome and timings of a request, or the server status, as text
+	msg_image,		// server -> client: the finished image as PPM
+	msg_status,		// client -> server: ask for the server status
+	msg_shutdown	// client -> server: finish the running jobs and exit
+};
+
+struct message_header {
+	uint32_t type;
+	uint32_t size;	// payload bytes following the header
+};
+
+inline bool send_message(socket_handle s, uint32_t type, const void* payload, size_t size) {
+	message_header header = { type, static_cast<uint32_t>(size) };
+	std::vector<char> buffer(reinterpret_cast<const char*>(&header), reinterpret_cast<const char*>(&header + 1));
+	if (size > 0)
+		buffer.insert(buffer.end(), static_cast<const char*>(payload), static_cast<const char*>(payload) + size);
+	return send_all(s, buffer.data(), buffer.size());
+}
+
+/// <summary>
+/// Blocks until a whole message arrived. Returns false if the connection closed.
+/// </summary>
+inline bool receive_message(socket_handle s, uint32_t& type, std::vector<char>& payload) {
+	message_header header;
+	if (!receive_all(s, reinterpret_cast<char*>(&header), sizeof(header)))
+		return false;
+	type = header.type;
+	payload.resize(header.size);
+	return header.size == 0 || receive_all(s, payload.data(), header.size);
+}
+
+/// <summary>
+/// Work unit as sent to a worker
+/// </summary>
+struct unit_message {
+	int32_t id;
+	int32_t x0, y0, x1, y1;
+	int32_t sample_begin, sample_end;
+};
+
+/// <summary>
+/// Everything a worker needs to build the scene and render units of it exactly like a
+/// local render would. Sent as "key=value" lines.
+/// </summary>
+struct render_job {
+	int scene_id = 8;
+	size_t primitives = 0;		// size of a generated scene, 0 for the default
+	render_settings settings;	// thread_count and show_progress are the worker's own
+	std::string sampler_name = "random";
+	uint32_t seed = 0;
+	bool use_arena = true;
+	bool fast_math = false;
+	bool has_lookfrom = false;
+	bool has_lookat = false;
+	point3 lookfrom;
+	point3 lookat;
+	double vfov = 0.0;			// 0 keeps the scene's field of view
+	double aperture = -1.0;		// < 0 keeps the scene's aperture
+
+	std::string to_text() const {
+		std::ostringstream out;
+		out.precision(17);
+		out << "scene=" << scene_id << '\n'
+			<< "primitives=" << primitives << '\n'
+			<< "width=" << settings.image_width << '\n'
+			<< "height=" << settings.image_height << '\n'
+			<< "spp=" << settings.samples_per_pixel << '\n'
+			<< "depth=" << settings.max_depth << '\n'
+			<< "packets=" << (settings.packets ? 1 : 0) << '\n'
+			<< "accel=" << settings.accel << '\n'
+			<< "motion_steps=" << settings.motion_steps << '\n'
+			<< "sampler=" << sampler_name << '\n'
+			<< "seed=" << seed << '\n'
+			<< "arena=" << (use_arena ? 1 : 0) << '\n'
+			<< "math=" << (fast_math ? "fast" : "exact") << '\n';
+		if (has_lookfrom)
+			out << "lookfrom=" << lookfrom.x() << ',' << lookfrom.y() << ',' << lookfrom.z() << '\n';
+		if (has_lookat)
+			out << "lookat=" << lookat.x() << ',' << lookat.y() << ',' << lookat.z() << '\n';
+		if (vfov > 0)
+			out << "vfov=" << vfov << '\n';
+		if (aperture >= 0)
+			out << "aperture=" << aperture << '\n';
+		return out.str();
+	}
+
+	bool from_text(const std::string& text) {
+		std::istringstream in(text);
+		std::string line;
+		while (std::getline(in, line)) {
+			auto equals = line.find('=');
+			if (equals == std::string::npos)
+				return false;
+			std::string key = line.substr(0, equals);
+			std::string value = line.substr(equals + 1);
+			if (key == "scene")
+				scene_id = atoi(value.c_str());
+			else if (key == "primitives")
+				primitives = static_cast<size_t>(strtoull(value.c_str(), nullptr, 10));
+			else if (key == "width")
+				settings.image_width = atoi(value.c_str());
+			else if (key == "height")
+				settings.image_height = atoi(value.c_str());
+			else if (key == "spp")
+				settings.samples_per_pixel = atoi(value.c_str());
+			else if (key == "depth")
+				settings.max_depth = atoi(value.c_str());
+			else if (key == "packets")
+				settings.packets = value == "1";
+			else if (key == "accel")
+				settings.accel = value;
+			else if (key == "motion_steps")
+				settings.motion_steps = atoi(value.c_str());
+			else if (key == "sampler")
+				sampler_name = value;
+			else if (key == "seed")
+				seed = static_cast<uint32_t>(strtoul(value.c_str(), nullptr, 10));
+			else if (key == "arena")
+				use_arena = value == "1";
+			else if (key == "math")
+				fast_math = value == "fast";
+			else if (key == "lookfrom")
+				has_lookfrom = parse_point(value, lookfrom);
+			else if (key == "lookat")
+				has_lookat = parse_point(value, lookat);
+			else if (key == "vfov")
+				vfov = atof(value.c_str());
+			else if (key == "aperture")
+				aperture = atof(value.c_str());
+		}
+		return settings.image_width > 0 && settings.image_height > 0 && settings.samples_per_pixel > 0;
+	}
+
+	/// <summary>
+	/// Puts the camera values of the job into the scene
+	/// </summary>
+	void apply_camera(scene_config& scene) const {
+		if (has_lookfrom)
+			scene.lookfrom = lookfrom;
+		if (has_lookat)
+			scene.lookat = lookat;
+		if (vfov > 0)
+			scene.vfov = vfov;
+		if (aperture >= 0)
+			scene.aperture = aperture;
+	}
+
+	/// <summary>
+	/// Reads a point given as "X,Y,Z"
+	/// </summary>
+	static bool parse_point(const std::string& text, point3& p) {
+		double x, y, z;
+		if (sscanf(text.c_str(), "%lf,%lf,%lf", &x, &y, &z) != 3)
+			return false;
+		p = point3(x, y, z);
+		return true;
+	}
+};
+
+// Worker
+// --------------------------
+
+/// <summary>
+/// Connects to the coordinator at address (retrying for connect_seconds, so workers may be
+/// started before it), builds the scene of the job it is sent and renders work units until
+/// the coordinator is done.
+/// </summary>
+/// <param name="address_text"></param>
+/// <param name="thread_count">render threads of this worker, 0 for every hardware thread</param>
+/// <param name="connect_seconds"></param>
+/// <returns>process exit code</returns>
+int run_worker(const std::string& address_text, int thread_count, double connect_seconds = 10.0) {
+	socket_address address;
+	if (!address.parse(address_text)) {
+		std::cerr << "ERROR: Bad worker address '" << address_text << "'.\n";
+		return 1;
+	}
+
+	socket_handle s = no_socket;
+	auto start = std::chrono::steady_clock::now();
+	while ((s = open_socket(address, false)) == no_socket) {
+		if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > connect_seconds) {
+			std::cerr << "ERROR: Could not connect to coordinator at '" << address_text << "'.\n";
+			return 1;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	uint32_t type;
+	std::vector<char> payload;
+	render_job job;
+	if (!receive_message(s, type, payload) || type != msg_job
+		|| !job.from_text(std::string(payload.begin(), payload.end()))) {
+		std::cerr << "ERROR: Worker did not get a valid job.\n";
+		close_socket(s);
+		return 1;
+	}
+
+	// Scenes draw their random layout from rand(); start from the same state as a fresh
+	// local render, so every process builds the same scene
+	srand(1);
+	fast_math_enabled() = job.fast_math;
+	scene_config scene = select_scene(job.scene_id, job.use_arena, job.primitives);
+	job.apply_camera(scene);
+	camera cam = make_camera(scene);
+	render_settings settings = job.settings;
+	settings.thread_count = thread_count;
+	settings.show_progress = false;
+	auto accel = build_scene_accel(scene.world, settings.accel, cam.shutter_open(), cam.shutter_close(),
+								   settings.motion_steps);
+	auto smp = make_sampler(job.sampler_name, settings.samples_per_pixel, job.seed);
+	if (!smp) {
+		std::cerr << "ERROR: Unknown sampler '" << job.sampler_name << "'.\n";
+		close_socket(s);
+		return 1;
+	}
+
+	if (!send_message(s, msg_ready, nullptr, 0)) {
+		close_socket(s);
+		return 1;
+	}
+
+	std::vector<color> tile;
+	std::vector<char> result;
+	while (receive_message(s, type, payload)) {
+		if (type == msg_done)
+			break;
+		if (type != msg_unit || payload.size() != sizeof(unit_message))
+			continue;
+
+		unit_message unit;
+		memcpy(&unit, payload.data(), sizeof(unit));
+		image_region region;
+		region.x0 = unit.x0;
+		region.y0 = unit.y0;
+		region.x1 = unit.x1;
+		region.y1 = unit.y1;
+		region.sample_begin = unit.sample_begin;
+		region.sample_end = unit.sample_end;
+		render_region(*accel, cam, scene.background, settings, *smp, region, tile);
+
+		result.resize(sizeof(int32_t) + tile.size() * 3 * sizeof(float));
+		memcpy(result.data(), &unit.id, sizeof(int32_t));
+		float* rgb = reinterpret_cast<float*>(result.data() + sizeof(int32_t));
+		for (size_t k = 0; k < tile.size(); k++) {
+			rgb[3 * k + 0] = static_cast<float>(tile[k].x());
+			rgb[3 * k + 1] = static_cast<float>(tile[k].y());
+			rgb[3 * k + 2] = static_cast<float>(tile[k].z());
+		}
+		if (!send_message(s, msg_result, result.data(), result.size()))
+			break;
+	}
+
+	close_socket(s);
+	return 0;
+}
+
+// Local worker processes
+// --------------------------
+
+#ifdef _WIN32
+typedef HANDLE process_handle;
+#else
+typedef pid_t process_handle;
+#endif
+
+/// <summary>
+/// Starts this executable as a worker process connecting to address
+/// </summary>
+inline bool spawn_worker_process(const std::string& program, const std::string& address, int threads,
+								 process_handle& process) {
+	const std::string thread_text = std::to_string(threads);
+#ifdef _WIN32
+	char path[MAX_PATH];
+	if (GetModuleFileNameA(nullptr, path, MAX_PATH) == 0)
+		return false;
+	std::string command = std::string("\"") + path + "\" --worker " + address + " --threads " + thread_text;
+	STARTUPINFOA startup;
+	PROCESS_INFORMATION info;
+	memset(&startup, 0, sizeof(startup));
+	startup.cb = sizeof(startup);
+	if (!CreateProcessA(nullptr, &command[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &info))
+		return false;
+	CloseHandle(info.hThread);
+	process = info.hProcess;
+	return true;
+#else
+	pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		execl("/proc/self/exe", program.c_str(), "--worker", address.c_str(), "--threads", thread_text.c_str(),
+			  static_cast<char*>(nullptr));
+		execlp(program.c_str(), program.c_str(), "--worker", address.c_str(), "--threads", thread_text.c_str(),
+			   static_cast<char*>(nullptr));
+		_exit(127);
+	}
+	process = pid;
+	return true;
+#endif
+}
+
+/// <summary>
+/// True once the process exited; the process is reaped then
+/// </summary>
+inline bool process_exited(process_handle process) {
+#ifdef _WIN32
+	return WaitForSingleObject(process, 0) == WAIT_OBJECT_0;
+#else
+	return waitpid(process, nullptr, WNOHANG) == process;
+#endif
+}
+
+/// <summary>
+/// Waits up to grace_seconds for the processes to exit, then kills the rest
+/// (eg. workers that hang)
+/// </summary>
+inline void reap_worker_processes(std::vector<process_handle>& processes, double grace_seconds) {
+	auto start = std::chrono::steady_clock::now();
+	while (!processes.empty()) {
+		processes.erase(std::remove_if(processes.begin(), processes.end(), [](process_handle p) {
+			if (!process_exited(p))
+				return false;
+#ifdef _WIN32
+			CloseHandle(p);
+#endif
+			return true;
+		}), processes.end());
+		if (processes.empty())
+			break;
+		if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > grace_seconds) {
+			for (auto p : processes) {
+#ifdef _WIN32
+				TerminateProcess(p, 1);
+				WaitForSingleObject(p, INFINITE);
+				CloseHandle(p);
+#else
+				kill(p, SIGKILL);
+				waitpid(p, nullptr, 0);
+#endif
+			}
+			processes.clear();
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+// Coordinator
+// --------------------------
+
+struct distributed_options {
+	std::string address;
+	std::string program;			// this executable, for spawning local workers
+	int spawn_workers = 0;			// local worker processes started by the coordinator
+	int worker_threads = 0;			// render threads of each spawned worker, 0 divides the hardware threads
+	int tile_size = 32;				// a multiple of packet_width keeps the packets of a local render
+	int pass_samples = 0;			// samples per unit, 0 for all samples of the pixel in one unit
+	double unit_timeout = 60.0;		// seconds before a unit is given to another worker
+	int units_in_flight = 2;		// units sent ahead to each worker to hide the round trip
+};
+
+struct distributed_stats {
+	int workers = 0;		// workers that built the scene and asked for work
+	int units = 0;
+	int reassigned = 0;		// units given to another worker after a timeout or a lost connection
+	double seconds = 0.0;	// from listening to the last result
+	std::vector<int> units_per_worker;
+};
+
+/// <summary>
+/// Splits the image into work units: tiles of tile_size pixels, and the samples of every
+/// tile into passes of pass_samples. Units are ordered pass by pass.
+/// </summary>
+std::vector<image_region> make_work_units(const render_settings& settings, int tile_size, int pass_samples) {
+	std::vector<image_region> units;
+	const int spp = settings.samples_per_pixel;
+	if (tile_size <= 0)
+		tile_size = std::max(settings.image_width, settings.image_height);
+	if (pass_samples <= 0 || pass_samples > spp)
+		pass_samples = spp;
+
+	for (int s0 = 0; s0 < spp; s0 += pass_samples) {
+		for (int y0 = 0; y0 < settings.image_height; y0 += tile_size) {
+			for (int x0 = 0; x0 < settings.image_width; x0 += tile_size) {
+				image_region region;
+				region.x0 = x0;
+				region.y0 = y0;
+				region.x1 = std::min(x0 + tile_size, settings.image_width);
+				region.y1 = std::min(y0 + tile_size, settings.image_height);
+				region.sample_begin = s0;
+				region.sample_end = std::min(s0 + pass_samples, spp);
+				units.push_back(region);
+			}
+		}
+	}
+	return units;
+}
+
+/// <summary>
+/// Renders job by handing out work units to the workers that connect to options.address
+/// and sums the returned tiles into framebuffer (same layout as render()).
+/// </summary>
+/// <returns>false if no image could be made (socket error, every local worker died)</returns>
+bool run_coordinator(const render_job& job, const distributed_options& options,
+					 std::vector<color>& framebuffer, distributed_stats& stats) {
+	typedef std::chrono::steady_clock clock;
+
+	socket_address address;
+	if (!address.parse(options.address)) {
+		std::cerr << "ERROR: Bad coordinator address '" << options.address << "'.\n";
+		return false;
+	}
+	socket_handle listener = open_socket(address, true);
+	if (listener == no_socket) {
+		std::cerr << "ERROR: Could not listen on '" << options.address << "'.\n";
+		return false;
+	}
+
+	const auto start = clock::now();
+	const render_settings& settings = job.settings;
+	const std::string job_text = job.to_text();
+
+	std::vector<process_handle> children;
+	if (options.spawn_workers > 0) {
+		int threads = options.worker_threads;
+		if (threads <= 0)
+			threads = std::max(1, resolve_thread_count(0) / options.spawn_workers);
+		for (int w = 0; w < options.spawn_workers; w++) {
+			process_handle process;
+			if (spawn_worker_process(options.program, options.address, threads, process))
+				children.push_back(process);
+			else
+				std::cerr << "WARNING: Could not start local worker " << w << ".\n";
+		}
+	}
+	else {
+		std::cerr << "Waiting for workers on " << options.address << '\n';
+	}
+
+	struct unit_state {
+		int owner = -1;	// link the unit was sent to, -1 while pending
+		bool done = false;
+		clock::time_point sent;
+	};
+	struct worker_link {
+		socket_handle s = no_socket;
+		std::vector<char> inbox;
+		bool ready = false;
+		bool stalled = false;	// missed a deadline, gets no new units until it answers again
+		int in_flight = 0;
+		int units_done = 0;
+	};
+
+	const auto units = make_work_units(settings, options.tile_size, options.pass_samples);
+	std::vector<unit_state> state(units.size());
+	std::deque<int> pending;
+	for (int u = 0; u < static_cast<int>(units.size()); u++)
+		pending.push_back(u);
+	std::vector<worker_link> links;
+	size_t done_count = 0;
+	bool failed = false;
+
+	framebuffer.assign(static_cast<size_t>(settings.image_width) * settings.image_height, color(0, 0, 0));
+	stats = distributed_stats();
+	stats.units = static_cast<int>(units.size());
+
+	auto requeue = [&](int u) {
+		links[state[u].owner].in_flight--;
+		state[u].owner = -1;
+		pending.push_front(u);
+		stats.reassigned++;
+	};
+	auto drop_link = [&](int l) {
+		close_socket(links[l].s);
+		links[l].s = no_socket;
+		for (int u = 0; u < static_cast<int>(units.size()); u++) {
+			if (state[u].owner == l && !state[u].done)
+				requeue(u);
+		}
+	};
+	auto merge_result = [&](int l, const std::vector<char>& payload) {
+		int32_t id;
+		if (payload.size() < sizeof(id))
+			return;
+		memcpy(&id, payload.data(), sizeof(id));
+		if (id < 0 || id >= static_cast<int>(units.size()))
+			return;
+		const image_region& region = units[id];
+		if (payload.size() != sizeof(id) + region.pixel_count() * 3 * sizeof(float))
+			return;
+
+		links[l].stalled = false;
+		if (state[id].owner == l) {
+			links[l].in_flight--;
+			state[id].owner = -1;
+		}
+		// A unit that timed out may come back twice; the first result counts
+		if (state[id].done)
+			return;
+		state[id].done = true;
+		done_count++;
+		links[l].units_done++;
+
+		const float* rgb = reinterpret_cast<const float*>(payload.data() + sizeof(id));
+		for (int y = region.y0; y < region.y1; y++) {
+			for (int x = region.x0; x < region.x1; x++, rgb += 3)
+				framebuffer[static_cast<size_t>(y) * settings.image_width + x] += color(rgb[0], rgb[1], rgb[2]);
+		}
+		if (settings.show_progress)
+			std::cerr << "\rUnitsRemaining: " << units.size() - done_count << ' ' << std::flush;
+	};
+
+	std::vector<char> buffer(64 * 1024);
+	while (done_count < units.size()) {
+		const auto now = clock::now();
+
+		// Units not returned in time go back to the front of the queue
+		for (int u = 0; u < static_cast<int>(units.size()); u++) {
+			if (state[u].owner >= 0 && !state[u].done
+				&& std::chrono::duration<double>(now - state[u].sent).count() > options.unit_timeout) {
+				std::cerr << "\nWARNING: Worker " << state[u].owner << " timed out on unit " << u << ", reassigning.\n";
+				links[state[u].owner].stalled = true;
+				requeue(u);
+			}
+		}
+
+		// Keep every responsive worker busy
+		for (int l = 0; l < static_cast<int>(links.size()); l++) {
+			worker_link& link = links[l];
+			while (link.s != no_socket && link.ready && !link.stalled
+				   && link.in_flight < options.units_in_flight && !pending.empty()) {
+				int u = pending.front();
+				pending.pop_front();
+				if (state[u].done)
+					continue;
+				const image_region& region = units[u];
+				unit_message message = { u, region.x0, region.y0, region.x1, region.y1,
+										 region.sample_begin, region.sample_end };
+				state[u].owner = l;
+				state[u].sent = now;
+				link.in_flight++;
+				if (!send_message(link.s, msg_unit, &message, sizeof(message)))
+					drop_link(l);
+			}
+		}
+
+		// Without connections and with every local worker gone nobody can finish the image
+		bool any_link = std::any_of(links.begin(), links.end(), [](const worker_link& l) { return l.s != no_socket; });
+		if (!any_link && options.spawn_workers > 0
+			&& std::all_of(children.begin(), children.end(), [](process_handle p) { return process_exited(p); })) {
+			std::cerr << "\nERROR: Every local worker exited before the image was done.\n";
+			failed = true;
+			break;
+		}
+
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(listener, &readable);
+		int max_fd = 0;
+#ifndef _WIN32
+		max_fd = listener;
+#endif
+		for (const auto& link : links) {
+			if (link.s == no_socket)
+				continue;
+			FD_SET(link.s, &readable);
+#ifndef _WIN32
+			max_fd = std::max(max_fd, link.s);
+#endif
+		}
+		timeval wait_time = { 0, 100000 };
+		if (select(max_fd + 1, &readable, nullptr, nullptr, &wait_time) <= 0)
+			continue;
+
+		if (FD_ISSET(listener, &readable)) {
+			socket_handle s = accept(listener, nullptr, nullptr);
+			if (s != no_socket) {
+				set_no_delay(s);
+				if (send_message(s, msg_job, job_text.data(), job_text.size())) {
+					worker_link link;
+					link.s = s;
+					links.push_back(link);
+				}
+				else {
+					close_socket(s);
+				}
+			}
+		}
+
+		for (int l = 0; l < static_cast<int>(links.size()); l++) {
+			if (links[l].s == no_socket || !FD_ISSET(links[l].s, &readable))
+				continue;
+			int received = static_cast<int>(recv(links[l].s, buffer.data(), static_cast<int>(buffer.size()), 0));
+			if (received <= 0) {
+				drop_link(l);
+				continue;
+			}
+
+			std::vector<char>& inbox = links[l].inbox;
+			inbox.insert(inbox.end(), buffer.begin(), buffer.begin() + received);
+			size_t offset = 0;
+			message_header header;
+			while (inbox.size() - offset >= sizeof(header)) {
+				memcpy(&header, inbox.data() + offset, sizeof(header));
+				if (inbox.size() - offset - sizeof(header) < header.size)
+					break;
+				const char* payload = inbox.data() + offset + sizeof(header);
+				if (header.type == msg_ready) {
+					links[l].ready = true;
+					stats.workers++;
+				}
+				else if (header.type == msg_result) {
+					merge_result(l, std::vector<char>(payload, payload + header.size));
+				}
+				offset += sizeof(header) + header.size;
+			}
+			inbox.erase(inbox.begin(), inbox.begin() + offset);
+		}
+	}
+	stats.seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+	for (auto& link : links) {
+		stats.units_per_worker.push_back(link.units_done);
+		if (link.s == no_socket)
+			continue;
+		send_message(link.s, msg_done, nullptr, 0);
+		close_socket(link.s);
+	}
+	close_socket(listener);
+#ifndef _WIN32
+	if (address.is_unix)
+		unlink(address.host.c_str());
+#endif
+	reap_worker_processes(children, 2.0);
+
+	if (settings.show_progress && !failed)
+		std::cerr << "\nDone.\n";
+	return !failed;
+}
+
+/// <summary>
+/// One line summary of a distributed render
+/// </summary>
+void print_distributed_stats(std::ostream& out, const distributed_stats& stats) {
+	out << "Distributed: " << stats.workers << " workers, " << stats.units << " units ("
+		<< stats.reassigned << " reassigned), " << stats.seconds << " s, units per worker:";
+	for (int n : stats.units_per_worker)
+		out << ' ' << n;
+	out << '\n';
+}
@@ -0,0 +1,290 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#include <emmintrin.h>
+	#define RT_FAST_MATH_SSE2 1
+#endif
+
+// Fast approximations of the transcendental functions used while shading.
+// Every function has a scalar form and, on x86, an SSE2 form working on two doubles.
+// Error bounds (measured with --math-errors over the domain given):
+//   fast_acos   [-1, 1]          abs error < 1e-7 rad
+//   fast_atan2  any (y, x)       abs error < 1.2e-5 rad
+//   fast_sin    |x| < 1e8        abs error < 1e-9
+//   fast_log    (0, inf)         abs error < 1e-9, rel error < 3e-9
+//   pow5        exact up to rounding
+
+const double fast_math_pi = 3.1415926535897932385;
+
+// Exact or fast mode
+// --------------------------
+
+/// <summary>
+/// Selects the fast approximations for the rt_* functions below. Set once before
+/// rendering; every render thread reads it.
+/// </summary>
+inline bool& fast_math_enabled() {
+	static bool enabled = false;
+	return enabled;
+}
+
+// Scalar forms
+// --------------------------
+
+/// <summary>
+/// acos, Abramowitz and Stegun 4.4.46: sqrt(1 - x) times a degree 7 polynomial on [0, 1]
+/// </summary>
+inline double fast_acos(double x) {
+	const double a = fabs(x);
+	double p = -0.0012624911;
+	p = p * a + 0.0066700901;
+	p = p * a - 0.0170881256;
+	p = p * a + 0.0308918810;
+	p = p * a - 0.0501743046;
+	p = p * a + 0.0889789874;
+	p = p * a - 0.2145988016;
+	p = p * a + 1.5707963050;
+	const double r = sqrt(fmax(0.0, 1.0 - a)) * p;
+	return x < 0 ? fast_math_pi - r : r;
+}
+
+/// <summary>
+/// atan on [0, 1], Hastings' degree 9 odd polynomial
+/// </summary>
+inline double fast_atan_unit(double z) {
+	const double z2 = z * z;
+	double p = 0.0208351;
+	p = p * z2 - 0.0851330;
+	p = p * z2 + 0.1801410;
+	p = p * z2 - 0.3302995;
+	p = p * z2 + 0.9998660;
+	return p * z;
+}
+
+/// <summary>
+/// atan2 reduced to fast_atan_unit of min(|x|,|y|) / max(|x|,|y|) and the quadrant
+/// </summary>
+inline double fast_atan2(double y, double x) {
+	const double ax = fabs(x), ay = fabs(y);
+	const double big = fmax(ax, ay);
+	if (big == 0.0)
+		return atan2(y, x);	// keeps the signed zero results
+
+	double r = fast_atan_unit(fmin(ax, ay) / big);
+	if (ay > ax)
+		r = 0.5 * fast_math_pi - r;
+	if (x < 0)
+		r = fast_math_pi - r;
+	return y < 0 ? -r : r;
+}
+
+/// <summary>
+/// sin on [-pi/2, pi/2], Taylor polynomial up to x^13
+/// </summary>
+inline double fast_sin_reduced(double x) {
+	const double x2 = x * x;
+	double p = 1.0 / 6227020800.0;
+	p = p * x2 - 1.0 / 39916800.0;
+	p = p * x2 + 1.0 / 362880.0;
+	p = p * x2 - 1.0 / 5040.0;
+	p = p * x2 + 1.0 / 120.0;
+	p = p * x2 - 1.0 / 6.0;
+	p = p * x2 + 1.0;
+	return p * x;
+}
+
+/// <summary>
+/// sin with the argument reduced to [-pi, pi] and folded to [-pi/2, pi/2].
+/// Arguments beyond 1e8 lose too much in the reduction and use std::sin.
+/// </summary>
+inline double fast_sin(double x) {
+	if (!(fabs(x) < 1e8))
+		return sin(x);
+	x -= 2.0 * fast_math_pi * std::nearbyint(x * (0.5 / fast_math_pi));
+	if (x > 0.5 * fast_math_pi)
+		x = fast_math_pi - x;
+	else if (x < -0.5 * fast_math_pi)
+		x = -fast_math_pi - x;
+	return fast_sin_reduced(x);
+}
+
+/// <summary>
+/// log of m in [sqrt(1/2), sqrt(2)): 2 atanh(t) with t = (m - 1) / (m + 1), |t| < 0.172
+/// </summary>
+inline double fast_log_reduced(double m) {
+	const double t = (m - 1.0) / (m + 1.0);
+	const double t2 = t * t;
+	double p = 1.0 / 9.0;
+	p = p * t2 + 1.0 / 7.0;
+	p = p * t2 + 1.0 / 5.0;
+	p = p * t2 + 1.0 / 3.0;
+	p = p * t2 + 1.0;
+	return 2.0 * t * p;
+}
+
+/// <summary>
+/// log, splitting x into mantissa and exponent from its bits.
+/// Zero, negative, subnormal, infinite and NaN arguments use std::log.
+/// </summary>
+inline double fast_log(double x) {
+	uint64_t bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+	const int biased_exponent = static_cast<int>(bits >> 52);	// includes the sign bit
+	if (biased_exponent <= 0 || biased_exponent >= 0x7ff)
+		return log(x);
+
+	bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;	// mantissa in [1, 2)
+	double m;
+	std::memcpy(&m, &bits, sizeof(m));
+	double e = biased_exponent - 1023;
+	if (m > 1.4142135623730951) {
+		m *= 0.5;
+		e += 1.0;
+	}
+	return e * 0.69314718055994531 + fast_log_reduced(m);
+}
+
+/// <summary>
+/// x^5 with three multiplications
+/// </summary>
+inline double pow5(double x) {
+	const double x2 = x * x;
+	return x2 * x2 * x;
+}
+
+// SIMD forms, two doubles per call
+// --------------------------
+
+#ifdef RT_FAST_MATH_SSE2
+inline __m128d select_pd(__m128d mask, __m128d a, __m128d b) {
+	return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+inline __m128d abs_pd(__m128d x) {
+	return _mm_andnot_pd(_mm_set1_pd(-0.0), x);
+}
+
+inline __m128d fast_acos_pd(__m128d x) {
+	const __m128d a = abs_pd(x);
+	__m128d p = _mm_set1_pd(-0.0012624911);
+	p = _mm_add_pd(_mm_mul_pd(p, a), _mm_set1_pd(0.0066700901));
+	p = _mm_add_pd(_mm_mul_pd(p, a), _mm_set1_pd(-0.0170881256));
+	p = _mm_add_pd(_mm_mul_pd(p, a), _mm_set1_pd(0.0308918810));
+	p = _mm_add_pd(_mm_mul_pd(p, a), _mm_set1_pd(-0.0501743046));
+	p = _mm_add_pd(_mm_mul_pd(p, a), _mm_set1_pd(0.0889789874));
+	p = _mm_add_pd(_mm_mul_pd(p, a), _mm_set1_pd(-0.2145988016));
+	p = _mm_add_pd(_mm_mul_pd(p, a), _mm_set1_pd(1.5707963050));
+	const __m128d r = _mm_mul_pd(_mm_sqrt_pd(_mm_max_pd(_mm_setzero_pd(), _mm_sub_pd(_mm_set1_pd(1.0), a))), p);
+	return select_pd(_mm_cmplt_pd(x, _mm_setzero_pd()), _mm_sub_pd(_mm_set1_pd(fast_math_pi), r), r);
+}
+
+/// <summary>
+/// SSE2 atan2. Lanes with x = y = 0 return 0.
+/// </summary>
+inline __m128d fast_atan2_pd(__m128d y, __m128d x) {
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d ax = abs_pd(x), ay = abs_pd(y);
+	const __m128d big = _mm_max_pd(ax, ay);
+	const __m128d small = _mm_min_pd(ax, ay);
+	const __m128d big_zero = _mm_cmpeq_pd(big, zero);
+	const __m128d z = _mm_div_pd(small, select_pd(big_zero, _mm_set1_pd(1.0), big));
+
+	const __m128d z2 = _mm_mul_pd(z, z);
+	__m128d r = _mm_set1_pd(0.0208351);
+	r = _mm_add_pd(_mm_mul_pd(r, z2), _mm_set1_pd(-0.0851330));
+	r = _mm_add_pd(_mm_mul_pd(r, z2), _mm_set1_pd(0.1801410));
+	r = _mm_add_pd(_mm_mul_pd(r, z2), _mm_set1_pd(-0.3302995));
+	r = _mm_add_pd(_mm_mul_pd(r, z2), _mm_set1_pd(0.9998660));
+	r = _mm_mul_pd(r, z);
+
+	r = select_pd(_mm_cmpgt_pd(ay, ax), _mm_sub_pd(_mm_set1_pd(0.5 * fast_math_pi), r), r);
+	r = select_pd(_mm_cmplt_pd(x, zero), _mm_sub_pd(_mm_set1_pd(fast_math_pi), r), r);
+	r = select_pd(_mm_cmplt_pd(y, zero), _mm_sub_pd(zero, r), r);
+	return _mm_andnot_pd(big_zero, r);
+}
+
+/// <summary>
+/// SSE2 sin, for |x| < 1e8 (see fast_sin)
+/// </summary>
+inline __m128d fast_sin_pd(__m128d x) {
+	const __m128d half_pi = _mm_set1_pd(0.5 * fast_math_pi);
+	const __m128d pi_v = _mm_set1_pd(fast_math_pi);
+
+	// k = round(x / 2pi); |x| < 1e8 keeps k inside int32
+	const __m128d k = _mm_cvtepi32_pd(_mm_cvtpd_epi32(_mm_mul_pd(x, _mm_set1_pd(0.5 / fast_math_pi))));
+	x = _mm_sub_pd(x, _mm_mul_pd(k, _mm_set1_pd(2.0 * fast_math_pi)));
+	x = select_pd(_mm_cmpgt_pd(x, half_pi), _mm_sub_pd(pi_v, x), x);
+	x = select_pd(_mm_cmplt_pd(x, _mm_sub_pd(_mm_setzero_pd(), half_pi)), _mm_sub_pd(_mm_sub_pd(_mm_setzero_pd(), pi_v), x), x);
+
+	const __m128d x2 = _mm_mul_pd(x, x);
+	__m128d p = _mm_set1_pd(1.0 / 6227020800.0);
+	p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 39916800.0));
+	p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 362880.0));
+	p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 5040.0));
+	p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 120.0));
+	p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 6.0));
+	p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0));
+	return _mm_mul_pd(p, x);
+}
+
+/// <summary>
+/// SSE2 log for normal positive doubles (see fast_log)
+/// </summary>
+inline __m128d fast_log_pd(__m128d x) {
+	const __m128i bits = _mm_castpd_si128(x);
+
+	// Exponent as double: put the biased exponent into the mantissa of 2^52 and subtract 2^52
+	const __m128i biased = _mm_srli_epi64(bits, 52);
+	const __m128d two52 = _mm_set1_pd(4503599627370496.0);
+	__m128d e = _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(biased, _mm_castpd_si128(two52))), two52);
+	e = _mm_sub_pd(e, _mm_set1_pd(1023.0));
+
+	__m128d m = _mm_castsi128_pd(_mm_or_si128(
+		_mm_and_si128(bits, _mm_set1_epi64x(0x000fffffffffffffLL)),
+		_mm_set1_epi64x(0x3ff0000000000000LL)));
+	const __m128d big = _mm_cmpgt_pd(m, _mm_set1_pd(1.4142135623730951));
+	m = select_pd(big, _mm_mul_pd(m, _mm_set1_pd(0.5)), m);
+	e = _mm_add_pd(e, _mm_and_pd(big, _mm_set1_pd(1.0)));
+
+	const __m128d t = _mm_div_pd(_mm_sub_pd(m, _mm_set1_pd(1.0)), _mm_add_pd(m, _mm_set1_pd(1.0)));
+	const __m128d t2 = _mm_mul_pd(t, t);
+	__m128d p = _mm_set1_pd(1.0 / 9.0);
+	p = _mm_add_pd(_mm_mul_pd(p, t2), _mm_set1_pd(1.0 / 7.0));
+	p = _mm_add_pd(_mm_mul_pd(p, t2), _mm_set1_pd(1.0 / 5.0));
+	p = _mm_add_pd(_mm_mul_pd(p, t2), _mm_set1_pd(1.0 / 3.0));
+	p = _mm_add_pd(_mm_mul_pd(p, t2), _mm_set1_pd(1.0));
+	p = _mm_mul_pd(_mm_mul_pd(p, t), _mm_set1_pd(2.0));
+	return _mm_add_pd(_mm_mul_pd(e, _mm_set1_pd(0.69314718055994531)), p);
+}
+#endif
+
+/// <summary>
+/// out[k] = fast_sin(x[k]) for k < n, two at a time with SSE2
+/// </summary>
+inline void fast_sin_array(const double* x, double* out, int n) {
+	int k = 0;
+#ifdef RT_FAST_MATH_SSE2
+	for (; k + 1 < n; k += 2) {
+		if (fabs(x[k]) < 1e8 && fabs(x[k + 1]) < 1e8)
+			_mm_storeu_pd(out + k, fast_sin_pd(_mm_loadu_pd(x + k)));
+		else {
+			out[k] = fast_sin(x[k]);
+			out[k + 1] = fast_sin(x[k + 1]);
+		}
+	}
+#endif
+	for (; k < n; k++)
+		out[k] = fast_sin(x[k]);
+}
+
+// Mode dependent functions used by the shading code
+// --------------------------
+
+inline double rt_acos(double x) { return fast_math_enabled() ? fast_acos(x) : acos(x); }
+inline double rt_atan2(double y, double x) { return fast_math_enabled() ? fast_atan2(y, x) : atan2(y, x); }
+inline double rt_sin(double x) { return fast_math_enabled() ? fast_sin(x) : sin(x); }
+inline double rt_log(double x) { return fast_math_enabled() ? fast_log(x) : log(x); }
+inline double rt_pow5(double x) { return fast_math_enabled() ? pow5(x) : pow(x, 5); }
@@ -0,0 +1,425 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "trace.h"
+
+// Grid acceleration structure
+// --------------------------
+// A uniform grid over the bounding box of a set of objects, traversed with a 3D-DDA
+// (Amanatides-Woo): the ray steps from cell to cell in the order it crosses them and
+// tests the objects listed in each cell. The closest hit found so far is kept across
+// cells, and the walk stops at the first cell that ends behind it. The resolution follows
+// from the object count: about density cells per object, as cubic as the box allows.
+//
+// Cells holding more than subgrid_objects objects get a grid of their own (one level, no
+// deeper), so a dense cluster in a sparse scene does not fill a few cells with hundreds of
+// objects. Objects spanning the cell along two axes or more stay in the cell; the subgrid
+// only spans the bounds of the others, which keeps a cluster on a huge object (a ground
+// sphere) from landing in one subcell. Objects spanning several cells are listed in all of them;
+// a small per-ray mailbox of the last objects tested skips most of the repeated tests.
+
+struct grid_options {
+	double density = 2.0;			// cells per object
+	int max_resolution = 128;		// cells along an axis of the top grid
+	int subgrid_objects = 24;		// a cell with more objects gets a subgrid
+	int max_subgrid_resolution = 16;
+};
+
+class grid_accel : public hittable {
+public:
+	grid_accel(const hittable_list& list, double time0, double time1, const grid_options& options = grid_options())
+		: grid_accel(list.objects, time0, time1, options) {}
+
+	grid_accel(const std::vector<shared_ptr<hittable>>& _objects, double time0, double time1,
+			   const grid_options& _options = grid_options());
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+		output_box = top.bounds;
+		return !objects.empty();
+	}
+
+	/// <summary>
+	/// The cells depend on the object bounds, so the grid is built again for [time0, time1]
+	/// </summary>
+	virtual void refit(double time0, double time1) override;
+
+	size_t object_count() const { return objects.size(); }
+	size_t cell_count() const;
+	size_t reference_count() const;		// object entries of all cells
+	size_t subgrid_count() const { return subgrids.size(); }
+	size_t memory_bytes() const;
+
+private:
+	struct grid_level {
+		aabb bounds;
+		int res[3] = { 1, 1, 1 };
+		double cell_size[3] = { 1, 1, 1 };
+		std::vector<uint32_t> cell_start;	// objects of cell c are items[cell_start[c], cell_start[c + 1])
+		std::vector<uint32_t> items;
+		std::vector<int32_t> subgrid;		// subgrid of each cell or -1, empty if there are none
+
+		size_t cell_index(int x, int y, int z) const { return (static_cast<size_t>(z) * res[1] + y) * res[0] + x; }
+	};
+
+	// Objects tested by the current ray, by index; direct mapped, a collision only costs a retest
+	struct mailbox {
+		static const int size = 32;
+		uint32_t ids[size];
+		mailbox() { std::fill(ids, ids + size, ~0u); }
+		bool seen(uint32_t id) {
+			uint32_t& slot = ids[id & (size - 1)];
+			if (slot == id)
+				return true;
+			slot = id;
+			return false;
+		}
+	};
+
+	void build(double time0, double time1);
+	static aabb cell_box(const grid_level& level, size_t c);
+	void fill_level(grid_level& level, const std::vector<uint32_t>& members, size_t cells_wanted, int max_resolution) const;
+	template <class Visit>
+	bool walk(const grid_level& level, const ray& r, const double* inv_dir, double t0, double t1, Visit&& visit) const;
+
+	std::vector<shared_ptr<hittable>> objects;
+	std::vector<aabb> boxes;
+	grid_options options;
+	grid_level top;
+	std::vector<grid_level> subgrids;
+};
+
+grid_accel::grid_accel(const std::vector<shared_ptr<hittable>>& _objects, double time0, double time1,
+					   const grid_options& _options)
+	: objects(_objects), options(_options) {
+	build(time0, time1);
+}
+
+void grid_accel::refit(double time0, double time1) {
+	for (const auto& object : objects)
+		object->refit(time0, time1);
+	build(time0, time1);
+}
+
+void grid_accel::build(double time0, double time1) {
+	RT_TRACE_SCOPE("grid build", "build");
+	top = grid_level();
+	subgrids.clear();
+	boxes.assign(objects.size(), aabb(point3(0, 0, 0), point3(0, 0, 0)));
+	if (objects.empty())
+		return;
+
+	std::vector<uint32_t> members(objects.size());
+	for (size_t k = 0; k < objects.size(); k++) {
+		if (!objects[k]->bounding_box(time0, time1, boxes[k]))
+			std::cerr << "No bounding box in grid_accel constructor.\n";
+		members[k] = static_cast<uint32_t>(k);
+		top.bounds = k == 0 ? boxes[k] : surrounding_box(top.bounds, boxes[k]);
+	}
+	fill_level(top, members, static_cast<size_t>(options.density * objects.size()), options.max_resolution);
+
+	// Dense cells get a subgrid over the objects not spanning the cell along two or more axes
+	// (ground, walls), unless it would not split them (eg. all span the subgrid)
+	const size_t cells = top.cell_start.size() - 1;
+	std::vector<char> stays(top.items.size(), 1);	// item stays in its top cell
+	for (size_t c = 0; c < cells; c++) {
+		const uint32_t first = top.cell_start[c], last = top.cell_start[c + 1];
+		if (last - first <= static_cast<uint32_t>(options.subgrid_objects))
+			continue;
+
+		const aabb cell = cell_box(top, c);
+		std::vector<uint32_t> inside;
+		aabb bounds;
+		for (uint32_t k = first; k < last; k++) {
+			const aabb& box = boxes[top.items[k]];
+			int spanned = 0;
+			for (int a = 0; a < 3; a++)
+				spanned += box.min()[a] <= cell.min()[a] && box.max()[a] >= cell.max()[a];
+			if (spanned >= 2)
+				continue;
+			const aabb clipped(point3(fmax(box.min().x(), cell.min().x()), fmax(box.min().y(), cell.min().y()),
+									  fmax(box.min().z(), cell.min().z())),
+							   point3(fmin(box.max().x(), cell.max().x()), fmin(box.max().y(), cell.max().y()),
+									  fmin(box.max().z(), cell.max().z())));
+			bounds = inside.empty() ? clipped : surrounding_box(bounds, clipped);
+			inside.push_back(top.items[k]);
+		}
+		if (inside.size() <= static_cast<size_t>(options.subgrid_objects))
+			continue;
+
+		grid_level sub;
+		sub.bounds = bounds;
+		fill_level(sub, inside, static_cast<size_t>(options.density * inside.size()), options.max_subgrid_resolution);
+
+		uint32_t fullest = 0;
+		for (size_t s = 0; s + 1 < sub.cell_start.size(); s++)
+			fullest = std::max(fullest, sub.cell_start[s + 1] - sub.cell_start[s]);
+		if (fullest >= inside.size())
+			continue;
+
+		if (top.subgrid.empty())
+			top.subgrid.assign(cells, -1);
+		top.subgrid[c] = static_cast<int32_t>(subgrids.size());
+		subgrids.push_back(std::move(sub));
+		for (uint32_t k = first, m = 0; k < last; k++) {
+			if (m < inside.size() && top.items[k] == inside[m]) {
+				stays[k] = 0;
+				m++;
+			}
+		}
+	}
+
+	// Drop the objects moved to subgrids from their top cells
+	if (!subgrids.empty()) {
+		std::vector<uint32_t> items;
+		uint32_t begin = 0;
+		for (size_t c = 0; c < cells; c++) {
+			const uint32_t end = top.cell_start[c + 1];
+			for (uint32_t k = begin; k < end; k++)
+				if (stays[k])
+					items.push_back(top.items[k]);
+			begin = end;
+			top.cell_start[c + 1] = static_cast<uint32_t>(items.size());
+		}
+		top.items = std::move(items);
+	}
+}
+
+/// <summary>
+/// Box of cell c of a level
+/// </summary>
+aabb grid_accel::cell_box(const grid_level& level, size_t c) {
+	const int x = static_cast<int>(c % level.res[0]);
+	const int y = static_cast<int>(c / level.res[0] % level.res[1]);
+	const int z = static_cast<int>(c / (static_cast<size_t>(level.res[0]) * level.res[1]));
+	const point3 lo(level.bounds.min().x() + x * level.cell_size[0], level.bounds.min().y() + y * level.cell_size[1],
+					level.bounds.min().z() + z * level.cell_size[2]);
+	return aabb(lo, lo + vec3(level.cell_size[0], level.cell_size[1], level.cell_size[2]));
+}
+
+/// <summary>
+/// Picks the resolution of a level for about cells_wanted cells and lists every member in
+/// the cells its box overlaps (two passes: count, then place)
+/// </summary>
+void grid_accel::fill_level(grid_level& level, const std::vector<uint32_t>& members, size_t cells_wanted,
+							int max_resolution) const {
+	const vec3 extent = level.bounds.max() - level.bounds.min();
+	const double largest = std::max(extent.x(), std::max(extent.y(), extent.z()));
+	// Flat boxes still get a thin slab of cells, not a volume of zero
+	const double floor = largest > 0 ? largest * 1e-3 : 1.0;
+	const double volume = std::max(extent.x(), floor) * std::max(extent.y(), floor) * std::max(extent.z(), floor);
+	const double cell_edge = std::cbrt(volume / static_cast<double>(std::max<size_t>(cells_wanted, 1)));
+	for (int a = 0; a < 3; a++) {
+		level.res[a] = std::max(1, std::min(max_resolution, static_cast<int>(extent[a] / cell_edge + 0.5)));
+		level.cell_size[a] = extent[a] > 0 ? extent[a] / level.res[a] : 1.0;
+	}
+
+	const size_t cells = static_cast<size_t>(level.res[0]) * level.res[1] * level.res[2];
+	auto cell_range = [&](uint32_t id, int lo[3], int hi[3]) {
+		for (int a = 0; a < 3; a++) {
+			const double inv = 1.0 / level.cell_size[a];
+			const double base = level.bounds.min()[a];
+			// Widened by a little so a hit on a cell boundary finds the object on both sides
+			const double pad = 1e-9 * level.cell_size[a];
+			lo[a] = std::max(0, std::min(level.res[a] - 1, static_cast<int>(std::floor((boxes[id].min()[a] - pad - base) * inv))));
+			hi[a] = std::max(0, std::min(level.res[a] - 1, static_cast<int>(std::floor((boxes[id].max()[a] + pad - base) * inv))));
+		}
+	};
+
+	level.cell_start.assign(cells + 1, 0);
+	int lo[3], hi[3];
+	for (uint32_t id : members) {
+		cell_range(id, lo, hi);
+		for (int z = lo[2]; z <= hi[2]; z++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int x = lo[0]; x <= hi[0]; x++)
+					level.cell_start[level.cell_index(x, y, z) + 1]++;
+	}
+	for (size_t c = 0; c < cells; c++)
+		level.cell_start[c + 1] += level.cell_start[c];
+
+	level.items.resize(level.cell_start[cells]);
+	std::vector<uint32_t> fill(level.cell_start.begin(), level.cell_start.end() - 1);
+	for (uint32_t id : members) {
+		cell_range(id, lo, hi);
+		for (int z = lo[2]; z <= hi[2]; z++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int x = lo[0]; x <= hi[0]; x++)
+					level.items[fill[level.cell_index(x, y, z)]++] = id;
+	}
+}
+
+/// <summary>
+/// 3D-DDA over the cells of a level that the ray crosses in [t0, t1], nearest first.
+/// Calls visit(cell, cell_t0, cell_t1) until it returns true.
+/// </summary>
+/// <returns>true if visit stopped the walk</returns>
+template <class Visit>
+bool grid_accel::walk(const grid_level& level, const ray& r, const double* inv_dir, double t0, double t1,
+					  Visit&& visit) const {
+	// Range of the ray inside the level's box
+	for (int a = 0; a < 3; a++) {
+		if (r.direction()[a] == 0.0) {
+			if (r.origin()[a] < level.bounds.min()[a] || r.origin()[a] > level.bounds.max()[a])
+				return false;
+			continue;
+		}
+		double ta = (level.bounds.min()[a] - r.origin()[a]) * inv_dir[a];
+		double tb = (level.bounds.max()[a] - r.origin()[a]) * inv_dir[a];
+		if (tb < ta)
+			std::swap(ta, tb);
+		t0 = fmax(t0, ta);
+		t1 = fmin(t1, tb);
+	}
+	if (t0 > t1)
+		return false;
+
+	int cell[3], step[3], stop[3];
+	double next[3], delta[3];
+	for (int a = 0; a < 3; a++) {
+		const double d = r.direction()[a];
+		const double p = r.origin()[a] + t0 * d - level.bounds.min()[a];
+		cell[a] = std::max(0, std::min(level.res[a] - 1, static_cast<int>(p / level.cell_size[a])));
+		if (d > 0) {
+			step[a] = 1;
+			stop[a] = level.res[a];
+			next[a] = (level.bounds.min()[a] + (cell[a] + 1) * level.cell_size[a] - r.origin()[a]) * inv_dir[a];
+			delta[a] = level.cell_size[a] * inv_dir[a];
+		}
+		else if (d < 0) {
+			step[a] = -1;
+			stop[a] = -1;
+			next[a] = (level.bounds.min()[a] + cell[a] * level.cell_size[a] - r.origin()[a]) * inv_dir[a];
+			delta[a] = -level.cell_size[a] * inv_dir[a];
+		}
+		else {
+			step[a] = 0;
+			stop[a] = -1;
+			next[a] = infinity;
+			delta[a] = infinity;
+		}
+	}
+
+	double cell_t0 = t0;
+	while (true) {
+		const int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+		const double cell_t1 = fmin(next[axis], t1);
+		RT_STAT(bvh_nodes_visited++);	// cells count as nodes in the traversal counters
+		if (visit(level.cell_index(cell[0], cell[1], cell[2]), cell_t0, cell_t1))
+			return true;
+		if (!(next[axis] < t1))	// also ends the walk of degenerate rays (zero direction, NaN range)
+			return false;
+		cell[axis] += step[axis];
+		if (cell[axis] == stop[axis])
+			return false;
+		cell_t0 = next[axis];
+		next[axis] += delta[axis];
+	}
+}
+
+bool grid_accel::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	if (objects.empty())
+		return false;
+	const double inv_dir[3] = { 1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z() };
+	mailbox tested;
+	bool hit_anything = false;
+
+	// Tests the objects of a cell; the walk ends at a cell that ends behind the closest hit
+	auto test_cell = [&](const grid_level& level, size_t c, double cell_t1) {
+		for (uint32_t k = level.cell_start[c]; k < level.cell_start[c + 1]; k++) {
+			const uint32_t id = level.items[k];
+			if (!tested.seen(id) && objects[id]->hit(r, t_min, t_max, rec)) {
+				hit_anything = true;
+				t_max = rec.t;
+			}
+		}
+		return hit_anything && t_max <= cell_t1;
+	};
+
+	walk(top, r, inv_dir, t_min, t_max, [&](size_t c, double cell_t0, double cell_t1) {
+		if (!top.subgrid.empty() && top.subgrid[c] >= 0) {
+			// The objects left in the cell first, they may shorten the subgrid walk
+			test_cell(top, c, cell_t1);
+			const grid_level& sub = subgrids[top.subgrid[c]];
+			walk(sub, r, inv_dir, cell_t0, fmin(cell_t1, t_max), [&](size_t s, double, double sub_t1) {
+				return test_cell(sub, s, sub_t1);
+			});
+			return hit_anything && t_max <= cell_t1;
+		}
+		return test_cell(top, c, cell_t1);
+	});
+	return hit_anything;
+}
+
+bool grid_accel::occluded(const ray& r, double t_min, double t_max) const {
+	if (objects.empty())
+		return false;
+	const double inv_dir[3] = { 1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z() };
+	mailbox tested;
+
+	auto test_cell = [&](const grid_level& level, size_t c) {
+		for (uint32_t k = level.cell_start[c]; k < level.cell_start[c + 1]; k++) {
+			const uint32_t id = level.items[k];
+			if (!tested.seen(id) && objects[id]->occluded(r, t_min, t_max))
+				return true;
+		}
+		return false;
+	};
+
+	return walk(top, r, inv_dir, t_min, t_max, [&](size_t c, double cell_t0, double cell_t1) {
+		if (!top.subgrid.empty() && top.subgrid[c] >= 0) {
+			if (test_cell(top, c))
+				return true;
+			const grid_level& sub = subgrids[top.subgrid[c]];
+			return walk(sub, r, inv_dir, cell_t0, cell_t1, [&](size_t s, double, double) {
+				return test_cell(sub, s);
+			});
+		}
+		return test_cell(top, c);
+	});
+}
+
+size_t grid_accel::cell_count() const {
+	size_t cells = top.cell_start.empty() ? 0 : top.cell_start.size() - 1;
+	for (const auto& sub : subgrids)
+		cells += sub.cell_start.size() - 1;
+	return cells;
+}
+
+size_t grid_accel::reference_count() const {
+	size_t references = top.items.size();
+	for (const auto& sub : subgrids)
+		references += sub.items.size();
+	return references;
+}
+
+size_t grid_accel::memory_bytes() const {
+	auto level_bytes = [](const grid_level& level) {
+		return (level.cell_start.size() + level.items.size()) * sizeof(uint32_t) + level.subgrid.size() * sizeof(int32_t);
+	};
+	size_t bytes = level_bytes(top) + boxes.size() * sizeof(aabb) + objects.size() * sizeof(shared_ptr<hittable>);
+	for (const auto& sub : subgrids)
+		bytes += level_bytes(sub) + sizeof(grid_level);
+	return bytes;
+}
+
+/// <summary>
+/// The objects at the leaves of a bvh_node tree, for building another structure over them
+/// </summary>
+inline void bvh_leaves(const shared_ptr<hittable>& node, std::vector<shared_ptr<hittable>>& leaves) {
+	if (auto bn = std::dynamic_pointer_cast<bvh_node>(node)) {
+		bvh_leaves(bn->left, leaves);
+		if (bn->right != bn->left)
+			bvh_leaves(bn->right, leaves);
+	}
+	else
+		leaves.push_back(node);
+}
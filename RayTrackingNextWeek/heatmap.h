@@ -0,0 +1,179 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+
+/// <summary>
+/// Per-pixel buffers, stored row by row from the top of the image like the framebuffer.
+/// </summary>
+struct heatmap_buffer {
+	int width = 0;
+	int height = 0;
+	std::vector<float> values;
+
+	void resize(int w, int h) {
+		width = w;
+		height = h;
+		values.assign(static_cast<size_t>(w) * h, 0.0f);
+	}
+
+	float max_value() const {
+		float m = 0.0f;
+		for (auto v : values)
+			m = std::max(m, v);
+		return m;
+	}
+
+	/// <summary>
+	/// Value below which the fraction p of the pixels lie
+	/// </summary>
+	float percentile(double p) const {
+		if (values.empty())
+			return 0.0f;
+		std::vector<float> sorted(values);
+		auto nth = sorted.begin() + static_cast<size_t>(clamp(p, 0.0, 1.0) * (sorted.size() - 1));
+		std::nth_element(sorted.begin(), nth, sorted.end());
+		return *nth;
+	}
+};
+
+/// <summary>
+/// Average traversal cost of the camera samples of each pixel (primary ray and its bounces)
+/// </summary>
+struct trace_heatmaps {
+	heatmap_buffer bvh_nodes;
+	heatmap_buffer aabb_tests;
+	heatmap_buffer primitive_tests;
+
+	void resize(int w, int h) {
+		bvh_nodes.resize(w, h);
+		aabb_tests.resize(w, h);
+		primitive_tests.resize(w, h);
+	}
+};
+
+/// <summary>
+/// Wall-clock time spent on the camera samples of each pixel, in microseconds per sample
+/// </summary>
+struct time_heatmap {
+	heatmap_buffer microseconds;
+
+	void resize(int w, int h) { microseconds.resize(w, h); }
+};
+
+/// <summary>
+/// Maps t in [0,1] to a black - blue - cyan - green - yellow - red - white ramp
+/// </summary>
+inline color false_color(double t) {
+	static const color ramp[] = {
+		color(0, 0, 0), color(0, 0, 1), color(0, 1, 1), color(0, 1, 0),
+		color(1, 1, 0), color(1, 0, 0), color(1, 1, 1)
+	};
+	const int segments = 6;
+
+	t = clamp(t, 0.0, 1.0) * segments;
+	int k = static_cast<int>(t);
+	if (k >= segments)
+		return ramp[segments];
+	auto f = t - k;
+	return (1 - f) * ramp[k] + f * ramp[k + 1];
+}
+
+/// <summary>
+/// Writes a buffer as false color PPM, scaled so scale_max maps to white.
+/// A scale_max of 0 uses the largest value in the buffer.
+/// </summary>
+inline bool write_heatmap_ppm(const std::string& path, const heatmap_buffer& buffer, double scale_max = 0.0) {
+	std::ofstream out(path);
+	if (!out) {
+		std::cerr << "ERROR: Could not open '" << path << "' for writing.\n";
+		return false;
+	}
+
+	if (scale_max <= 0.0)
+		scale_max = buffer.max_value();
+	const double inv_scale = scale_max > 0.0 ? 1.0 / scale_max : 0.0;
+
+	out << "P3\n" << buffer.width << ' ' << buffer.height << "\n255\n";
+	for (auto v : buffer.values) {
+		auto c = false_color(v * inv_scale);
+		out << static_cast<int>(255.999 * c.x()) << ' '
+			<< static_cast<int>(255.999 * c.y()) << ' '
+			<< static_cast<int>(255.999 * c.z()) << '\n';
+	}
+	return true;
+}
+
+/// <summary>
+/// Writes the traversal heatmaps as PREFIX_bvh_nodes.ppm, PREFIX_aabb_tests.ppm and PREFIX_primitive_tests.ppm
+/// </summary>
+inline void write_trace_heatmaps(const std::string& prefix, const trace_heatmaps& heatmaps) {
+	const std::pair<const char*, const heatmap_buffer*> maps[] = {
+		{ "bvh_nodes", &heatmaps.bvh_nodes },
+		{ "aabb_tests", &heatmaps.aabb_tests },
+		{ "primitive_tests", &heatmaps.primitive_tests }
+	};
+
+	for (const auto& map : maps) {
+		auto path = prefix + "_" + map.first + ".ppm";
+		if (write_heatmap_ppm(path, *map.second))
+			std::cerr << "Wrote " << path << " (white = " << map.second->max_value() << " per sample)\n";
+	}
+}
+
+/// <summary>
+/// Writes a buffer as grayscale Portable Float Map (PFM), the float values as they are.
+/// PFM stores rows from the bottom of the image.
+/// </summary>
+inline bool write_heatmap_pfm(const std::string& path, const heatmap_buffer& buffer) {
+	std::ofstream out(path, std::ios::binary);
+	if (!out) {
+		std::cerr << "ERROR: Could not open '" << path << "' for writing.\n";
+		return false;
+	}
+
+	// A negative scale marks little-endian floats
+	const uint32_t probe = 1;
+	const bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+	out << "Pf\n" << buffer.width << ' ' << buffer.height << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+	for (int y = buffer.height - 1; y >= 0; y--)
+		out.write(reinterpret_cast<const char*>(&buffer.values[static_cast<size_t>(y) * buffer.width]),
+				  sizeof(float) * buffer.width);
+	return static_cast<bool>(out);
+}
+
+/// <summary>
+/// Writes the render-time heatmap as PREFIX_time.ppm (false color, white at the 99th
+/// percentile so a few slow pixels do not wash out the rest) and PREFIX_time.pfm, and
+/// summarizes how the time is spread over the pixels.
+/// </summary>
+inline void write_time_heatmap(const std::string& prefix, const time_heatmap& heatmap) {
+	const heatmap_buffer& buffer = heatmap.microseconds;
+	const double white = buffer.percentile(0.99);
+	const auto ppm_path = prefix + "_time.ppm";
+	const auto pfm_path = prefix + "_time.pfm";
+	if (write_heatmap_ppm(ppm_path, buffer, white))
+		std::cerr << "Wrote " << ppm_path << " (white = " << white << " us per sample)\n";
+	if (write_heatmap_pfm(pfm_path, buffer))
+		std::cerr << "Wrote " << pfm_path << " (us per sample)\n";
+
+	// Share of the time spent in the slowest tenth of the pixels
+	std::vector<float> sorted(buffer.values);
+	std::sort(sorted.begin(), sorted.end(), std::greater<float>());
+	double total = 0.0, slowest = 0.0;
+	for (size_t k = 0; k < sorted.size(); k++) {
+		total += sorted[k];
+		if (k < (sorted.size() + 9) / 10)
+			slowest += sorted[k];
+	}
+	if (!sorted.empty() && total > 0)
+		std::cerr << "Pixel time: mean " << total / sorted.size() << " us, median " << buffer.percentile(0.5)
+				  << " us, max " << sorted.front() << " us per sample; slowest 10% of the pixels take "
+				  << 100.0 * slowest / total << "% of the time\n";
+}
@@ -0,0 +1,417 @@
+#pragma once
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+
+// Box grid (heightfield)
+// --------------------------
+// A regular grid of boxes standing on a common base, such as the ground of final_scene,
+// stored as one float height per cell instead of a box of six rects each. Above the
+// cells is a min/max mip: level L holds the lowest and highest top of every block of
+// 2^L x 2^L cells, up to one block over the whole grid. A ray walks the blocks of a level
+// in the order it crosses them, a 2D DDA that inside a block of 2x2 children is just the
+// order of the ray's direction signs. It passes over a block whose highest top is below
+// the ray and descends into the others down to single cells. Cells are intersected
+// exactly like box does, so the hits (t, normals, uvs, faces) are those of the boxes.
+
+class box_grid : public hittable {
+public:
+	box_grid() {}
+
+	/// <summary>
+	/// Grid of nx x nz cells of cell_x x cell_z with cell (0, 0) at base_corner. The box of cell
+	/// (i, k) reaches from base_corner.y() to heights[k * nx + i]; a cell no higher than the
+	/// base is empty.
+	/// </summary>
+	box_grid(const point3& base_corner, double _cell_x, double _cell_z, int _nx, int _nz,
+			 std::vector<float> _heights, shared_ptr<material> mat);
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+		output_box = aabb(corner, point3(corner.x() + nx * cell_x, fmax(top, corner.y() + 0.0001),
+										 corner.z() + nz * cell_z));
+		return true;
+	}
+
+	/// <summary>
+	/// Bytes of the heights and the mip
+	/// </summary>
+	size_t memory_bytes() const;
+
+public:
+	point3 corner;
+	double cell_x = 1.0, cell_z = 1.0;
+	int nx = 0, nz = 0;
+	std::vector<float> heights;
+	shared_ptr<material> mp;
+
+private:
+	struct mip_level {
+		int nx = 0, nz = 0;
+		std::vector<float> low, high;	// lowest and highest top of each block
+	};
+
+	float cell_height(int i, int k) const;
+	float block_low(int level, int bi, int bk) const;
+	float block_high(int level, int bi, int bk) const;
+	bool footprint(const ray& r, int level, int bi, int bk, double& t0, double& t1) const;
+	bool hit_cell(const ray& r, int i, int k, double t_min, double t_max, hit_record& rec) const;
+
+	// What the walk needs of a ray
+	struct grid_ray {
+		double ox, oy, oz;
+		double dy;
+		double inv_dx, inv_dy, inv_dz;
+		int first_x, first_z;	// child of a 2x2 block the ray reaches first, 1 where it runs to -x / -z
+		double y_slack;
+	};
+	grid_ray setup(const ray& r) const;
+	bool cell_occluded(const grid_ray& g, int i, int k, double t_min, double t_max) const;
+	bool above_or_below(const grid_ray& g, int level, int bi, int bk, double t0, double t1) const;
+	template <class Visit>
+	void walk_children(const grid_ray& g, int level, int bi, int bk, double t0, double t1, Visit&& visit) const;
+	bool hit_block(const ray& r, const grid_ray& g, int level, int bi, int bk, double t0, double t1,
+				   double t_min, double& t_max, hit_record& rec) const;
+	bool occluded_block(const ray& r, const grid_ray& g, int level, int bi, int bk, double t0, double t1,
+						bool entered, double t_min, double t_max) const;
+
+	std::vector<mip_level> mip;		// mip[L - 1] has the blocks of 2^L cells, the last one block
+	float top = 0.0f;
+};
+
+box_grid::box_grid(const point3& base_corner, double _cell_x, double _cell_z, int _nx, int _nz,
+				   std::vector<float> _heights, shared_ptr<material> mat)
+	: corner(base_corner), cell_x(_cell_x), cell_z(_cell_z), nx(_nx), nz(_nz),
+	  heights(std::move(_heights)), mp(mat) {
+	heights.resize(static_cast<size_t>(nx) * nz, static_cast<float>(corner.y()));
+	top = heights.empty() ? static_cast<float>(corner.y()) : *std::max_element(heights.begin(), heights.end());
+
+	int level_nx = nx, level_nz = nz;
+	for (int level = 1; level_nx > 1 || level_nz > 1; level++) {
+		mip_level next;
+		next.nx = (level_nx + 1) / 2;
+		next.nz = (level_nz + 1) / 2;
+		next.low.assign(static_cast<size_t>(next.nx) * next.nz, infinity);
+		next.high.assign(next.low.size(), -infinity);
+		for (int bk = 0; bk < level_nz; bk++) {
+			for (int bi = 0; bi < level_nx; bi++) {
+				const size_t parent = static_cast<size_t>(bk / 2) * next.nx + bi / 2;
+				next.low[parent] = std::min(next.low[parent], block_low(level - 1, bi, bk));
+				next.high[parent] = std::max(next.high[parent], block_high(level - 1, bi, bk));
+			}
+		}
+		level_nx = next.nx;
+		level_nz = next.nz;
+		mip.push_back(std::move(next));
+	}
+}
+
+size_t box_grid::memory_bytes() const {
+	size_t bytes = heights.size() * sizeof(float);
+	for (const auto& level : mip)
+		bytes += (level.low.size() + level.high.size()) * sizeof(float);
+	return bytes;
+}
+
+inline float box_grid::cell_height(int i, int k) const {
+	return heights[static_cast<size_t>(k) * nx + i];
+}
+
+inline float box_grid::block_low(int level, int bi, int bk) const {
+	if (level == 0)
+		return cell_height(bi, bk);
+	const mip_level& m = mip[level - 1];
+	return m.low[static_cast<size_t>(bk) * m.nx + bi];
+}
+
+inline float box_grid::block_high(int level, int bi, int bk) const {
+	if (level == 0)
+		return cell_height(bi, bk);
+	const mip_level& m = mip[level - 1];
+	return m.high[static_cast<size_t>(bk) * m.nx + bi];
+}
+
+/// <summary>
+/// Parameter range [t0, t1] of the ray over the footprint (x and z only) of block (bi, bk)
+/// of a level. Uses the cell boundaries and divisions of hit_cell, so a cell hit always
+/// lies in the range of the blocks around it.
+/// </summary>
+inline bool box_grid::footprint(const ray& r, int level, int bi, int bk, double& t0, double& t1) const {
+	const int i0 = bi << level, i1 = std::min((bi + 1) << level, nx);
+	const int k0 = bk << level, k1 = std::min((bk + 1) << level, nz);
+	const double lo[2] = { corner.x() + i0 * cell_x, corner.z() + k0 * cell_z };
+	const double hi[2] = { corner.x() + i1 * cell_x, corner.z() + k1 * cell_z };
+	const int axes[2] = { 0, 2 };
+
+	t0 = -infinity;
+	t1 = infinity;
+	for (int a = 0; a < 2; a++) {
+		const double o = r.origin()[axes[a]];
+		const double d = r.direction()[axes[a]];
+		if (d == 0.0) {
+			if (o < lo[a] || o > hi[a])
+				return false;
+			continue;
+		}
+		double ta = (lo[a] - o) / d;
+		double tb = (hi[a] - o) / d;
+		if (tb < ta)
+			std::swap(ta, tb);
+		t0 = fmax(t0, ta);
+		t1 = fmin(t1, tb);
+	}
+	return t0 <= t1;
+}
+
+/// <summary>
+/// The box of cell (i, k), tested as box does with its rects: the side where the ray
+/// enters, or the one where it leaves if it enters before t_min
+/// </summary>
+bool box_grid::hit_cell(const ray& r, int i, int k, double t_min, double t_max, hit_record& rec) const {
+	const double height = cell_height(i, k);
+	if (height <= corner.y())
+		return false;
+
+	const double lo[3] = { corner.x() + i * cell_x, corner.y(), corner.z() + k * cell_z };
+	const double hi[3] = { lo[0] + cell_x, height, lo[2] + cell_z };
+	double t_enter = -infinity, t_exit = infinity;
+	int enter_axis = 0, exit_axis = 0;
+	for (int a = 0; a < 3; a++) {
+		auto t0 = (lo[a] - r.origin()[a]) / r.direction()[a];
+		auto t1 = (hi[a] - r.origin()[a]) / r.direction()[a];
+		if (t1 < t0)
+			std::swap(t0, t1);
+		if (t0 > t_enter) {
+			t_enter = t0;
+			enter_axis = a;
+		}
+		if (t1 < t_exit) {
+			t_exit = t1;
+			exit_axis = a;
+		}
+	}
+	if (t_exit < t_enter)
+		return false;
+
+	double t;
+	int axis;
+	if (t_enter >= t_min && t_enter <= t_max) {
+		t = t_enter;
+		axis = enter_axis;
+	}
+	else if (t_exit >= t_min && t_exit <= t_max) {
+		t = t_exit;
+		axis = exit_axis;
+	}
+	else
+		return false;
+
+	// The uvs of the xy, xz and yz rects of a box
+	const double x = r.origin().x() + t * r.direction().x();
+	const double y = r.origin().y() + t * r.direction().y();
+	const double z = r.origin().z() + t * r.direction().z();
+	vec3 outward_normal;
+	if (axis == 0) {
+		rec.u = (y - lo[1]) / (hi[1] - lo[1]);
+		rec.v = (z - lo[2]) / (hi[2] - lo[2]);
+		outward_normal = vec3(1, 0, 0);
+	}
+	else if (axis == 1) {
+		rec.u = (x - lo[0]) / (hi[0] - lo[0]);
+		rec.v = (z - lo[2]) / (hi[2] - lo[2]);
+		outward_normal = vec3(0, 1, 0);
+	}
+	else {
+		rec.u = (x - lo[0]) / (hi[0] - lo[0]);
+		rec.v = (y - lo[1]) / (hi[1] - lo[1]);
+		outward_normal = vec3(0, 0, 1);
+	}
+	rec.t = t;
+	rec.set_face_normal(r, outward_normal);
+	rec.mat_ptr = mp.get();
+	rec.p = r.at(t);
+	return true;
+}
+
+inline box_grid::grid_ray box_grid::setup(const ray& r) const {
+	grid_ray g;
+	g.ox = r.origin().x();
+	g.oy = r.origin().y();
+	g.oz = r.origin().z();
+	g.dy = r.direction().y();
+	g.inv_dx = 1.0 / r.direction().x();
+	g.inv_dy = 1.0 / r.direction().y();
+	g.inv_dz = 1.0 / r.direction().z();
+	g.first_x = r.direction().x() < 0 ? 1 : 0;
+	g.first_z = r.direction().z() < 0 ? 1 : 0;
+	g.y_slack = 1e-9 * (1.0 + fabs(top));
+	return g;
+}
+
+/// <summary>
+/// The box of cell (i, k) as box::occluded tests it: one slab test, true if the ray
+/// enters or leaves the box in [t_min, t_max]
+/// </summary>
+inline bool box_grid::cell_occluded(const grid_ray& g, int i, int k, double t_min, double t_max) const {
+	const double height = cell_height(i, k);
+	if (height <= corner.y())
+		return false;
+
+	const double x0 = corner.x() + i * cell_x, z0 = corner.z() + k * cell_z;
+	double tx0 = (x0 - g.ox) * g.inv_dx, tx1 = (x0 + cell_x - g.ox) * g.inv_dx;
+	double ty0 = (corner.y() - g.oy) * g.inv_dy, ty1 = (height - g.oy) * g.inv_dy;
+	double tz0 = (z0 - g.oz) * g.inv_dz, tz1 = (z0 + cell_z - g.oz) * g.inv_dz;
+	if (g.inv_dx < 0.0)
+		std::swap(tx0, tx1);
+	if (g.inv_dy < 0.0)
+		std::swap(ty0, ty1);
+	if (g.inv_dz < 0.0)
+		std::swap(tz0, tz1);
+	const double t_enter = fmax(tx0, fmax(ty0, tz0));
+	const double t_exit = fmin(tx1, fmin(ty1, tz1));
+	if (t_exit < t_enter)
+		return false;
+	return (t_enter >= t_min && t_enter <= t_max) || (t_exit >= t_min && t_exit <= t_max);
+}
+
+/// <summary>
+/// True if the ray is over the highest top or under the base all the way from t0 to t1
+/// </summary>
+inline bool box_grid::above_or_below(const grid_ray& g, int level, int bi, int bk, double t0, double t1) const {
+	const double y0 = g.oy + t0 * g.dy;
+	const double y1 = g.oy + t1 * g.dy;
+	return fmin(y0, y1) > block_high(level, bi, bk) + g.y_slack || fmax(y0, y1) < corner.y() - g.y_slack;
+}
+
+/// <summary>
+/// The DDA of one block: splits [t0, t1], the ray's range over block (bi, bk) of a level, where
+/// it crosses the planes between the block's 2x2 children, and calls
+/// visit(child i, child k, begin, end, crossed) for the children in the order the ray passes
+/// them. crossed is false for the first child, whose begin is t0. The walk stops when visit
+/// returns true.
+/// </summary>
+template <class Visit>
+void box_grid::walk_children(const grid_ray& g, int level, int bi, int bk, double t0, double t1, Visit&& visit) const {
+	const int child = level - 1;
+	const int child_nx = child == 0 ? nx : mip[child - 1].nx;
+	const int child_nz = child == 0 ? nz : mip[child - 1].nz;
+	const double split_x = corner.x() + ((2 * bi + 1) << child) * cell_x;
+	const double split_z = corner.z() + ((2 * bk + 1) << child) * cell_z;
+	const double tx = (split_x - g.ox) * g.inv_dx;
+	const double tz = (split_z - g.oz) * g.inv_dz;
+
+	// Child at t0, and the crossings still ahead
+	int sx = g.first_x ^ (tx <= t0 ? 1 : 0);
+	int sz = g.first_z ^ (tz <= t0 ? 1 : 0);
+	double cross_x = tx > t0 && tx < t1 ? tx : infinity;
+	double cross_z = tz > t0 && tz < t1 ? tz : infinity;
+
+	double begin = t0;
+	for (bool crossed = false;; crossed = true) {
+		const double end = fmin(fmin(cross_x, cross_z), t1);
+		const int ci = 2 * bi + sx, ck = 2 * bk + sz;
+		if (ci < child_nx && ck < child_nz && visit(ci, ck, begin, end, crossed))
+			return;
+		if (end >= t1)
+			return;
+		if (cross_x <= cross_z) {
+			sx ^= 1;
+			cross_x = infinity;
+		}
+		else {
+			sz ^= 1;
+			cross_z = infinity;
+		}
+		begin = end;
+	}
+}
+
+/// <summary>
+/// Closest hit below block (bi, bk) of a level, which the ray crosses in [t0, t1]. t_max
+/// shrinks with every hit, so the children after it are left out by the range alone.
+/// </summary>
+bool box_grid::hit_block(const ray& r, const grid_ray& g, int level, int bi, int bk, double t0, double t1,
+						 double t_min, double& t_max, hit_record& rec) const {
+	if (level == 0) {
+		if (!hit_cell(r, bi, bk, t_min, t_max, rec))
+			return false;
+		t_max = rec.t;
+		return true;
+	}
+
+	bool hit_anything = false;
+	walk_children(g, level, bi, bk, t0, t1, [&](int ci, int ck, double begin, double end, bool) {
+		if (begin > t_max)
+			return true;
+		end = fmin(end, t_max);
+		if (!above_or_below(g, level - 1, ci, ck, begin, end)
+			&& hit_block(r, g, level - 1, ci, ck, begin, end, t_min, t_max, rec))
+			hit_anything = true;
+		return false;
+	});
+	return hit_anything;
+}
+
+/// <summary>
+/// Any hit below block (bi, bk) of a level, crossed in [t0, t1]; entered is true if the
+/// ray comes into the block through its side at t0 rather than starting in it. Entering
+/// a block lower than its lowest top is a hit on the side of a cell right there.
+/// </summary>
+bool box_grid::occluded_block(const ray& r, const grid_ray& g, int level, int bi, int bk, double t0, double t1,
+							  bool entered, double t_min, double t_max) const {
+	if (level == 0)
+		return cell_occluded(g, bi, bk, t_min, t_max);
+
+	bool occluded = false;
+	walk_children(g, level, bi, bk, t0, t1, [&](int ci, int ck, double begin, double end, bool crossed) {
+		if (above_or_below(g, level - 1, ci, ck, begin, end))
+			return false;
+		const bool child_entered = entered || crossed;
+		const double y = g.oy + begin * g.dy;
+		if (child_entered && y > corner.y() && y < block_low(level - 1, ci, ck))
+			occluded = true;
+		else
+			occluded = occluded_block(r, g, level - 1, ci, ck, begin, end, child_entered, t_min, t_max);
+		return occluded;
+	});
+	return occluded;
+}
+
+bool box_grid::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_box_grid]++);
+	if (nx <= 0 || nz <= 0)
+		return false;
+
+	const int level = static_cast<int>(mip.size());
+	double t0, t1;
+	if (!footprint(r, level, 0, 0, t0, t1))
+		return false;
+	t0 = fmax(t0, t_min);
+	t1 = fmin(t1, t_max);
+	const grid_ray g = setup(r);
+	if (t0 > t1 || above_or_below(g, level, 0, 0, t0, t1))
+		return false;
+	return hit_block(r, g, level, 0, 0, t0, t1, t_min, t_max, rec);
+}
+
+bool box_grid::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_box_grid]++);
+	if (nx <= 0 || nz <= 0)
+		return false;
+
+	const int level = static_cast<int>(mip.size());
+	double t0, t1;
+	if (!footprint(r, level, 0, 0, t0, t1))
+		return false;
+	const bool entered = t0 >= t_min;
+	t0 = fmax(t0, t_min);
+	t1 = fmin(t1, t_max);
+	const grid_ray g = setup(r);
+	if (t0 > t1 || above_or_below(g, level, 0, 0, t0, t1))
+		return false;
+	return occluded_block(r, g, level, 0, 0, t0, t1, entered, t_min, t_max);
+}
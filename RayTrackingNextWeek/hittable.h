@@ -1,6 +1,8 @@
 #pragma once
 #include "rtweekend.h"
 #include "aabb.h"
+#include "motion.h"
+#include "packet.h"
 
 // Foward declaration
 class material;
@@ -8,7 +10,7 @@ class material;
 struct hit_record {
 	point3 p = point3(0, 0, 0); // consider renaming 'pos', 'position', or 'hitPosition'
 	vec3 normal = vec3(0, 0, 0);
-	shared_ptr<material> mat_ptr;
+	material* mat_ptr = nullptr;	// non-owning, the hit object keeps its material alive
 	double t = 0.0;
 	double u = 0.0; 
 	double v = 0.0;
@@ -26,6 +28,42 @@ struct hit_record {
 	}
 };
 
+/// <summary>
+/// Closest hits of a ray_packet. t_max[k] starts as the lane's search limit and
+/// shrinks to rec[k].t when lane k hits something; mask has a bit per lane that hit.
+/// </summary>
+struct packet_hits {
+	hit_record rec[packet_width];
+	double t_max[packet_width];
+	int mask = 0;
+};
+
+/// <summary>
+/// Parts of a ray inside a closed object: disjoint parameter ranges [enter, exit]
+/// in increasing order
+/// </summary>
+struct ray_intervals {
+	static const int capacity = 8;
+	double enter[capacity];
+	double exit[capacity];
+	int count = 0;
+
+	/// <summary>
+	/// Appends [t0, t1] clipped to [t_min, t_max]. Returns false if nothing of it is left
+	/// or there is no room.
+	/// </summary>
+	bool add(double t0, double t1, double t_min, double t_max) {
+		t0 = fmax(t0, t_min);
+		t1 = fmin(t1, t_max);
+		if (t0 >= t1 || count == capacity)
+			return false;
+		enter[count] = t0;
+		exit[count] = t1;
+		count++;
+		return true;
+	}
+};
+
 class hittable {
 public: 
 
@@ -39,7 +77,107 @@ public:
 	/// <param name="rec"></param>
 	/// <returns></returns>
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+
+	/// <summary>
+	/// Any-hit query for shadow and visibility rays. Returns true as soon as
+	/// any intersection in [t_min, t_max] is found, without computing hit attributes.
+	/// The default falls back to hit(); every built-in hittable overrides it.
+	/// </summary>
+	/// <param name="r"></param>
+	/// <param name="t_min"></param>
+	/// <param name="t_max"></param>
+	/// <returns></returns>
+	virtual bool occluded(const ray& r, double t_min, double t_max) const {
+		hit_record rec;
+		return hit(r, t_min, t_max, rec);
+	}
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0; 
+
+	/// <summary>
+	/// Closest hit of every active lane of a packet, see packet_hits.
+	/// The default traces the lanes one by one; acceleration structures and
+	/// primitives with a cheap SIMD test override it.
+	/// </summary>
+	/// <param name="p"></param>
+	/// <param name="active">bit mask of the lanes to trace</param>
+	/// <param name="t_min"></param>
+	/// <param name="hits"></param>
+	virtual void hit_packet(const ray_packet& p, int active, double t_min, packet_hits& hits) const {
+		for (int k = 0; k < p.count; k++) {
+			if ((active & (1 << k)) && hit(p.rays[k], t_min, hits.t_max[k], hits.rec[k])) {
+				hits.t_max[k] = hits.rec[k].t;
+				hits.mask |= 1 << k;
+			}
+		}
+	}
+
+	/// <summary>
+	/// Any-hit query for a batch of shadow rays. Returns the mask of active lanes
+	/// with an intersection in [t_min, t_max[k]].
+	/// </summary>
+	/// <param name="p"></param>
+	/// <param name="active"></param>
+	/// <param name="t_min"></param>
+	/// <param name="t_max">per lane limit</param>
+	/// <returns></returns>
+	virtual int occluded_packet(const ray_packet& p, int active, double t_min, const double* t_max) const {
+		int mask = 0;
+		for (int k = 0; k < p.count; k++) {
+			if ((active & (1 << k)) && occluded(p.rays[k], t_min, t_max[k]))
+				mask |= 1 << k;
+		}
+		return mask;
+	}
+
+	/// <summary>
+	/// Boxes at time0 and time1 whose linear interpolation bounds the object
+	/// at every time in between. Used by motion_bvh_node.
+	/// Static objects return their bounding box for both.
+	/// </summary>
+	/// <param name="time0"></param>
+	/// <param name="time1"></param>
+	/// <param name="box0"></param>
+	/// <param name="box1"></param>
+	/// <returns></returns>
+	virtual bool motion_bounds(double time0, double time1, aabb& box0, aabb& box1) const {
+		if (!bounding_box(time0, time1, box0))
+			return false;
+		box1 = box0;
+		return true;
+	}
+
+	/// <summary>
+	/// Updates the bounds the object keeps (eg. the node boxes of a BVH) for the shutter
+	/// interval [time0, time1] without changing its structure. Used between the frames of
+	/// an animation. Objects that compute their bounds on demand have nothing to update.
+	/// </summary>
+	/// <param name="time0"></param>
+	/// <param name="time1"></param>
+	virtual void refit(double time0, double time1) {}
+
+	/// <summary>
+	/// Parts of the ray in [t_min, t_max] that are inside the object, for objects that
+	/// enclose a volume (eg. the boundary of a constant_medium). Convex objects find both
+	/// crossings with one test. The default works for any closed boundary: it walks the
+	/// crossings with hit() from -infinity, every other one entering the object.
+	/// </summary>
+	/// <param name="r"></param>
+	/// <param name="t_min"></param>
+	/// <param name="t_max"></param>
+	/// <param name="inside"></param>
+	/// <returns>true if some part of the ray is inside</returns>
+	virtual bool hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const {
+		inside.count = 0;
+		hit_record enter_rec, exit_rec;
+		double t = -infinity;
+		while (inside.count < ray_intervals::capacity && t < t_max && hit(r, t, infinity, enter_rec)) {
+			if (!hit(r, enter_rec.t + 0.0001, infinity, exit_rec))
+				break;
+			inside.add(enter_rec.t, exit_rec.t, t_min, t_max);
+			t = exit_rec.t + 0.0001;
+		}
+		return inside.count > 0;
+	}
 };
 
 
@@ -49,16 +187,34 @@ public:
 	translate(shared_ptr<hittable> p, const vec3& displacement)
 		: ptr(p), offset(displacement) {}
 
+	/// <summary>
+	/// Instance whose displacement is animated by keyframes
+	/// </summary>
+	/// <param name="p"></param>
+	/// <param name="displacements"></param>
+	translate(shared_ptr<hittable> p, const keyframe_track& displacements)
+		: ptr(p), offset(displacements) {}
+
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool motion_bounds(double time0, double time1, aabb& box0, aabb& box1) const override;
+	virtual void refit(double time0, double time1) override { ptr->refit(time0, time1); }
+	virtual bool hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const override {
+		RT_STAT(primitive_tests[prim_instance]++);
+		// Moving the ray does not change its parameter, so the intervals carry over
+		return ptr->hit_interval(ray(r.origin() - offset.at(r.time()), r.direction(), r.time()), t_min, t_max, inside);
+	}
 
 
 public:
 	shared_ptr<hittable> ptr;
-	vec3 offset;
+	keyframe_track offset;
 };
 
 bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_instance]++);
+	auto offset = this->offset.at(r.time());
 	ray moved_r(r.origin() - offset, r.direction(), r.time());
 
 	if (!ptr->hit(moved_r, t_min, t_max, rec))
@@ -69,11 +225,39 @@ bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
 
 	return true;
 }
+bool translate::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_instance]++);
+	ray moved_r(r.origin() - offset.at(r.time()), r.direction(), r.time());
+	return ptr->occluded(moved_r, t_min, t_max);
+}
 bool translate::bounding_box(double time0, double time1, aabb& output_box) const {
-	if (!ptr->bounding_box(time0, time1, output_box))
+	aabb box;
+	if (!ptr->bounding_box(time0, time1, box))
+		return false;
+
+	// Sweep the box over the displacement at both ends and at every key in between
+	auto offset0 = offset.at(time0);
+	output_box = aabb(box.min() + offset0, box.max() + offset0);
+	auto offset1 = offset.at(time1);
+	output_box = surrounding_box(output_box, aabb(box.min() + offset1, box.max() + offset1));
+
+	for (size_t k = 0; k < offset.key_count(); k++) {
+		const auto& key = offset.key(k);
+		if (key.time > time0 && key.time < time1)
+			output_box = surrounding_box(output_box, aabb(box.min() + key.value, box.max() + key.value));
+	}
+
+	return true;
+}
+bool translate::motion_bounds(double time0, double time1, aabb& box0, aabb& box1) const {
+	if (!ptr->motion_bounds(time0, time1, box0, box1))
 		return false;
 
-	output_box = aabb(output_box.min() + offset, output_box.max() + offset);
+	auto deviation = offset.max_deviation(time0, time1);
+	auto offset0 = offset.at(time0);
+	auto offset1 = offset.at(time1);
+	box0 = expand_box(aabb(box0.min() + offset0, box0.max() + offset0), deviation);
+	box1 = expand_box(aabb(box1.min() + offset1, box1.max() + offset1), deviation);
 
 	return true;
 }
@@ -83,10 +267,19 @@ public:
 	rotate_x(shared_ptr<hittable> p, double angle); 
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		output_box = bbox;
 		return hasbox;
 	}
+	virtual void refit(double time0, double time1) override {
+		ptr->refit(time0, time1);
+		update_box(time0, time1);
+	}
+	virtual bool hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const override {
+		RT_STAT(primitive_tests[prim_instance]++);
+		return ptr->hit_interval(to_object(r), t_min, t_max, inside);
+	}
 
 public:
 	shared_ptr<hittable> ptr;
@@ -94,13 +287,27 @@ public:
 	double cos_theta;
 	bool hasbox;
 	aabb bbox;
+
+private:
+	/// <summary>
+	/// Rotates a world space ray into the space of the wrapped object
+	/// </summary>
+	ray to_object(const ray& r) const;
+
+	/// <summary>
+	/// Box around the rotated box of the wrapped object over [time0, time1]
+	/// </summary>
+	void update_box(double time0, double time1);
 };
 
 rotate_x::rotate_x(shared_ptr<hittable> p, double angle) : ptr(p) {
 	auto radians = degrees_to_radians(angle);
 	sin_theta = sin(radians);
 	cos_theta = cos(radians);
-	hasbox = ptr->bounding_box(0, 1, bbox);
+	update_box(0, 1);
+}
+void rotate_x::update_box(double time0, double time1) {
+	hasbox = ptr->bounding_box(time0, time1, bbox);
 
 	point3 min(infinity, infinity, infinity);
 	point3 max(-infinity, -infinity, -infinity);
@@ -127,7 +334,7 @@ rotate_x::rotate_x(shared_ptr<hittable> p, double angle) : ptr(p) {
 
 	bbox = aabb(min, max);
 }
-bool rotate_x::hit(const ray& r, double t_min, double t_max, hit_record& rec)const {
+ray rotate_x::to_object(const ray& r) const {
 	auto origin = r.origin();
 	auto direction = r.direction();
 
@@ -137,7 +344,15 @@ bool rotate_x::hit(const ray& r, double t_min, double t_max, hit_record& rec)con
 	direction[1] = cos_theta * r.direction()[1] + sin_theta * r.direction()[2];
 	direction[2] = -sin_theta * r.direction()[1] + cos_theta * r.direction()[2];
 
-	ray rotated_r(origin, direction, r.time());
+	return ray(origin, direction, r.time());
+}
+bool rotate_x::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_instance]++);
+	return ptr->occluded(to_object(r), t_min, t_max);
+}
+bool rotate_x::hit(const ray& r, double t_min, double t_max, hit_record& rec)const {
+	RT_STAT(primitive_tests[prim_instance]++);
+	ray rotated_r = to_object(r);
 
 	if (!ptr->hit(rotated_r, t_min, t_max, rec))
 		return false;
@@ -163,10 +378,19 @@ public:
 	rotate_y(shared_ptr<hittable> p, double angle);
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		output_box = bbox;
 		return hasbox;
 	}
+	virtual void refit(double time0, double time1) override {
+		ptr->refit(time0, time1);
+		update_box(time0, time1);
+	}
+	virtual bool hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const override {
+		RT_STAT(primitive_tests[prim_instance]++);
+		return ptr->hit_interval(to_object(r), t_min, t_max, inside);
+	}
 
 public:
 	shared_ptr<hittable> ptr; 
@@ -174,13 +398,27 @@ public:
 	double cos_theta; 
 	bool hasbox; 
 	aabb bbox;
+
+private:
+	/// <summary>
+	/// Rotates a world space ray into the space of the wrapped object
+	/// </summary>
+	ray to_object(const ray& r) const;
+
+	/// <summary>
+	/// Box around the rotated box of the wrapped object over [time0, time1]
+	/// </summary>
+	void update_box(double time0, double time1);
 };
 
 rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 	auto radians = degrees_to_radians(angle); 
 	sin_theta = sin(radians); 
 	cos_theta = cos(radians); 
-	hasbox = ptr->bounding_box(0, 1, bbox);
+	update_box(0, 1);
+}
+void rotate_y::update_box(double time0, double time1) {
+	hasbox = ptr->bounding_box(time0, time1, bbox);
 
 	point3 min(infinity, infinity, infinity); 
 	point3 max(-infinity, -infinity, -infinity);
@@ -207,7 +445,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 
 	bbox = aabb(min, max);
 }
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+ray rotate_y::to_object(const ray& r) const {
 	auto origin = r.origin(); 
 	auto direction = r.direction();
 
@@ -217,7 +455,15 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
 	direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-	ray rotated_r(origin, direction, r.time()); 
+	return ray(origin, direction, r.time());
+}
+bool rotate_y::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_instance]++);
+	return ptr->occluded(to_object(r), t_min, t_max);
+}
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_instance]++);
+	ray rotated_r = to_object(r); 
 
 	if (!ptr->hit(rotated_r, t_min, t_max, rec))
 		return false;
@@ -243,10 +489,19 @@ public:
 	rotate_z(shared_ptr<hittable> p, double angle);
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		output_box = bbox;
 		return hasbox;
 	}
+	virtual void refit(double time0, double time1) override {
+		ptr->refit(time0, time1);
+		update_box(time0, time1);
+	}
+	virtual bool hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const override {
+		RT_STAT(primitive_tests[prim_instance]++);
+		return ptr->hit_interval(to_object(r), t_min, t_max, inside);
+	}
 
 public: 
 	shared_ptr<hittable> ptr; 
@@ -254,13 +509,27 @@ public:
 	double cos_theta;
 	bool hasbox;
 	aabb bbox;
+
+private:
+	/// <summary>
+	/// Rotates a world space ray into the space of the wrapped object
+	/// </summary>
+	ray to_object(const ray& r) const;
+
+	/// <summary>
+	/// Box around the rotated box of the wrapped object over [time0, time1]
+	/// </summary>
+	void update_box(double time0, double time1);
 };
 
 rotate_z::rotate_z(shared_ptr<hittable> p, double angle) : ptr(p) {
 	auto radians = degrees_to_radians(angle);
 	sin_theta = sin(radians);
 	cos_theta = cos(radians);
-	hasbox = ptr->bounding_box(0, 1, bbox);
+	update_box(0, 1);
+}
+void rotate_z::update_box(double time0, double time1) {
+	hasbox = ptr->bounding_box(time0, time1, bbox);
 
 	point3 min(infinity, infinity, infinity);
 	point3 max(-infinity, -infinity, -infinity);
@@ -287,7 +556,7 @@ rotate_z::rotate_z(shared_ptr<hittable> p, double angle) : ptr(p) {
 
 	bbox = aabb(min, max);
 }
-bool rotate_z::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+ray rotate_z::to_object(const ray& r) const {
 	auto origin = r.origin();
 	auto direction = r.direction();
 
@@ -297,7 +566,15 @@ bool rotate_z::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	direction[0] = cos_theta * r.direction()[0] + sin_theta * r.direction()[1];
 	direction[1] = -sin_theta * r.direction()[0] + cos_theta * r.direction()[1];
 
-	ray rotated_r(origin, direction, r.time());
+	return ray(origin, direction, r.time());
+}
+bool rotate_z::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_instance]++);
+	return ptr->occluded(to_object(r), t_min, t_max);
+}
+bool rotate_z::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_instance]++);
+	ray rotated_r = to_object(r);
 
 	if (!ptr->hit(rotated_r, t_min, t_max, rec))
 		return false;
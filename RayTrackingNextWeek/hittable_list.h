@@ -23,8 +23,16 @@ public:
 	void add(shared_ptr<hittable> object) {objects.push_back(object); }
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual void hit_packet(const ray_packet& p, int active, double t_min, packet_hits& hits) const override;
+	virtual int occluded_packet(const ray_packet& p, int active, double t_min, const double* t_max) const override;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool motion_bounds(double time0, double time1, aabb& box0, aabb& box1) const override;
+	virtual void refit(double time0, double time1) override {
+		for (const auto& object : objects)
+			object->refit(time0, time1);
+	}
 
 public:
 	std::vector<shared_ptr<hittable>> objects;
@@ -57,6 +65,36 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 	return hit_anything;
 }
 
+/// <summary>
+/// Returns true at the first object that intersects the ray in [t_min, t_max]
+/// </summary>
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+	for (const auto& object : objects) {
+		if (object->occluded(r, t_min, t_max))
+			return true;
+	}
+	return false;
+}
+
+/// <summary>
+/// Passes the packet on to every object, so objects with a packet
+/// traversal (eg. a bvh_wide) keep tracing it as a packet
+/// </summary>
+void hittable_list::hit_packet(const ray_packet& p, int active, double t_min, packet_hits& hits) const {
+	for (const auto& object : objects)
+		object->hit_packet(p, active, t_min, hits);
+}
+
+int hittable_list::occluded_packet(const ray_packet& p, int active, double t_min, const double* t_max) const {
+	int mask = 0;
+	for (const auto& object : objects) {
+		mask |= object->occluded_packet(p, active & ~mask, t_min, t_max);
+		if ((active & ~mask) == 0)
+			break;
+	}
+	return mask;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const {
 	if (objects.empty())
 		return false; 
@@ -68,7 +106,25 @@ bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) c
 		if (!object->bounding_box(time0, time1, temp_box))
 			return false;
 		output_box = first_box ? temp_box : surrounding_box(output_box, temp_box);
-		first_box = true;
+		first_box = false;
+	}
+
+	return true;
+}
+
+bool hittable_list::motion_bounds(double time0, double time1, aabb& box0, aabb& box1) const {
+	if (objects.empty())
+		return false;
+
+	aabb temp_box0, temp_box1;
+	bool first_box = true;
+
+	for (const auto& object : objects) {
+		if (!object->motion_bounds(time0, time1, temp_box0, temp_box1))
+			return false;
+		box0 = first_box ? temp_box0 : surrounding_box(box0, temp_box0);
+		box1 = first_box ? temp_box1 : surrounding_box(box1, temp_box1);
+		first_box = false;
 	}
 
 	return true;
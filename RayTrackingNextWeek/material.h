@@ -1,6 +1,8 @@
 #pragma once
 #include "rtweekend.h"
 #include "texture.h"
+#include "sampler.h"
+#include "stats.h"
 
 struct hit_record; 
 
@@ -16,16 +18,17 @@ public:
 
 class lambertian : public material {
 public: 
-	lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
+	lambertian(const color& a) : albedo(make_scene_object<solid_color>(a)) {}
 	lambertian(shared_ptr<texture> a) : albedo(a) {}
 
 
 	virtual bool scatter(const ray& r_in, const hit_record& rec,
 		color& attenuation, ray& scattered) const override {
+		RT_STAT(shading_calls[mat_lambertian]++);
 		
 		// Diffuse scatter methods. Change for different diffuse methods. PICK ONE ONLY!!!!
 		//auto scatter_direction = rec.normal + random_in_unit_sphere();
-		auto scatter_direction = rec.normal + random_unit_vector(); 
+		auto scatter_direction = rec.normal + sample_unit_vector(); 
 		//auto scatter_direction = random_in_hemisphere(rec.normal);
 		
 		// Catch degenerate scatter direction 
@@ -43,13 +46,14 @@ public:
 
 class metal : public material {
 public: 
-	metal(const color& a, double f) : albedo(make_shared<solid_color>(a)), fuzz (f < 1 ? f: 1) {}
+	metal(const color& a, double f) : albedo(make_scene_object<solid_color>(a)), fuzz (f < 1 ? f: 1) {}
 
 	metal(shared_ptr<texture> a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+		RT_STAT(shading_calls[mat_metal]++);
 		vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal); 
-		scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+		scattered = ray(rec.p, reflected + fuzz * sample_in_unit_sphere(), r_in.time());
 		attenuation = albedo->value(rec.u,rec.v, rec.p); 
 		return (dot(scattered.direction(), rec.normal) > 0.0);
 	}
@@ -64,6 +68,7 @@ public:
 	dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+		RT_STAT(shading_calls[mat_dielectric]++);
 		attenuation = color(1.0, 1.0, 1.0); 
 		double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
@@ -75,7 +80,7 @@ public:
 		bool cannot_refract = refraction_ratio * sin_theta > 1.0; 
 		vec3 direction; 
 
-		if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+		if (cannot_refract || reflectance(cos_theta, refraction_ratio) > sample_1d())
 			direction = reflect(unit_direction, rec.normal); 
 		else 
 			direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -92,7 +97,7 @@ private:
 		// Use Schlick's approximation for reflectance.
 		auto r0 = (1 - ref_idx) / (1 + ref_idx); 
 		r0 = r0 * r0; 
-		return r0 + (1 - r0) * pow((1 - cosine), 5);
+		return r0 + (1 - r0) * rt_pow5(1 - cosine);
 	}
 };
 
@@ -100,10 +105,11 @@ class diffuse_light : public material{
 
 public:
 	diffuse_light(shared_ptr<texture> a) : emit(a) {}
-	diffuse_light(color c) : emit(make_shared <solid_color>(c)) {} 
+	diffuse_light(color c) : emit(make_scene_object<solid_color>(c)) {} 
 
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override 
 	{
+		RT_STAT(shading_calls[mat_diffuse_light]++);
 		return false;
 	}
 	
@@ -119,11 +125,12 @@ public:
 
 class isotropic : public material {
 public: 
-	isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
+	isotropic(color c) : albedo(make_scene_object<solid_color>(c)) {}
 	isotropic(shared_ptr<texture> a) : albedo(a) {}
 
 	virtual bool scatter(const ray& r, const hit_record& rec, color& attenuation, ray& scattered) const override {
-		scattered = ray(rec.p, random_in_unit_sphere(), r.time());
+		RT_STAT(shading_calls[mat_isotropic]++);
+		scattered = ray(rec.p, sample_unit_vector(), r.time());
 		attenuation = albedo->value(rec.u, rec.v, rec.p);
 		return true;
 	}
@@ -0,0 +1,70 @@
+#pragma once
+#include <vector>
+
+#include "rtweekend.h"
+
+struct vec3_keyframe {
+	double time;
+	vec3 value;
+};
+
+/// <summary>
+/// Piecewise linear animation of a vec3 (eg. a center or an offset).
+/// Keys must be sorted by time. Before the first and after the last key
+/// the first and last segments are extended, which matches the two key
+/// behaviour of moving_sphere.
+/// </summary>
+class keyframe_track {
+public:
+	keyframe_track() : keys{ { 0.0, vec3(0, 0, 0) } } {}
+	keyframe_track(const vec3& constant) : keys{ { 0.0, constant } } {}
+	keyframe_track(const std::vector<vec3_keyframe>& _keys) : keys(_keys) {
+		if (keys.empty())
+			keys.push_back({ 0.0, vec3(0, 0, 0) });
+	}
+
+	bool is_static() const { return keys.size() == 1; }
+	size_t key_count() const { return keys.size(); }
+	const vec3_keyframe& key(size_t k) const { return keys[k]; }
+
+	vec3 at(double time) const {
+		if (keys.size() == 1)
+			return keys[0].value;
+
+		// Find the segment containing time, clamped to the first/last segment
+		size_t k = 0;
+		while (k + 2 < keys.size() && time > keys[k + 1].time)
+			k++;
+
+		const auto& a = keys[k];
+		const auto& b = keys[k + 1];
+		auto f = (time - a.time) / (b.time - a.time);
+		return a.value + f * (b.value - a.value);
+	}
+
+	/// <summary>
+	/// Largest per axis distance between the track and the straight line from
+	/// at(time0) to at(time1), for times in [time0, time1]. The track is piecewise
+	/// linear, so the largest distance is found at one of the interior keys.
+	/// </summary>
+	vec3 max_deviation(double time0, double time1) const {
+		vec3 deviation(0, 0, 0);
+		if (keys.size() <= 2 || time1 <= time0)
+			return deviation;
+
+		auto start = at(time0);
+		auto end = at(time1);
+		for (const auto& k : keys) {
+			if (k.time <= time0 || k.time >= time1)
+				continue;
+			auto f = (k.time - time0) / (time1 - time0);
+			auto d = k.value - (start + f * (end - start));
+			for (int a = 0; a < 3; a++)
+				deviation[a] = fmax(deviation[a], fabs(d[a]));
+		}
+		return deviation;
+	}
+
+private:
+	std::vector<vec3_keyframe> keys;
+};
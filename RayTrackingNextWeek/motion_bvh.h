@@ -0,0 +1,193 @@
+#pragma once
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "stats.h"
+#include <algorithm>
+#include <vector>
+
+/// <summary>
+/// BVH whose node bounds move with the objects over the shutter interval.
+/// The interval [time0, time1] is split into time_steps equal segments. Every node stores
+/// a box at the start and at the end of each segment and interpolates them at r.time(),
+/// so a ray only tests the space the objects occupy at its own time instead of the
+/// whole swept volume. With one time step this is a plain open/close motion BVH;
+/// more steps tighten the bounds of keyframed objects with more than two keys.
+/// </summary>
+class motion_bvh_node : public hittable {
+public:
+	/// <summary>
+	///
+	/// </summary>
+	/// <param name="list"></param>
+	/// <param name="time0">shutter open</param>
+	/// <param name="time1">shutter close</param>
+	/// <param name="time_steps">number of segments the shutter interval is split into</param>
+	motion_bvh_node(const hittable_list& list, double time0, double time1, int time_steps = 1)
+		: motion_bvh_node(std::vector<shared_ptr<hittable>>(list.objects), 0, list.objects.size(),
+						  time0, time1, time_steps)
+	{}
+
+	/// <summary>
+	/// Builds the node over objects[start, end). Reorders that range in place,
+	/// so the object array is shared by the whole build instead of copied per node.
+	/// </summary>
+	motion_bvh_node(std::vector<shared_ptr<hittable>>&& objects,
+					size_t start, size_t end, double time0, double time1, int time_steps)
+		: motion_bvh_node(objects, start, end, time0, time1, time_steps)
+	{}
+
+	motion_bvh_node(std::vector<shared_ptr<hittable>>& objects,
+					size_t start, size_t end, double time0, double time1, int time_steps);
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool motion_bounds(double time0, double time1, aabb& box0, aabb& box1) const override;
+
+	/// <summary>
+	/// Moves the node's time segments to the new shutter interval and recomputes their bounds
+	/// </summary>
+	virtual void refit(double time0, double time1) override;
+
+	/// <summary>
+	/// Box of the node at a given time
+	/// </summary>
+	aabb box_at(double time) const;
+
+public:
+	shared_ptr<hittable> left;
+	shared_ptr<hittable> right;
+	double time0, time1;
+	int time_steps;
+	std::vector<aabb> bounds;	// start and end box of every time segment
+	aabb swept_box;				// union of all bounds, returned by bounding_box()
+
+private:
+	double segment_start(int s) const { return time0 + (time1 - time0) * s / time_steps; }
+	void compute_bounds();
+};
+
+aabb motion_bvh_node::box_at(double time) const {
+	// Outside the shutter interval objects may be anywhere the swept box allows.
+	if (time < time0 || time > time1 || time1 <= time0)
+		return swept_box;
+
+	auto x = (time - time0) / (time1 - time0) * time_steps;
+	int s = std::min(static_cast<int>(x), time_steps - 1);
+	return lerp_box(bounds[2 * s], bounds[2 * s + 1], x - s);
+}
+
+bool motion_bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(bvh_nodes_visited++);
+	if (!box_at(r.time()).hit(r, t_min, t_max))
+		return false;
+
+	bool hit_left = left->hit(r, t_min, t_max, rec);
+	if (right == left)
+		return hit_left;
+	bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+
+	return hit_left || hit_right;
+}
+
+bool motion_bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(bvh_nodes_visited++);
+	if (!box_at(r.time()).hit(r, t_min, t_max))
+		return false;
+
+	return left->occluded(r, t_min, t_max)
+		|| (right != left && right->occluded(r, t_min, t_max));
+}
+
+bool motion_bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
+	output_box = swept_box;
+	return true;
+}
+
+bool motion_bvh_node::motion_bounds(double t0, double t1, aabb& box0, aabb& box1) const {
+	// Exact when both times fall inside one segment, otherwise fall back to the swept box
+	if (t0 >= time0 && t1 <= time1 && time1 > time0) {
+		auto x0 = (t0 - time0) / (time1 - time0) * time_steps;
+		auto x1 = (t1 - time0) / (time1 - time0) * time_steps;
+		int s0 = std::min(static_cast<int>(x0), time_steps - 1);
+		int s1 = std::min(static_cast<int>(x1), time_steps - 1);
+		if (s0 == s1 || (s1 == s0 + 1 && x1 == s1)) {
+			box0 = lerp_box(bounds[2 * s0], bounds[2 * s0 + 1], x0 - s0);
+			box1 = lerp_box(bounds[2 * s0], bounds[2 * s0 + 1], x1 - s0);
+			return true;
+		}
+	}
+
+	box0 = box1 = swept_box;
+	return true;
+}
+
+void motion_bvh_node::refit(double t0, double t1) {
+	left->refit(t0, t1);
+	if (right != left)
+		right->refit(t0, t1);
+	time0 = t0;
+	time1 = t1;
+	compute_bounds();
+}
+
+void motion_bvh_node::compute_bounds() {
+	bounds.resize(2 * static_cast<size_t>(time_steps));
+
+	for (int s = 0; s < time_steps; s++) {
+		aabb left0, left1, right0, right1;
+		auto ta = segment_start(s);
+		auto tb = segment_start(s + 1);
+
+		if (!left->motion_bounds(ta, tb, left0, left1)
+			|| !right->motion_bounds(ta, tb, right0, right1))
+		{
+			std::cerr << "No bounding box in motion_bvh_node constructor. \n";
+		}
+
+		bounds[2 * s] = surrounding_box(left0, right0);
+		bounds[2 * s + 1] = surrounding_box(left1, right1);
+	}
+
+	swept_box = bounds[0];
+	for (const auto& b : bounds)
+		swept_box = surrounding_box(swept_box, b);
+}
+
+motion_bvh_node::motion_bvh_node(std::vector<shared_ptr<hittable>>& objects,
+	size_t start, size_t end, double _time0, double _time1, int _time_steps)
+	: time0(_time0), time1(_time1), time_steps(_time_steps > 0 ? _time_steps : 1) {
+
+	// Same split as bvh_node, so both trees have the same shape and only the bounds differ
+	int axis = random_int(0, 2);
+	auto comparator = (axis == 0) ? box_x_compare
+					: (axis == 1) ? box_y_compare
+								  : box_z_compare;
+
+	size_t object_span = end - start;
+
+	if (object_span == 1) {
+		left = right = objects[start];
+	}
+	else if (object_span == 2) {
+		if (comparator(objects[start], objects[start + 1])) {
+			left = objects[start];
+			right = objects[start + 1];
+		}
+		else {
+			left = objects[start + 1];
+			right = objects[start];
+		}
+	}
+	else {
+		std::sort(objects.begin() + start, objects.begin() + end, comparator);
+
+		auto mid = start + object_span / 2;
+		left = make_shared<motion_bvh_node>(objects, start, mid, time0, time1, time_steps);
+		right = make_shared<motion_bvh_node>(objects, mid, end, time0, time1, time_steps);
+	}
+
+	compute_bounds();
+}
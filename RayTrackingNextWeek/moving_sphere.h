@@ -1,17 +1,34 @@
 #pragma once
 #include "rtweekend.h"
 #include "hittable.h"
+#include "motion.h"
 
 class moving_sphere : public hittable {
 public:
 	// Constructors
 	moving_sphere() {}
 	moving_sphere(point3 cen0, point3 cen1, double _time0, double _time1, double r, shared_ptr<material> m)
-		: center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m) 
+		: center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m),
+		  path(std::vector<vec3_keyframe>{ { _time0, cen0 }, { _time1, cen1 } })
+	{};
+
+	/// <summary>
+	/// Sphere whose center follows a keyframed path with any number of keys
+	/// </summary>
+	/// <param name="_path"></param>
+	/// <param name="r"></param>
+	/// <param name="m"></param>
+	moving_sphere(const keyframe_track& _path, double r, shared_ptr<material> m)
+		: center0(_path.key(0).value), center1(_path.key(_path.key_count() - 1).value),
+		  time0(_path.key(0).time), time1(_path.key(_path.key_count() - 1).time),
+		  radius(r), mat_ptr(m), path(_path)
 	{};
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool motion_bounds(double time0, double time1, aabb& box0, aabb& box1) const override;
 
 	point3 center(double time) const;
 
@@ -20,13 +37,15 @@ public:
 	double time0, time1; 
 	double radius;
 	shared_ptr<material> mat_ptr; 
+	keyframe_track path;
 };
 
 point3 moving_sphere::center(double time) const {
-	return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
+	return path.at(time);
 }
 
 bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	RT_STAT(primitive_tests[prim_moving_sphere]++);
 	vec3 oc = r.origin() - center(r.time());
 	auto a = r.direction().length_squared(); 
 	auto half_b = dot(oc, r.direction()); 
@@ -49,11 +68,30 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
 	rec.p = r.at(rec.t);
 	auto outward_normal = (rec.p - center(r.time())) / radius; 
 	rec.set_face_normal(r, outward_normal); 
-	rec.mat_ptr = mat_ptr;
+	rec.mat_ptr = mat_ptr.get();
 
 	return true; 
 }
 
+bool moving_sphere::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_moving_sphere]++);
+	vec3 oc = r.origin() - center(r.time());
+	auto a = r.direction().length_squared();
+	auto half_b = dot(oc, r.direction());
+	auto c = oc.length_squared() - radius * radius;
+
+	auto discriminant = half_b * half_b - a * c;
+	if (discriminant < 0)
+		return false;
+
+	auto sqrtd = sqrt(discriminant);
+	auto root = (-half_b - sqrtd) / a;
+	if (root >= t_min && root <= t_max)
+		return true;
+	root = (-half_b + sqrtd) / a;
+	return root >= t_min && root <= t_max;
+}
+
 bool moving_sphere::bounding_box(double time0, double time1, aabb& output_box) const {
 	aabb box0(center(time0) - vec3(radius, radius, radius),
 			  center(time0) + vec3(radius, radius, radius));
@@ -62,5 +100,40 @@ bool moving_sphere::bounding_box(double time0, double time1, aabb& output_box) c
 			  center(time1) + vec3(radius, radius, radius));
 
 	output_box = surrounding_box(box0, box1);
+
+	// Keys inside the interval can reach outside of the boxes at its ends
+	for (size_t k = 0; k < path.key_count(); k++) {
+		const auto& key = path.key(k);
+		if (key.time > time0 && key.time < time1)
+			output_box = surrounding_box(output_box, aabb(key.value - vec3(radius, radius, radius),
+														  key.value + vec3(radius, radius, radius)));
+	}
 	return true;
-}
\ No newline at end of file
+}
+
+bool moving_sphere::motion_bounds(double time0, double time1, aabb& box0, aabb& box1) const {
+	auto extent = vec3(radius, radius, radius) + path.max_deviation(time0, time1);
+
+	box0 = aabb(center(time0) - extent, center(time0) + extent);
+	box1 = aabb(center(time1) - extent, center(time1) + extent);
+	return true;
+}
+
+/// <summary>
+/// Both roots of the ray-sphere quadratic, the part of the ray between them is inside
+/// </summary>
+bool moving_sphere::hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const {
+	RT_STAT(primitive_tests[prim_moving_sphere]++);
+	inside.count = 0;
+	vec3 oc = r.origin() - center(r.time());
+	auto a = r.direction().length_squared();
+	auto half_b = dot(oc, r.direction());
+	auto c = oc.length_squared() - radius * radius;
+
+	auto discriminant = half_b * half_b - a * c;
+	if (discriminant < 0)
+		return false;
+	auto sqrtd = sqrt(discriminant);
+
+	return inside.add((-half_b - sqrtd) / a, (-half_b + sqrtd) / a, t_min, t_max);
+}
@@ -0,0 +1,189 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "rtweekend.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define RT_PACKET_SSE 1
+#endif
+
+const int packet_width = 8;	// rays per packet, a multiple of 4 (one SSE register)
+const float slab_far_scale = 1.0f + 2.0f * 3.0f * 5.96e-8f;	// 1 + 2 gamma(3), absorbs float rounding of the slab test
+
+/// <summary>
+/// Inverse of a direction component as float. Components close to zero are replaced
+/// by a tiny signed value, so the inverse is large but finite and slab products never
+/// produce NaN (0 * inf) for axis parallel rays.
+/// </summary>
+inline float safe_inverse(double d) {
+	if (fabs(d) < 1e-30)
+		d = d < 0 ? -1e-30 : 1e-30;
+	return static_cast<float>(1.0 / d);
+}
+
+/// <summary>
+/// Number of lanes set in a packet mask
+/// </summary>
+inline int lane_count(int mask) {
+	int n = 0;
+	for (; mask; mask &= mask - 1)
+		n++;
+	return n;
+}
+
+/// <summary>
+/// Up to packet_width coherent rays traced together (eg. neighbouring pinhole camera
+/// rays, or shadow rays towards one point). Keeps float SoA copies for the SIMD lane
+/// tests and the per-axis interval of origins and inverse directions for culling
+/// whole nodes with one test. Call finalize() after filling rays and count.
+/// </summary>
+struct ray_packet {
+	ray rays[packet_width];
+	int count = 0;
+
+	alignas(16) float ox[packet_width], oy[packet_width], oz[packet_width];
+	alignas(16) float dx[packet_width], dy[packet_width], dz[packet_width];
+	alignas(16) float ix[packet_width], iy[packet_width], iz[packet_width];
+
+	float org_lo[3], org_hi[3];
+	float inv_lo[3], inv_hi[3];
+	bool inv_same_sign[3];
+
+	int full_mask() const { return (1 << count) - 1; }
+
+	void finalize() {
+		for (int k = 0; k < packet_width; k++) {
+			// unused lanes repeat lane 0, they are masked off anyway
+			const ray& r = rays[k < count ? k : 0];
+			ox[k] = static_cast<float>(r.origin().x());
+			oy[k] = static_cast<float>(r.origin().y());
+			oz[k] = static_cast<float>(r.origin().z());
+			dx[k] = static_cast<float>(r.direction().x());
+			dy[k] = static_cast<float>(r.direction().y());
+			dz[k] = static_cast<float>(r.direction().z());
+			ix[k] = safe_inverse(r.direction().x());
+			iy[k] = safe_inverse(r.direction().y());
+			iz[k] = safe_inverse(r.direction().z());
+		}
+
+		const float* org[3] = { ox, oy, oz };
+		const float* inv[3] = { ix, iy, iz };
+		for (int a = 0; a < 3; a++) {
+			org_lo[a] = *std::min_element(org[a], org[a] + packet_width);
+			org_hi[a] = *std::max_element(org[a], org[a] + packet_width);
+			inv_lo[a] = *std::min_element(inv[a], inv[a] + packet_width);
+			inv_hi[a] = *std::max_element(inv[a], inv[a] + packet_width);
+			inv_same_sign[a] = (inv_lo[a] > 0) == (inv_hi[a] > 0);
+		}
+	}
+};
+
+/// <summary>
+/// Lanes of active whose closest hit so far (t_max) is not nearer than dist
+/// </summary>
+inline int lanes_not_beyond(int active, const float* t_max, float dist) {
+#ifdef RT_PACKET_SSE
+	int mask = 0;
+	const __m128 d = _mm_set1_ps(dist);
+	for (int g = 0; g < packet_width; g += 4)
+		mask |= _mm_movemask_ps(_mm_cmple_ps(d, _mm_load_ps(t_max + g))) << g;
+	return mask & active;
+#else
+	int mask = 0;
+	for (int k = 0; k < packet_width; k++) {
+		if (dist <= t_max[k])
+			mask |= 1 << k;
+	}
+	return mask & active;
+#endif
+}
+
+/// <summary>
+/// Interval arithmetic (frustum) test of a box against the whole packet. Gives a lower
+/// bound of every ray's entry distance and an upper bound of every exit distance; returns
+/// false only if no ray of the packet can hit the box. Axes where the directions differ
+/// in sign are skipped, which keeps the test conservative.
+/// </summary>
+inline bool packet_may_hit_box(const ray_packet& p, const float lo[3], const float hi[3],
+							   float t_min, float t_max) {
+	float enter = t_min;
+	float exit = t_max;
+	for (int a = 0; a < 3; a++) {
+		if (!p.inv_same_sign[a])
+			continue;
+		// (lo - o) and (hi - o) over the origin interval, times the inverse direction interval
+		const float d0_lo = lo[a] - p.org_hi[a], d0_hi = lo[a] - p.org_lo[a];
+		const float d1_lo = hi[a] - p.org_hi[a], d1_hi = hi[a] - p.org_lo[a];
+		const float t0[4] = { d0_lo * p.inv_lo[a], d0_lo * p.inv_hi[a], d0_hi * p.inv_lo[a], d0_hi * p.inv_hi[a] };
+		const float t1[4] = { d1_lo * p.inv_lo[a], d1_lo * p.inv_hi[a], d1_hi * p.inv_lo[a], d1_hi * p.inv_hi[a] };
+		const float t0_lo = std::min(std::min(t0[0], t0[1]), std::min(t0[2], t0[3]));
+		const float t0_hi = std::max(std::max(t0[0], t0[1]), std::max(t0[2], t0[3]));
+		const float t1_lo = std::min(std::min(t1[0], t1[1]), std::min(t1[2], t1[3]));
+		const float t1_hi = std::max(std::max(t1[0], t1[1]), std::max(t1[2], t1[3]));
+		enter = std::max(enter, std::min(t0_lo, t1_lo));
+		exit = std::min(exit, std::max(t0_hi, t1_hi));
+	}
+	return enter <= exit * slab_far_scale;
+}
+
+/// <summary>
+/// Slab test of one box against every lane of the packet. Returns the mask of active
+/// lanes that hit the box and the smallest entry distance among them in nearest.
+/// t_max holds each lane's current closest hit.
+/// </summary>
+inline int packet_box_mask(const ray_packet& p, int active, const float lo[3], const float hi[3],
+						   float t_min, const float* t_max, float& nearest) {
+	int mask = 0;
+#ifdef RT_PACKET_SSE
+	const __m128 lo_x = _mm_set1_ps(lo[0]), lo_y = _mm_set1_ps(lo[1]), lo_z = _mm_set1_ps(lo[2]);
+	const __m128 hi_x = _mm_set1_ps(hi[0]), hi_y = _mm_set1_ps(hi[1]), hi_z = _mm_set1_ps(hi[2]);
+	const __m128i lane_bits = _mm_set_epi32(8, 4, 2, 1);
+	__m128 nearest4 = _mm_set1_ps(std::numeric_limits<float>::infinity());
+	for (int g = 0; g < packet_width; g += 4) {
+		const __m128 ox = _mm_load_ps(p.ox + g), oy = _mm_load_ps(p.oy + g), oz = _mm_load_ps(p.oz + g);
+		const __m128 ix = _mm_load_ps(p.ix + g), iy = _mm_load_ps(p.iy + g), iz = _mm_load_ps(p.iz + g);
+
+		const __m128 t0x = _mm_mul_ps(_mm_sub_ps(lo_x, ox), ix), t1x = _mm_mul_ps(_mm_sub_ps(hi_x, ox), ix);
+		const __m128 t0y = _mm_mul_ps(_mm_sub_ps(lo_y, oy), iy), t1y = _mm_mul_ps(_mm_sub_ps(hi_y, oy), iy);
+		const __m128 t0z = _mm_mul_ps(_mm_sub_ps(lo_z, oz), iz), t1z = _mm_mul_ps(_mm_sub_ps(hi_z, oz), iz);
+
+		const __m128 enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+										_mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(t_min)));
+		__m128 exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+								 _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_loadu_ps(t_max + g)));
+		exit = _mm_mul_ps(exit, _mm_set1_ps(slab_far_scale));
+
+		// Hit lanes that are also active; inactive lanes do not count for nearest
+		const __m128 active4 = _mm_castsi128_ps(_mm_cmpeq_epi32(
+			_mm_and_si128(_mm_set1_epi32(active >> g), lane_bits), lane_bits));
+		const __m128 hit4 = _mm_and_ps(_mm_cmple_ps(enter, exit), active4);
+		nearest4 = _mm_min_ps(nearest4, _mm_or_ps(_mm_and_ps(hit4, enter), _mm_andnot_ps(hit4, nearest4)));
+		mask |= _mm_movemask_ps(hit4) << g;
+	}
+	nearest4 = _mm_min_ps(nearest4, _mm_shuffle_ps(nearest4, nearest4, _MM_SHUFFLE(1, 0, 3, 2)));
+	nearest4 = _mm_min_ps(nearest4, _mm_shuffle_ps(nearest4, nearest4, _MM_SHUFFLE(2, 3, 0, 1)));
+	nearest = _mm_cvtss_f32(nearest4);
+#else
+	nearest = std::numeric_limits<float>::infinity();
+	for (int k = 0; k < packet_width; k++) {
+		const float o[3] = { p.ox[k], p.oy[k], p.oz[k] };
+		const float inv[3] = { p.ix[k], p.iy[k], p.iz[k] };
+		float enter = t_min;
+		float exit = t_max[k];
+		for (int a = 0; a < 3; a++) {
+			float t0 = (lo[a] - o[a]) * inv[a];
+			float t1 = (hi[a] - o[a]) * inv[a];
+			enter = std::max(enter, std::min(t0, t1));
+			exit = std::min(exit, std::max(t0, t1));
+		}
+		if (enter <= exit * slab_far_scale && (active & (1 << k))) {
+			mask |= 1 << k;
+			nearest = std::min(nearest, enter);
+		}
+	}
+#endif
+	return mask;
+}
@@ -0,0 +1,306 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "material.h"
+#include "box.h"
+#include "heightfield.h"
+
+// Generated scenes
+// --------------------------
+// Scenes of any number of primitives for scalability tests: build time, memory and ray
+// throughput against primitive count. Every generator draws from its own fixed-seed
+// scene_random instead of rand(), so a scene of a given size is always the same, no matter
+// what was built before it or on which thread. The objects spread over a volume (or an
+// area) that grows with the count, so the density of the scene stays the same.
+
+/// <summary>
+/// splitmix64 generator of the scene generators
+/// </summary>
+struct scene_random {
+	explicit scene_random(uint64_t seed) : state(seed) {}
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	// Real in [0,1)
+	double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+	double uniform(double min, double max) { return min + (max - min) * uniform(); }
+	size_t index(size_t count) { return static_cast<size_t>(uniform() * count); }
+
+	// Standard normal, Box-Muller
+	double gaussian() {
+		const double u = 1.0 - uniform();
+		return std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * pi * uniform());
+	}
+
+	point3 in_box(const point3& lo, const point3& hi) {
+		return point3(uniform(lo.x(), hi.x()), uniform(lo.y(), hi.y()), uniform(lo.z(), hi.z()));
+	}
+
+	uint64_t state;
+};
+
+/// <summary>
+/// Shared materials, so the memory of a generated scene is that of its geometry
+/// </summary>
+struct material_palette {
+	std::vector<shared_ptr<material>> materials;
+
+	/// <summary>
+	/// Mostly diffuse, some metal and a little glass, as random_scene
+	/// </summary>
+	explicit material_palette(scene_random& rng) {
+		for (int k = 0; k < 24; k++) {
+			const color a(rng.uniform(), rng.uniform(), rng.uniform());
+			const color b(rng.uniform(), rng.uniform(), rng.uniform());
+			materials.push_back(make_scene_object<lambertian>(a * b));
+		}
+		for (int k = 0; k < 6; k++) {
+			const color albedo(rng.uniform(0.5, 1), rng.uniform(0.5, 1), rng.uniform(0.5, 1));
+			materials.push_back(make_scene_object<metal>(albedo, rng.uniform(0, 0.5)));
+		}
+		materials.push_back(make_scene_object<dielectric>(1.5));
+		materials.push_back(make_scene_object<dielectric>(1.5));
+	}
+
+	const shared_ptr<material>& pick(scene_random& rng) const { return materials[rng.index(materials.size())]; }
+};
+
+/// <summary>
+/// Edge of a cube that holds count objects at one per spacing^3
+/// </summary>
+inline double generated_cube_side(size_t count, double spacing) {
+	return spacing * std::cbrt(static_cast<double>(std::max<size_t>(count, 1)));
+}
+
+/// <summary>
+/// Edge of a square that holds count objects at one per spacing^2
+/// </summary>
+inline double generated_square_side(size_t count, double spacing) {
+	return spacing * std::sqrt(static_cast<double>(std::max<size_t>(count, 1)));
+}
+
+/// <summary>
+/// Camera position that sees all of a cube of edge side centered on the origin
+/// </summary>
+inline point3 generated_volume_view(double side) {
+	return side * point3(1.0, 0.7, 1.4);
+}
+
+/// <summary>
+/// Camera position looking down over a square of edge side on the ground, centered on the origin
+/// </summary>
+inline point3 generated_plane_view(double side) {
+	return point3(0, 0.25 * side + 1, -0.7 * side);
+}
+
+/// <summary>
+/// Ground sphere whose top is the plane y = 0 and that is flat over a square of edge side
+/// </summary>
+inline shared_ptr<hittable> generated_ground(double side) {
+	const double radius = std::max(1000.0, 100.0 * side);
+	auto checker = make_scene_object<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+	return make_scene_object<sphere>(point3(0, -radius, 0), radius, make_scene_object<lambertian>(checker));
+}
+
+/// <summary>
+/// count random spheres of mixed materials, uniform in a cube centered on the origin
+/// </summary>
+hittable_list many_spheres(size_t count) {
+	scene_random rng(10);
+	material_palette palette(rng);
+	const double half = generated_cube_side(count, 2.0) / 2;
+
+	hittable_list world;
+	world.objects.reserve(count);
+	for (size_t k = 0; k < count; k++) {
+		const point3 center = rng.in_box(point3(-half, -half, -half), point3(half, half, half));
+		world.add(make_scene_object<sphere>(center, rng.uniform(0.2, 0.5), palette.pick(rng)));
+	}
+	return world;
+}
+
+/// <summary>
+/// count boxes on a square grid over a ground plane. The boxes are instances: translations
+/// of a few dozen rotated prototype boxes, so one box costs one small object.
+/// </summary>
+hittable_list instanced_boxes(size_t count) {
+	scene_random rng(11);
+	material_palette palette(rng);
+	const int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(std::max<size_t>(count, 1)))));
+	const double cell = 2.0;
+	const double half = columns * cell / 2;
+
+	// 8 shapes in 8 orientations
+	std::vector<shared_ptr<hittable>> prototypes;
+	for (int shape = 0; shape < 8; shape++) {
+		const double w = rng.uniform(0.4, 0.8), h = rng.uniform(0.5, 3.0), d = rng.uniform(0.4, 0.8);
+		auto prototype = make_scene_object<box>(point3(-w, 0, -d), point3(w, h, d), palette.pick(rng));
+		for (int angle = 0; angle < 8; angle++)
+			prototypes.push_back(make_scene_object<rotate_y>(prototype, angle * 11.25));
+	}
+
+	hittable_list world;
+	world.objects.reserve(count + 1);
+	world.add(generated_ground(2 * half));
+	for (size_t k = 0; k < count; k++) {
+		const double x = -half + (k % columns + 0.5) * cell + rng.uniform(-0.1, 0.1);
+		const double z = -half + (k / columns + 0.5) * cell + rng.uniform(-0.1, 0.1);
+		world.add(make_scene_object<translate>(prototypes[rng.index(prototypes.size())], vec3(x, 0, z)));
+	}
+	return world;
+}
+
+/// <summary>
+/// count small spheres in gaussian clusters of about 2000 spheres, with empty space between
+/// the clusters: the uneven distribution that median and SAH splits handle differently
+/// </summary>
+hittable_list clustered_spheres(size_t count) {
+	scene_random rng(12);
+	material_palette palette(rng);
+	const size_t clusters = std::max<size_t>(1, count / 2000);
+	const double half = generated_cube_side(count, 2.0) / 2;
+	const double spread = half / (2.0 * std::cbrt(static_cast<double>(clusters)));
+
+	std::vector<point3> centers;
+	for (size_t c = 0; c < clusters; c++)
+		centers.push_back(rng.in_box(point3(-half, -half, -half), point3(half, half, half)));
+
+	hittable_list world;
+	world.objects.reserve(count);
+	for (size_t k = 0; k < count; k++) {
+		const point3& center = centers[rng.index(centers.size())];
+		const point3 p = center + spread * vec3(rng.gaussian(), rng.gaussian(), rng.gaussian()) / 2;
+		world.add(make_scene_object<sphere>(p, rng.uniform(0.1, 0.3), palette.pick(rng)));
+	}
+	return world;
+}
+
+/// <summary>
+/// count large spheres packed into a small cube, so every point lies in many bounding boxes
+/// </summary>
+hittable_list dense_spheres(size_t count) {
+	scene_random rng(13);
+	material_palette palette(rng);
+	const double half = generated_cube_side(count, 0.5) / 2;
+
+	hittable_list world;
+	world.objects.reserve(count);
+	for (size_t k = 0; k < count; k++) {
+		const point3 center = rng.in_box(point3(-half, -half, -half), point3(half, half, half));
+		world.add(make_scene_object<sphere>(center, rng.uniform(0.4, 1.0), palette.pick(rng)));
+	}
+	return world;
+}
+
+/// <summary>
+/// count spheres on a ground plane as in random_scene, half of them moving during the shutter
+/// interval, for motion blur structures
+/// </summary>
+hittable_list moving_spheres(size_t count) {
+	scene_random rng(14);
+	material_palette palette(rng);
+	const double half = generated_square_side(count, 1.0) / 2;
+
+	hittable_list world;
+	world.objects.reserve(count + 1);
+	world.add(generated_ground(2 * half));
+	for (size_t k = 0; k < count; k++) {
+		const point3 center(rng.uniform(-half, half), 0.2, rng.uniform(-half, half));
+		if (k % 2 == 0) {
+			const vec3 motion(rng.uniform(-0.3, 0.3), rng.uniform(0, 0.5), rng.uniform(-0.3, 0.3));
+			world.add(make_scene_object<moving_sphere>(center, center + motion, 0.0, 1.0, 0.2, palette.pick(rng)));
+		}
+		else {
+			world.add(make_scene_object<sphere>(center, 0.2, palette.pick(rng)));
+		}
+	}
+	return world;
+}
+
+/// <summary>
+/// count small colored lights floating over a ground plane, the only light of the scene
+/// </summary>
+hittable_list many_lights(size_t count) {
+	scene_random rng(15);
+	const double half = generated_square_side(count, 2.0) / 2;
+
+	std::vector<shared_ptr<material>> lights;
+	for (int k = 0; k < 16; k++)
+		lights.push_back(make_scene_object<diffuse_light>(4.0 * color(rng.uniform(0.3, 1), rng.uniform(0.3, 1),
+																	  rng.uniform(0.3, 1))));
+
+	hittable_list world;
+	world.objects.reserve(count + 1);
+	world.add(generated_ground(2 * half));
+	for (size_t k = 0; k < count; k++) {
+		const point3 center(rng.uniform(-half, half), rng.uniform(0.5, 3.0), rng.uniform(-half, half));
+		world.add(make_scene_object<sphere>(center, rng.uniform(0.1, 0.3), lights[rng.index(lights.size())]));
+	}
+	return world;
+}
+
+/// <summary>
+/// Heights of a terrain of columns x columns cells of edge 1: rolling hills of 0.3 to 3
+/// with some roughness, cell (i, k) at [k * columns + i]
+/// </summary>
+std::vector<float> terrain_heights(int columns, scene_random& rng) {
+	std::vector<float> heights(static_cast<size_t>(columns) * columns);
+	for (int k = 0; k < columns; k++) {
+		for (int i = 0; i < columns; i++) {
+			const double hills = (0.5 + 0.5 * std::sin(0.11 * i + 1.3 * std::sin(0.05 * k)))
+				* (0.5 + 0.5 * std::cos(0.07 * k + 0.8 * std::sin(0.03 * i)));
+			heights[static_cast<size_t>(k) * columns + i] = static_cast<float>(0.3 + 2.4 * hills + rng.uniform(0, 0.3));
+		}
+	}
+	return heights;
+}
+
+/// <summary>
+/// Terrain of about count cells as one box_grid
+/// </summary>
+hittable_list terrain_grid(size_t count) {
+	scene_random rng(16);
+	const int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(std::max<size_t>(count, 1)))));
+	const double half = columns / 2.0;
+
+	hittable_list world;
+	world.add(make_scene_object<box_grid>(point3(-half, 0, -half), 1.0, 1.0, columns, columns,
+										  terrain_heights(columns, rng),
+										  make_scene_object<lambertian>(color(0.48, 0.83, 0.53))));
+	return world;
+}
+
+/// <summary>
+/// The terrain of terrain_grid as separate boxes, for comparing the two
+/// </summary>
+hittable_list terrain_boxes(size_t count) {
+	scene_random rng(16);
+	const int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(std::max<size_t>(count, 1)))));
+	const double half = columns / 2.0;
+	const std::vector<float> heights = terrain_heights(columns, rng);
+	auto ground = make_scene_object<lambertian>(color(0.48, 0.83, 0.53));
+
+	hittable_list world;
+	world.objects.reserve(heights.size());
+	for (int k = 0; k < columns; k++) {
+		for (int i = 0; i < columns; i++) {
+			const double x0 = -half + i * 1.0, z0 = -half + k * 1.0;
+			world.add(make_scene_object<box>(point3(x0, 0, z0),
+											 point3(x0 + 1.0, heights[static_cast<size_t>(k) * columns + i], z0 + 1.0),
+											 ground));
+		}
+	}
+	return world;
+}
@@ -0,0 +1,183 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "sampler.h"
+#include "renderer.h"
+#include "scene_accel.h"
+
+// Time-budgeted rendering
+// --------------------------
+// Renders the image in progressive passes of whole samples until a wall-clock budget is
+// used up. Each pass adds the samples [sample_begin, sample_end) to every pixel, so the
+// image after any pass is a complete render with that many samples. The throughput
+// measured so far predicts how long the next pass takes: a pass may use half of the time
+// left, and the last, partial pass adds one more sample to bands of rows for as long as
+// they still fit. Pixels can therefore end with one sample more than others, and every
+// pixel is divided by its own sample count.
+
+/// <summary>
+/// One pass of a time-budgeted render: samples [sample_begin, sample_end) of rows [y0, y1)
+/// </summary>
+struct budget_pass {
+	int sample_begin = 0, sample_end = 0;
+	int y0 = 0, y1 = 0;
+	double seconds = 0.0;
+};
+
+/// <summary>
+/// What a time-budgeted render achieved
+/// </summary>
+struct budget_report {
+	double budget_seconds = 0.0;
+	double seconds = 0.0;			// from the start of the render to the end of the last pass
+	double accel_build_seconds = 0.0;
+	std::vector<budget_pass> passes;
+	int min_spp = 0;
+	int max_spp = 0;
+	double mean_spp = 0.0;
+	uint64_t samples = 0;
+};
+
+/// <summary>
+/// Renders the world into framebuffer (sums of samples, as render()) in progressive passes
+/// until budget_seconds have passed or every pixel has settings.samples_per_pixel samples.
+/// The samples of each pixel are counted in sample_counts. The sampler should be made for
+/// settings.samples_per_pixel, which only limits the samples when it is reached.
+/// </summary>
+render_stats render_time_budget(const hittable& world, const camera& cam, const color& background,
+								const render_settings& settings, const sampler& smp, double budget_seconds,
+								std::vector<color>& framebuffer, std::vector<int>& sample_counts,
+								budget_report& report, std::chrono::steady_clock::time_point start) {
+	typedef std::chrono::steady_clock clock;
+	auto seconds_since_start = [&]() { return std::chrono::duration<double>(clock::now() - start).count(); };
+
+	const int width = settings.image_width;
+	const int height = settings.image_height;
+	const int max_samples = settings.samples_per_pixel;
+	framebuffer.assign(static_cast<size_t>(width) * height, color(0, 0, 0));
+	sample_counts.assign(framebuffer.size(), 0);
+	report.budget_seconds = budget_seconds;
+
+	render_settings pass_settings = settings;
+	pass_settings.show_progress = false;
+	render_stats total;
+	std::vector<color> tile;
+	double render_seconds = 0.0;
+	double pixel_samples = 0.0;
+
+	// Seconds one more sample of rows [y0, y1) should take, 0 while nothing was measured
+	auto predict = [&](int y0, int y1, int samples) {
+		return pixel_samples > 0 ? render_seconds / pixel_samples * width * (y1 - y0) * samples : 0.0;
+	};
+	auto render_pass = [&](int y0, int y1, int sample_begin, int sample_end) {
+		image_region region = image_region::full(settings);
+		region.y0 = y0;
+		region.y1 = y1;
+		region.sample_begin = sample_begin;
+		region.sample_end = sample_end;
+		RT_TRACE_SCOPE("budget pass", "render");
+		auto stats = render_region(world, cam, background, pass_settings, smp, region, tile);
+		for (int y = y0; y < y1; y++) {
+			for (int x = 0; x < width; x++) {
+				const size_t pixel = static_cast<size_t>(y) * width + x;
+				framebuffer[pixel] += tile[static_cast<size_t>(y - y0) * width + x];
+				sample_counts[pixel] += region.samples();
+			}
+		}
+		total.merge(stats);
+		render_seconds += stats.render_seconds;
+		pixel_samples += static_cast<double>(region.pixel_count()) * region.samples();
+		report.passes.push_back({ sample_begin, sample_end, y0, y1, stats.render_seconds });
+		if (settings.show_progress)
+			std::cerr << "Pass " << report.passes.size() << ": samples " << sample_begin << '-' << sample_end
+					  << " of rows " << y0 << '-' << y1 << " in " << stats.render_seconds * 1000.0 << " ms, "
+					  << budget_seconds - seconds_since_start() << " s left\n";
+	};
+	// Adds sample 'sample' to bands of rows while they fit into the budget
+	// Returns false if it ran out of time before the last row
+	auto banded_pass = [&](int sample) {
+		const int band_rows = std::max(1, height / 16);
+		for (int y0 = 0; y0 < height; y0 += band_rows) {
+			const int y1 = std::min(y0 + band_rows, height);
+			// Bands differ in cost, so leave some room for a band that is slower than the average
+			if (seconds_since_start() + 1.25 * predict(y0, y1, 1) > budget_seconds)
+				return false;
+			render_pass(y0, y1, sample, sample + 1);
+		}
+		return true;
+	};
+
+	// The first sample is added in bands, both to measure the throughput before committing to
+	// a whole pass and to stop in time when not even one sample per pixel fits
+	int samples_done = 0;
+	if (max_samples > 0 && banded_pass(0))
+		samples_done = 1;
+
+	while (samples_done > 0 && samples_done < max_samples) {
+		const double remaining = budget_seconds - seconds_since_start();
+		const double one_sample = predict(0, height, 1);
+		int samples = max_samples - samples_done;
+		if (one_sample > 0)
+			samples = static_cast<int>(std::min<double>(samples, remaining * 0.5 / one_sample));
+		if (samples < 1) {
+			if (!banded_pass(samples_done))
+				break;
+			samples_done++;
+			continue;
+		}
+		render_pass(0, height, samples_done, samples_done + samples);
+		samples_done += samples;
+	}
+
+	report.seconds = seconds_since_start();
+	report.samples = total.samples;
+	auto counts = std::minmax_element(sample_counts.begin(), sample_counts.end());
+	report.min_spp = *counts.first;
+	report.max_spp = *counts.second;
+	report.mean_spp = static_cast<double>(total.samples) / sample_counts.size();
+	total.render_seconds = render_seconds;
+	return total;
+}
+
+/// <summary>
+/// Builds the top-level structure over the world list and renders it within the budget.
+/// The build counts against the budget.
+/// </summary>
+render_stats render_time_budget(const hittable_list& world, const camera& cam, const color& background,
+								const render_settings& settings, const sampler& smp, double budget_seconds,
+								std::vector<color>& framebuffer, std::vector<int>& sample_counts,
+								budget_report& report) {
+	auto start = std::chrono::steady_clock::now();
+	auto accel = build_scene_accel(world, settings.accel, cam.shutter_open(), cam.shutter_close(),
+								   settings.motion_steps);
+	report.accel_build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return render_time_budget(static_cast<const hittable&>(*accel), cam, background, settings, smp, budget_seconds,
+							  framebuffer, sample_counts, report, start);
+}
+
+/// <summary>
+/// Writes framebuffer as plain PPM image, dividing every pixel by its own sample count
+/// </summary>
+void write_ppm(std::ostream& out, const std::vector<color>& framebuffer, const std::vector<int>& sample_counts,
+			   int image_width, int image_height) {
+	out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+	for (size_t pixel = 0; pixel < framebuffer.size(); pixel++)
+		write_color(out, framebuffer[pixel], std::max(1, sample_counts[pixel]));
+}
+
+/// <summary>
+/// Summary of a time-budgeted render
+/// </summary>
+void print_budget_report(std::ostream& out, const budget_report& report) {
+	out << "Time budget " << report.budget_seconds << " s, used " << report.seconds << " s (structure build "
+		<< report.accel_build_seconds * 1000.0 << " ms), " << report.passes.size() << " passes\n"
+		<< "Samples per pixel: min " << report.min_spp << ", max " << report.max_spp << ", mean "
+		<< report.mean_spp << " (" << report.samples / std::max(report.seconds, 1e-9) / 1e6 << " Msamples/s)\n";
+	if (report.min_spp == 0)
+		std::cerr << "WARNING: Not every pixel got a sample within the time budget.\n";
+}
@@ -0,0 +1,431 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+#include "color.h"
+#include "camera.h"
+#include "sampler.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "scene_accel.h"
+#include "convergence.h"
+#include "progressive.h"
+#include "heatmap.h"
+
+// Image-quality regression
+// --------------------------
+// Speedups that change arithmetic or sampling change the noise of an image, so images are
+// not compared with each other but with a converged reference of each scene. Updating the
+// references also renders every scene at the test settings with the current build and
+// stores its error and time as the baseline. A check renders the test settings again and
+// fails a scene if its error grew by more than the tolerance, so unbiased changes to the
+// noise pass and biased ones do not. A second render gets the baseline's time as budget,
+// which compares the error reached in equal time: the time-to-quality of a change, not
+// only its ray throughput.
+//
+// The references directory holds quality.txt, one line of key=value fields per scene,
+// and a linear-color PFM reference image per scene.
+
+/// <summary>
+/// Errors of an image against a reference, both in linear color averaged per pixel
+/// </summary>
+struct quality_metrics {
+	double rmse = 0.0;		// root mean square error over pixels and channels
+	double psnr = 0.0;		// dB, of the displayed (gamma corrected, clamped) images, peak 1
+	double relmse = 0.0;	// mean of (image - reference)^2 / (reference^2 + 0.01)
+};
+
+/// <summary>
+/// Mean color of every pixel from sums of spp samples
+/// </summary>
+inline std::vector<color> average_samples(const std::vector<color>& sums, int spp) {
+	std::vector<color> image(sums.size());
+	for (size_t p = 0; p < sums.size(); p++)
+		image[p] = sums[p] / std::max(1, spp);
+	return image;
+}
+
+/// <summary>
+/// Relative squared error of one pixel, averaged over its channels
+/// </summary>
+inline double pixel_relmse(const color& value, const color& reference) {
+	double sum = 0.0;
+	for (int c = 0; c < 3; c++) {
+		const double d = value[c] - reference[c];
+		sum += d * d / (reference[c] * reference[c] + 0.01);
+	}
+	return sum / 3.0;
+}
+
+quality_metrics compare_images(const std::vector<color>& image, const std::vector<color>& reference) {
+	quality_metrics m;
+	if (image.empty() || image.size() != reference.size()) {
+		m.rmse = m.relmse = infinity;
+		return m;
+	}
+
+	m.rmse = image_rmse(image, 1, reference, 1);
+	double display_mse = 0.0;
+	for (size_t p = 0; p < image.size(); p++) {
+		m.relmse += pixel_relmse(image[p], reference[p]);
+		for (int c = 0; c < 3; c++) {
+			const double d = clamp(sqrt(std::max(0.0, image[p][c])), 0.0, 1.0)
+				- clamp(sqrt(std::max(0.0, reference[p][c])), 0.0, 1.0);
+			display_mse += d * d;
+		}
+	}
+	m.relmse /= image.size();
+	display_mse /= 3.0 * image.size();
+	m.psnr = display_mse > 0 ? 10.0 * log10(1.0 / display_mse) : infinity;
+	return m;
+}
+
+/// <summary>
+/// Writes an image as color Portable Float Map (linear color, rows from the bottom)
+/// </summary>
+bool write_color_pfm(const std::string& path, const std::vector<color>& image, int width, int height) {
+	std::ofstream out(path, std::ios::binary);
+	if (!out) {
+		std::cerr << "ERROR: Could not open '" << path << "' for writing.\n";
+		return false;
+	}
+	const uint32_t probe = 1;
+	const bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+	out << "PF\n" << width << ' ' << height << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+	std::vector<float> row(static_cast<size_t>(width) * 3);
+	for (int y = height - 1; y >= 0; y--) {
+		for (int x = 0; x < width; x++)
+			for (int c = 0; c < 3; c++)
+				row[static_cast<size_t>(x) * 3 + c] = static_cast<float>(image[static_cast<size_t>(y) * width + x][c]);
+		out.write(reinterpret_cast<const char*>(row.data()), sizeof(float) * row.size());
+	}
+	return static_cast<bool>(out);
+}
+
+/// <summary>
+/// Reads a color PFM written on a machine of the same byte order
+/// </summary>
+bool read_color_pfm(const std::string& path, std::vector<color>& image, int& width, int& height) {
+	std::ifstream in(path, std::ios::binary);
+	std::string magic;
+	double scale = 0.0;
+	if (!in || !(in >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0) {
+		std::cerr << "ERROR: '" << path << "' is not a color PFM image.\n";
+		return false;
+	}
+	in.get();	// the single whitespace after the header
+
+	const uint32_t probe = 1;
+	const bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+	if ((scale < 0) != little_endian) {
+		std::cerr << "ERROR: '" << path << "' was written with the other byte order.\n";
+		return false;
+	}
+
+	image.resize(static_cast<size_t>(width) * height);
+	std::vector<float> row(static_cast<size_t>(width) * 3);
+	for (int y = height - 1; y >= 0; y--) {
+		if (!in.read(reinterpret_cast<char*>(row.data()), sizeof(float) * row.size())) {
+			std::cerr << "ERROR: '" << path << "' ends before its last pixel.\n";
+			return false;
+		}
+		for (int x = 0; x < width; x++)
+			image[static_cast<size_t>(y) * width + x] = color(row[x * 3], row[x * 3 + 1], row[x * 3 + 2]);
+	}
+	return true;
+}
+
+/// <summary>
+/// Test settings of one scene and what the build that made the reference achieved with them
+/// </summary>
+struct quality_baseline {
+	int scene_id = 0;
+	int image_width = 0;
+	int image_height = 0;
+	int samples_per_pixel = 0;
+	int reference_spp = 0;
+	uint32_t seed = 0;
+	double seconds = 0.0;		// render time at samples_per_pixel
+	quality_metrics metrics;	// error at samples_per_pixel
+	double equal_time_relmse = 0.0;	// error of a render with seconds as time budget
+
+	std::string to_line() const {
+		std::ostringstream out;
+		out.precision(9);
+		out << "scene=" << scene_id << " width=" << image_width << " height=" << image_height
+			<< " spp=" << samples_per_pixel << " reference_spp=" << reference_spp << " seed=" << seed
+			<< " seconds=" << seconds << " rmse=" << metrics.rmse << " psnr=" << metrics.psnr
+			<< " relmse=" << metrics.relmse << " equal_time_relmse=" << equal_time_relmse;
+		return out.str();
+	}
+
+	bool from_line(const std::string& line) {
+		std::istringstream in(line);
+		std::string field;
+		while (in >> field) {
+			auto equals = field.find('=');
+			if (equals == std::string::npos)
+				return false;
+			const std::string key = field.substr(0, equals);
+			const char* value = field.c_str() + equals + 1;
+			if (key == "scene")
+				scene_id = atoi(value);
+			else if (key == "width")
+				image_width = atoi(value);
+			else if (key == "height")
+				image_height = atoi(value);
+			else if (key == "spp")
+				samples_per_pixel = atoi(value);
+			else if (key == "reference_spp")
+				reference_spp = atoi(value);
+			else if (key == "seed")
+				seed = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+			else if (key == "seconds")
+				seconds = atof(value);
+			else if (key == "rmse")
+				metrics.rmse = atof(value);
+			else if (key == "psnr")
+				metrics.psnr = atof(value);
+			else if (key == "relmse")
+				metrics.relmse = atof(value);
+			else if (key == "equal_time_relmse")
+				equal_time_relmse = atof(value);
+		}
+		return scene_id > 0 && image_width > 0 && image_height > 0 && samples_per_pixel > 0;
+	}
+};
+
+struct quality_options {
+	std::string directory;			// references and quality.txt
+	std::string out_directory;		// test and diff images of failed scenes, empty for directory
+	int image_width = 96;
+	int samples_per_pixel = 16;
+	int reference_spp = 1024;
+	int max_depth = 50;
+	int thread_count = 0;
+	uint32_t seed = 0;
+	std::string sampler_name = "random";	// a make_sampler name, checked by the caller
+	std::string accel = "wide";
+	int motion_steps = 1;
+	bool packets = true;
+	bool use_arena = true;
+	std::string schedule = "steal";
+	double tolerance = 0.1;			// allowed relative growth of relMSE at the test spp
+	double time_tolerance = 0.25;	// allowed relative growth of relMSE in equal time
+	int first_scene = 1;
+	int last_scene = builtin_scene_count;
+};
+
+inline std::string quality_reference_path(const std::string& directory, int scene_id) {
+	return directory + "/" + scene_name(scene_id) + ".pfm";
+}
+
+/// <summary>
+/// Scene and render settings of a quality render. The scene generator is reseeded so each
+/// run builds the same scene as a normal render.
+/// </summary>
+scene_config quality_scene(int scene_id, const quality_options& options, int image_width, int spp,
+						   render_settings& settings) {
+	srand(1);
+	scene_config scene = select_scene(scene_id, options.use_arena);
+	settings.image_width = image_width;
+	settings.image_height = static_cast<int>(image_width / scene.aspect_ratio);
+	settings.samples_per_pixel = spp;
+	settings.max_depth = options.max_depth;
+	settings.thread_count = options.thread_count;
+	settings.show_progress = false;
+	settings.packets = options.packets;
+	settings.accel = options.accel;
+	settings.motion_steps = options.motion_steps;
+	settings.schedule = options.schedule;
+	return scene;
+}
+
+/// <summary>
+/// Test renders of one scene: at the test spp, and with the time of a render at the test spp
+/// as budget. Both are averaged per pixel.
+/// </summary>
+struct quality_test {
+	std::vector<color> image;
+	double seconds = 0.0;
+	std::vector<color> equal_time_image;
+	budget_report equal_time;
+};
+
+/// <summary>
+/// Renders the test images of a scene; budget_seconds of 0 uses the time of the render at the
+/// test spp. The structure is built once and its build is not timed. The equal-time render may
+/// take up to max_spp samples, so only the budget limits it.
+/// </summary>
+quality_test render_quality_test(const scene_config& scene, const render_settings& settings,
+								 const quality_options& options, uint32_t seed, int max_spp, double budget_seconds) {
+	quality_test test;
+	camera cam = make_camera(scene);
+	auto accel = build_scene_accel(scene.world, settings.accel, cam.shutter_open(), cam.shutter_close(),
+								   settings.motion_steps);
+	const hittable& world = *accel;
+
+	auto smp = make_sampler(options.sampler_name, settings.samples_per_pixel, seed);
+	std::vector<color> sums;
+	test.seconds = render(world, cam, scene.background, settings, *smp, sums).render_seconds;
+	test.image = average_samples(sums, settings.samples_per_pixel);
+
+	render_settings budget_settings = settings;
+	budget_settings.samples_per_pixel = std::max(max_spp, settings.samples_per_pixel);
+	auto budget_sampler = make_sampler(options.sampler_name, budget_settings.samples_per_pixel, seed);
+	std::vector<int> sample_counts;
+	render_time_budget(world, cam, scene.background, budget_settings, *budget_sampler,
+					   budget_seconds > 0 ? budget_seconds : test.seconds, sums, sample_counts, test.equal_time,
+					   std::chrono::steady_clock::now());
+	test.equal_time_image.resize(sums.size());
+	for (size_t p = 0; p < sums.size(); p++)
+		test.equal_time_image[p] = sums[p] / std::max(1, sample_counts[p]);
+	return test;
+}
+
+/// <summary>
+/// Renders the references of the scenes and the baselines of the current build, and writes
+/// them to options.directory
+/// </summary>
+bool update_quality_references(const quality_options& options) {
+	std::ofstream manifest(options.directory + "/quality.txt");
+	if (!manifest) {
+		std::cerr << "ERROR: Could not write '" << options.directory << "/quality.txt'.\n";
+		return false;
+	}
+
+	for (int id = options.first_scene; id <= options.last_scene; id++) {
+		render_settings settings;
+		scene_config scene = quality_scene(id, options, options.image_width, options.reference_spp, settings);
+
+		// The reference uses an unrelated scramble so it is not correlated with the test images
+		std::cerr << "Reference of " << scene_name(id) << " at " << options.reference_spp << " spp\n";
+		sobol_sampler reference_sampler(options.reference_spp, hash_u32(options.seed ^ 0x5bd1e995U));
+		std::vector<color> reference;
+		render(scene.world, make_camera(scene), scene.background, settings, reference_sampler, reference);
+		reference = average_samples(reference, options.reference_spp);
+		if (!write_color_pfm(quality_reference_path(options.directory, id), reference,
+							 settings.image_width, settings.image_height))
+			return false;
+
+		settings.samples_per_pixel = options.samples_per_pixel;
+		const quality_test test = render_quality_test(scene, settings, options, options.seed, options.reference_spp, 0.0);
+
+		quality_baseline baseline;
+		baseline.scene_id = id;
+		baseline.image_width = settings.image_width;
+		baseline.image_height = settings.image_height;
+		baseline.samples_per_pixel = options.samples_per_pixel;
+		baseline.reference_spp = options.reference_spp;
+		baseline.seed = options.seed;
+		baseline.seconds = test.seconds;
+		baseline.metrics = compare_images(test.image, reference);
+		baseline.equal_time_relmse = compare_images(test.equal_time_image, reference).relmse;
+		manifest << baseline.to_line() << '\n';
+	}
+	std::cerr << "Wrote references of scenes " << options.first_scene << '-' << options.last_scene
+			  << " to " << options.directory << '\n';
+	return static_cast<bool>(manifest);
+}
+
+/// <summary>
+/// Writes the test image of a failed scene and a false color map of its relative error
+/// (white at the 99th percentile)
+/// </summary>
+void write_quality_failure(const std::string& prefix, const std::vector<color>& image,
+						   const std::vector<color>& reference, int width, int height) {
+	std::ofstream out(prefix + "_test.ppm");
+	if (out)
+		write_ppm(out, image, width, height, 1);
+
+	heatmap_buffer error;
+	error.resize(width, height);
+	for (size_t p = 0; p < image.size(); p++)
+		error.values[p] = static_cast<float>(pixel_relmse(image[p], reference[p]));
+	write_heatmap_ppm(prefix + "_diff.ppm", error, error.percentile(0.99));
+	std::cerr << "  wrote " << prefix << "_test.ppm and " << prefix << "_diff.ppm\n";
+}
+
+/// <summary>
+/// Checks every scene of the references against its baseline, at the test spp and in the
+/// baseline's time. Prints a table to out and writes images of the failed scenes.
+/// </summary>
+/// <returns>number of failed scenes, or -1 if the references could not be read</returns>
+int run_quality_check(const quality_options& options, std::ostream& out) {
+	std::ifstream manifest(options.directory + "/quality.txt");
+	if (!manifest) {
+		std::cerr << "ERROR: No references in '" << options.directory << "', make them with --quality-update.\n";
+		return -1;
+	}
+	std::vector<quality_baseline> baselines;
+	std::string line;
+	while (std::getline(manifest, line)) {
+		quality_baseline baseline;
+		if (baseline.from_line(line) && baseline.scene_id >= options.first_scene && baseline.scene_id <= options.last_scene)
+			baselines.push_back(baseline);
+	}
+	const std::string out_directory = options.out_directory.empty() ? options.directory : options.out_directory;
+
+	out << std::left << std::setw(20) << "scene" << std::right
+		<< std::setw(10) << "rmse" << std::setw(9) << "psnr" << std::setw(11) << "relmse"
+		<< std::setw(11) << "baseline" << std::setw(9) << "ms" << std::setw(8) << "base"
+		<< std::setw(12) << "equal-time" << std::setw(11) << "baseline" << std::setw(7) << "spp" << "  result\n";
+
+	int failures = 0;
+	for (const auto& baseline : baselines) {
+		std::vector<color> reference;
+		int width = 0, height = 0;
+		if (!read_color_pfm(quality_reference_path(options.directory, baseline.scene_id), reference, width, height))
+			return -1;
+
+		render_settings settings;
+		scene_config scene = quality_scene(baseline.scene_id, options, baseline.image_width,
+										   baseline.samples_per_pixel, settings);
+		if (width != settings.image_width || height != settings.image_height) {
+			std::cerr << "ERROR: The reference of " << scene_name(baseline.scene_id) << " is " << width << 'x'
+					  << height << ", the scene renders " << settings.image_width << 'x' << settings.image_height << ".\n";
+			return -1;
+		}
+
+		const quality_test test = render_quality_test(scene, settings, options, baseline.seed, baseline.reference_spp,
+													  baseline.seconds);
+		const quality_metrics metrics = compare_images(test.image, reference);
+		const double equal_time = compare_images(test.equal_time_image, reference).relmse;
+		const bool fixed_ok = metrics.relmse <= baseline.metrics.relmse * (1.0 + options.tolerance);
+		const bool time_ok = test.equal_time.min_spp > 0
+			&& equal_time <= baseline.equal_time_relmse * (1.0 + options.time_tolerance);
+
+		out << std::left << std::setw(20) << scene_name(baseline.scene_id) << std::right
+			<< std::setprecision(5) << std::setw(10) << metrics.rmse
+			<< std::fixed << std::setprecision(2) << std::setw(9) << metrics.psnr
+			<< std::defaultfloat << std::setprecision(4) << std::setw(11) << metrics.relmse
+			<< std::setw(11) << baseline.metrics.relmse
+			<< std::fixed << std::setprecision(0) << std::setw(9) << test.seconds * 1000.0
+			<< std::setw(8) << baseline.seconds * 1000.0
+			<< std::defaultfloat << std::setprecision(4) << std::setw(12) << equal_time
+			<< std::setw(11) << baseline.equal_time_relmse
+			<< std::fixed << std::setprecision(1) << std::setw(7) << test.equal_time.mean_spp << std::defaultfloat
+			<< "  " << (fixed_ok && time_ok ? "ok" : !fixed_ok ? "FAIL (error)" : "FAIL (equal time)") << '\n';
+
+		if (!fixed_ok || !time_ok) {
+			failures++;
+			write_quality_failure(out_directory + "/" + scene_name(baseline.scene_id),
+								  fixed_ok ? test.equal_time_image : test.image, reference,
+								  settings.image_width, settings.image_height);
+		}
+	}
+
+	out << std::setprecision(6) << baselines.size() - failures << " of " << baselines.size()
+		<< " scenes passed (relMSE within " << options.tolerance * 100.0 << "% of the baseline, "
+		<< options.time_tolerance * 100.0 << "% in equal time)\n";
+	return failures;
+}
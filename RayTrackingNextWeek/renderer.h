@@ -0,0 +1,505 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rtweekend.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "camera.h"
+#include "sampler.h"
+#include "stats.h"
+#include "heatmap.h"
+#include "scene_accel.h"
+#include "scheduler.h"
+#include "trace.h"
+
+/// <summary>
+/// Ray and sample counts of a render. Each worker keeps its own copy,
+/// they are merged when the render finishes.
+/// </summary>
+struct render_stats {
+	uint64_t primary_rays = 0;
+	uint64_t secondary_rays = 0;
+	uint64_t samples = 0;
+	double render_seconds = 0.0;
+	double accel_build_seconds = 0.0;	// top-level structure built by render() for a world list
+	double pilot_seconds = 0.0;		// cost estimate of the work-stealing schedule, part of render_seconds
+	trace_counters counters;	// only filled when built with RT_ENABLE_STATS
+	std::vector<thread_utilization> threads;	// per render thread, filled by render_region
+
+	void merge(const render_stats& other) {
+		primary_rays += other.primary_rays;
+		secondary_rays += other.secondary_rays;
+		samples += other.samples;
+		counters.merge(other.counters);
+	}
+};
+
+color ray_color(const ray& r, const color& background, const hittable& world, int depth, render_stats& stats);
+
+/// <summary>
+/// Color of a ray whose closest hit is already known. Used by ray_color and
+/// by the packet path, which finds the first hit of several rays at once
+/// and continues every path with single rays from there.
+/// </summary>
+/// <param name="r"></param>
+/// <param name="hit">false if the ray missed every object</param>
+/// <param name="rec">closest hit of r</param>
+/// <param name="background"></param>
+/// <param name="world"></param>
+/// <param name="depth"></param>
+/// <param name="stats"></param>
+/// <returns></returns>
+color shade_hit(const ray& r, bool hit, const hit_record& rec, const color& background,
+				const hittable& world, int depth, render_stats& stats) {
+
+	// If the ray hits nothing, return the background color.
+	if (!hit) {
+
+		/*
+		// if NO object is hit render default sky background
+		vec3 unit_direction = unit_vector(r.direction());
+		auto t = 0.5 * (unit_direction.y() + 1.0);
+		return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0); // linear interpolation
+		// blendValue = (1 -t) * startValue + t * endValue
+		*/
+
+		return background;
+	}
+
+	ray scattered;
+	color attenuation;
+	color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+
+	if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+		return emitted;
+
+	stats.secondary_rays++;
+	return emitted + attenuation * ray_color(scattered, background, world, depth - 1, stats);
+}
+
+/// <summary>
+/// returns the color value of a ray cast into a scene
+/// </summary>
+/// <param name="r"></param>
+/// <param name="background"></param>
+/// <param name="world"></param>
+/// <param name="depth"></param>
+/// <param name="stats"></param>
+/// <returns></returns>
+color ray_color(const ray& r,const color& background, const hittable& world, int depth, render_stats& stats) {
+
+	hit_record rec;
+
+	// If we've exceeded the ray bounce limit, no morelight is gathered.
+	// Prevents infinity recursion.
+	if (depth <= 0)
+		return color(0, 0, 0);
+
+	bool hit = world.hit(r, 0.001, infinity, rec);
+	return shade_hit(r, hit, rec, background, world, depth, stats);
+}
+
+struct render_settings {
+	int image_width = 480;
+	int image_height = 270;
+	int samples_per_pixel = 100;
+	int max_depth = 50;	// sets recussive limt for ray_color function
+	int thread_count = 0;	// 0 uses every hardware thread
+	bool show_progress = true;
+	// Trace primary rays of pinhole cameras as packets of neighbouring pixels. The image is the
+	// same as with single rays; worlds with media keep single rays (see contains_media).
+	bool packets = true;
+	std::string accel = "wide";	// top-level structure built over a world list, see build_scene_accel
+	int motion_steps = 1;		// time segments per node of "motion-bvh"
+	// "steal": threads take tiles from their own deque and steal from each other, expensive tiles
+	// are split (tile_scheduler). "rows": threads take whole rows from the top of the image.
+	std::string schedule = "steal";
+};
+
+inline int resolve_thread_count(int requested) {
+	if (requested > 0)
+		return requested;
+	int hardware = static_cast<int>(std::thread::hardware_concurrency());
+	return hardware > 0 ? hardware : 1;
+}
+
+/// <summary>
+/// Part of an image: the pixels [x0, x1) x [y0, y1), counted in rows from the top of
+/// the image, and the samples [sample_begin, sample_end) of each of them.
+/// </summary>
+struct image_region {
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+	int sample_begin = 0, sample_end = 0;
+
+	int width() const { return x1 - x0; }
+	int height() const { return y1 - y0; }
+	int samples() const { return sample_end - sample_begin; }
+	size_t pixel_count() const { return static_cast<size_t>(width()) * height(); }
+
+	/// <summary>
+	/// Every pixel and every sample of the image described by settings
+	/// </summary>
+	static image_region full(const render_settings& settings) {
+		image_region region;
+		region.x1 = settings.image_width;
+		region.y1 = settings.image_height;
+		region.sample_end = settings.samples_per_pixel;
+		return region;
+	}
+};
+
+/// <summary>
+/// Pilot pass of the work-stealing schedule: times sample 0 of one pixel in every
+/// stride x stride cell of the region. Pixel sample streams restart at start_pixel_sample,
+/// so tracing them here does not change the image.
+/// </summary>
+cost_estimate estimate_pixel_cost(const hittable& world, const camera& cam, const color& background,
+								  const render_settings& settings, const sampler& smp, const image_region& region,
+								  int thread_count, int stride = 4) {
+	RT_TRACE_SCOPE("cost estimate", "render");
+	cost_estimate costs;
+	costs.x0 = region.x0;
+	costs.y0 = region.y0;
+	costs.stride = stride;
+	costs.columns = (region.width() + stride - 1) / stride;
+	costs.rows = (region.height() + stride - 1) / stride;
+	costs.cell_cost.assign(static_cast<size_t>(costs.columns) * costs.rows, 0.0f);
+
+	std::atomic<int> next_row(0);
+	auto worker = [&]() {
+		auto local_sampler = smp.clone();
+		active_sampler() = local_sampler.get();
+		render_stats stats;
+		for (int cy = next_row++; cy < costs.rows; cy = next_row++) {
+			const int row = std::min(region.y0 + cy * stride + stride / 2, region.y1 - 1);
+			const int j = settings.image_height - 1 - row;
+			for (int cx = 0; cx < costs.columns; cx++) {
+				const int i = std::min(region.x0 + cx * stride + stride / 2, region.x1 - 1);
+				auto start = std::chrono::steady_clock::now();
+				local_sampler->start_pixel_sample(i, j, 0);
+				double du, dv;
+				local_sampler->get_2d(du, dv);
+				ray r = cam.get_ray((i + du) / (settings.image_width - 1), (j + dv) / (settings.image_height - 1));
+				ray_color(r, background, world, settings.max_depth, stats);
+				costs.cell_cost[static_cast<size_t>(cy) * costs.columns + cx] = static_cast<float>(
+					std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+			}
+		}
+		active_sampler() = nullptr;
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; t++)
+		threads.emplace_back(worker);
+	for (auto& thread : threads)
+		thread.join();
+	return costs;
+}
+
+/// <summary>
+/// Renders a region of the image into tile, the sum of the region's samples of each of its
+/// pixels, stored row by row from the top of the region. Pixel sample (i, j, s) draws from
+/// the same sampler stream as in a render of the whole image, so the regions of an image
+/// can be rendered apart (eg. by other processes) and summed into the same result.
+/// </summary>
+/// <param name="world"></param>
+/// <param name="cam"></param>
+/// <param name="background"></param>
+/// <param name="settings">size and samples per pixel of the whole image</param>
+/// <param name="smp"></param>
+/// <param name="region"></param>
+/// <param name="tile"></param>
+/// <param name="heatmaps">optional per-pixel traversal cost of the region, needs RT_ENABLE_STATS</param>
+/// <param name="times">optional per-pixel render time of the region</param>
+/// <returns></returns>
+render_stats render_region(const hittable& world, const camera& cam, const color& background,
+						   const render_settings& settings, const sampler& smp, const image_region& region,
+						   std::vector<color>& tile, trace_heatmaps* heatmaps = nullptr,
+						   time_heatmap* times = nullptr) {
+	RT_TRACE_SCOPE_RECT("render_region", "render", region.x0, region.y0, region.x1, region.y1);
+
+	const int image_width = settings.image_width;
+	const int image_height = settings.image_height;
+	const int thread_count = resolve_thread_count(settings.thread_count);
+	const int tile_width = region.width();
+
+	tile.assign(region.pixel_count(), color(0, 0, 0));
+	if (heatmaps)
+		heatmaps->resize(tile_width, region.height());
+	if (times)
+		times->resize(tile_width, region.height());
+
+	auto start = std::chrono::steady_clock::now();
+	std::atomic<int> next_row(region.y0);
+	std::atomic<size_t> pixels_done(0);
+	std::vector<render_stats> worker_stats(thread_count);
+	std::vector<thread_utilization> utilization(thread_count);
+	// Per-pixel heatmaps need the traversal cost of single pixels, so they keep single rays
+	const bool use_packets = settings.packets && cam.is_pinhole() && !heatmaps && !contains_media(world);
+
+	// Work stealing is for more than one thread. Its tiles are split at packet boundaries, so
+	// the packets are those of a render by rows.
+	double pilot_seconds = 0.0;
+	cost_estimate costs;
+	std::unique_ptr<tile_scheduler> scheduler;
+	if (settings.schedule == "steal" && thread_count > 1) {
+		costs = estimate_pixel_cost(world, cam, background, settings, smp, region, thread_count);
+		pilot_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		scheduler.reset(new tile_scheduler(region.x0, region.y0, region.x1, region.y1, thread_count, costs,
+										   32, packet_width));
+	}
+
+	auto worker = [&](int worker_id) {
+		if (thread_count > 1)
+			trace_thread_name("render worker " + std::to_string(worker_id));
+		auto local_sampler = smp.clone();
+		render_stats stats;
+		active_sampler() = local_sampler.get();
+#ifdef RT_ENABLE_STATS
+		trace_counters& counters = thread_counters();
+		counters = trace_counters();
+#endif
+
+		// Starts the sample stream of pixel sample (i, j, s) and returns its camera ray
+		auto camera_ray = [&](int i, int j, int s) {
+			local_sampler->start_pixel_sample(i, j, s);
+			double du, dv;
+			local_sampler->get_2d(du, dv);
+			auto u = (i + du) / (image_width - 1);
+			auto v = (j + dv) / (image_height - 1);
+			return cam.get_ray(u, v);
+		};
+
+		// Pixel times are taken by the thread rendering the pixel and written to the pixel's own
+		// slot, so the threads share no timing state
+		typedef std::chrono::steady_clock clock;
+		auto microseconds = [](clock::time_point from, clock::time_point to) {
+			return std::chrono::duration<float, std::micro>(to - from).count();
+		};
+
+		// Renders the pixels [x_begin, x_end) of a row
+		auto render_span = [&](int row, int x_begin, int x_end) {
+			int j = image_height - 1 - row;
+			const size_t tile_row = static_cast<size_t>(row - region.y0) * tile_width;
+
+			if (use_packets) {
+				// One packet holds the same sample of packet_width neighbouring pixels. Only the
+				// first hit is traced as a packet; the paths diverge after the first bounce,
+				// so they continue as single rays.
+				for (int i0 = x_begin; i0 < x_end; i0 += packet_width) {
+					color pixel_colors[packet_width];
+					float lane_time[packet_width] = {};
+					ray_packet packet;
+					packet.count = std::min(packet_width, x_end - i0);
+
+					for (int s = region.sample_begin; s < region.sample_end; s++) {
+						clock::time_point lap = times ? clock::now() : clock::time_point();
+						packet_hits hits;
+						for (int k = 0; k < packet.count; k++) {
+							packet.rays[k] = camera_ray(i0 + k, j, s);
+							hits.t_max[k] = infinity;
+						}
+						packet.finalize();
+						world.hit_packet(packet, packet.full_mask(), 0.001, hits);
+						stats.primary_rays += packet.count;
+						if (times) {
+							// The packet's first hit is shared evenly, the shading belongs to its lane
+							const auto now = clock::now();
+							const float share = microseconds(lap, now) / packet.count;
+							for (int k = 0; k < packet.count; k++)
+								lane_time[k] += share;
+							lap = now;
+						}
+
+						for (int k = 0; k < packet.count; k++) {
+							// Replay the lane's camera sample, so shading continues its own sample stream
+							ray r = camera_ray(i0 + k, j, s);
+#ifdef RT_ENABLE_STATS
+							const auto secondary_before = stats.secondary_rays;
+#endif
+							if (settings.max_depth > 0)
+								pixel_colors[k] += shade_hit(r, (hits.mask & (1 << k)) != 0, hits.rec[k],
+															 background, world, settings.max_depth, stats);
+#ifdef RT_ENABLE_STATS
+							counters.path_depth[std::min<uint64_t>(stats.secondary_rays - secondary_before,
+																   trace_counters::depth_bins - 1)]++;
+#endif
+							if (times) {
+								const auto now = clock::now();
+								lane_time[k] += microseconds(lap, now);
+								lap = now;
+							}
+						}
+					}
+
+					for (int k = 0; k < packet.count; k++)
+						tile[tile_row + i0 - region.x0 + k] = pixel_colors[k];
+					if (times) {
+						for (int k = 0; k < packet.count; k++)
+							times->microseconds.values[tile_row + i0 - region.x0 + k] = lane_time[k] / region.samples();
+					}
+					stats.samples += static_cast<uint64_t>(packet.count) * region.samples();
+				}
+			}
+			else for (int i = x_begin; i < x_end; ++i)	// column
+			{
+				color pixel_color(0, 0, 0);
+				const clock::time_point pixel_start = times ? clock::now() : clock::time_point();
+#ifdef RT_ENABLE_STATS
+				const auto nodes_before = counters.bvh_nodes_visited;
+				const auto aabb_before = counters.aabb_tests;
+				const auto prims_before = counters.total_primitive_tests();
+#endif
+				for (int s = region.sample_begin; s < region.sample_end; s++) { // anti-aliasing subpixel rays
+					ray r = camera_ray(i, j, s);
+					stats.primary_rays++;
+#ifdef RT_ENABLE_STATS
+					const auto secondary_before = stats.secondary_rays;
+					pixel_color += ray_color(r, background, world, settings.max_depth, stats);
+					counters.path_depth[std::min<uint64_t>(stats.secondary_rays - secondary_before,
+														   trace_counters::depth_bins - 1)]++;
+#else
+					pixel_color += ray_color(r, background, world, settings.max_depth, stats);
+#endif
+				}
+				stats.samples += region.samples();
+				const size_t pixel = tile_row + i - region.x0;
+				tile[pixel] = pixel_color;
+				if (times)
+					times->microseconds.values[pixel] = microseconds(pixel_start, clock::now()) / region.samples();
+#ifdef RT_ENABLE_STATS
+				if (heatmaps) {
+					const float per_sample = 1.0f / region.samples();
+					heatmaps->bvh_nodes.values[pixel] = (counters.bvh_nodes_visited - nodes_before) * per_sample;
+					heatmaps->aabb_tests.values[pixel] = (counters.aabb_tests - aabb_before) * per_sample;
+					heatmaps->primitive_tests.values[pixel] = (counters.total_primitive_tests() - prims_before) * per_sample;
+				}
+#endif
+			}
+		};
+
+		auto report_progress = [&](size_t pixels) {
+			const size_t done = (pixels_done += pixels);
+			if (settings.show_progress && worker_id == 0)
+				std::cerr << "\rScalinesRemaining: " << region.height() - static_cast<int>(done / tile_width) << ' ' << std::flush;
+		};
+
+		thread_utilization& busy = utilization[worker_id];
+		if (scheduler) {
+			render_tile t;
+			while (scheduler->next(worker_id, t, busy)) {
+				RT_TRACE_SCOPE_RECT("tile", "render", t.x0, t.y0, t.x1, t.y1);
+				auto tile_start = std::chrono::steady_clock::now();
+				for (int row = t.y0; row < t.y1; row++)
+					render_span(row, t.x0, t.x1);
+				busy.busy_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
+				busy.tiles++;
+				report_progress(t.pixel_count());
+			}
+		}
+		else {
+			// Whole rows from the top of the image until none are left
+			for (int row = next_row++; row < region.y1; row = next_row++) {
+				RT_TRACE_SCOPE_RECT("row", "render", region.x0, row, region.x1, row + 1);
+				auto row_start = std::chrono::steady_clock::now();
+				render_span(row, region.x0, region.x1);
+				busy.busy_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - row_start).count();
+				busy.tiles++;
+				report_progress(tile_width);
+			}
+		}
+
+		active_sampler() = nullptr;
+#ifdef RT_ENABLE_STATS
+		stats.counters = counters;
+#endif
+		worker_stats[worker_id] = stats;
+	};
+
+	if (thread_count == 1) {
+		worker(0);
+	}
+	else {
+		std::vector<std::thread> threads;
+		for (int t = 0; t < thread_count; t++)
+			threads.emplace_back(worker, t);
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	render_stats total;
+	for (const auto& stats : worker_stats)
+		total.merge(stats);
+	total.render_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	total.pilot_seconds = pilot_seconds;
+	total.threads = utilization;
+
+	if (settings.show_progress)
+		std::cerr << "\nDone.\n";
+	return total;
+}
+
+/// <summary>
+/// Renders the world into framebuffer. The framebuffer holds the
+/// sum of all samples of a pixel, stored row by row from the top of the image.
+/// Every pixel sample draws its random numbers from its own sampler stream,
+/// so the image does not depend on the number of threads.
+/// </summary>
+/// <param name="world"></param>
+/// <param name="cam"></param>
+/// <param name="background"></param>
+/// <param name="settings"></param>
+/// <param name="smp"></param>
+/// <param name="framebuffer"></param>
+/// <param name="heatmaps">optional per-pixel traversal cost, needs RT_ENABLE_STATS</param>
+/// <param name="times">optional per-pixel render time</param>
+/// <returns></returns>
+render_stats render(const hittable& world, const camera& cam, const color& background,
+					const render_settings& settings, const sampler& smp, std::vector<color>& framebuffer,
+					trace_heatmaps* heatmaps = nullptr, time_heatmap* times = nullptr) {
+	return render_region(world, cam, background, settings, smp, image_region::full(settings),
+						 framebuffer, heatmaps, times);
+}
+
+/// <summary>
+/// Builds the top-level acceleration structure over the world list (settings.accel)
+/// for the camera's shutter interval, then renders it. The build time is returned
+/// in accel_build_seconds and is not part of render_seconds.
+/// </summary>
+render_stats render(const hittable_list& world, const camera& cam, const color& background,
+					const render_settings& settings, const sampler& smp, std::vector<color>& framebuffer,
+					trace_heatmaps* heatmaps = nullptr, time_heatmap* times = nullptr) {
+	auto start = std::chrono::steady_clock::now();
+	auto accel = build_scene_accel(world, settings.accel, cam.shutter_open(), cam.shutter_close(),
+								   settings.motion_steps);
+	double build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	auto stats = render(static_cast<const hittable&>(*accel), cam, background, settings, smp, framebuffer, heatmaps, times);
+	stats.accel_build_seconds = build_seconds;
+	return stats;
+}
+
+/// <summary>
+/// Writes framebuffer as plain PPM image
+/// </summary>
+/// <param name="out"></param>
+/// <param name="framebuffer"></param>
+/// <param name="image_width"></param>
+/// <param name="image_height"></param>
+/// <param name="samples_per_pixel"></param>
+void write_ppm(std::ostream& out, const std::vector<color>& framebuffer,
+			   int image_width, int image_height, int samples_per_pixel) {
+	RT_TRACE_SCOPE("write_ppm", "output");
+	out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+	for (const auto& pixel_color : framebuffer)
+		write_color(out, pixel_color, samples_per_pixel);
+}
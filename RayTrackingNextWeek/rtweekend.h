@@ -5,6 +5,9 @@
 #include <memory>
 #include <cstdlib>
 
+#include "arena.h"
+#include "fast_math.h"
+
 // Using 
 
 using std::shared_ptr; 
@@ -0,0 +1,359 @@
+#pragma once
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <string>
+
+// Hashing utilities
+// --------------------------
+
+/// <summary>
+/// Integer hash with good avalanche (lowbias32).
+/// Used to derive decorrelated seeds per pixel, sample and dimension.
+/// </summary>
+inline uint32_t hash_u32(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t value) {
+	return hash_u32(seed ^ (value + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+	x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+	x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+	x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+	return x;
+}
+
+/// <summary>
+/// Hash based Owen scrambling (Laine-Karras permutation, Burley 2020 constants).
+/// Operates on bit reversed values, so each bit only depends on the bits above it.
+/// </summary>
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cU;
+	x ^= x * 0xb82f1e52U;
+	x ^= x * 0xc7afe638U;
+	x ^= x * 0x8d22f6e6U;
+	return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+	x = reverse_bits(x);
+	x = laine_karras_permutation(x, seed);
+	x = reverse_bits(x);
+	return x;
+}
+
+/// <summary>
+/// Random permutation of i in [0, l) without storage (Kensler 2013).
+/// </summary>
+inline uint32_t permute_index(uint32_t i, uint32_t l, uint32_t p) {
+	uint32_t w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= p;             i *= 0xe170893dU;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;        i *= 0x0929eb3fU;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;  i *= 1 | p >> 27;
+		                    i *= 0x6935fa69U;
+		i ^= (i & w) >> 11; i *= 0x74dcb303U;
+		i ^= (i & w) >> 2;  i *= 0x9e501cc3U;
+		i ^= (i & w) >> 2;  i *= 0xc860a3dfU;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= l);
+	return (i + p) % l;
+}
+
+/// <summary>
+/// Maps 32 bits to a double in [0,1).
+/// </summary>
+inline double u32_to_unit(uint32_t x) {
+	return x * (1.0 / 4294967296.0);
+}
+
+// Sobol sequence (first two dimensions)
+// --------------------------
+
+/// <summary>
+/// Evaluates one of the first two Sobol dimensions.
+/// Dimension 0 is the van der Corput sequence, dimension 1 uses
+/// the primitive polynomial x + 1, whose direction numbers follow v[i] = v[i-1] ^ (v[i-1] >> 1).
+/// Together they form a (0,2)-sequence, so every power of two prefix is fully stratified.
+/// </summary>
+inline uint32_t sobol_2d(uint32_t index, int dim) {
+	if (dim == 0)
+		return reverse_bits(index);
+
+	uint32_t result = 0;
+	uint32_t v = 1U << 31;
+	for (; index; index >>= 1, v ^= v >> 1) {
+		if (index & 1)
+			result ^= v;
+	}
+	return result;
+}
+
+// Samplers
+// --------------------------
+
+/// <summary>
+/// Source of sample values for a single pixel sample.
+/// Every pixel/sample pair gets its own stream, and each call to get_1d()/get_2d()
+/// consumes the next dimension of that stream. The consumption order is:
+/// pixel jitter (2D), lens (2D), time (1D), then per bounce whatever the
+/// material asks for. Media take keyed values (get_keyed_1d) that consume nothing.
+/// </summary>
+class sampler {
+public:
+	sampler(int spp, uint32_t _seed) : samples_per_pixel(spp > 0 ? spp : 1), seed(_seed) {}
+	virtual ~sampler() {}
+
+	/// <summary>
+	/// Resets the stream to the first dimension of sample 'sample_index' of pixel (i, j)
+	/// </summary>
+	virtual void start_pixel_sample(int i, int j, int sample_index) {
+		pixel_seed = hash_combine(hash_combine(seed, static_cast<uint32_t>(i)), static_cast<uint32_t>(j));
+		index = static_cast<uint32_t>(sample_index);
+		dimension = 0;
+	}
+
+	virtual double get_1d() = 0;
+	virtual void get_2d(double& u, double& v) = 0;
+
+	/// <summary>
+	/// Value for key at the current point of the stream, without consuming a dimension. For
+	/// draws of objects that one acceleration structure tests and another culls
+	/// (constant_medium): the value does not depend on traversal, and the dimensions of the
+	/// rest of the path stay where they are.
+	/// </summary>
+	double get_keyed_1d(uint32_t key) const {
+		return u32_to_unit(hash_combine(hash_combine(hash_combine(pixel_seed, index), dimension), key));
+	}
+
+	/// <summary>
+	/// Creates an independent sampler with the same settings. Used to give each worker its own state.
+	/// </summary>
+	virtual shared_ptr<sampler> clone() const = 0;
+	virtual const char* name() const = 0;
+
+public:
+	int samples_per_pixel;
+	uint32_t seed;
+
+protected:
+	uint32_t pixel_seed = 0;
+	uint32_t index = 0;
+	uint32_t dimension = 0;
+};
+
+/// <summary>
+/// Independent uniform samples, equivalent to calling random_double() for every dimension,
+/// but seeded per pixel sample so results do not depend on render order.
+/// </summary>
+class random_sampler : public sampler {
+public:
+	random_sampler(int spp, uint32_t _seed) : sampler(spp, _seed) {}
+
+	virtual void start_pixel_sample(int i, int j, int sample_index) override {
+		sampler::start_pixel_sample(i, j, sample_index);
+		state = hash_combine(pixel_seed, index) | 1;
+	}
+
+	virtual double get_1d() override {
+		dimension++;	// only counted, for get_keyed_1d
+		// xorshift32
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return u32_to_unit(hash_u32(state));
+	}
+
+	virtual void get_2d(double& u, double& v) override {
+		u = get_1d();
+		v = get_1d();
+	}
+
+	virtual shared_ptr<sampler> clone() const override { return make_shared<random_sampler>(*this); }
+	virtual const char* name() const override { return "random"; }
+
+private:
+	uint32_t state = 1;
+};
+
+/// <summary>
+/// Jittered stratification. Each dimension is split into samples_per_pixel strata
+/// (2D requests into a sqrt(spp) x sqrt(spp) grid), and the strata are visited in an
+/// order that is randomly permuted per pixel and per dimension.
+/// </summary>
+class stratified_sampler : public sampler {
+public:
+	stratified_sampler(int spp, uint32_t _seed) : sampler(spp, _seed) {
+		nx = static_cast<int>(sqrt(static_cast<double>(samples_per_pixel)));
+		ny = (samples_per_pixel + nx - 1) / nx;
+	}
+
+	virtual double get_1d() override {
+		uint32_t dim_seed = hash_combine(pixel_seed, dimension++);
+		uint32_t n = static_cast<uint32_t>(samples_per_pixel);
+		uint32_t stratum = permute_index(index % n, n, dim_seed);
+		double jitter = u32_to_unit(hash_combine(dim_seed, index));
+		return (stratum + jitter) / n;
+	}
+
+	virtual void get_2d(double& u, double& v) override {
+		uint32_t dim_seed = hash_combine(pixel_seed, dimension);
+		dimension += 2;
+		uint32_t n = static_cast<uint32_t>(nx * ny);
+		uint32_t stratum = permute_index(index % n, n, dim_seed);
+		uint32_t jitter_seed = hash_combine(dim_seed, index);
+		u = ((stratum % nx) + u32_to_unit(jitter_seed)) / nx;
+		v = ((stratum / nx) + u32_to_unit(hash_u32(jitter_seed))) / ny;
+	}
+
+	virtual shared_ptr<sampler> clone() const override { return make_shared<stratified_sampler>(*this); }
+	virtual const char* name() const override { return "stratified"; }
+
+private:
+	int nx, ny;
+};
+
+/// <summary>
+/// Owen scrambled Sobol sampler (Burley 2020, "Practical Hash-based Owen Scrambling").
+/// Dimensions are drawn in pairs from the 2D Sobol (0,2)-sequence. Each pair shuffles
+/// the sample index and scrambles the points with its own seed, so pairs are
+/// decorrelated from each other while each pair stays stratified.
+/// </summary>
+class sobol_sampler : public sampler {
+public:
+	sobol_sampler(int spp, uint32_t _seed) : sampler(spp, _seed) {}
+
+	virtual double get_1d() override {
+		uint32_t dim_seed = hash_combine(pixel_seed, dimension++);
+		uint32_t shuffled = nested_uniform_scramble(index, dim_seed);
+		return u32_to_unit(nested_uniform_scramble(sobol_2d(shuffled, 0), hash_u32(dim_seed)));
+	}
+
+	virtual void get_2d(double& u, double& v) override {
+		uint32_t dim_seed = hash_combine(pixel_seed, dimension);
+		dimension += 2;
+		uint32_t shuffled = nested_uniform_scramble(index, dim_seed);
+		u = u32_to_unit(nested_uniform_scramble(sobol_2d(shuffled, 0), hash_combine(dim_seed, 0)));
+		v = u32_to_unit(nested_uniform_scramble(sobol_2d(shuffled, 1), hash_combine(dim_seed, 1)));
+	}
+
+	virtual shared_ptr<sampler> clone() const override { return make_shared<sobol_sampler>(*this); }
+	virtual const char* name() const override { return "sobol"; }
+};
+
+/// <summary>
+/// Creates a sampler by name ("random", "stratified" or "sobol").
+/// Returns nullptr for unknown names.
+/// </summary>
+inline shared_ptr<sampler> make_sampler(const std::string& name, int spp, uint32_t seed) {
+	if (name == "random")
+		return make_shared<random_sampler>(spp, seed);
+	if (name == "stratified")
+		return make_shared<stratified_sampler>(spp, seed);
+	if (name == "sobol")
+		return make_shared<sobol_sampler>(spp, seed);
+	return nullptr;
+}
+
+// Active sampler
+// --------------------------
+// The renderer installs a sampler per thread before tracing a pixel sample.
+// Camera, materials and media draw their random numbers through the functions below.
+// Outside of rendering (ie. scene construction) they fall back to random_double().
+
+inline sampler*& active_sampler() {
+	thread_local sampler* current = nullptr;
+	return current;
+}
+
+inline double sample_1d() {
+	sampler* s = active_sampler();
+	return s ? s->get_1d() : random_double();
+}
+
+/// <summary>
+/// sampler::get_keyed_1d of the active sampler
+/// </summary>
+inline double sample_keyed_1d(uint32_t key) {
+	sampler* s = active_sampler();
+	return s ? s->get_keyed_1d(key) : random_double();
+}
+
+inline void sample_2d(double& u, double& v) {
+	sampler* s = active_sampler();
+	if (s) {
+		s->get_2d(u, v);
+	}
+	else {
+		u = random_double();
+		v = random_double();
+	}
+}
+
+// Sample warping
+// --------------------------
+// Direct mappings from the unit square. Unlike the rejection loops in vec3.h
+// they consume a fixed number of dimensions, which keeps the streams stratified.
+
+/// <summary>
+/// Uniform direction on the unit sphere
+/// </summary>
+inline vec3 sample_unit_vector() {
+	double u, v;
+	sample_2d(u, v);
+	auto z = 1.0 - 2.0 * u;
+	auto r = sqrt(fmax(0.0, 1.0 - z * z));
+	auto phi = 2.0 * pi * v;
+	return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+/// <summary>
+/// Uniform point inside the unit sphere
+/// </summary>
+inline vec3 sample_in_unit_sphere() {
+	auto direction = sample_unit_vector();
+	return cbrt(sample_1d()) * direction;
+}
+
+/// <summary>
+/// Uniform point inside the unit disk (concentric mapping, Shirley-Chiu).
+/// </summary>
+inline vec3 sample_in_unit_disk() {
+	double u, v;
+	sample_2d(u, v);
+	auto a = 2.0 * u - 1.0;
+	auto b = 2.0 * v - 1.0;
+	if (a == 0 && b == 0)
+		return vec3(0, 0, 0);
+
+	double r, theta;
+	if (fabs(a) > fabs(b)) {
+		r = a;
+		theta = (pi / 4) * (b / a);
+	}
+	else {
+		r = b;
+		theta = (pi / 2) - (pi / 4) * (a / b);
+	}
+	return vec3(r * cos(theta), r * sin(theta), 0);
+}
@@ -0,0 +1,347 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "motion_bvh.h"
+#include "grid_accel.h"
+#include "constant_medium.h"
+#include "sampler.h"
+
+/// <summary>
+/// Structure build_scene_accel picked for a group of objects with accel "auto"
+/// </summary>
+struct accel_choice {
+	std::string group;			// "top level", or "nested" for a bvh_node built by the scene
+	size_t objects = 0;
+	double bvh_ns = 0.0;		// estimated nanoseconds per ray of each candidate
+	double grid_ns = 0.0;
+	bool grid = false;
+};
+
+/// <summary>
+/// Two-level acceleration structure over a world list. Bounded objects, instances and
+/// nested bvh_nodes go into one top-level structure; nested bvh_nodes stay bottom-level
+/// structures underneath it. Objects without a bounding box cannot be placed in a BVH
+/// and are kept in a separate list that every ray tests.
+/// </summary>
+class scene_accel : public hittable {
+public:
+	scene_accel() {}
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual void hit_packet(const ray_packet& p, int active, double t_min, packet_hits& hits) const override;
+	virtual int occluded_packet(const ray_packet& p, int active, double t_min, const double* t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual void refit(double time0, double time1) override;
+
+	/// <summary>
+	/// refit_growth of the top-level structure; 1 if it has no node boxes that stretch
+	/// (a list, or a motion_bvh_node, whose time segments are recomputed by refit)
+	/// </summary>
+	double refit_growth() const;
+
+public:
+	shared_ptr<hittable> top;	// top-level structure over bounded objects, null if there are none
+	hittable_list unbounded;	// objects without a bounding box
+	size_t bounded_count = 0;
+	std::vector<accel_choice> choices;	// what accel "auto" picked for each group
+	bool has_media = false;		// objects draw samples inside hit(), see contains_media
+};
+
+bool scene_accel::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	bool hit_anything = false;
+	if (top && top->hit(r, t_min, t_max, rec)) {
+		hit_anything = true;
+		t_max = rec.t;
+	}
+	if (!unbounded.objects.empty() && unbounded.hit(r, t_min, t_max, rec))
+		hit_anything = true;
+	return hit_anything;
+}
+
+bool scene_accel::occluded(const ray& r, double t_min, double t_max) const {
+	return (top && top->occluded(r, t_min, t_max))
+		|| (!unbounded.objects.empty() && unbounded.occluded(r, t_min, t_max));
+}
+
+void scene_accel::hit_packet(const ray_packet& p, int active, double t_min, packet_hits& hits) const {
+	if (top)
+		top->hit_packet(p, active, t_min, hits);
+	if (!unbounded.objects.empty())
+		unbounded.hit_packet(p, active, t_min, hits);
+}
+
+int scene_accel::occluded_packet(const ray_packet& p, int active, double t_min, const double* t_max) const {
+	int mask = top ? top->occluded_packet(p, active, t_min, t_max) : 0;
+	if (!unbounded.objects.empty() && (active & ~mask))
+		mask |= unbounded.occluded_packet(p, active & ~mask, t_min, t_max);
+	return mask;
+}
+
+bool scene_accel::bounding_box(double time0, double time1, aabb& output_box) const {
+	// Unbounded objects make the whole scene unbounded
+	if (!top || !unbounded.objects.empty())
+		return false;
+	return top->bounding_box(time0, time1, output_box);
+}
+
+void scene_accel::refit(double time0, double time1) {
+	if (top)
+		top->refit(time0, time1);
+	unbounded.refit(time0, time1);
+}
+
+double scene_accel::refit_growth() const {
+	if (auto wide8 = std::dynamic_pointer_cast<bvh8>(top))
+		return wide8->refit_growth();
+	if (auto wide4 = std::dynamic_pointer_cast<bvh4>(top))
+		return wide4->refit_growth();
+	if (auto node = std::dynamic_pointer_cast<bvh_node>(top))
+		return node->refit_growth();
+	return 1.0;
+}
+
+/// <summary>
+/// True if an object draws samples inside hit() (constant_medium). Such a hit has to be
+/// traced on its own pixel's sample stream, so packet tracing is off for worlds with media.
+/// Looks through lists, bvh_nodes, instances and scene_accel; other structures are not opened.
+/// </summary>
+inline bool contains_media(const hittable& object) {
+	if (dynamic_cast<const constant_medium*>(&object))
+		return true;
+	if (auto accel = dynamic_cast<const scene_accel*>(&object))
+		return accel->has_media;
+	if (auto list = dynamic_cast<const hittable_list*>(&object)) {
+		for (const auto& child : list->objects)
+			if (contains_media(*child))
+				return true;
+		return false;
+	}
+	if (auto node = dynamic_cast<const bvh_node*>(&object))
+		return contains_media(*node->left) || (node->right != node->left && contains_media(*node->right));
+	if (auto t = dynamic_cast<const translate*>(&object))
+		return contains_media(*t->ptr);
+	if (auto rx = dynamic_cast<const rotate_x*>(&object))
+		return contains_media(*rx->ptr);
+	if (auto ry = dynamic_cast<const rotate_y*>(&object))
+		return contains_media(*ry->ptr);
+	if (auto rz = dynamic_cast<const rotate_z*>(&object))
+		return contains_media(*rz->ptr);
+	return false;
+}
+
+/// <summary>
+/// Names accepted by build_scene_accel
+/// </summary>
+inline bool is_accel_name(const std::string& name) {
+	return name == "bvh" || name == "motion-bvh" || name == "bvh4" || name == "bvh8"
+		|| name == "wide" || name == "grid" || name == "auto" || name == "none";
+}
+
+/// <summary>
+/// Width of the bvh_wide an accel name builds, -1 for the binary and list kinds
+/// </summary>
+inline int accel_width(const std::string& accel) {
+	return accel == "bvh4" ? 4
+		 : accel == "bvh8" ? 8
+		 : accel == "wide" ? widest_bvh_width()
+						   : -1;
+}
+
+/// <summary>
+/// The object with its bvh_node replaced by convert(node). Instances (translate, rotate_*)
+/// are looked through; one wrapping a bvh_node comes back as a copy around the converted
+/// node, with the same bounds and hits. The object itself is never changed, so the world
+/// list stays as the scene built it.
+/// </summary>
+template <class Convert>
+inline shared_ptr<hittable> replace_nested_bvh(const shared_ptr<hittable>& object, Convert&& convert) {
+	if (auto node = std::dynamic_pointer_cast<bvh_node>(object))
+		return convert(node);
+
+	auto rewrap = [&](auto instance) -> shared_ptr<hittable> {
+		auto child = replace_nested_bvh(instance->ptr, convert);
+		if (child == instance->ptr)
+			return object;
+		auto copy = make_shared<typename decltype(instance)::element_type>(*instance);
+		copy->ptr = child;
+		return copy;
+	};
+	if (auto t = std::dynamic_pointer_cast<translate>(object))
+		return rewrap(t);
+	if (auto rx = std::dynamic_pointer_cast<rotate_x>(object))
+		return rewrap(rx);
+	if (auto ry = std::dynamic_pointer_cast<rotate_y>(object))
+		return rewrap(ry);
+	if (auto rz = std::dynamic_pointer_cast<rotate_z>(object))
+		return rewrap(rz);
+	return object;
+}
+
+/// <summary>
+/// Bottom-level structure for an object of the world list. For the wide kinds a nested
+/// bvh_node is collapsed into a bvh_wide of the same width.
+/// </summary>
+inline shared_ptr<hittable> to_bottom_level(const shared_ptr<hittable>& object, int width,
+											double time0, double time1) {
+	if (width < 0)
+		return object;
+	return replace_nested_bvh(object, [&](const shared_ptr<bvh_node>& node) -> shared_ptr<hittable> {
+		if (width == 8)
+			return make_shared<bvh8>(node, time0, time1);
+		return make_shared<bvh4>(node, time0, time1);
+	});
+}
+
+/// <summary>
+/// Rays for the cost estimate of a group, towards the centers of randomly picked objects so
+/// most of them hit something like the rays of a render do. Half start on a sphere around
+/// box (camera rays), half at another object (bounces). Deterministic, the same group always
+/// gets the same rays.
+/// </summary>
+std::vector<ray> estimate_rays(const std::vector<shared_ptr<hittable>>& objects, const aabb& box,
+							   double time0, double time1, int count) {
+	const point3 center = 0.5 * (box.min() + box.max());
+	const double radius = 0.75 * (box.max() - box.min()).length() + 1e-3;
+	auto unit = [](uint32_t k, uint32_t dim) { return u32_to_unit(hash_u32(k * 0x9e3779b9U ^ hash_u32(dim))); };
+	auto object_center = [&](uint32_t k, uint32_t dim, double time) {
+		aabb object_box;
+		const size_t pick = std::min(objects.size() - 1, static_cast<size_t>(unit(k, dim) * objects.size()));
+		if (!objects[pick]->bounding_box(time, time, object_box))
+			object_box = box;
+		return 0.5 * (object_box.min() + object_box.max());
+	};
+
+	std::vector<ray> rays;
+	rays.reserve(count);
+	for (int k = 0; k < count; k++) {
+		const double time = time0 + unit(k, 0) * (time1 - time0);
+		const double z = 2.0 * unit(k, 1) - 1.0, phi = 2.0 * pi * unit(k, 2);
+		const double s = sqrt(std::max(0.0, 1.0 - z * z));
+		const point3 outside = center + radius * vec3(s * cos(phi), s * sin(phi), z);
+		const point3 target = object_center(k, 3, time);
+		point3 origin = k % 2 == 0 ? outside : object_center(k, 4, time);
+		if ((target - origin).length_squared() < 1e-12 * radius * radius)
+			origin = outside;
+		rays.push_back(ray(origin, target - origin, time));
+	}
+	return rays;
+}
+
+/// <summary>
+/// Nanoseconds per closest-hit query of rays against structure, one timed pass
+/// </summary>
+double time_rays(const hittable& structure, const std::vector<ray>& rays) {
+	auto start = std::chrono::steady_clock::now();
+	hit_record rec;
+	for (const auto& r : rays)
+		structure.hit(r, 0.001, infinity, rec);
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / rays.size();
+}
+
+/// <summary>
+/// The cheaper of a wide BVH and a grid over objects, recorded in choices. The quick cost
+/// estimate times both on the same estimate_rays, alternating so both see the same machine
+/// load, and keeps the best of a few passes of each.
+/// </summary>
+shared_ptr<hittable> choose_structure(const shared_ptr<hittable>& bvh, const std::vector<shared_ptr<hittable>>& objects,
+									  const char* group, double time0, double time1,
+									  std::vector<accel_choice>& choices) {
+	if (objects.size() < 2)
+		return bvh;
+	auto grid = make_shared<grid_accel>(objects, time0, time1);
+	aabb box;
+	bvh->bounding_box(time0, time1, box);
+	const auto rays = estimate_rays(objects, box, time0, time1, 1024);
+
+	accel_choice choice;
+	choice.group = group;
+	choice.objects = objects.size();
+	choice.bvh_ns = infinity;
+	choice.grid_ns = infinity;
+	for (int pass = 0; pass < 5; pass++) {
+		choice.bvh_ns = std::min(choice.bvh_ns, time_rays(*bvh, rays));
+		choice.grid_ns = std::min(choice.grid_ns, time_rays(*grid, rays));
+	}
+	choice.grid = choice.grid_ns < choice.bvh_ns;
+	choices.push_back(choice);
+	if (choice.grid)
+		return grid;
+	return bvh;
+}
+
+/// <summary>
+/// Builds the acceleration structure the renderer traces.
+/// </summary>
+/// <param name="world">not changed; instances around converted bvh_nodes are copied</param>
+/// <param name="accel">"wide" (bvh_wide of the widest width the CPU supports), "bvh4", "bvh8",
+/// "bvh" (bvh_node), "motion-bvh" (motion_bvh_node), "grid" (grid_accel, also for the nested
+/// bvh_nodes), "auto" (wide or grid for the top level and each nested bvh_node, whichever
+/// choose_structure finds cheaper) or "none" (plain list)</param>
+/// <param name="time0">shutter open</param>
+/// <param name="time1">shutter close</param>
+/// <param name="motion_steps">time segments per node of "motion-bvh"</param>
+/// <returns></returns>
+shared_ptr<scene_accel> build_scene_accel(const hittable_list& world, const std::string& accel,
+										  double time0, double time1, int motion_steps = 1) {
+	RT_TRACE_SCOPE("build_scene_accel", "build");
+	auto result = make_shared<scene_accel>();
+	result->has_media = contains_media(world);
+
+	const int width = accel_width(accel);
+
+	auto grid_bottom_level = [&](const shared_ptr<bvh_node>& node) -> shared_ptr<hittable> {
+		std::vector<shared_ptr<hittable>> leaves;
+		bvh_leaves(node, leaves);
+		return make_shared<grid_accel>(leaves, time0, time1);
+	};
+	auto auto_bottom_level = [&](const shared_ptr<bvh_node>& node) -> shared_ptr<hittable> {
+		std::vector<shared_ptr<hittable>> leaves;
+		bvh_leaves(node, leaves);
+		return choose_structure(to_bottom_level(node, widest_bvh_width(), time0, time1), leaves, "nested",
+								time0, time1, result->choices);
+	};
+
+	hittable_list bounded;
+	for (const auto& object : world.objects) {
+		aabb box;
+		if (!object->bounding_box(time0, time1, box))
+			result->unbounded.add(object);
+		else if (accel == "grid")
+			bounded.add(replace_nested_bvh(object, grid_bottom_level));
+		else if (accel == "auto")
+			bounded.add(replace_nested_bvh(object, auto_bottom_level));
+		else
+			bounded.add(to_bottom_level(object, width, time0, time1));
+	}
+	result->bounded_count = bounded.objects.size();
+
+	if (bounded.objects.empty())
+		return result;
+
+	if (accel == "none")
+		result->top = make_shared<hittable_list>(bounded);
+	else if (accel == "grid")
+		result->top = make_shared<grid_accel>(bounded, time0, time1);
+	else if (accel == "auto")
+		result->top = choose_structure(make_wide_bvh(bounded, time0, time1), bounded.objects, "top level",
+									   time0, time1, result->choices);
+	else if (accel == "motion-bvh")
+		result->top = make_shared<motion_bvh_node>(bounded, time0, time1, motion_steps);
+	else if (width == 8)
+		result->top = make_shared<bvh8>(bounded, time0, time1);
+	else if (width == 4)
+		result->top = make_shared<bvh4>(bounded, time0, time1);
+	else
+		result->top = make_shared<bvh_node>(bounded, time0, time1);
+
+	return result;
+}
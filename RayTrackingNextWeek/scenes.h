@@ -0,0 +1,485 @@
+#pragma once
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "camera.h"
+#include "material.h"
+#include "aarect.h"
+#include "box.h"
+#include "constant_medium.h"
+#include "bvh.h"
+#include "trace.h"
+#include "procedural_scenes.h"
+
+// Scenes
+hittable_list random_scene() {
+
+	hittable_list world;
+
+	auto checker = make_scene_object<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+	auto ground_material = make_scene_object<lambertian>(checker);
+	world.add(make_scene_object<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+	for (int a = -11; a < 11; a++) {
+		for (int b = -11; b < 11; b++) {
+			auto choose_mat = random_double();
+			point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+			if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+				shared_ptr<material> sphere_material;
+
+				if (choose_mat < 0.8) {
+					// Diffuse 
+					auto albedo = color::random() * color::random();
+					sphere_material = make_scene_object<lambertian>(albedo);
+					auto center2 = center + vec3(0, random_double(0, 0.75), 0);
+					world.add(make_scene_object<moving_sphere>(
+						center, center2, 0.0, 1.0, 0.2, sphere_material));
+				}
+				else if (choose_mat < 0.95) {
+					// metal 
+					auto albedo = color::random(0.5, 1);
+					auto fuzz = random_double(0, 0.5);
+					sphere_material = make_scene_object<metal>(albedo, fuzz);
+					world.add(make_scene_object<sphere>(center, 0.2, sphere_material));
+				}
+				else {
+					// glass 
+					sphere_material = make_scene_object<dielectric>(1.5);
+					double randomRadius = random_double(0.1, 0.9);
+					world.add(make_scene_object<sphere>(center, randomRadius, sphere_material));
+				}
+			}
+		}
+	}
+
+	auto material1 = make_scene_object<dielectric>(1.5);
+	world.add(make_scene_object<sphere>(point3(0, 1, 0), 1.0, material1));
+
+	auto material2 = make_scene_object<lambertian>(color(0.4, 0.2, 0.1));
+	world.add(make_scene_object<sphere>(point3(-4, 1, 0), 1.0, ground_material));
+
+	auto material3 = make_scene_object<metal>(color(0.7, 0.6, 0.5), 0.0);
+	world.add(make_scene_object<sphere>(point3(4, 1, 0), 1.0, material3));
+
+	return world;
+}
+hittable_list two_spheres() {
+	hittable_list objects; 
+
+	auto checker = make_scene_object<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+	auto checker_material = make_scene_object<lambertian>(checker);
+
+	objects.add(make_scene_object<sphere>(point3(0, -10, 0), 10, make_scene_object<lambertian>(checker)));
+	objects.add(make_scene_object<sphere>(point3(0, 10, 0), 10, make_scene_object<lambertian>(checker)));
+
+	return objects;
+}
+hittable_list two_perlin_spheres() {
+	hittable_list objects; 
+
+	auto pertext = make_scene_object<noise_texture>(4); 
+	auto pertext_material = make_scene_object<lambertian>(pertext);
+
+	objects.add(make_scene_object<sphere>(point3(0, -1000, 0), 1000, pertext_material));
+	objects.add(make_scene_object<sphere>(point3(0, 2, 0), 2, pertext_material));
+
+	return objects;
+}
+hittable_list earth(){
+	hittable_list objects;
+
+	auto perlinNoise = make_scene_object<noise_texture>(4);
+	auto groundMat = make_scene_object<lambertian>(perlinNoise);
+	objects.add(make_scene_object<xz_rect>(-100, 100, -100, 100, -2, groundMat));
+
+	auto white = make_scene_object<lambertian>(color(0.73, 0.73, 0.73));
+	objects.add(make_scene_object<sphere>(point3(1, 0, -3), 1, white));
+
+	auto earth_texture = make_scene_object<image_texture>("..\\_SourceImages\\earthmap.jpg"); 
+	auto earth_surface = make_scene_object<metal>(earth_texture, .05); 
+	auto globe = make_scene_object<sphere>(point3(0, 0, 0), 2, earth_surface);
+	objects.add(globe); 
+
+	return objects;
+}
+hittable_list simple_light() {
+	hittable_list objects;
+
+	auto pertext = make_scene_object<noise_texture>(4);
+	auto pertext_material = make_scene_object<lambertian>(pertext);
+
+	objects.add(make_scene_object<sphere>(point3(0, -1000, 0), 1000, pertext_material));
+	objects.add(make_scene_object<sphere>(point3(0, 2, 0), 2, pertext_material));
+
+	auto difflight = make_scene_object<diffuse_light>(color(4, 4, 4));
+	objects.add(make_scene_object<xy_rect>(3, 5, 1, 3, -2, difflight));
+	objects.add(make_scene_object<sphere>(point3(0, 8, 0), 3, difflight));
+
+	return objects;
+}
+hittable_list cornell_box() {
+	hittable_list objects;
+
+	auto red = make_scene_object<lambertian>(color(0.65, 0.05, 0.05));
+	auto white = make_scene_object<lambertian>(color(0.73, 0.73, 0.73));
+	auto green = make_scene_object<lambertian>(color(0.12, 0.45, 0.15));
+	auto light = make_scene_object<diffuse_light>(color(15, 15, 15));
+
+	objects.add(make_scene_object<yz_rect>(0, 555, 0, 555, 555, green));
+	objects.add(make_scene_object<yz_rect>(0, 555, 0, 555, 0, red));
+	objects.add(make_scene_object<xz_rect>(150, 400, 200, 350, 554, light));
+	objects.add(make_scene_object<xz_rect>(0, 555, 0, 555, 0, white));
+	objects.add(make_scene_object<xz_rect>(0, 555, 0, 555, 555, white));
+	objects.add(make_scene_object<xy_rect>(0, 555, 0, 555, 555, white));
+
+	shared_ptr<hittable> box1 = make_scene_object<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+	box1 = make_scene_object<rotate_y>(box1, 15);
+	box1 = make_scene_object<translate>(box1, vec3(265, 0, 295));
+	objects.add(box1);
+
+	shared_ptr<hittable> box2 = make_scene_object<box>(point3(0, 0, 0), point3(165, 165, 165), white);
+	//box2 = make_scene_object<rotate_x>(box2, -20);
+	box2 = make_scene_object<rotate_y>(box2, -18);
+	//box2 = make_scene_object<rotate_z>(box2, -18);
+	box2 = make_scene_object<translate>(box2, vec3(130, 1, 65));
+	objects.add(box2);
+
+	/*
+	auto earth_texture = make_scene_object<image_texture>("..\\_SourceImages\\earthmap.jpg");
+	auto earthMetal_surface = make_scene_object<metal>(earth_texture, .2);
+	auto globe = make_scene_object<sphere>(point3(150, 100, 200), 100, earthMetal_surface);
+	objects.add(globe);
+	*/
+
+	return objects;
+}
+hittable_list cornell_smoke() {
+	hittable_list objects;
+
+	auto red = make_scene_object<lambertian>(color(0.65, 0.05, 0.05));
+	auto white = make_scene_object<lambertian>(color(0.73, 0.73, 0.73));
+	auto green = make_scene_object<lambertian>(color(0.12, 0.45, 0.15));
+	auto light = make_scene_object<diffuse_light>(color(15, 15, 15));
+
+	objects.add(make_scene_object<yz_rect>(0, 555, 0, 555, 555, green));
+	objects.add(make_scene_object<yz_rect>(0, 555, 0, 555, 0, red));
+	objects.add(make_scene_object<xz_rect>(150, 400, 200, 350, 554, light));
+	objects.add(make_scene_object<xz_rect>(0, 555, 0, 555, 0, white));
+	objects.add(make_scene_object<xz_rect>(0, 555, 0, 555, 555, white));
+	objects.add(make_scene_object<xy_rect>(0, 555, 0, 555, 555, white));
+
+	shared_ptr<hittable> box1 = make_scene_object<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+	box1 = make_scene_object<rotate_y>(box1, 15);
+	box1 = make_scene_object<translate>(box1, vec3(265, 0, 295));
+	objects.add(make_scene_object<constant_medium>(box1, 0.01, color(0, 0, 0)));
+
+	shared_ptr<hittable> box2 = make_scene_object<box>(point3(0, 0, 0), point3(165, 165, 165), white);
+	box2 = make_scene_object<rotate_y>(box2, -18);
+	box2 = make_scene_object<translate>(box2, vec3(130, 1, 65));
+	objects.add(make_scene_object<constant_medium>(box2, 0.01, color(1,1,1)));
+
+
+	return objects;
+}
+hittable_list final_scene() {
+	auto ground = make_scene_object<lambertian>(color(0.48, 0.83, 0.53));
+
+	// 20 x 20 boxes of random height as one box_grid
+	const int boxes_per_side = 20;
+	std::vector<float> heights(boxes_per_side * boxes_per_side);
+	for (int i = 0; i < boxes_per_side; i++) {
+		for (int j = 0; j < boxes_per_side; j++)
+			heights[j * boxes_per_side + i] = static_cast<float>(random_double(1, 101));
+	}
+
+	// The boxes used to be in a bvh_node of 511 nodes, each of which drew a random split axis.
+	// Drawing as many here keeps the sphere cloud and the noise of this scene where they were,
+	// whatever the acceleration structures do with rand() now.
+	const int old_ground_bvh_nodes = 511;
+	for (int n = 0; n < old_ground_bvh_nodes; n++)
+		random_int(0, 2);
+
+	hittable_list objects;
+
+	objects.add(make_scene_object<box_grid>(point3(-1000, 0, -1000), 100.0, 100.0, boxes_per_side, boxes_per_side,
+											std::move(heights), ground));
+
+	auto light = make_scene_object<diffuse_light>(color(7, 7, 7));
+	objects.add(make_scene_object<xz_rect>(123, 423, 147, 412, 554, light));
+
+	auto center1 = point3(400, 400, 200);
+	auto center2 = center1 + vec3(30, 0, 0);
+	auto moving_sphere_material = make_scene_object<lambertian>(color(0.7, 0.3, 0.1));
+	objects.add(make_scene_object<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+
+	objects.add(make_scene_object<sphere>(point3(260, 150, 45), 50, make_scene_object<dielectric>(1.5)));
+	objects.add(make_scene_object<sphere>(
+		point3(0, 150, 145), 50, make_scene_object<metal>(color(0.8, 0.8, 0.9), 1.0)
+		));
+
+	auto boundary = make_scene_object<sphere>(point3(360, 150, 145), 70, make_scene_object<dielectric>(1.5));
+	objects.add(boundary);
+	objects.add(make_scene_object<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
+	boundary = make_scene_object<sphere>(point3(0, 0, 0), 5000, make_scene_object<dielectric>(1.5));
+	objects.add(make_scene_object<constant_medium>(boundary, .0001, color(1, 1, 1)));
+
+	auto emat = make_scene_object<lambertian>(make_scene_object<image_texture>("..\\_SourceImages\\earthmap.jpg"));
+	objects.add(make_scene_object<sphere>(point3(400, 200, 400), 100, emat));
+	auto pertext = make_scene_object<noise_texture>(0.1);
+	objects.add(make_scene_object<sphere>(point3(220, 280, 300), 80, make_scene_object<lambertian>(pertext)));
+
+	hittable_list boxes2;
+	auto white = make_scene_object<lambertian>(color(.73, .73, .73));
+	int ns = 1000;
+	for (int j = 0; j < ns; j++) {
+		boxes2.add(make_scene_object<sphere>(point3::random(0, 165), 10, white));
+	}
+
+	objects.add(make_scene_object<translate>(
+		make_scene_object<rotate_y>(
+			make_scene_object<bvh_node>(boxes2, 0.0, 1.0), 15),
+		vec3(-100, 270, 395)
+		)
+	);
+
+	return objects;
+}
+
+/// <summary>
+/// World and view settings of a built-in scene
+/// </summary>
+struct scene_config {
+	shared_ptr<scene_arena> arena;	// owns the objects of world, null when built on the heap
+	hittable_list world;
+	double aspect_ratio = 16.0 / 9.0;
+	int image_width = 480;
+	int samples_per_pixel = 100;	// Sets anti-alaising samples
+	point3 lookfrom;
+	point3 lookat;
+	double vfov = 40.0;
+	double aperture = 0.0;
+	color background = color(0, 0, 0);
+};
+
+const int builtin_scene_count = 8;
+
+// Generated scenes of any size, see procedural_scenes.h
+const int first_generated_scene = 10;
+const int last_generated_scene = 17;
+const size_t default_generated_primitives = 100000;
+
+inline bool is_generated_scene(int scene_id) {
+	return scene_id >= first_generated_scene && scene_id <= last_generated_scene;
+}
+
+/// <summary>
+/// Name of the scene function behind a built-in scene id
+/// </summary>
+/// <param name="scene_id"></param>
+/// <returns></returns>
+const char* scene_name(int scene_id) {
+	switch (scene_id)
+	{
+	case 1: return "random_scene";
+	case 2: return "two_spheres";
+	case 3: return "two_perlin_spheres";
+	case 4: return "earth";
+	case 5: return "simple_light";
+	case 6: return "cornell_box";
+	case 7: return "cornell_smoke";
+	case 8: return "final_scene";
+	case 10: return "many_spheres";
+	case 11: return "instanced_boxes";
+	case 12: return "clustered_spheres";
+	case 13: return "dense_spheres";
+	case 14: return "moving_spheres";
+	case 15: return "many_lights";
+	case 16: return "terrain_grid";
+	case 17: return "terrain_boxes";
+	default: return "empty";
+	}
+}
+
+/// <summary>
+/// Builds a built-in scene by id (1 = random_scene ... 8 = final_scene, 10 - 17 generated scenes)
+/// </summary>
+/// <param name="scene_id"></param>
+/// <param name="use_arena">create the scene objects in scene.arena instead of one heap allocation each.
+/// The world then only holds non-owning handles and must not outlive the returned scene_config.</param>
+/// <param name="primitives">size of a generated scene, 0 for default_generated_primitives</param>
+/// <param name="build_world">false only fills in the view settings and leaves the world empty</param>
+/// <returns></returns>
+scene_config select_scene(int scene_id, bool use_arena = true, size_t primitives = 0, bool build_world = true) {
+	RT_TRACE_SCOPE(scene_name(scene_id), "scene");
+	scene_config scene;
+	if (primitives == 0)
+		primitives = default_generated_primitives;
+	// Generated scenes are for timing, so they render with fewer samples
+	if (is_generated_scene(scene_id)) {
+		scene.samples_per_pixel = 16;
+		scene.background = color(0.70, 0.80, 1.00);
+		scene.lookat = point3(0, 0, 0);
+		scene.vfov = 40.0;
+	}
+	if (use_arena && build_world) {
+		scene.arena = make_shared<scene_arena>();
+		active_arena() = scene.arena.get();
+	}
+
+	switch (scene_id)
+	{
+	case 1:
+		if (build_world)
+			scene.world = random_scene();
+		scene.background = color(0.70, 0.80, 1.00);
+		scene.lookfrom = point3(13, 2, 3);
+		scene.lookat = point3(0, 0, 0);
+		scene.vfov = 20.0;
+		scene.aperture = 0.1;
+		break;
+
+	case 2:
+		if (build_world)
+			scene.world = two_spheres();
+		scene.background = color(0.70, 0.80, 1.00);
+		scene.lookfrom = point3(13, 2, 3);
+		scene.lookat = point3(0, 0, 0);
+		scene.vfov = 20.0;
+		break;
+
+	case 3:
+		if (build_world)
+			scene.world = two_perlin_spheres();
+		scene.background = color(0.70, 0.80, 1.00);
+		scene.lookfrom = point3(13, 2, 3);
+		scene.lookat = point3(0, 0, 0);
+		scene.vfov = 20.0;
+		break;
+
+	case 4:
+		if (build_world)
+			scene.world = earth();
+		scene.background = color(0.70, 0.80, 1.00);
+		scene.lookfrom = point3(13, 2, 3);
+		scene.lookat = point3(0, 0, 0);
+		scene.vfov = 20.0;
+		break;
+
+	case 5:
+		if (build_world)
+			scene.world = simple_light();
+		scene.samples_per_pixel = 400;
+		scene.background = color(0, 0, 0);
+		scene.lookfrom = point3(26, 3, 6);
+		scene.lookat = point3(0, 2, 0);
+		scene.vfov = 20.0;
+		break;
+
+	case 6:
+		if (build_world)
+			scene.world = cornell_box();
+		scene.aspect_ratio = 1.0;
+		scene.image_width = 600;
+		scene.samples_per_pixel = 1000;
+		scene.background = color(0, 0, 0);
+		scene.lookfrom = point3(278, 278, -800);
+		scene.lookat = point3(278, 278, 0);
+		scene.vfov = 40.0;
+		break;
+
+	case 7:
+		if (build_world)
+			scene.world = cornell_smoke();
+		scene.aspect_ratio = 1.0;
+		scene.image_width = 600;
+		scene.samples_per_pixel = 1000;
+		scene.lookfrom = point3(278, 278, -800);
+		scene.lookat = point3(278, 278, 0);
+		scene.vfov = 40.0;
+		break;
+
+	case 8:
+		if (build_world)
+			scene.world = final_scene();
+		scene.aspect_ratio = 1.0;
+		scene.image_width = 800;
+		scene.samples_per_pixel = 500;
+		scene.background = color(0.5, 0.7, 1.0);
+		scene.lookfrom = point3(478, 278, -600);
+		scene.lookat = point3(278, 278, 0);
+		scene.vfov = 40.0;
+		break;
+
+	case 10:
+		if (build_world)
+			scene.world = many_spheres(primitives);
+		scene.lookfrom = generated_volume_view(generated_cube_side(primitives, 2.0));
+		break;
+
+	case 11:
+		if (build_world)
+			scene.world = instanced_boxes(primitives);
+		scene.lookfrom = generated_plane_view(generated_square_side(primitives, 2.0));
+		break;
+
+	case 12:
+		if (build_world)
+			scene.world = clustered_spheres(primitives);
+		scene.lookfrom = generated_volume_view(generated_cube_side(primitives, 2.0));
+		break;
+
+	case 13:
+		if (build_world)
+			scene.world = dense_spheres(primitives);
+		scene.lookfrom = generated_volume_view(generated_cube_side(primitives, 0.5));
+		break;
+
+	case 14:
+		if (build_world)
+			scene.world = moving_spheres(primitives);
+		scene.lookfrom = generated_plane_view(generated_square_side(primitives, 1.0));
+		break;
+
+	case 15:
+		if (build_world)
+			scene.world = many_lights(primitives);
+		scene.background = color(0, 0, 0);
+		scene.lookfrom = generated_plane_view(generated_square_side(primitives, 2.0));
+		break;
+
+	case 16:
+		if (build_world)
+			scene.world = terrain_grid(primitives);
+		scene.lookfrom = generated_plane_view(generated_square_side(primitives, 1.0));
+		break;
+
+	case 17:
+		if (build_world)
+			scene.world = terrain_boxes(primitives);
+		scene.lookfrom = generated_plane_view(generated_square_side(primitives, 1.0));
+		break;
+
+	default:
+	case 9:
+		scene.background = color(0.0, 0.0, 0.0);
+		break;
+	}
+
+	active_arena() = nullptr;
+	return scene;
+}
+
+/// <summary>
+/// Camera for a scene. Shutter is open from time 0 to 1.
+/// </summary>
+/// <param name="scene"></param>
+/// <returns></returns>
+camera make_camera(const scene_config& scene) {
+	vec3 vup(0, 1, 0);
+	auto dist_to_focus = 10.0;
+
+	return camera(scene.lookfrom, scene.lookat, vup, scene.vfov, scene.aspect_ratio,
+				  scene.aperture, dist_to_focus, 0.0, 1.0);
+}
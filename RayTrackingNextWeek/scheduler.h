@@ -0,0 +1,226 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing tile scheduler
+// --------------------------
+// Every render thread owns a deque of tiles. A thread takes tiles from the back of its own
+// deque and, once that is empty, steals from the front of another thread's deque, where the
+// largest pieces are. A tile whose estimated cost is above split_cost is cut in two when it
+// is taken, and the halves go back onto the taker's deque, so expensive parts of the image
+// end up in small pieces other threads can steal while cheap parts stay in large tiles.
+
+/// <summary>
+/// Pixels [x0, x1) x [y0, y1) of the image (rows from the top) and their estimated cost
+/// </summary>
+struct render_tile {
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+	double cost = 0.0;
+
+	int width() const { return x1 - x0; }
+	int height() const { return y1 - y0; }
+	size_t pixel_count() const { return static_cast<size_t>(width()) * height(); }
+};
+
+/// <summary>
+/// Where a render thread spent its time
+/// </summary>
+struct thread_utilization {
+	double busy_seconds = 0.0;	// rendering pixels
+	int tiles = 0;				// tiles rendered
+	int stolen = 0;				// tiles taken from other threads
+	int splits = 0;				// tiles cut in two by this thread
+};
+
+/// <summary>
+/// Cost of every pixel of an image region, estimated from a sparse grid of pilot samples.
+/// Pixel (x, y) gets the cost measured at the grid point of its stride x stride cell.
+/// </summary>
+struct cost_estimate {
+	int x0 = 0, y0 = 0;
+	int stride = 1;
+	int columns = 0, rows = 0;
+	std::vector<float> cell_cost;	// seconds per sample of one pixel of the cell
+
+	bool empty() const { return cell_cost.empty(); }
+
+	/// <summary>
+	/// Estimated seconds per sample of all pixels of a tile
+	/// </summary>
+	double tile_cost(const render_tile& tile) const {
+		if (empty())
+			return static_cast<double>(tile.pixel_count());
+		double cost = 0.0;
+		for (int cy = (tile.y0 - y0) / stride; cy <= (tile.y1 - 1 - y0) / stride; cy++) {
+			const int cell_y0 = std::max(tile.y0, y0 + cy * stride);
+			const int cell_y1 = std::min(tile.y1, y0 + (cy + 1) * stride);
+			for (int cx = (tile.x0 - x0) / stride; cx <= (tile.x1 - 1 - x0) / stride; cx++) {
+				const int cell_x0 = std::max(tile.x0, x0 + cx * stride);
+				const int cell_x1 = std::min(tile.x1, x0 + (cx + 1) * stride);
+				cost += cell_cost[static_cast<size_t>(cy) * columns + cx]
+					* (cell_x1 - cell_x0) * (cell_y1 - cell_y0);
+			}
+		}
+		return cost;
+	}
+};
+
+class tile_scheduler {
+public:
+	/// <summary>
+	/// Cuts the region into tiles of tile_size pixels and deals them out to the threads in
+	/// contiguous runs, so every thread starts on its own part of the image.
+	/// </summary>
+	/// <param name="x_align">x positions tiles are split at are multiples of this (eg. packet_width)</param>
+	/// <param name="tiles_per_thread">tiles are split until their cost is below the total cost / (threads * tiles_per_thread)</param>
+	tile_scheduler(int x0, int y0, int x1, int y1, int thread_count, const cost_estimate& _costs,
+				   int tile_size = 32, int _x_align = 8, int tiles_per_thread = 16)
+		: costs(_costs), x_origin(x0), x_align(std::max(1, _x_align)), queues(std::max(1, thread_count)) {
+
+		std::vector<render_tile> tiles;
+		double total_cost = 0.0;
+		for (int ty = y0; ty < y1; ty += tile_size) {
+			for (int tx = x0; tx < x1; tx += tile_size) {
+				render_tile tile;
+				tile.x0 = tx;
+				tile.y0 = ty;
+				tile.x1 = std::min(tx + tile_size, x1);
+				tile.y1 = std::min(ty + tile_size, y1);
+				tile.cost = costs.tile_cost(tile);
+				total_cost += tile.cost;
+				tiles.push_back(tile);
+			}
+		}
+		split_cost = total_cost / (static_cast<double>(queues.size()) * tiles_per_thread);
+
+		for (size_t t = 0; t < tiles.size(); t++)
+			queues[t * queues.size() / tiles.size()].tiles.push_back(tiles[t]);
+		queued = static_cast<int>(tiles.size());
+	}
+
+	/// <summary>
+	/// Gets the next tile of a thread: from its own deque, or stolen from another thread.
+	/// Returns false once every tile has been handed out.
+	/// </summary>
+	bool next(int thread, render_tile& tile, thread_utilization& utilization) {
+		while (queued > 0) {
+			if (take(thread, tile, utilization))
+				return true;
+
+			// Own deque is empty: steal the oldest (largest) tile of the next thread that has one
+			const int count = static_cast<int>(queues.size());
+			bool stole = false;
+			for (int k = 1; k < count && !stole; k++) {
+				tile_queue& victim = queues[(thread + k) % count];
+				std::unique_lock<std::mutex> lock(victim.mutex);
+				if (victim.tiles.empty())
+					continue;
+				render_tile stolen = victim.tiles.front();
+				victim.tiles.pop_front();
+				lock.unlock();
+
+				// Put it on the own deque, so it is split there and its halves can be stolen again
+				std::lock_guard<std::mutex> own_lock(queues[thread].mutex);
+				queues[thread].tiles.push_back(stolen);
+				utilization.stolen++;
+				stole = true;
+			}
+			if (!stole)
+				std::this_thread::yield();
+		}
+		return false;
+	}
+
+private:
+	struct tile_queue {
+		std::mutex mutex;
+		std::deque<render_tile> tiles;
+	};
+
+	/// <summary>
+	/// Pops the newest tile of a thread's own deque, splitting it while it is too expensive.
+	/// Splits happen under the deque's lock, so no thread sees the deques empty while
+	/// a tile is being cut.
+	/// </summary>
+	bool take(int thread, render_tile& tile, thread_utilization& utilization) {
+		tile_queue& own = queues[thread];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (own.tiles.empty())
+			return false;
+		tile = own.tiles.back();
+		own.tiles.pop_back();
+
+		render_tile first, second;
+		while (tile.cost > split_cost && split(tile, first, second)) {
+			own.tiles.push_back(second);
+			queued++;
+			utilization.splits++;
+			tile = first;
+		}
+		queued--;
+		return true;
+	}
+
+	/// <summary>
+	/// Cuts a tile in two across its longer side. x cuts keep to multiples of x_align from
+	/// the left of the region.
+	/// </summary>
+	bool split(const render_tile& tile, render_tile& first, render_tile& second) const {
+		first = second = tile;
+		const int x_mid = x_origin + (tile.x0 - x_origin + tile.width() / 2) / x_align * x_align;
+		const bool can_split_x = x_mid > tile.x0 && x_mid < tile.x1;
+		if (tile.height() > 1 && (tile.height() >= tile.width() || !can_split_x)) {
+			first.y1 = second.y0 = tile.y0 + tile.height() / 2;
+		}
+		else if (can_split_x) {
+			first.x1 = second.x0 = x_mid;
+		}
+		else {
+			return false;
+		}
+		first.cost = costs.tile_cost(first);
+		second.cost = costs.tile_cost(second);
+		return true;
+	}
+
+	const cost_estimate& costs;
+	const int x_origin;
+	const int x_align;
+	double split_cost = 0.0;
+	std::vector<tile_queue> queues;
+	std::atomic<int> queued{ 0 };	// tiles in the deques
+};
+
+/// <summary>
+/// Busy share of the render threads over seconds, 1 if every thread rendered all the time
+/// </summary>
+inline double mean_utilization(const std::vector<thread_utilization>& threads, double seconds) {
+	if (threads.empty() || seconds <= 0)
+		return 0.0;
+	double busy = 0.0;
+	for (const auto& u : threads)
+		busy += u.busy_seconds;
+	return busy / (seconds * threads.size());
+}
+
+/// <summary>
+/// One line per render thread: share of seconds it was busy, and its tiles
+/// </summary>
+void print_thread_utilization(std::ostream& out, const std::vector<thread_utilization>& threads, double seconds) {
+	out << "thread      busy    tiles   stolen   splits\n";
+	out << std::fixed << std::setprecision(1);
+	for (size_t t = 0; t < threads.size(); t++) {
+		const auto& u = threads[t];
+		out << std::setw(6) << t << std::setw(9) << (seconds > 0 ? 100.0 * u.busy_seconds / seconds : 0.0) << '%'
+			<< std::setw(8) << u.tiles << std::setw(9) << u.stolen << std::setw(9) << u.splits << '\n';
+	}
+	out << "utilization " << 100.0 * mean_utilization(threads, seconds) << "%\n";
+	out.unsetf(std::ios::floatfield);
+	out << std::setprecision(6);
+}
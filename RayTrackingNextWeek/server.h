@@ -0,0 +1,783 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "sampler.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "scene_accel.h"
+#include "distributed.h"
+
+// Render server
+// --------------------------
+// A long running process that listens on a socket (usually a local Unix socket) and
+// renders the jobs clients send it. Built scenes and their acceleration structures stay
+// in a cache between jobs, so a job on a cached scene only pays for its pixels. All jobs
+// share one pool of render threads, which take bands of rows from the running jobs in
+// turn. A client sends one msg_request per job and gets a msg_reply with the outcome and
+// timings of the job, followed by a msg_image unless the server wrote the image to disk.
+
+/// <summary>
+/// A job sent to the render server. Sizes and sample counts of 0 and unset camera values
+/// keep the settings of the scene. Sent as "key=value" lines.
+/// </summary>
+struct render_request {
+	int scene_id = 8;
+	size_t primitives = 0;		// size of a generated scene, 0 for the default
+	int image_width = 0;
+	int image_height = 0;		// 0 derives the height from the width and the scene's aspect ratio
+	int samples_per_pixel = 0;
+	int max_depth = 50;
+	bool packets = true;
+	std::string accel = "wide";
+	int motion_steps = 1;
+	std::string sampler_name = "random";
+	uint32_t seed = 0;
+	bool use_arena = true;
+	bool has_lookfrom = false;
+	bool has_lookat = false;
+	point3 lookfrom;
+	point3 lookat;
+	double vfov = 0.0;			// 0 keeps the scene's field of view
+	double aperture = -1.0;		// < 0 keeps the scene's aperture
+	std::string output_path;	// file the server writes the image to, empty sends it back
+
+	std::string to_text() const {
+		std::ostringstream out;
+		out.precision(17);
+		out << "scene=" << scene_id << '\n'
+			<< "primitives=" << primitives << '\n'
+			<< "width=" << image_width << '\n'
+			<< "height=" << image_height << '\n'
+			<< "spp=" << samples_per_pixel << '\n'
+			<< "depth=" << max_depth << '\n'
+			<< "packets=" << (packets ? 1 : 0) << '\n'
+			<< "accel=" << accel << '\n'
+			<< "motion_steps=" << motion_steps << '\n'
+			<< "sampler=" << sampler_name << '\n'
+			<< "seed=" << seed << '\n'
+			<< "arena=" << (use_arena ? 1 : 0) << '\n';
+		if (has_lookfrom)
+			out << "lookfrom=" << lookfrom.x() << ',' << lookfrom.y() << ',' << lookfrom.z() << '\n';
+		if (has_lookat)
+			out << "lookat=" << lookat.x() << ',' << lookat.y() << ',' << lookat.z() << '\n';
+		if (vfov > 0)
+			out << "vfov=" << vfov << '\n';
+		if (aperture >= 0)
+			out << "aperture=" << aperture << '\n';
+		if (!output_path.empty())
+			out << "output=" << output_path << '\n';
+		return out.str();
+	}
+
+	bool from_text(const std::string& text) {
+		std::istringstream in(text);
+		std::string line;
+		while (std::getline(in, line)) {
+			auto equals = line.find('=');
+			if (equals == std::string::npos)
+				return false;
+			std::string key = line.substr(0, equals);
+			std::string value = line.substr(equals + 1);
+			if (key == "scene")
+				scene_id = atoi(value.c_str());
+			else if (key == "primitives")
+				primitives = static_cast<size_t>(strtoull(value.c_str(), nullptr, 10));
+			else if (key == "width")
+				image_width = atoi(value.c_str());
+			else if (key == "height")
+				image_height = atoi(value.c_str());
+			else if (key == "spp")
+				samples_per_pixel = atoi(value.c_str());
+			else if (key == "depth")
+				max_depth = atoi(value.c_str());
+			else if (key == "packets")
+				packets = value == "1";
+			else if (key == "accel")
+				accel = value;
+			else if (key == "motion_steps")
+				motion_steps = atoi(value.c_str());
+			else if (key == "sampler")
+				sampler_name = value;
+			else if (key == "seed")
+				seed = static_cast<uint32_t>(strtoul(value.c_str(), nullptr, 10));
+			else if (key == "arena")
+				use_arena = value == "1";
+			else if (key == "lookfrom")
+				has_lookfrom = parse_point(value, lookfrom);
+			else if (key == "lookat")
+				has_lookat = parse_point(value, lookat);
+			else if (key == "vfov")
+				vfov = atof(value.c_str());
+			else if (key == "aperture")
+				aperture = atof(value.c_str());
+			else if (key == "output")
+				output_path = value;
+		}
+		return image_width >= 0 && image_height >= 0 && samples_per_pixel >= 0;
+	}
+
+	/// <summary>
+	/// Reads a point given as "X,Y,Z"
+	/// </summary>
+	static bool parse_point(const std::string& text, point3& p) {
+		double x, y, z;
+		if (sscanf(text.c_str(), "%lf,%lf,%lf", &x, &y, &z) != 3)
+			return false;
+		p = point3(x, y, z);
+		return true;
+	}
+};
+
+/// <summary>
+/// Puts the camera values of a request into the scene
+/// </summary>
+inline void apply_request_camera(const render_request& request, scene_config& scene) {
+	if (request.has_lookfrom)
+		scene.lookfrom = request.lookfrom;
+	if (request.has_lookat)
+		scene.lookat = request.lookat;
+	if (request.vfov > 0)
+		scene.vfov = request.vfov;
+	if (request.aperture >= 0)
+		scene.aperture = request.aperture;
+}
+
+// Shared render threads
+// --------------------------
+
+/// <summary>
+/// Render threads shared by every job of the server. A job is cut into bands of band_rows
+/// rows; the threads take the next band of each running job in turn, so a small preview
+/// submitted behind a large render starts right away instead of waiting for it. Pixels
+/// draw from the same sampler streams as in render(), so the image of a job is the same
+/// as that of a local render.
+/// </summary>
+class render_pool {
+public:
+	render_pool(int thread_count, int band_rows)
+		: rows_per_band(std::max(1, band_rows)) {
+		const int count = resolve_thread_count(thread_count);
+		for (int t = 0; t < count; t++)
+			threads.emplace_back(&render_pool::work, this);
+	}
+
+	~render_pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		work_available.notify_all();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	render_pool(const render_pool&) = delete;
+	render_pool& operator=(const render_pool&) = delete;
+
+	/// <summary>
+	/// Renders an image like render() on the pool's threads and blocks until it is done.
+	/// settings.thread_count and show_progress are ignored.
+	/// </summary>
+	/// <param name="queue_seconds">time until the first band of the image was started</param>
+	render_stats render(const hittable& world, const camera& cam, const color& background,
+						const render_settings& settings, const sampler& smp,
+						std::vector<color>& framebuffer, double& queue_seconds) {
+		pool_job job;
+		job.world = &world;
+		job.cam = &cam;
+		job.background = background;
+		job.settings = settings;
+		job.settings.thread_count = 1;
+		job.settings.show_progress = false;
+		job.smp = &smp;
+		job.framebuffer = &framebuffer;
+		job.submitted = clock::now();
+		framebuffer.assign(static_cast<size_t>(settings.image_width) * settings.image_height, color(0, 0, 0));
+
+		std::unique_lock<std::mutex> lock(mutex);
+		jobs.push_back(&job);
+		queued_jobs++;
+		work_available.notify_all();
+		band_done.wait(lock, [&] { return job.rows_done == settings.image_height; });
+
+		queue_seconds = std::chrono::duration<double>(job.started - job.submitted).count();
+		job.stats.render_seconds = std::chrono::duration<double>(clock::now() - job.started).count();
+		return job.stats;
+	}
+
+	int thread_count() const { return static_cast<int>(threads.size()); }
+
+	/// <summary>
+	/// Jobs waiting for their first band
+	/// </summary>
+	int queued() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return queued_jobs;
+	}
+
+	/// <summary>
+	/// Jobs with at least one band started and not finished
+	/// </summary>
+	int running() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return running_jobs;
+	}
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct pool_job {
+		const hittable* world = nullptr;
+		const camera* cam = nullptr;
+		color background;
+		render_settings settings;
+		const sampler* smp = nullptr;
+		std::vector<color>* framebuffer = nullptr;
+		int next_row = 0;	// first row of the next band to hand out
+		int rows_done = 0;
+		render_stats stats;
+		clock::time_point submitted;
+		clock::time_point started;
+	};
+
+	void work() {
+		trace_thread_name("pool worker");
+		std::vector<color> tile;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			work_available.wait(lock, [&] { return stopping || !jobs.empty(); });
+			if (jobs.empty())
+				return;
+
+			// Next band of the next job in turn; a job leaves the list once all its bands are out
+			if (next_job >= jobs.size())
+				next_job = 0;
+			pool_job& job = *jobs[next_job];
+			if (job.next_row == 0) {
+				job.started = clock::now();
+				queued_jobs--;
+				running_jobs++;
+			}
+			image_region region = image_region::full(job.settings);
+			region.y0 = job.next_row;
+			region.y1 = std::min(job.next_row + rows_per_band, job.settings.image_height);
+			job.next_row = region.y1;
+			if (job.next_row == job.settings.image_height)
+				jobs.erase(jobs.begin() + next_job);
+			else
+				next_job++;
+
+			lock.unlock();
+			RT_TRACE_SCOPE_RECT("pool band", "render", region.x0, region.y0, region.x1, region.y1);
+			auto stats = render_region(*job.world, *job.cam, job.background, job.settings, *job.smp, region, tile);
+			std::copy(tile.begin(), tile.end(),
+					  job.framebuffer->begin() + static_cast<size_t>(region.y0) * job.settings.image_width);
+			lock.lock();
+
+			job.stats.merge(stats);
+			job.rows_done += region.height();
+			if (job.rows_done == job.settings.image_height) {
+				running_jobs--;
+				band_done.notify_all();
+			}
+		}
+	}
+
+	const int rows_per_band;
+	mutable std::mutex mutex;
+	std::condition_variable work_available;
+	std::condition_variable band_done;
+	std::vector<pool_job*> jobs;	// jobs with bands left to hand out, in order of arrival
+	size_t next_job = 0;
+	int queued_jobs = 0;
+	int running_jobs = 0;
+	bool stopping = false;
+	std::vector<std::thread> threads;
+};
+
+// Scene cache
+// --------------------------
+
+/// <summary>
+/// A built scene and the top-level structure over it for the shutter interval of its camera
+/// </summary>
+struct cached_scene {
+	std::mutex build_mutex;	// held while the scene is built
+	bool built = false;
+	scene_config scene;
+	shared_ptr<scene_accel> accel;
+	double build_seconds = 0.0;
+};
+
+/// <summary>
+/// The most recently used built scenes, by scene id, arena use and acceleration structure.
+/// A scene dropped from the cache stays alive until the jobs rendering it are done.
+/// </summary>
+class scene_cache {
+public:
+	explicit scene_cache(size_t _capacity) : capacity(std::max<size_t>(1, _capacity)) {}
+
+	/// <summary>
+	/// Returns the scene of a request, building it if it is not cached. Jobs on other
+	/// cached scenes do not wait for the build.
+	/// </summary>
+	/// <param name="hit">true if the scene was in the cache (or being built for another job)</param>
+	shared_ptr<cached_scene> acquire(const render_request& request, bool& hit) {
+		std::ostringstream key_text;
+		key_text << request.scene_id << ' ' << request.primitives << ' ' << request.use_arena << ' ' << request.accel << ' ' << request.motion_steps;
+		const std::string key = key_text.str();
+
+		shared_ptr<cached_scene> entry;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = std::find_if(entries.begin(), entries.end(), [&](const cache_entry& e) { return e.key == key; });
+			hit = it != entries.end();
+			if (hit) {
+				it->last_used = ++use_count;
+				entry = it->scene;
+				hits++;
+			}
+			else {
+				entry = make_shared<cached_scene>();
+				entries.push_back({ key, entry, ++use_count });
+				misses++;
+				if (entries.size() > capacity) {
+					auto oldest = std::min_element(entries.begin(), entries.end(),
+												   [](const cache_entry& a, const cache_entry& b) { return a.last_used < b.last_used; });
+					entries.erase(oldest);
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> build_lock(entry->build_mutex);
+		if (!entry->built) {
+			auto start = std::chrono::steady_clock::now();
+			{
+				// Scenes draw their random layout from rand(), and so do bvh_node and
+				// motion_bvh_node for their split axes; start from the same state as a fresh
+				// local render, and keep other builds from drawing from it until both are done
+				std::lock_guard<std::mutex> rand_lock(rand_mutex);
+				srand(1);
+				entry->scene = select_scene(request.scene_id, request.use_arena, request.primitives);
+				camera cam = make_camera(entry->scene);
+				entry->accel = build_scene_accel(entry->scene.world, request.accel, cam.shutter_open(),
+												 cam.shutter_close(), request.motion_steps);
+			}
+			entry->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			entry->built = true;
+		}
+		return entry;
+	}
+
+	size_t size() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return entries.size();
+	}
+
+	uint64_t hit_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return hits;
+	}
+
+	uint64_t miss_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return misses;
+	}
+
+private:
+	struct cache_entry {
+		std::string key;
+		shared_ptr<cached_scene> scene;
+		uint64_t last_used;
+	};
+
+	const size_t capacity;
+	mutable std::mutex mutex;
+	std::mutex rand_mutex;
+	std::vector<cache_entry> entries;
+	uint64_t use_count = 0;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+};
+
+// Server
+// --------------------------
+
+struct server_options {
+	std::string address;
+	int thread_count = 0;		// render threads shared by all jobs, 0 for every hardware thread
+	int band_rows = 4;			// rows a render thread takes from a job at a time
+	size_t cached_scenes = 4;	// built scenes kept between jobs
+	size_t recent_jobs = 16;	// jobs listed with their timings in the status
+};
+
+/// <summary>
+/// Timings of a finished job, as listed in the server status
+/// </summary>
+struct server_job_record {
+	int id = 0;
+	int scene_id = 0;
+	int image_width = 0;
+	int image_height = 0;
+	int samples_per_pixel = 0;
+	bool cache_hit = false;
+	double scene_ms = 0.0;		// cache lookup, and the build of a missing scene
+	double queue_ms = 0.0;		// waiting for the render threads
+	double render_ms = 0.0;
+	double total_ms = 0.0;		// from the request to the reply
+	std::string output;			// file the image was written to, empty if sent back
+
+	std::string to_text() const {
+		std::ostringstream out;
+		out << "job=" << id << " scene=" << scene_id << " size=" << image_width << 'x' << image_height
+			<< " spp=" << samples_per_pixel << " cache=" << (cache_hit ? "hit" : "miss")
+			<< " scene_ms=" << scene_ms << " queue_ms=" << queue_ms << " render_ms=" << render_ms
+			<< " total_ms=" << total_ms;
+		if (!output.empty())
+			out << " output=" << output;
+		return out.str();
+	}
+};
+
+class render_server {
+public:
+	explicit render_server(const server_options& _options)
+		: options(_options), pool(_options.thread_count, _options.band_rows), cache(_options.cached_scenes) {}
+
+	/// <summary>
+	/// Serves clients until one sends msg_shutdown. Every connection gets its own thread,
+	/// which handles the requests of the connection one after the other.
+	/// </summary>
+	/// <returns>process exit code</returns>
+	int run() {
+		socket_address address;
+		if (!address.parse(options.address)) {
+			std::cerr << "ERROR: Bad server address '" << options.address << "'.\n";
+			return 1;
+		}
+		socket_handle listener = open_socket(address, true);
+		if (listener == no_socket) {
+			std::cerr << "ERROR: Could not listen on '" << options.address << "'.\n";
+			return 1;
+		}
+		std::cerr << "Render server on " << options.address << ", " << pool.thread_count()
+				  << " render threads, " << options.cached_scenes << " cached scenes\n";
+
+		struct connection {
+			std::thread thread;
+			socket_handle s;
+			shared_ptr<std::atomic<bool>> finished;
+		};
+		std::vector<connection> connections;
+
+		while (!stopping) {
+			// Threads of closed connections are joined as new ones arrive
+			for (size_t c = 0; c < connections.size();) {
+				if (*connections[c].finished) {
+					connections[c].thread.join();
+					connections.erase(connections.begin() + c);
+				}
+				else {
+					c++;
+				}
+			}
+
+			fd_set readable;
+			FD_ZERO(&readable);
+			FD_SET(listener, &readable);
+			int max_fd = 0;
+#ifndef _WIN32
+			max_fd = listener;
+#endif
+			timeval wait_time = { 0, 200000 };
+			if (select(max_fd + 1, &readable, nullptr, nullptr, &wait_time) <= 0)
+				continue;
+
+			socket_handle s = accept(listener, nullptr, nullptr);
+			if (s == no_socket)
+				continue;
+			auto finished = make_shared<std::atomic<bool>>(false);
+			connections.push_back({ std::thread([this, s, finished] {
+				serve_connection(s);
+				*finished = true;
+			}), s, finished });
+		}
+
+		// Running jobs finish and are answered; idle connections are woken from their receive
+		close_socket(listener);
+#ifndef _WIN32
+		if (address.is_unix)
+			unlink(address.host.c_str());
+#endif
+		for (auto& c : connections) {
+#ifdef _WIN32
+			shutdown(c.s, SD_RECEIVE);
+#else
+			shutdown(c.s, SHUT_RD);
+#endif
+		}
+		for (auto& c : connections)
+			c.thread.join();
+		std::cerr << "Render server stopped after " << completed_jobs << " jobs (" << failed_jobs << " failed)\n";
+		return 0;
+	}
+
+	/// <summary>
+	/// Queue depth, cache use and the timings of the most recent jobs, as "key=value" lines
+	/// </summary>
+	std::string status_text() {
+		std::ostringstream out;
+		out << "threads=" << pool.thread_count() << '\n'
+			<< "queued=" << pool.queued() << '\n'
+			<< "running=" << pool.running() << '\n'
+			<< "cached_scenes=" << cache.size() << '\n'
+			<< "cache_hits=" << cache.hit_count() << '\n'
+			<< "cache_misses=" << cache.miss_count() << '\n';
+		std::lock_guard<std::mutex> lock(record_mutex);
+		out << "completed=" << completed_jobs << '\n'
+			<< "failed=" << failed_jobs << '\n';
+		for (const auto& record : recent)
+			out << record.to_text() << '\n';
+		return out.str();
+	}
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	void serve_connection(socket_handle s) {
+		uint32_t type;
+		std::vector<char> payload;
+		while (receive_message(s, type, payload)) {
+			bool ok = true;
+			if (type == msg_request) {
+				ok = serve_request(s, std::string(payload.begin(), payload.end()));
+			}
+			else if (type == msg_status) {
+				const std::string status = status_text();
+				ok = send_message(s, msg_reply, status.data(), status.size());
+			}
+			else if (type == msg_shutdown) {
+				stopping = true;
+				const std::string reply = "status=ok\n";
+				send_message(s, msg_reply, reply.data(), reply.size());
+				break;
+			}
+			if (!ok)
+				break;
+		}
+		close_socket(s);
+	}
+
+	/// <summary>
+	/// Renders a requested image and sends the reply (and the image)
+	/// </summary>
+	/// <returns>false if the client went away</returns>
+	bool serve_request(socket_handle s, const std::string& text) {
+		RT_TRACE_SCOPE("server job", "server");
+		const auto start = clock::now();
+		auto ms_since = [](clock::time_point from) {
+			return std::chrono::duration<double, std::milli>(clock::now() - from).count();
+		};
+		auto send_error = [&](const std::string& message) {
+			{
+				std::lock_guard<std::mutex> lock(record_mutex);
+				failed_jobs++;
+			}
+			std::cerr << "WARNING: Rejected request: " << message << '\n';
+			const std::string reply = "status=error\nmessage=" + message + '\n';
+			return send_message(s, msg_reply, reply.data(), reply.size());
+		};
+
+		render_request request;
+		if (!request.from_text(text))
+			return send_error("bad request");
+		if ((request.scene_id < 1 || request.scene_id > builtin_scene_count + 1) && !is_generated_scene(request.scene_id))
+			return send_error("unknown scene " + std::to_string(request.scene_id));
+		if (!is_accel_name(request.accel))
+			return send_error("unknown acceleration structure '" + request.accel + "'");
+
+		server_job_record record;
+		record.id = ++next_job_id;
+		record.scene_id = request.scene_id;
+
+		shared_ptr<cached_scene> entry = cache.acquire(request, record.cache_hit);
+		record.scene_ms = ms_since(start);
+
+		scene_config scene_view;
+		scene_view.aspect_ratio = entry->scene.aspect_ratio;
+		scene_view.lookfrom = entry->scene.lookfrom;
+		scene_view.lookat = entry->scene.lookat;
+		scene_view.vfov = entry->scene.vfov;
+		scene_view.aperture = entry->scene.aperture;
+		apply_request_camera(request, scene_view);
+
+		render_settings settings;
+		settings.image_width = request.image_width > 0 ? request.image_width : entry->scene.image_width;
+		settings.image_height = request.image_height > 0 ? request.image_height
+			: static_cast<int>(settings.image_width / scene_view.aspect_ratio);
+		settings.samples_per_pixel = request.samples_per_pixel > 0 ? request.samples_per_pixel
+			: entry->scene.samples_per_pixel;
+		settings.max_depth = request.max_depth;
+		settings.packets = request.packets;
+		settings.accel = request.accel;
+		settings.motion_steps = request.motion_steps;
+		if (settings.image_height <= 0)
+			return send_error("image height is 0");
+		if (request.image_height > 0)
+			scene_view.aspect_ratio = static_cast<double>(settings.image_width) / settings.image_height;
+		record.image_width = settings.image_width;
+		record.image_height = settings.image_height;
+		record.samples_per_pixel = settings.samples_per_pixel;
+
+		auto smp = make_sampler(request.sampler_name, settings.samples_per_pixel, request.seed);
+		if (!smp)
+			return send_error("unknown sampler '" + request.sampler_name + "'");
+
+		// The structure was built for the scene camera's shutter interval, which make_camera
+		// gives every camera
+		camera cam = make_camera(scene_view);
+		std::vector<color> framebuffer;
+		double queue_seconds = 0.0;
+		auto stats = pool.render(*entry->accel, cam, entry->scene.background, settings, *smp,
+								 framebuffer, queue_seconds);
+		record.queue_ms = queue_seconds * 1000.0;
+		record.render_ms = stats.render_seconds * 1000.0;
+
+		std::string image;
+		if (!request.output_path.empty()) {
+			std::ofstream out(request.output_path);
+			if (out)
+				write_ppm(out, framebuffer, settings.image_width, settings.image_height, settings.samples_per_pixel);
+			if (!out)
+				return send_error("could not write '" + request.output_path + "'");
+			record.output = request.output_path;
+		}
+		else {
+			std::ostringstream out;
+			write_ppm(out, framebuffer, settings.image_width, settings.image_height, settings.samples_per_pixel);
+			image = out.str();
+		}
+		record.total_ms = ms_since(start);
+
+		{
+			std::lock_guard<std::mutex> lock(record_mutex);
+			completed_jobs++;
+			recent.push_back(record);
+			while (recent.size() > options.recent_jobs)
+				recent.pop_front();
+		}
+		std::cerr << "Job " << record.id << ": scene " << record.scene_id << ' ' << record.image_width << 'x'
+				  << record.image_height << ' ' << record.samples_per_pixel << " spp, scene "
+				  << (record.cache_hit ? "cached " : "built ") << record.scene_ms << " ms, queued "
+				  << record.queue_ms << " ms, render " << record.render_ms << " ms\n";
+
+		const std::string reply = "status=ok\n" + record.to_text() + '\n';
+		if (!send_message(s, msg_reply, reply.data(), reply.size()))
+			return false;
+		return image.empty() || send_message(s, msg_image, image.data(), image.size());
+	}
+
+	const server_options options;
+	render_pool pool;
+	scene_cache cache;
+	std::atomic<bool> stopping{ false };
+	std::atomic<int> next_job_id{ 0 };
+	std::mutex record_mutex;
+	std::deque<server_job_record> recent;
+	int completed_jobs = 0;
+	int failed_jobs = 0;
+};
+
+// Client
+// --------------------------
+
+/// <summary>
+/// Sends a render request to the server at address, prints the server's reply to stderr
+/// and writes the image to image_out unless the server wrote it to request.output_path
+/// </summary>
+/// <returns>process exit code</returns>
+int submit_render_request(const std::string& address_text, const render_request& request, std::ostream& image_out) {
+	socket_address address;
+	if (!address.parse(address_text)) {
+		std::cerr << "ERROR: Bad server address '" << address_text << "'.\n";
+		return 1;
+	}
+	socket_handle s = open_socket(address, false);
+	if (s == no_socket) {
+		std::cerr << "ERROR: Could not connect to render server at '" << address_text << "'.\n";
+		return 1;
+	}
+
+	const std::string text = request.to_text();
+	uint32_t type;
+	std::vector<char> payload;
+	if (!send_message(s, msg_request, text.data(), text.size()) || !receive_message(s, type, payload)
+		|| type != msg_reply) {
+		std::cerr << "ERROR: Render server closed the connection.\n";
+		close_socket(s);
+		return 1;
+	}
+
+	const std::string reply(payload.begin(), payload.end());
+	std::cerr << reply;
+	if (reply.compare(0, 10, "status=ok\n") != 0) {
+		close_socket(s);
+		return 1;
+	}
+
+	int result = 0;
+	if (request.output_path.empty()) {
+		if (receive_message(s, type, payload) && type == msg_image) {
+			image_out.write(payload.data(), payload.size());
+		}
+		else {
+			std::cerr << "ERROR: Render server did not send the image.\n";
+			result = 1;
+		}
+	}
+	close_socket(s);
+	return result;
+}
+
+/// <summary>
+/// Sends msg_status or msg_shutdown to the server at address and prints its reply to out
+/// </summary>
+/// <returns>process exit code</returns>
+int send_server_command(const std::string& address_text, uint32_t command, std::ostream& out) {
+	socket_address address;
+	if (!address.parse(address_text)) {
+		std::cerr << "ERROR: Bad server address '" << address_text << "'.\n";
+		return 1;
+	}
+	socket_handle s = open_socket(address, false);
+	if (s == no_socket) {
+		std::cerr << "ERROR: Could not connect to render server at '" << address_text << "'.\n";
+		return 1;
+	}
+
+	uint32_t type;
+	std::vector<char> payload;
+	bool ok = send_message(s, command, nullptr, 0) && receive_message(s, type, payload) && type == msg_reply;
+	close_socket(s);
+	if (!ok) {
+		std::cerr << "ERROR: Render server closed the connection.\n";
+		return 1;
+	}
+	out.write(payload.data(), payload.size());
+	return 0;
+}
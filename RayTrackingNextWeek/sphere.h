@@ -9,10 +9,13 @@ public:
 	sphere() { 
 		center = point3(0, 0, 0); radius = 1.0; 
 	}
-	sphere(point3 cen, double r, shared_ptr<material>m = make_shared<lambertian>(color(0.75, 0.75, 0.75))) : center(cen), radius(r), mat_ptr(m) {}
+	sphere(point3 cen, double r, shared_ptr<material>m = make_scene_object<lambertian>(color(0.75, 0.75, 0.75))) : center(cen), radius(r), mat_ptr(m) {}
 
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override; 
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual void hit_packet(const ray_packet& p, int active, double t_min, packet_hits& hits) const override;
+	virtual bool hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
 private: 
@@ -24,8 +27,8 @@ private:
 		//     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
 		//     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
 
-		auto theta = acos(-p.y()); 
-		auto phi = atan2(-p.z(), p.x()) + pi;
+		auto theta = rt_acos(-p.y()); 
+		auto phi = rt_atan2(-p.z(), p.x()) + pi;
 
 		u = phi / (2 * pi); 
 		v = theta / pi;
@@ -52,6 +55,7 @@ public:
 /// <returns></returns>
 bool::sphere::hit(const ray& inRay, double t_min, double t_max, hit_record& hitRecord) const
 {
+	RT_STAT(primitive_tests[prim_sphere]++);
 	vec3 oc = inRay.origin() - center;
 	auto a = inRay.direction().length_squared();
 	auto half_b = dot(oc, inRay.direction());
@@ -77,13 +81,104 @@ bool::sphere::hit(const ray& inRay, double t_min, double t_max, hit_record& hitR
 	vec3 outward_normal = (hitRecord.p - center) / radius ; // normal pointing to out from sphere center in direction of ray
 	hitRecord.set_face_normal(inRay, outward_normal); // sets normal in opposite directon of incoming ray
 	get_sphere_uv(outward_normal, hitRecord.u, hitRecord.v);
-	hitRecord.mat_ptr = mat_ptr;
+	hitRecord.mat_ptr = mat_ptr.get();
 
 	return true;
 }
 
+bool sphere::occluded(const ray& r, double t_min, double t_max) const {
+	RT_STAT(primitive_tests[prim_sphere]++);
+	vec3 oc = r.origin() - center;
+	auto a = r.direction().length_squared();
+	auto half_b = dot(oc, r.direction());
+	auto c = oc.length_squared() - radius * radius;
+
+	auto discriminant = half_b * half_b - a * c;
+	if (discriminant < 0)
+		return false;
+
+	auto sqrtDiscriminant = sqrt(discriminant);
+	auto root = (-half_b - sqrtDiscriminant) / a;
+	if (root >= t_min && root <= t_max)
+		return true;
+	root = (-half_b + sqrtDiscriminant) / a;
+	return root >= t_min && root <= t_max;
+}
+
+/// <summary>
+/// Rejects the lanes whose discriminant is clearly negative with a float SIMD test
+/// over the whole packet, then runs the exact hit() on the lanes that are left.
+/// The rejection keeps a relative margin, so float rounding never drops a grazing hit.
+/// </summary>
+void sphere::hit_packet(const ray_packet& p, int active, double t_min, packet_hits& hits) const {
+	const float cx = static_cast<float>(center.x());
+	const float cy = static_cast<float>(center.y());
+	const float cz = static_cast<float>(center.z());
+	const float r2 = static_cast<float>(radius * radius);
+	const float margin = 1e-4f;
+
+	int maybe = 0;
+#ifdef RT_PACKET_SSE
+	const __m128 cx4 = _mm_set1_ps(cx), cy4 = _mm_set1_ps(cy), cz4 = _mm_set1_ps(cz);
+	const __m128 r2_4 = _mm_set1_ps(r2);
+	for (int g = 0; g < packet_width; g += 4) {
+		const __m128 dx = _mm_load_ps(p.dx + g), dy = _mm_load_ps(p.dy + g), dz = _mm_load_ps(p.dz + g);
+		const __m128 ocx = _mm_sub_ps(_mm_load_ps(p.ox + g), cx4);
+		const __m128 ocy = _mm_sub_ps(_mm_load_ps(p.oy + g), cy4);
+		const __m128 ocz = _mm_sub_ps(_mm_load_ps(p.oz + g), cz4);
+
+		const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		const __m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+		const __m128 oc2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz));
+		const __m128 b2 = _mm_mul_ps(half_b, half_b);
+
+		const __m128 discriminant = _mm_sub_ps(b2, _mm_mul_ps(a, _mm_sub_ps(oc2, r2_4)));
+		const __m128 bound = _mm_mul_ps(_mm_set1_ps(-margin), _mm_add_ps(b2, _mm_mul_ps(a, _mm_add_ps(oc2, r2_4))));
+		maybe |= _mm_movemask_ps(_mm_cmpge_ps(discriminant, bound)) << g;
+	}
+#else
+	for (int k = 0; k < packet_width; k++) {
+		const float ocx = p.ox[k] - cx, ocy = p.oy[k] - cy, ocz = p.oz[k] - cz;
+		const float a = p.dx[k] * p.dx[k] + p.dy[k] * p.dy[k] + p.dz[k] * p.dz[k];
+		const float half_b = ocx * p.dx[k] + ocy * p.dy[k] + ocz * p.dz[k];
+		const float oc2 = ocx * ocx + ocy * ocy + ocz * ocz;
+		const float discriminant = half_b * half_b - a * (oc2 - r2);
+		if (discriminant >= -margin * (half_b * half_b + a * (oc2 + r2)))
+			maybe |= 1 << k;
+	}
+#endif
+	maybe &= active;
+
+	RT_STAT(primitive_tests[prim_sphere] += lane_count(active & ~maybe));
+	for (int k = 0; k < p.count; k++) {
+		if ((maybe & (1 << k)) && hit(p.rays[k], t_min, hits.t_max[k], hits.rec[k])) {
+			hits.t_max[k] = hits.rec[k].t;
+			hits.mask |= 1 << k;
+		}
+	}
+}
+
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
 	output_box = aabb(center - vec3(radius, radius, radius),
 		center + vec3(radius, radius, radius));
 	return true;
-}
\ No newline at end of file
+}
+
+/// <summary>
+/// Both roots of the ray-sphere quadratic, the part of the ray between them is inside
+/// </summary>
+bool sphere::hit_interval(const ray& r, double t_min, double t_max, ray_intervals& inside) const {
+	RT_STAT(primitive_tests[prim_sphere]++);
+	inside.count = 0;
+	vec3 oc = r.origin() - center;
+	auto a = r.direction().length_squared();
+	auto half_b = dot(oc, r.direction());
+	auto c = oc.length_squared() - radius * radius;
+
+	auto discriminant = half_b * half_b - a * c;
+	if (discriminant < 0)
+		return false;
+	auto sqrtd = sqrt(discriminant);
+
+	return inside.add((-half_b - sqrtd) / a, (-half_b + sqrtd) / a, t_min, t_max);
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+// Traversal and shading counters
+// --------------------------
+// Define RT_ENABLE_STATS (eg. /D RT_ENABLE_STATS or -DRT_ENABLE_STATS) to record them.
+// Without it every RT_STAT() compiles to nothing.
+// Counters are thread local; the renderer resets them per worker and merges
+// the worker totals into render_stats when the render finishes.
+
+enum primitive_kind {
+	prim_sphere,
+	prim_moving_sphere,
+	prim_xy_rect,
+	prim_xz_rect,
+	prim_yz_rect,
+	prim_box,
+	prim_constant_medium,
+	prim_instance,	// translate / rotate wrappers
+	prim_box_grid,
+	prim_kind_count
+};
+
+enum material_kind {
+	mat_lambertian,
+	mat_metal,
+	mat_dielectric,
+	mat_diffuse_light,
+	mat_isotropic,
+	mat_kind_count
+};
+
+inline const char* primitive_kind_name(int kind) {
+	static const char* names[prim_kind_count] = {
+		"sphere", "moving_sphere", "xy_rect", "xz_rect", "yz_rect", "box", "constant_medium", "instance", "box_grid"
+	};
+	return names[kind];
+}
+
+inline const char* material_kind_name(int kind) {
+	static const char* names[mat_kind_count] = {
+		"lambertian", "metal", "dielectric", "diffuse_light", "isotropic"
+	};
+	return names[kind];
+}
+
+struct trace_counters {
+	static const int depth_bins = 64;
+
+	uint64_t bvh_nodes_visited = 0;
+	uint64_t aabb_tests = 0;
+	uint64_t primitive_tests[prim_kind_count] = {};
+	uint64_t shading_calls[mat_kind_count] = {};
+	uint64_t path_depth[depth_bins] = {};	// number of paths by bounce count
+
+	void merge(const trace_counters& other) {
+		bvh_nodes_visited += other.bvh_nodes_visited;
+		aabb_tests += other.aabb_tests;
+		for (int k = 0; k < prim_kind_count; k++)
+			primitive_tests[k] += other.primitive_tests[k];
+		for (int k = 0; k < mat_kind_count; k++)
+			shading_calls[k] += other.shading_calls[k];
+		for (int k = 0; k < depth_bins; k++)
+			path_depth[k] += other.path_depth[k];
+	}
+
+	uint64_t total_primitive_tests() const {
+		uint64_t total = 0;
+		for (int k = 0; k < prim_kind_count; k++)
+			total += primitive_tests[k];
+		return total;
+	}
+};
+
+#ifdef RT_ENABLE_STATS
+	inline trace_counters& thread_counters() {
+		thread_local trace_counters counters;
+		return counters;
+	}
+	#define RT_STAT(expr) (thread_counters().expr)
+	const bool stats_enabled = true;
+#else
+	#define RT_STAT(expr) ((void)0)
+	const bool stats_enabled = false;
+#endif
+
+/// <summary>
+/// Prints aggregated counters, normalized per camera sample
+/// </summary>
+inline void print_trace_counters(std::ostream& out, const trace_counters& c, uint64_t samples) {
+	if (!stats_enabled) {
+		out << "Traversal counters are disabled. Rebuild with RT_ENABLE_STATS defined.\n";
+		return;
+	}
+
+	const double per = samples > 0 ? 1.0 / samples : 0.0;
+	out << std::fixed << std::setprecision(2)
+		<< "Traversal counters (per camera sample)\n"
+		<< "  bvh nodes visited  " << std::setw(14) << c.bvh_nodes_visited * per << '\n'
+		<< "  aabb slab tests    " << std::setw(14) << c.aabb_tests * per << '\n'
+		<< "Primitive intersection tests (per camera sample)\n";
+	for (int k = 0; k < prim_kind_count; k++)
+		out << "  " << std::left << std::setw(19) << primitive_kind_name(k) << std::right
+			<< std::setw(14) << c.primitive_tests[k] * per << '\n';
+	out << "Shading calls (per camera sample)\n";
+	for (int k = 0; k < mat_kind_count; k++)
+		out << "  " << std::left << std::setw(19) << material_kind_name(k) << std::right
+			<< std::setw(14) << c.shading_calls[k] * per << '\n';
+
+	out << "Path depth distribution (bounces: paths)\n";
+	int last = trace_counters::depth_bins - 1;
+	while (last > 0 && c.path_depth[last] == 0)
+		last--;
+	for (int k = 0; k <= last; k++)
+		out << "  " << std::setw(3) << k << (k == trace_counters::depth_bins - 1 ? "+" : " ")
+			<< std::setw(16) << c.path_depth[k] << '\n';
+	out.unsetf(std::ios_base::floatfield);
+}
+
+/// <summary>
+/// Writes counters as a JSON object (without trailing newline)
+/// </summary>
+inline void write_trace_counters_json(std::ostream& out, const trace_counters& c, const char* indent) {
+	out << "{\n"
+		<< indent << "  \"bvh_nodes_visited\": " << c.bvh_nodes_visited << ",\n"
+		<< indent << "  \"aabb_tests\": " << c.aabb_tests << ",\n"
+		<< indent << "  \"primitive_tests\": {";
+	for (int k = 0; k < prim_kind_count; k++)
+		out << (k ? ", " : " ") << "\"" << primitive_kind_name(k) << "\": " << c.primitive_tests[k];
+	out << " },\n" << indent << "  \"shading_calls\": {";
+	for (int k = 0; k < mat_kind_count; k++)
+		out << (k ? ", " : " ") << "\"" << material_kind_name(k) << "\": " << c.shading_calls[k];
+	out << " },\n" << indent << "  \"path_depth\": [";
+	for (int k = 0; k < trace_counters::depth_bins; k++)
+		out << (k ? ", " : "") << c.path_depth[k];
+	out << "]\n" << indent << "}";
+}
@@ -0,0 +1,208 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "rtweekend.h"
+#include "color.h"
+#include "camera.h"
+#include "sampler.h"
+#include "renderer.h"
+#include "scene_accel.h"
+
+// Streaming output
+// --------------------------
+// For images too large to keep a framebuffer of: the image is rendered in horizontal
+// bands from the top, and every finished band is handed to a writer thread that converts
+// it to 8-bit pixels and appends its rows to a binary PPM (P6) file while the next band
+// renders. At most max_queued bands wait for the writer; the renderer blocks when the
+// writer falls that far behind. Memory is a few bands, independent of the image height.
+
+struct stream_options {
+	int band_rows = 64;		// rows rendered together (all render threads work on one band)
+	int max_queued = 2;		// finished bands waiting for the writer
+};
+
+struct stream_stats {
+	int bands = 0;
+	double render_seconds = 0.0;
+	double write_seconds = 0.0;		// writer thread converting and writing
+	double stall_seconds = 0.0;		// renderer waiting for room in the queue
+	size_t band_buffers = 0;		// band buffers allocated, bounds the memory used for pixels
+	size_t band_bytes = 0;			// bytes of one band buffer
+};
+
+/// <summary>
+/// Writer thread of a streamed image. Bands are passed in order with push(); their buffers
+/// come back through take_buffer() once written, so no more than max_queued + 2 band
+/// buffers exist at any time.
+/// </summary>
+class band_writer {
+public:
+	band_writer(std::ostream& _out, int _width, int _samples_per_pixel, int _max_queued)
+		: out(_out), width(_width), samples_per_pixel(_samples_per_pixel),
+		  max_queued(std::max(1, _max_queued)), thread(&band_writer::work, this) {}
+
+	~band_writer() { finish(); }
+
+	band_writer(const band_writer&) = delete;
+	band_writer& operator=(const band_writer&) = delete;
+
+	/// <summary>
+	/// An empty buffer for the next band, a written one if there is one
+	/// </summary>
+	std::vector<color> take_buffer() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (free_buffers.empty()) {
+			buffers_allocated++;
+			return std::vector<color>();
+		}
+		std::vector<color> buffer = std::move(free_buffers.back());
+		free_buffers.pop_back();
+		return buffer;
+	}
+
+	/// <summary>
+	/// Queues the next band (rows of width pixels, sums of samples_per_pixel samples).
+	/// Blocks while max_queued bands are waiting.
+	/// </summary>
+	/// <returns>seconds spent waiting for room</returns>
+	double push(std::vector<color>&& band) {
+		auto start = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(mutex);
+		room.wait(lock, [&] { return queued.size() < static_cast<size_t>(max_queued); });
+		queued.push_back(std::move(band));
+		band_ready.notify_one();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	/// <summary>
+	/// Writes the remaining bands and stops the writer thread
+	/// </summary>
+	void finish() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finishing = true;
+		}
+		band_ready.notify_one();
+		if (thread.joinable())
+			thread.join();
+	}
+
+	double write_seconds() const { return writing_seconds; }
+	size_t buffer_count() const { return buffers_allocated; }
+
+private:
+	void work() {
+		trace_thread_name("band writer");
+		std::vector<unsigned char> row(static_cast<size_t>(width) * 3);
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			band_ready.wait(lock, [&] { return finishing || !queued.empty(); });
+			if (queued.empty())
+				return;
+			std::vector<color> band = std::move(queued.front());
+			queued.pop_front();
+			room.notify_one();
+			lock.unlock();
+
+			RT_TRACE_SCOPE("write band", "output");
+			auto start = std::chrono::steady_clock::now();
+			for (size_t first = 0; first < band.size(); first += width) {
+				for (int x = 0; x < width; x++)
+					color_to_rgb8(band[first + x], samples_per_pixel, &row[static_cast<size_t>(x) * 3]);
+				out.write(reinterpret_cast<const char*>(row.data()), row.size());
+			}
+			writing_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			lock.lock();
+			free_buffers.push_back(std::move(band));
+		}
+	}
+
+	std::ostream& out;
+	const int width;
+	const int samples_per_pixel;
+	const int max_queued;
+	std::mutex mutex;
+	std::condition_variable band_ready;
+	std::condition_variable room;
+	std::deque<std::vector<color>> queued;
+	std::vector<std::vector<color>> free_buffers;
+	size_t buffers_allocated = 0;
+	bool finishing = false;
+	double writing_seconds = 0.0;	// only touched by the writer thread until it is joined
+	std::thread thread;
+};
+
+/// <summary>
+/// Renders the world band by band and streams the image as binary PPM to out. The pixels
+/// are those of render(); only the bands in flight are kept in memory.
+/// </summary>
+render_stats render_streaming(const hittable& world, const camera& cam, const color& background,
+							  const render_settings& settings, const sampler& smp, std::ostream& out,
+							  const stream_options& options, stream_stats& stream) {
+	const int band_rows = std::max(1, options.band_rows);
+	out << "P6\n" << settings.image_width << ' ' << settings.image_height << "\n255\n";
+
+	render_settings band_settings = settings;
+	band_settings.show_progress = false;
+	render_stats total;
+	stream = stream_stats();
+	auto start = std::chrono::steady_clock::now();
+	{
+		band_writer writer(out, settings.image_width, settings.samples_per_pixel, options.max_queued);
+		for (int y0 = 0; y0 < settings.image_height; y0 += band_rows) {
+			image_region region = image_region::full(settings);
+			region.y0 = y0;
+			region.y1 = std::min(y0 + band_rows, settings.image_height);
+
+			std::vector<color> band = writer.take_buffer();
+			total.merge(render_region(world, cam, background, band_settings, smp, region, band));
+			stream.stall_seconds += writer.push(std::move(band));
+			stream.bands++;
+			if (settings.show_progress)
+				std::cerr << "\rScalinesRemaining: " << settings.image_height - region.y1 << ' ' << std::flush;
+		}
+		writer.finish();
+		stream.write_seconds = writer.write_seconds();
+		stream.band_buffers = writer.buffer_count();
+	}
+	stream.band_bytes = static_cast<size_t>(band_rows) * settings.image_width * sizeof(color);
+	stream.render_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	total.render_seconds = stream.render_seconds;
+	if (settings.show_progress)
+		std::cerr << "\nDone.\n";
+	return total;
+}
+
+/// <summary>
+/// Builds the top-level structure over the world list, then streams the render
+/// </summary>
+render_stats render_streaming(const hittable_list& world, const camera& cam, const color& background,
+							  const render_settings& settings, const sampler& smp, std::ostream& out,
+							  const stream_options& options, stream_stats& stream) {
+	auto start = std::chrono::steady_clock::now();
+	auto accel = build_scene_accel(world, settings.accel, cam.shutter_open(), cam.shutter_close(),
+								   settings.motion_steps);
+	double build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	auto stats = render_streaming(static_cast<const hittable&>(*accel), cam, background, settings, smp, out,
+								  options, stream);
+	stats.accel_build_seconds = build_seconds;
+	return stats;
+}
+
+/// <summary>
+/// One line summary of a streamed render
+/// </summary>
+void print_stream_stats(std::ostream& out, const stream_stats& stream) {
+	out << "Streamed " << stream.bands << " bands in " << stream.render_seconds << " s (writer busy "
+		<< stream.write_seconds << " s, renderer waited " << stream.stall_seconds << " s for the writer), "
+		<< stream.band_buffers << " band buffers of " << stream.band_bytes / 1024 << " KiB\n";
+}
@@ -2,6 +2,7 @@
 #include "rtweekend.h"
 #include "rtw_stb_image.h"
 #include "perlin.h"
+#include "trace.h"
 
 #include <iostream>
 
@@ -32,10 +33,19 @@ public:
 	checker_texture(shared_ptr<texture> _even, shared_ptr<texture> _odd)
 		: even(_even), odd(_odd) {}
 	checker_texture(color c1, color c2)
-		: even(make_shared<solid_color>(c1)), odd(make_shared<solid_color>(c2)) {}
+		: even(make_scene_object<solid_color>(c1)), odd(make_scene_object<solid_color>(c2)) {}
 
 	virtual color value(double u, double v, const point3& p) const override {
-		auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z()); 
+		double sines;
+		if (fast_math_enabled()) {
+			const double x[3] = { 10 * p.x(), 10 * p.y(), 10 * p.z() };
+			double s[3];
+			fast_sin_array(x, s, 3);
+			sines = s[0] * s[1] * s[2];
+		}
+		else {
+			sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+		}
 		if (sines < 0)
 			return odd->value(u, v, p);
 		else
@@ -55,7 +65,7 @@ public:
 	virtual color value(double u, double v, const point3& p) const override {
 		//return color(1, 1, 1) * 0.5 * (1.0 + noise.noise(scale * p));
 		//return color(1, 1, 1) * noise.turb(scale * p, 10);
-		return color(1, 1, 1) * 0.5 * (1 + sin(scale * p.z() + 10 * noise.turb(p)));
+		return color(1, 1, 1) * 0.5 * (1 + rt_sin(scale * p.z() + 10 * noise.turb(p)));
 	}
 
 public: 
@@ -72,6 +82,7 @@ public:
 		: data(nullptr), width(0), height(0), bytes_per_scanline(0){}
 
 	image_texture(const char* filename) {
+		RT_TRACE_SCOPE("image_texture decode", "scene");
 		auto components_per_pixel = bytes_per_pixel;
 
 		data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel); 
@@ -0,0 +1,254 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Trace-event profiling
+// --------------------------
+// RT_TRACE_SCOPE(name, category) records the wall time of the enclosing scope as a
+// Chrome trace event ("X" phase) once tracing was started with start_trace(). Names and
+// categories must be string literals (or otherwise outlive the trace). While tracing is
+// off a marker is a single test of a flag; define RT_DISABLE_TRACE to compile the markers
+// out completely. Every thread appends to its own buffer, so recording takes no lock.
+// write_trace() writes the events of all threads as JSON for chrome://tracing or Perfetto.
+
+struct trace_event {
+	const char* name;
+	const char* category;
+	double start_us;
+	double duration_us;
+	int arg_count;
+	const char* arg_names[4];
+	int64_t args[4];
+};
+
+/// <summary>
+/// Events of one thread
+/// </summary>
+struct trace_buffer {
+	int thread_id = 0;
+	std::string thread_name;
+	std::vector<trace_event> events;
+};
+
+/// <summary>
+/// Buffers of every thread that recorded an event. Buffers outlive their threads.
+/// </summary>
+class trace_recorder {
+public:
+	static trace_recorder& instance() {
+		static trace_recorder recorder;
+		return recorder;
+	}
+
+	/// <summary>
+	/// Buffer of the calling thread, created on its first event
+	/// </summary>
+	trace_buffer& thread_buffer() {
+		thread_local trace_buffer* buffer = nullptr;
+		if (!buffer) {
+			std::lock_guard<std::mutex> lock(mutex);
+			buffers.emplace_back(new trace_buffer());
+			buffer = buffers.back().get();
+			buffer->thread_id = static_cast<int>(buffers.size());
+		}
+		return *buffer;
+	}
+
+	/// <summary>
+	/// Names the calling thread. Threads given the name of an earlier thread share its row in
+	/// the trace, so the short-lived render threads of successive renders line up.
+	/// </summary>
+	void name_thread(const std::string& name) {
+		trace_buffer& own = thread_buffer();
+		std::lock_guard<std::mutex> lock(mutex);
+		own.thread_name = name;
+		for (const auto& buffer : buffers) {
+			if (buffer.get() != &own && buffer->thread_name == name) {
+				own.thread_id = buffer->thread_id;
+				break;
+			}
+		}
+	}
+
+	double now_us() const {
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	/// <summary>
+	/// Writes every recorded event as a trace-event JSON object
+	/// </summary>
+	void write(std::ostream& out) {
+		std::lock_guard<std::mutex> lock(mutex);
+		out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+		bool first = true;
+		auto separator = [&]() -> std::ostream& {
+			out << (first ? "" : ",\n");
+			first = false;
+			return out;
+		};
+		out.precision(3);
+		out << std::fixed;
+		std::vector<int> named;
+		for (const auto& buffer : buffers) {
+			if (!buffer->thread_name.empty() && std::find(named.begin(), named.end(), buffer->thread_id) == named.end()) {
+				named.push_back(buffer->thread_id);
+				separator() << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": " << buffer->thread_id
+							<< ", \"args\": {\"name\": \"" << buffer->thread_name << "\"}}";
+			}
+			for (const auto& e : buffer->events) {
+				separator() << "{\"ph\": \"X\", \"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+							<< "\", \"pid\": 1, \"tid\": " << buffer->thread_id << ", \"ts\": " << e.start_us
+							<< ", \"dur\": " << e.duration_us;
+				if (e.arg_count > 0) {
+					out << ", \"args\": {";
+					for (int a = 0; a < e.arg_count; a++)
+						out << (a > 0 ? ", " : "") << '"' << e.arg_names[a] << "\": " << e.args[a];
+					out << '}';
+				}
+				out << '}';
+			}
+		}
+		out << "\n]}\n";
+		out.unsetf(std::ios::floatfield);
+	}
+
+	size_t event_count() {
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t count = 0;
+		for (const auto& buffer : buffers)
+			count += buffer->events.size();
+		return count;
+	}
+
+private:
+	trace_recorder() : origin(std::chrono::steady_clock::now()) {}
+
+	std::chrono::steady_clock::time_point origin;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<trace_buffer>> buffers;
+};
+
+/// <summary>
+/// Whether markers record events. A constant-initialized flag, so testing it costs one load.
+/// </summary>
+inline bool& trace_enabled() {
+	static bool enabled = false;
+	return enabled;
+}
+
+inline void start_trace() {
+	trace_recorder::instance();	// time origin of the trace
+	trace_enabled() = true;
+}
+
+/// <summary>
+/// Names the calling thread in the trace (eg. "render worker 3")
+/// </summary>
+inline void trace_thread_name(const std::string& name) {
+	if (trace_enabled())
+		trace_recorder::instance().name_thread(name);
+}
+
+/// <summary>
+/// Stops tracing and writes the events to path
+/// </summary>
+inline bool write_trace(const std::string& path) {
+	trace_enabled() = false;
+	std::ofstream out(path);
+	if (!out) {
+		std::cerr << "ERROR: Could not open '" << path << "' for writing.\n";
+		return false;
+	}
+	trace_recorder::instance().write(out);
+	return static_cast<bool>(out);
+}
+
+/// <summary>
+/// Writes the trace to path when it goes out of scope, if tracing was started for a path
+/// </summary>
+class trace_file_writer {
+public:
+	explicit trace_file_writer(const std::string& _path) : path(_path) {
+		if (!path.empty()) {
+			start_trace();
+			trace_thread_name("main");
+		}
+	}
+
+	~trace_file_writer() {
+		if (path.empty())
+			return;
+		const size_t events = trace_recorder::instance().event_count();
+		if (write_trace(path))
+			std::cerr << "Trace of " << events << " events written to " << path << '\n';
+	}
+
+private:
+	std::string path;
+};
+
+/// <summary>
+/// Records the time from its construction to its destruction as one trace event.
+/// Up to four integer arguments can be attached with arg().
+/// </summary>
+class trace_scope {
+public:
+	trace_scope(const char* _name, const char* _category, bool when = true)
+		: active(when && trace_enabled()) {
+		if (active) {
+			event.name = _name;
+			event.category = _category;
+			event.arg_count = 0;
+			event.start_us = trace_recorder::instance().now_us();
+		}
+	}
+
+	~trace_scope() {
+		if (active) {
+			auto& recorder = trace_recorder::instance();
+			event.duration_us = recorder.now_us() - event.start_us;
+			recorder.thread_buffer().events.push_back(event);
+		}
+	}
+
+	trace_scope(const trace_scope&) = delete;
+	trace_scope& operator=(const trace_scope&) = delete;
+
+	trace_scope& arg(const char* name, int64_t value) {
+		if (active && event.arg_count < 4) {
+			event.arg_names[event.arg_count] = name;
+			event.args[event.arg_count++] = value;
+		}
+		return *this;
+	}
+
+private:
+	bool active;
+	trace_event event;
+};
+
+#define RT_TRACE_CONCAT_(a, b) a##b
+#define RT_TRACE_CONCAT(a, b) RT_TRACE_CONCAT_(a, b)
+
+#ifndef RT_DISABLE_TRACE
+	// Marks the rest of the enclosing scope
+	#define RT_TRACE_SCOPE(name, category) trace_scope RT_TRACE_CONCAT(rt_trace_scope_, __LINE__)(name, category)
+	// Marks the rest of the enclosing scope if condition holds
+	#define RT_TRACE_SCOPE_IF(condition, name, category) \
+		trace_scope RT_TRACE_CONCAT(rt_trace_scope_, __LINE__)(name, category, condition)
+	// Marks the rest of the enclosing scope, with the pixel rectangle [x0, x1) x [y0, y1) it works on
+	#define RT_TRACE_SCOPE_RECT(name, category, x0, y0, x1, y1) \
+		trace_scope RT_TRACE_CONCAT(rt_trace_scope_, __LINE__)(name, category); \
+		RT_TRACE_CONCAT(rt_trace_scope_, __LINE__).arg("x", x0).arg("y", y0).arg("width", (x1) - (x0)).arg("height", (y1) - (y0))
+#else
+	#define RT_TRACE_SCOPE(name, category) ((void)0)
+	#define RT_TRACE_SCOPE_IF(condition, name, category) ((void)0)
+	#define RT_TRACE_SCOPE_RECT(name, category, x0, y0, x1, y1) ((void)0)
+#endif